@@ -5,9 +5,18 @@
 #include "FunctionInfo.h"
 #include "ExcelVariant.h"
 #include "Conversion.h"
+#include "Invoke.h"
+#include "Profile.h"
+#include "Trace.h"
+#include "Log.h"
+#include "ObjectCache.h"
+#include "ResultCache.h"
+#include "WorkbookState.h"
+#include "SharedData.h"
 #include <vector>
 #include <cassert>
 #include <algorithm>
+#include <stdio.h>
 
 namespace XLL_NAMESPACE
 {
@@ -280,19 +289,175 @@ static int RegisterFunctionTest(LPXLOPER12 dllName)
 
 #define EXPORT_UNDECORATED_NAME comment(linker, "/export:" __FUNCTION__ "=" __FUNCDNAME__)
 
+// Registers a function or command exported by this library by name.
+// Returns true if the registration succeeds.
+static bool RegisterBuiltinFunction(LPXLOPER12 dllName, LPCWSTR procedure,
+	LPCWSTR typeText, LPCWSTR functionText, int macroType)
+{
+	ExcelVariant xProcedure(procedure);
+	ExcelVariant xTypeText(typeText);
+	ExcelVariant xFunctionText(functionText);
+	ExcelVariant xArgumentText((const wchar_t*)nullptr);
+	ExcelVariant xMacroType(macroType);
+
+	XLOPER12 id;
+	if (Excel12(xlfRegister, &id, 6, dllName, &xProcedure, &xTypeText,
+		&xFunctionText, &xArgumentText, &xMacroType) != xlretSuccess)
+	{
+		return false;
+	}
+	Excel12(xlFree, 0, 1, &id);
+	return true;
+}
+
+//
+// Calculation events
+//
+// XLL Connector registers a hidden command for xleventCalculationEnded
+// and xleventCalculationCanceled, so that state cached during a
+// calculation (such as whether the Function Wizard is open) is
+// refreshed once per calculation, and workbook state saved during the
+// calculation is written to the workbook.
+//
+// The command name contains the address of the handler so that two
+// XLLs built with XLL Connector do not overwrite each other's command.
+// Events are only supported in Excel 2010 and later; registration
+// fails silently in earlier versions.
+//
+
+int WINAPI XllConnectorCalculationEvent()
+{
+#pragma EXPORT_UNDECORATED_NAME
+	InvalidateDialogState();
+	FlushWorkbookState();
+	return 1;
+}
+
+static void RegisterCalculationEvents(LPXLOPER12 dllName)
+{
+	wchar_t commandName[64];
+	swprintf_s(commandName, L"XllConnectorCalculationEvent_%p",
+		(void*)&XllConnectorCalculationEvent);
+
+	if (!RegisterBuiltinFunction(dllName, L"XllConnectorCalculationEvent",
+		L"J", commandName, 2))
+	{
+		return;
+	}
+
+	ExcelVariant xCommandName(commandName);
+	ExcelVariant calculationEnded(xleventCalculationEnded);
+	ExcelVariant calculationCanceled(xleventCalculationCanceled);
+	Excel12(xlEventRegister, 0, 2, &xCommandName, &calculationEnded);
+	Excel12(xlEventRegister, 0, 2, &xCommandName, &calculationCanceled);
+}
+
+//
+// Report UDFs
+//
+// Built-in UDFs that return a report as an array. Each module fills a
+// ReportTable; ReturnReport() converts it to the global return value,
+// which is safe because the report UDFs are registered as thread-unsafe.
+//
+
+static LPXLOPER12 ReturnReport(void (*getReport)(ReportTable &))
+{
+	ReportTable table;
+	getReport(table);
+
+	LPXLOPER12 xResult = &globalReturnValue;
+	if (SUCCEEDED(table.CreateValue(xResult)))
+	{
+		xResult->xltype |= xlbitDLLFree;
+		return xResult;
+	}
+	return const_cast<LPXLOPER12>(&Constants::ErrValue);
+}
+
+//
+// XllProfileReport
+//
+// Returns the profile report of functions exported with the XLL_PROFILE
+// attribute. It is registered only if at least one function is profiled,
+// and it is volatile so that the report is refreshed on every
+// calculation.
+//
+
+LPXLOPER12 WINAPI XllProfileReport()
+{
+#pragma EXPORT_UNDECORATED_NAME
+	return ReturnReport(GetProfileReport);
+}
+
+//
+// XllCallbackReport
+//
+// Returns the time spent in callbacks into Excel, by function number
+// and calling UDF. It is registered only if callback profiling is
+// enabled when the XLL is loaded.
+//
+
+LPXLOPER12 WINAPI XllCallbackReport()
+{
+#pragma EXPORT_UNDECORATED_NAME
+	return ReturnReport(GetCallbackReport);
+}
+
+//
+// XllObjectCacheReport
+//
+// Returns the memory budget of the object cache and its eviction, spill
+// and reload counts. It is registered only if a budget is set when the
+// XLL is loaded.
+//
+
+LPXLOPER12 WINAPI XllObjectCacheReport()
+{
+#pragma EXPORT_UNDECORATED_NAME
+	return ReturnReport(GetObjectCacheReport);
+}
+
+//
+// XllResultCacheReport
+//
+// Returns the size of the persistent result cache and its hit, miss,
+// store and compaction counts. It is registered only if the cache is
+// enabled when the XLL is loaded.
+//
+
+LPXLOPER12 WINAPI XllResultCacheReport()
+{
+#pragma EXPORT_UNDECORATED_NAME
+	return ReturnReport(GetResultCacheReport);
+}
+
 int WINAPI xlAutoOpen()
 {
 #pragma EXPORT_UNDECORATED_NAME
 
+	StartLoggingFromEnvironment();
+	ConfigureProfilingFromEnvironment();
+	bool hasObjectCacheBudget = ConfigureObjectCacheFromEnvironment();
+	bool hasResultCache = ConfigureResultCacheFromEnvironment();
+
 	ExportTableHelper exports;
 	if (!exports.LoadSymbols())
+	{
+		XLL_LOG_ERROR("Cannot load the export table of the XLL");
 		return 0;
+	}
 
 	XLOPER12 xDLL;
 	if (Excel12(xlGetName, &xDLL, 0) == xlretSuccess)
 	{
 		for (FunctionInfo &f : XLL_NAMESPACE::FunctionInfo::registry())
 		{
+			if (f.cacheVersion != nullptr && !f.isCacheable)
+			{
+				XLL_LOG_WARNING("Results of %ls are not cached, because it takes "
+					"or returns an object handle or a shared array", f.name);
+				f.cacheVersion = nullptr;
+			}
 			try 
 			{
 				double id = RegisterFunction(&xDLL, f, exports);
@@ -300,12 +465,50 @@ int WINAPI xlAutoOpen()
 				{
 					f.registerId = id;
 				}
+				else
+				{
+					XLL_LOG_WARNING("Cannot register function %s", f.name);
+				}
+			}
+			catch (const std::exception &ex)
+			{
+				XLL_LOG_ERROR("Cannot register function %s: %s", f.name, ex.what());
 			}
 			catch (...)
 			{
+				XLL_LOG_ERROR("Cannot register function %s", f.name);
 			}
 		}
 		// RegisterFunctionTest(&xDLL);
+		try
+		{
+			RegisterCalculationEvents(&xDLL);
+			if (GetProfiledFunctionCount() > 0)
+			{
+				RegisterBuiltinFunction(&xDLL, L"XllProfileReport", L"Q!",
+					L"XllProfileReport", 1);
+			}
+			if (IsCallbackProfilingEnabled())
+			{
+				RegisterBuiltinFunction(&xDLL, L"XllCallbackReport", L"Q!",
+					L"XllCallbackReport", 1);
+			}
+			if (hasObjectCacheBudget)
+			{
+				RegisterBuiltinFunction(&xDLL, L"XllObjectCacheReport", L"Q!",
+					L"XllObjectCacheReport", 1);
+			}
+			if (hasResultCache)
+			{
+				RegisterBuiltinFunction(&xDLL, L"XllResultCacheReport", L"Q!",
+					L"XllResultCacheReport", 1);
+			}
+		}
+		catch (...)
+		{
+		}
+		StartProfileDump();
+		StartTracingFromEnvironment();
 		Excel12(xlFree, 0, 1, &xDLL);
 	}
 	return 1;
@@ -328,7 +531,19 @@ int WINAPI xlAutoClose()
 	//   2) https://msdn.microsoft.com/en-us/library/office/bb687841.aspx
 	//      A known bug prevents the name from being deleted.
 	// 
-	// Therefore we do nothing here.
+	// Therefore we only write the pending state of the active workbook
+	// and drop the rest, stop the background
+	// threads started in xlAutoOpen(), close the result cache, release
+	// the cached objects while the code of their destructors is still
+	// loaded, and release the shared datasets held by this process.
+	FlushWorkbookState();
+	ClearWorkbookState();
+	StopProfileDump();
+	StopTracing();
+	CloseResultCache();
+	StopLogging();
+	ClearObjectCache();
+	CloseSharedData();
 #if 0
 	for (FunctionInfo &f : XLL_NAMESPACE::FunctionInfo::registry())
 	{
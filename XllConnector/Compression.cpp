@@ -0,0 +1,182 @@
+////////////////////////////////////////////////////////////////////////////
+// Compression.cpp -- fast LZ77 codec for serialized add-in state
+
+#include "Compression.h"
+#include <cstring>
+
+namespace XLL_NAMESPACE
+{
+	//
+	// The compressed data is a series of sequences. Each sequence starts
+	// with a token byte whose high four bits are the number of literals
+	// and whose low four bits are the length of the match minus four. A
+	// value of 15 in either half is followed by more bytes to add to it,
+	// each 255 except the last. The literals follow, and then the offset
+	// of the match as two bytes, least significant first, and the extra
+	// bytes of the match length. The last sequence has literals only.
+	//
+	// The last bytes of the input are always literals, so that a match
+	// never needs to be checked against the end of the input while it
+	// is extended.
+	//
+
+	static const int HashBits = 14;
+	static const size_t MinMatch = 4;
+	static const size_t MaxOffset = 65535;
+	static const size_t LastLiterals = 5;
+
+	static inline unsigned int Read32(const unsigned char *p)
+	{
+		unsigned int value;
+		memcpy(&value, p, sizeof(value));
+		return value;
+	}
+
+	static inline unsigned int HashSequence(unsigned int sequence)
+	{
+		return (sequence * 2654435761U) >> (32 - HashBits);
+	}
+
+	static void WriteLength(std::vector<unsigned char> &output, size_t length)
+	{
+		while (length >= 255)
+		{
+			output.push_back(255);
+			length -= 255;
+		}
+		output.push_back((unsigned char)length);
+	}
+
+	static void WriteSequence(std::vector<unsigned char> &output,
+		const unsigned char *literals, size_t literalCount,
+		size_t offset, size_t matchLength)
+	{
+		size_t extraMatch = (matchLength >= MinMatch) ? matchLength - MinMatch : 0;
+		unsigned char token = (unsigned char)(
+			((literalCount < 15 ? literalCount : 15) << 4) |
+			(extraMatch < 15 ? extraMatch : 15));
+		output.push_back(token);
+		if (literalCount >= 15)
+			WriteLength(output, literalCount - 15);
+		output.insert(output.end(), literals, literals + literalCount);
+
+		if (matchLength == 0)
+			return;
+		output.push_back((unsigned char)offset);
+		output.push_back((unsigned char)(offset >> 8));
+		if (extraMatch >= 15)
+			WriteLength(output, extraMatch - 15);
+	}
+
+	void CompressBytes(const void *data, size_t size, std::vector<unsigned char> &output)
+	{
+		const unsigned char *src = static_cast<const unsigned char *>(data);
+		output.reserve(output.size() + size + size / 255 + 16);
+
+		// Positions are stored plus one, so that zero means empty.
+		std::vector<size_t> table((size_t)1 << HashBits, 0);
+
+		size_t anchor = 0;
+		size_t i = 0;
+		size_t matchLimit = (size > LastLiterals) ? size - LastLiterals : 0;
+		size_t searchLimit = (matchLimit > MinMatch) ? matchLimit - MinMatch : 0;
+		while (i < searchLimit)
+		{
+			unsigned int sequence = Read32(src + i);
+			unsigned int h = HashSequence(sequence);
+			size_t candidate = table[h];
+			table[h] = i + 1;
+
+			if (candidate == 0 || i - (candidate - 1) > MaxOffset ||
+				Read32(src + candidate - 1) != sequence)
+			{
+				// Skip faster through data that does not compress.
+				i += 1 + ((i - anchor) >> 6);
+				continue;
+			}
+
+			size_t match = candidate - 1;
+			size_t length = MinMatch;
+			while (i + length < matchLimit && src[match + length] == src[i + length])
+				length++;
+
+			WriteSequence(output, src + anchor, i - anchor, i - match, length);
+			i += length;
+			anchor = i;
+		}
+
+		WriteSequence(output, src + anchor, size - anchor, 0, 0);
+	}
+
+	// Reads the extra bytes of a length. Returns false on overrun.
+	static bool ReadLength(const unsigned char *&p, const unsigned char *end, size_t &length)
+	{
+		unsigned char b;
+		do
+		{
+			if (p == end)
+				return false;
+			b = *p++;
+			length += b;
+		} while (b == 255);
+		return true;
+	}
+
+	bool DecompressBytes(const void *data, size_t dataSize, void *output, size_t size)
+	{
+		const unsigned char *p = static_cast<const unsigned char *>(data);
+		const unsigned char *end = p + dataSize;
+		unsigned char *const dst = static_cast<unsigned char *>(output);
+		unsigned char *o = dst;
+		unsigned char *const dstEnd = dst + size;
+
+		// The data must end with a sequence of literals only, so that data
+		// cut short after a match is not taken for the whole.
+		for (;;)
+		{
+			if (p == end)
+				return false;
+			unsigned char token = *p++;
+
+			size_t literalCount = token >> 4;
+			if (literalCount == 15 && !ReadLength(p, end, literalCount))
+				return false;
+			if (literalCount > (size_t)(end - p) || literalCount > (size_t)(dstEnd - o))
+				return false;
+			if (literalCount != 0)
+				memcpy(o, p, literalCount);
+			o += literalCount;
+			p += literalCount;
+
+			if (p == end)
+				return o == dstEnd;
+
+			if (end - p < 2)
+				return false;
+			size_t offset = (size_t)p[0] | ((size_t)p[1] << 8);
+			p += 2;
+			if (offset == 0 || offset > (size_t)(o - dst))
+				return false;
+
+			size_t length = token & 15;
+			if (length == 15 && !ReadLength(p, end, length))
+				return false;
+			length += MinMatch;
+			if (length > (size_t)(dstEnd - o))
+				return false;
+
+			const unsigned char *match = o - offset;
+			if (offset >= length)
+			{
+				memcpy(o, match, length);
+				o += length;
+			}
+			else
+			{
+				// The match overlaps the bytes it produces.
+				for (size_t k = 0; k < length; k++)
+					*o++ = match[k];
+			}
+		}
+	}
+}
@@ -0,0 +1,34 @@
+////////////////////////////////////////////////////////////////////////////
+// Compression.h -- fast LZ77 codec for serialized add-in state
+//
+// The codec trades compression ratio for speed, in the manner of LZ4:
+// it finds repeated sequences of four or more bytes within the last 64 KB
+// with a single hash probe, and encodes the input as runs of literal bytes
+// followed by back-references. Serialized state, such as arrays of
+// doubles and repeated strings, typically shrinks by a factor of two to
+// five, at several hundred megabytes per second in both directions.
+//
+// The compressed data does not record its uncompressed size; store it
+// alongside the data and pass it to DecompressBytes().
+//
+
+#pragma once
+
+#if defined(_WIN32)
+#include "xlldef.h"
+#elif !defined(XLL_NAMESPACE)
+#define XLL_NAMESPACE xll
+#endif
+#include <cstddef>
+#include <vector>
+
+namespace XLL_NAMESPACE
+{
+	// Appends the compressed form of size bytes at data to output.
+	void CompressBytes(const void *data, size_t size, std::vector<unsigned char> &output);
+
+	// Decompresses dataSize bytes at data into exactly size bytes at
+	// output. Returns false if the compressed data is corrupt or does not
+	// decompress to size bytes.
+	bool DecompressBytes(const void *data, size_t dataSize, void *output, size_t size);
+}
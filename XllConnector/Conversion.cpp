@@ -42,6 +42,35 @@ namespace XLL_NAMESPACE
 		return S_OK;
 	}
 
+	size_t GetValueSize(const XLOPER12 &x)
+	{
+		size_t size = sizeof(XLOPER12);
+		switch (x.xltype & ~(xlbitDLLFree | xlbitXLFree))
+		{
+		case xltypeStr:
+			if (x.val.str != nullptr)
+				size += sizeof(wchar_t) * ((unsigned short)x.val.str[0] + 1);
+			break;
+		case xltypeRef:
+			if (x.val.mref.lpmref != nullptr)
+				size += sizeof(XLMREF12) + sizeof(XLREF12) * x.val.mref.lpmref->count;
+			break;
+		case xltypeMulti:
+			if (x.val.array.lparray != nullptr)
+			{
+				int count = x.val.array.rows * x.val.array.columns;
+				for (int i = 0; i < count; i++)
+					size += GetValueSize(x.val.array.lparray[i]);
+			}
+			break;
+		case xltypeBigData:
+			if (x.val.bigdata.h.lpbData != nullptr)
+				size += x.val.bigdata.cbData;
+			break;
+		}
+		return size;
+	}
+
 	HRESULT CreateValue(LPXLOPER12 dest, const XLOPER12 &from)
 	{
 		assert(dest != nullptr);
@@ -60,6 +60,10 @@ namespace XLL_NAMESPACE
 	HRESULT CreateValue(LPXLOPER12, const std::wstring &);
 	HRESULT DeleteValue(LPXLOPER12);
 
+	// Returns the number of bytes of memory held by an XLOPER12,
+	// including the strings, references and array elements it owns.
+	size_t GetValueSize(const XLOPER12 &);
+
 	// Conversions from XLOPER12.
 	HRESULT CreateValue(double*, const XLOPER12 &);
 
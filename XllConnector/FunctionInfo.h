@@ -7,8 +7,10 @@
 #include <Windows.h>
 #include <string>
 #include <vector>
+#include <deque>
 #include <array>
 #include "TypeText.h"
+#include "Profile.h"
 
 // TODO: it makes more sense to put typetext inside this file?
 
@@ -43,28 +45,50 @@ namespace XLL_NAMESPACE
 
 		double registerId;
 
+		// Index into the profile statistics, or -1 if the function is
+		// not profiled.
+		int profileId;
+
+		// Version tag of the results kept in the persistent result
+		// cache, or NULL if the results are not cached.
+		LPCWSTR cacheVersion;
+
+		// False if the signature of the function cannot be cached, i.e.
+		// it takes or returns an object handle or a shared array.
+		bool isCacheable;
+
 		//bool isPure;
 		//bool isThreadSafe;
 
 		FunctionInfo(FARPROC entryPoint, LPCWSTR typeText)
 			: entryPoint(entryPoint), typeText(typeText),
 			name(), description(), macroType(1), category(), 
-			shortcut(), helpTopic(), registerId()
+			shortcut(), helpTopic(), registerId(), profileId(-1),
+			cacheVersion(), isCacheable(true)
 		{
 		}
 
-		static std::vector<FunctionInfo> & registry()
+		// The registry is a deque so that references to its elements
+		// remain valid as more functions are added.
+		static std::deque<FunctionInfo> & registry()
 		{
-			static std::vector<FunctionInfo> s_functions;
+			static std::deque<FunctionInfo> s_functions;
 			return s_functions;
 		}
 
 		template <int Attributes, typename TRet, typename... TArgs>
-		static FunctionInfo& Create(TRet(__stdcall *func)(TArgs...), FARPROC stub = 0)
+		static FunctionInfo& Create(TRet(__stdcall *func)(TArgs...), FARPROC stub = 0,
+			bool isCacheable = true)
 		{
 			const wchar_t *typeText = GetTypeTextImpl<wchar_t, Attributes>(func);
 			registry().emplace_back((stub == 0)? (FARPROC)func : stub, typeText);
-			return registry().back();
+			FunctionInfo &info = registry().back();
+			info.isCacheable = isCacheable;
+			if (FunctionAttributes<Attributes>::IsProfiled)
+			{
+				info.profileId = RegisterProfiledFunction(&info);
+			}
+			return info;
 		}
 	};
 
@@ -107,5 +131,17 @@ namespace XLL_NAMESPACE
 			_info.helpTopic = helpTopic;
 			return (*this);
 		}
+
+		// Keeps the results of the function in the persistent result
+		// cache (see ResultCache.h). Change the version whenever the
+		// function would return different results for the same
+		// arguments. A function that takes or returns an object handle
+		// or a shared array is not cached, and a warning is logged when
+		// it is registered.
+		FunctionInfoBuilder& Cacheable(LPCWSTR version)
+		{
+			_info.cacheVersion = version;
+			return (*this);
+		}
 	};
 }
\ No newline at end of file
@@ -3,6 +3,7 @@
 
 #include "Invoke.h"
 #include <stdio.h>
+#include <atomic>
 
 using namespace XLL_NAMESPACE;
 
@@ -107,10 +108,69 @@ namespace XLL_NAMESPACE
 		return TRUE; // keep iterating
 	}
 
+	class WindowDialogStateProvider : public DialogStateProvider
+	{
+	public:
+		virtual bool IsDialogBoxOpen() override
+		{
+			bool bFoundDialog = false;
+			EnumWindows(IsDialogBoxOpen_Callback, (LPARAM)&bFoundDialog);
+			return bFoundDialog;
+		}
+	};
+
+	static WindowDialogStateProvider s_defaultDialogStateProvider;
+
+	static std::atomic<DialogStateProvider*> s_dialogStateProvider(
+		&s_defaultDialogStateProvider);
+
+	// The cached dialog state is packed into a single 64-bit word so
+	// that it can be read and written atomically by recalc threads:
+	//
+	//   bits 63-48  generation, bumped by InvalidateDialogState()
+	//   bits 47-1   tick count (in milliseconds) when the state expires
+	//   bit  0      1 if a dialog box is open
+	//
+	// A word whose generation differs from s_dialogStateGeneration is
+	// stale. Only the answer that no dialog box is open is cached: while
+	// one is open, every call asks the provider again, so that a cell
+	// calculated just after the dialog closes does not return #N/A. Two
+	// threads may refresh a stale state at the same time; this is
+	// harmless because both store the same answer.
+
+	static std::atomic<unsigned long long> s_dialogState(0);
+	static std::atomic<unsigned short> s_dialogStateGeneration(1);
+
+	DialogStateProvider* SetDialogStateProvider(DialogStateProvider *provider)
+	{
+		if (provider == nullptr)
+			provider = &s_defaultDialogStateProvider;
+		DialogStateProvider *previous = s_dialogStateProvider.exchange(provider);
+		InvalidateDialogState();
+		return previous;
+	}
+
+	void InvalidateDialogState()
+	{
+		++s_dialogStateGeneration;
+	}
+
 	bool IsDialogBoxOpen()
 	{
-		bool bFoundDialog = false;
-		EnumWindows(IsDialogBoxOpen_Callback, (LPARAM)&bFoundDialog);
-		return bFoundDialog;
+		const unsigned long long tickMask = (1ull << 47) - 1;
+		unsigned long long generation = s_dialogStateGeneration.load();
+		unsigned long long now = GetTickCount64() & tickMask;
+
+		unsigned long long state = s_dialogState.load();
+		if ((state >> 48) == generation && (state & 1) == 0 &&
+			now < ((state >> 1) & tickMask))
+		{
+			return false;
+		}
+
+		bool isOpen = s_dialogStateProvider.load()->IsDialogBoxOpen();
+		unsigned long long expiry = isOpen ? 0 : (now + XLL_DIALOG_STATE_CACHE_MS) & tickMask;
+		s_dialogState.store((generation << 48) | (expiry << 1) | (isOpen ? 1 : 0));
+		return isOpen;
 	}
 }
\ No newline at end of file
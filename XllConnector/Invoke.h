@@ -23,6 +23,40 @@ namespace XLL_NAMESPACE
 		const char* what() const override { return m_errorMessage; }
 	};
 
+	//
+	// DialogStateProvider
+	//
+	// Detects whether the Function Wizard or Replace dialog box is open
+	// in the current Excel session.
+	//
+	// The default provider enumerates the top-level windows of the
+	// process, which is expensive. IsDialogBoxOpen() therefore caches
+	// the answer that no dialog box is open; the cache is discarded at
+	// the end of each calculation, or after XLL_DIALOG_STATE_CACHE_MS
+	// milliseconds, whichever comes first. While a dialog box is open,
+	// the provider is asked on every call.
+	//
+	// A test host that does not create any window may install its own
+	// provider by calling SetDialogStateProvider().
+	//
+
+	class DialogStateProvider
+	{
+	public:
+		virtual ~DialogStateProvider() {}
+		virtual bool IsDialogBoxOpen() = 0;
+	};
+
+	// Installs a dialog state provider and returns the previous one.
+	// If provider is NULL, the default provider is restored. The
+	// caller retains ownership of provider, which must stay alive
+	// until it is replaced.
+	DialogStateProvider* SetDialogStateProvider(DialogStateProvider *provider);
+
+	// Discards the cached dialog state, so that the next call to
+	// IsDialogBoxOpen() queries the provider again.
+	void InvalidateDialogState();
+
 	// Returns true if the Function Wizard or Replace dialog box is
 	// open in the current Excel session.
 	bool IsDialogBoxOpen();
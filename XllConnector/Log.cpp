@@ -0,0 +1,507 @@
+////////////////////////////////////////////////////////////////////////////
+// Log.cpp -- asynchronous logging that is cheap enough for recalc threads
+
+#include "Log.h"
+#include "ThreadBuffer.h"
+#include <Windows.h>
+#include <algorithm>
+#include <stdio.h>
+#include <vector>
+
+namespace XLL_NAMESPACE
+{
+	// Effective level: LogLevelOff while logging is stopped.
+	std::atomic<int> g_logLevel(LogLevelOff);
+
+	// Level set by SetLogLevel(), applied when logging is started.
+	static std::atomic<int> s_configuredLogLevel(LogLevelInfo);
+
+	static_assert((XLL_LOG_BUFFER_SIZE & (XLL_LOG_BUFFER_SIZE - 1)) == 0,
+		"XLL_LOG_BUFFER_SIZE must be a power of two.");
+
+	////////////////////////////////////////////////////////////////////////
+	// Per-thread ring buffers
+	//
+	// Each thread that logs owns a LogBuffer (see ThreadBuffer.h), which
+	// the writer thread drains.
+	//
+
+	struct LogBuffer : ThreadBufferNode<LogBuffer>
+	{
+		RingBuffer<LogRecord, XLL_LOG_BUFFER_SIZE> records;
+	};
+
+	typedef ThreadBufferList<LogBuffer> LogBuffers;
+
+	LogRecord* ReserveLogRecord(LogLevel level, const char *format) XLL_NOEXCEPT
+	{
+		LogBuffer *buffer = LogBuffers::Get();
+		if (buffer == nullptr)
+			return nullptr;
+
+		LogRecord *record = buffer->records.Reserve();
+		if (record == nullptr)
+			return nullptr;
+
+		record->timestamp = ReadTimestamp();
+		record->format = format;
+		record->level = (unsigned short)level;
+		record->size = 0;
+		return record;
+	}
+
+	void CommitLogRecord(LogRecord *) XLL_NOEXCEPT
+	{
+		// The record is the one reserved last in the calling thread's buffer.
+		LogBuffers::Get()->records.Publish();
+	}
+
+	unsigned long long GetDroppedLogRecordCount()
+	{
+		unsigned long long n = 0;
+		for (LogBuffer *p = LogBuffers::First(); p != nullptr; p = p->next)
+			n += p->records.dropped();
+		return n;
+	}
+
+	void SetLogLevel(LogLevel level)
+	{
+		s_configuredLogLevel.store(level);
+		if (g_logLevel.load() != LogLevelOff)
+			g_logLevel.store(level);
+	}
+
+	LogLevel GetLogLevel()
+	{
+		return (LogLevel)s_configuredLogLevel.load();
+	}
+
+	////////////////////////////////////////////////////////////////////////
+	// Formatting
+
+	class LogRecordReader
+	{
+		const LogRecord &m_record;
+		size_t m_pos;
+
+	public:
+		explicit LogRecordReader(const LogRecord &record) : m_record(record), m_pos(0) {}
+
+		// Returns the type of the next argument and advances past the
+		// tag, or returns -1 if there are no more arguments.
+		int NextType()
+		{
+			if (m_pos >= m_record.size)
+				return -1;
+			int type = m_record.data[m_pos];
+			if (type != LogArgumentTruncated)
+				m_pos++;
+			return type;
+		}
+
+		template <typename T> T Read()
+		{
+			T value;
+			memcpy(&value, &m_record.data[m_pos], sizeof(T));
+			m_pos += sizeof(T);
+			return value;
+		}
+
+		std::string ReadString(bool isWide)
+		{
+			unsigned short n = Read<unsigned short>();
+			const unsigned char *p = &m_record.data[m_pos];
+			std::string s;
+			if (isWide)
+			{
+				m_pos += n * sizeof(wchar_t);
+				std::wstring w(n, L'\0');
+				memcpy(&w[0], p, n * sizeof(wchar_t));
+				int len = WideCharToMultiByte(CP_UTF8, 0, w.c_str(), n, nullptr, 0, nullptr, nullptr);
+				if (len > 0)
+				{
+					s.resize(len);
+					WideCharToMultiByte(CP_UTF8, 0, w.c_str(), n, &s[0], len, nullptr, nullptr);
+				}
+			}
+			else
+			{
+				m_pos += n;
+				s.assign((const char *)p, n);
+			}
+			return s;
+		}
+	};
+
+	static bool IsOneOf(char c, const char *chars)
+	{
+		return c != '\0' && strchr(chars, c) != nullptr;
+	}
+
+	// Formats the next argument according to the printf conversion
+	// specification spec (flags, width and precision, without length
+	// modifier) and conversion character conv. The argument is
+	// formatted according to its actual type if conv does not fit it.
+	static void FormatArgument(std::string &out, std::string spec, char conv,
+		LogRecordReader &reader)
+	{
+		char buffer[1024];
+		buffer[0] = '\0';
+
+		int type = reader.NextType();
+		switch (type)
+		{
+		case LogArgumentInt:
+		{
+			long long value = reader.Read<long long>();
+			if (IsOneOf(conv, "eEfFgGaA"))
+				_snprintf_s(buffer, _TRUNCATE, (spec + conv).c_str(), (double)value);
+			else if (conv == 'c')
+				_snprintf_s(buffer, _TRUNCATE, (spec + conv).c_str(), (int)value);
+			else
+				_snprintf_s(buffer, _TRUNCATE, (spec + "ll" + (IsOneOf(conv, "ouxX") ? conv : 'd')).c_str(), value);
+			break;
+		}
+		case LogArgumentUInt:
+		{
+			unsigned long long value = reader.Read<unsigned long long>();
+			if (IsOneOf(conv, "eEfFgGaA"))
+				_snprintf_s(buffer, _TRUNCATE, (spec + conv).c_str(), (double)value);
+			else
+				_snprintf_s(buffer, _TRUNCATE, (spec + "ll" + (IsOneOf(conv, "ouxX") ? conv : 'u')).c_str(), value);
+			break;
+		}
+		case LogArgumentDouble:
+		{
+			double value = reader.Read<double>();
+			_snprintf_s(buffer, _TRUNCATE, (spec + (IsOneOf(conv, "eEfFgGaA") ? conv : 'g')).c_str(), value);
+			break;
+		}
+		case LogArgumentPointer:
+			_snprintf_s(buffer, _TRUNCATE, (spec + 'p').c_str(), reader.Read<const void *>());
+			break;
+		case LogArgumentString:
+		case LogArgumentWideString:
+		{
+			std::string s = reader.ReadString(type == LogArgumentWideString);
+			_snprintf_s(buffer, _TRUNCATE, (spec + 's').c_str(), s.c_str());
+			break;
+		}
+		case LogArgumentTruncated:
+			out += "...";
+			return;
+		default:
+			out += "<missing>";
+			return;
+		}
+		out += buffer;
+	}
+
+	static void FormatLogMessage(std::string &out, const LogRecord &record)
+	{
+		LogRecordReader reader(record);
+		const char *p = record.format;
+		while (*p != '\0')
+		{
+			if (*p != '%')
+			{
+				out += *p++;
+				continue;
+			}
+			if (p[1] == '%')
+			{
+				out += '%';
+				p += 2;
+				continue;
+			}
+
+			std::string spec("%");
+			++p;
+			while (IsOneOf(*p, "-+ #0"))
+				spec += *p++;
+			while (IsOneOf(*p, "0123456789."))
+				spec += *p++;
+			while (IsOneOf(*p, "hlLjztwI"))
+			{
+				if (*p++ == 'I')
+				{
+					while (IsOneOf(*p, "0123456789"))
+						p++;
+				}
+			}
+			char conv = *p;
+			if (conv != '\0')
+				p++;
+			FormatArgument(out, spec, conv, reader);
+		}
+	}
+
+	////////////////////////////////////////////////////////////////////////
+	// Writer thread
+
+	static HANDLE s_hLogThread = NULL;
+	static HANDLE s_hLogStopEvent = NULL;
+	static FILE *s_logFile = nullptr;
+	static std::wstring s_logFileName;
+	static unsigned long long s_logFileSize = 0;
+	static unsigned long long s_maxLogFileSize = 0;
+	static int s_maxLogFileCount = 0;
+	static unsigned long long s_reportedDropCount = 0;
+
+	// Wall-clock time and timestamp taken together when logging starts.
+	static ULARGE_INTEGER s_startFileTime;
+	static unsigned long long s_startTimestamp = 0;
+
+	struct PendingLogRecord
+	{
+		DWORD threadId;
+		LogRecord record;
+
+		bool operator<(const PendingLogRecord &other) const
+		{
+			return record.timestamp < other.record.timestamp;
+		}
+	};
+
+	static const char * const s_levelNames[] = {
+		"TRACE", "DEBUG", "INFO ", "WARN ", "ERROR"
+	};
+
+	static void FormatLogHeader(std::string &out, unsigned long long timestamp,
+		int level, DWORD threadId)
+	{
+		double seconds = (double)(long long)(timestamp - s_startTimestamp) /
+			GetTimestampFrequency();
+		ULARGE_INTEGER t;
+		t.QuadPart = s_startFileTime.QuadPart + (long long)(seconds * 1e7);
+
+		FILETIME utc, local;
+		utc.dwLowDateTime = t.LowPart;
+		utc.dwHighDateTime = t.HighPart;
+		SYSTEMTIME st;
+		FileTimeToLocalFileTime(&utc, &local);
+		FileTimeToSystemTime(&local, &st);
+
+		char buffer[100];
+		_snprintf_s(buffer, _TRUNCATE, "%04d-%02d-%02d %02d:%02d:%02d.%06d %s [%lu] ",
+			st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, st.wSecond,
+			(int)(t.QuadPart % 10000000 / 10),
+			(level >= 0 && level < LogLevelOff) ? s_levelNames[level] : "?    ",
+			threadId);
+		out += buffer;
+	}
+
+	static void RotateLogFile()
+	{
+		fclose(s_logFile);
+		s_logFile = nullptr;
+
+		for (int i = s_maxLogFileCount - 1; i >= 1; i--)
+		{
+			std::wstring from = s_logFileName + L"." + std::to_wstring(i);
+			std::wstring to = s_logFileName + L"." + std::to_wstring(i + 1);
+			MoveFileExW(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING);
+		}
+		if (s_maxLogFileCount >= 1)
+		{
+			std::wstring to = s_logFileName + L".1";
+			MoveFileExW(s_logFileName.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING);
+		}
+
+		FILE *fp = nullptr;
+		if (_wfopen_s(&fp, s_logFileName.c_str(), L"wb") == 0)
+			s_logFile = fp;
+		s_logFileSize = 0;
+	}
+
+	static void WriteLogLine(const std::string &line)
+	{
+		if (s_logFile == nullptr)
+			return;
+
+		fwrite(line.c_str(), 1, line.size(), s_logFile);
+		s_logFileSize += line.size();
+		if (IsDebuggerPresent())
+			OutputDebugStringA(line.c_str());
+
+		if (s_maxLogFileSize > 0 && s_logFileSize >= s_maxLogFileSize)
+			RotateLogFile();
+	}
+
+	// Formats and writes all published records in timestamp order.
+	// Called only by the writer thread, or by StopLogging() after the
+	// writer thread has exited.
+	static void FlushLogBuffers()
+	{
+		std::vector<PendingLogRecord> pending;
+		for (LogBuffer *p = LogBuffers::First(); p != nullptr; p = p->next)
+		{
+			DWORD threadId = p->threadId;
+			p->records.Drain([&pending, threadId](const LogRecord &record)
+			{
+				PendingLogRecord r;
+				r.threadId = threadId;
+				r.record = record;
+				pending.push_back(r);
+			});
+		}
+
+		std::stable_sort(pending.begin(), pending.end());
+
+		std::string line;
+		for (const PendingLogRecord &r : pending)
+		{
+			line.clear();
+			FormatLogHeader(line, r.record.timestamp, r.record.level, r.threadId);
+			FormatLogMessage(line, r.record);
+			line += "\r\n";
+			WriteLogLine(line);
+		}
+
+		unsigned long long dropped = GetDroppedLogRecordCount();
+		if (dropped != s_reportedDropCount)
+		{
+			line.clear();
+			FormatLogHeader(line, ReadTimestamp(), LogLevelWarning, GetCurrentThreadId());
+			line += std::to_string(dropped - s_reportedDropCount);
+			line += " log records dropped because the buffer was full\r\n";
+			WriteLogLine(line);
+			s_reportedDropCount = dropped;
+		}
+
+		if (s_logFile != nullptr)
+			fflush(s_logFile);
+	}
+
+	static DWORD WINAPI LogWriterThreadProc(LPVOID)
+	{
+		while (WaitForSingleObject(s_hLogStopEvent, 100) == WAIT_TIMEOUT)
+		{
+			FlushLogBuffers();
+		}
+		return 0;
+	}
+
+	BOOL StartLogging(LPCWSTR fileName, unsigned long long maxFileSize, int maxFileCount)
+	{
+		if (s_logFile != nullptr)
+			return FALSE;
+
+		FILE *fp = nullptr;
+		if (_wfopen_s(&fp, fileName, L"ab") != 0 || fp == nullptr)
+			return FALSE;
+
+		s_hLogStopEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+		if (s_hLogStopEvent == NULL)
+		{
+			fclose(fp);
+			return FALSE;
+		}
+
+		// Discard records left over from a previous session.
+		for (LogBuffer *p = LogBuffers::First(); p != nullptr; p = p->next)
+			p->records.Discard();
+		s_reportedDropCount = GetDroppedLogRecordCount();
+
+		_fseeki64(fp, 0, SEEK_END);
+		s_logFile = fp;
+		s_logFileName = fileName;
+		s_logFileSize = (unsigned long long)_ftelli64(fp);
+		s_maxLogFileSize = maxFileSize;
+		s_maxLogFileCount = maxFileCount;
+
+		FILETIME ft;
+		GetSystemTimeAsFileTime(&ft);
+		s_startTimestamp = ReadTimestamp();
+		s_startFileTime.LowPart = ft.dwLowDateTime;
+		s_startFileTime.HighPart = ft.dwHighDateTime;
+
+		s_hLogThread = CreateThread(NULL, 0, LogWriterThreadProc, NULL, 0, NULL);
+		if (s_hLogThread == NULL)
+		{
+			CloseHandle(s_hLogStopEvent);
+			s_hLogStopEvent = NULL;
+			fclose(fp);
+			s_logFile = nullptr;
+			return FALSE;
+		}
+
+		g_logLevel.store(s_configuredLogLevel.load());
+		return TRUE;
+	}
+
+	void StopLogging()
+	{
+		if (s_hLogThread == NULL)
+			return;
+
+		g_logLevel.store(LogLevelOff);
+
+		SetEvent(s_hLogStopEvent);
+		WaitForSingleObject(s_hLogThread, INFINITE);
+		CloseHandle(s_hLogThread);
+		CloseHandle(s_hLogStopEvent);
+		s_hLogThread = NULL;
+		s_hLogStopEvent = NULL;
+
+		FlushLogBuffers();
+		if (s_logFile != nullptr)
+		{
+			fclose(s_logFile);
+			s_logFile = nullptr;
+		}
+	}
+
+	static bool ParseLogLevel(LPCWSTR s, LogLevel &level)
+	{
+		static const struct { LPCWSTR name; LogLevel level; } names[] = {
+			{ L"trace", LogLevelTrace },
+			{ L"debug", LogLevelDebug },
+			{ L"info", LogLevelInfo },
+			{ L"warning", LogLevelWarning },
+			{ L"warn", LogLevelWarning },
+			{ L"error", LogLevelError },
+			{ L"off", LogLevelOff },
+		};
+		for (size_t i = 0; i < ARRAYSIZE(names); i++)
+		{
+			if (_wcsicmp(s, names[i].name) == 0)
+			{
+				level = names[i].level;
+				return true;
+			}
+		}
+		if (s[0] >= L'0' && s[0] <= L'0' + LogLevelOff && s[1] == L'\0')
+		{
+			level = (LogLevel)(s[0] - L'0');
+			return true;
+		}
+		return false;
+	}
+
+	void StartLoggingFromEnvironment()
+	{
+		WCHAR fileName[MAX_PATH];
+		DWORD n = GetEnvironmentVariableW(L"XLL_LOG_FILE", fileName, ARRAYSIZE(fileName));
+		if (n == 0 || n >= ARRAYSIZE(fileName))
+			return;
+
+		WCHAR value[32];
+		n = GetEnvironmentVariableW(L"XLL_LOG_LEVEL", value, ARRAYSIZE(value));
+		LogLevel level;
+		if (n > 0 && n < ARRAYSIZE(value) && ParseLogLevel(value, level))
+			SetLogLevel(level);
+
+		unsigned long long maxFileSize = 10 * 1024 * 1024;
+		n = GetEnvironmentVariableW(L"XLL_LOG_FILE_SIZE", value, ARRAYSIZE(value));
+		if (n > 0 && n < ARRAYSIZE(value))
+			maxFileSize = _wcstoui64(value, nullptr, 10);
+
+		int maxFileCount = 5;
+		n = GetEnvironmentVariableW(L"XLL_LOG_FILE_COUNT", value, ARRAYSIZE(value));
+		if (n > 0 && n < ARRAYSIZE(value))
+			maxFileCount = _wtoi(value);
+
+		StartLogging(fileName, maxFileSize, maxFileCount);
+	}
+}
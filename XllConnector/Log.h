@@ -0,0 +1,288 @@
+////////////////////////////////////////////////////////////////////////////
+// Log.h -- asynchronous logging that is cheap enough for recalc threads
+//
+// Use the macros to write a log record, e.g.
+//
+//   XLL_LOG_INFO("Loaded curve %s with %d points", curveName, n);
+//   XLL_LOG_ERROR("%ls failed: %s", functionName, ex.what());
+//
+// The format string follows printf() conventions and must be a string
+// literal, because it is stored by pointer and formatted later. The
+// arguments are copied into a binary record; strings are copied by
+// value (and truncated if the record is full), so they need not
+// outlive the call. The l/ll/h/I64 length modifiers are ignored: each
+// argument is formatted according to its actual type.
+//
+// Each thread writes its records to its own ring buffer without taking
+// a lock. A background thread formats the records and appends them to
+// the log file, which is rotated when it grows too large. If a buffer
+// is full, the record is dropped and counted instead of blocking the
+// calling thread.
+//
+// Records below XLL_LOG_LEVEL are removed at compile time. Records
+// below the runtime level (see SetLogLevel()) cost a load and a branch.
+// Nothing is recorded until logging is started, either in xlAutoOpen()
+// if the environment variable XLL_LOG_FILE is set, or by calling
+// StartLogging(). XLL_LOG_LEVEL (runtime level, e.g. "debug"),
+// XLL_LOG_FILE_SIZE (bytes) and XLL_LOG_FILE_COUNT may also be set in
+// the environment.
+//
+
+#pragma once
+
+#include "xlldef.h"
+#include "Timestamp.h"
+#include <atomic>
+#include <string>
+#include <string.h>
+
+//
+// XLL_LOG_BUFFER_SIZE
+//
+// Number of records in the ring buffer of each thread. Must be a power
+// of two. Takes effect when XLL Connector itself is compiled.
+//
+
+#ifndef XLL_LOG_BUFFER_SIZE
+#define XLL_LOG_BUFFER_SIZE 512
+#endif
+
+//
+// XLL_LOG_RECORD_SIZE
+//
+// Size in bytes of a log record, including its header. Arguments that
+// do not fit are truncated or replaced by "...".
+//
+
+#ifndef XLL_LOG_RECORD_SIZE
+#define XLL_LOG_RECORD_SIZE 256
+#endif
+
+namespace XLL_NAMESPACE
+{
+	enum LogLevel
+	{
+		LogLevelTrace = XLL_LOG_LEVEL_TRACE,
+		LogLevelDebug = XLL_LOG_LEVEL_DEBUG,
+		LogLevelInfo = XLL_LOG_LEVEL_INFO,
+		LogLevelWarning = XLL_LOG_LEVEL_WARNING,
+		LogLevelError = XLL_LOG_LEVEL_ERROR,
+		LogLevelOff = XLL_LOG_LEVEL_OFF,
+	};
+
+	extern std::atomic<int> g_logLevel;
+
+	// Returns true if logging is started and records of the given level
+	// are written.
+	inline bool IsLogEnabled(LogLevel level)
+	{
+		return level >= g_logLevel.load(std::memory_order_relaxed);
+	}
+
+	// Sets the minimum level of records to write. Takes effect when
+	// logging is started.
+	void SetLogLevel(LogLevel level);
+	LogLevel GetLogLevel();
+
+	// Starts writing log records to the given file, appending to it.
+	// When the file exceeds maxFileSize bytes, it is renamed to
+	// <fileName>.1 (shifting older files up to <fileName>.<maxFileCount>)
+	// and a new file is started. Returns FALSE if logging is already
+	// started or if the file cannot be opened.
+	BOOL StartLogging(LPCWSTR fileName,
+		unsigned long long maxFileSize = 10 * 1024 * 1024, int maxFileCount = 5);
+
+	// Stops logging, writes all pending records and closes the file.
+	void StopLogging();
+
+	// Starts logging if XLL_LOG_FILE is set. Called by xlAutoOpen().
+	void StartLoggingFromEnvironment();
+
+	// Returns the number of records dropped because a buffer was full.
+	unsigned long long GetDroppedLogRecordCount();
+
+	//
+	// LogRecord
+	//
+	// Binary log record. The arguments are stored in data[] as a type
+	// tag followed by the value; see LogArgumentType.
+	//
+
+	enum LogArgumentType
+	{
+		LogArgumentInt,        // long long
+		LogArgumentUInt,       // unsigned long long
+		LogArgumentDouble,     // double
+		LogArgumentPointer,    // const void *
+		LogArgumentString,     // unsigned short length, char[length]
+		LogArgumentWideString, // unsigned short length, wchar_t[length]
+		LogArgumentTruncated,  // no value; the remaining arguments did not fit
+	};
+
+	struct LogRecordHeader
+	{
+		unsigned long long timestamp;
+		const char *format;
+		unsigned short level;
+		unsigned short size; // number of bytes used in data[]
+	};
+
+	struct LogRecord : LogRecordHeader
+	{
+		enum { Capacity = XLL_LOG_RECORD_SIZE - sizeof(LogRecordHeader) };
+		unsigned char data[Capacity];
+	};
+
+	// Returns a record to fill in, or nullptr if the calling thread's
+	// buffer is full. The record is published by CommitLogRecord().
+	LogRecord* ReserveLogRecord(LogLevel level, const char *format) XLL_NOEXCEPT;
+	void CommitLogRecord(LogRecord *record) XLL_NOEXCEPT;
+
+	//
+	// LogRecordWriter
+	//
+	// Appends arguments to a LogRecord.
+	//
+
+	class LogRecordWriter
+	{
+		LogRecord *m_record;
+		bool m_isFull;
+
+		bool Put(unsigned char type, const void *value, size_t size)
+		{
+			if (m_isFull)
+				return false;
+			if (m_record->size + 1 + size > LogRecord::Capacity - 1)
+			{
+				m_record->data[m_record->size++] = LogArgumentTruncated;
+				m_isFull = true;
+				return false;
+			}
+			m_record->data[m_record->size++] = type;
+			memcpy(&m_record->data[m_record->size], value, size);
+			m_record->size += (unsigned short)size;
+			return true;
+		}
+
+		void PutString(unsigned char type, const void *s, size_t length, size_t charSize)
+		{
+			if (m_isFull)
+				return;
+			size_t available = LogRecord::Capacity - 1 - m_record->size;
+			if (available < 1 + sizeof(unsigned short) + charSize)
+			{
+				m_record->data[m_record->size++] = LogArgumentTruncated;
+				m_isFull = true;
+				return;
+			}
+			size_t maxLength = (available - 1 - sizeof(unsigned short)) / charSize;
+			if (length > maxLength)
+				length = maxLength;
+			unsigned short n = (unsigned short)length;
+			m_record->data[m_record->size++] = type;
+			memcpy(&m_record->data[m_record->size], &n, sizeof(n));
+			m_record->size += sizeof(n);
+			memcpy(&m_record->data[m_record->size], s, n * charSize);
+			m_record->size += (unsigned short)(n * charSize);
+		}
+
+	public:
+		explicit LogRecordWriter(LogRecord *record) : m_record(record), m_isFull(false) {}
+
+		void Add(bool value) { Add((long long)value); }
+		void Add(char value) { Add((long long)value); }
+		void Add(signed char value) { Add((long long)value); }
+		void Add(unsigned char value) { Add((unsigned long long)value); }
+		void Add(short value) { Add((long long)value); }
+		void Add(unsigned short value) { Add((unsigned long long)value); }
+		void Add(int value) { Add((long long)value); }
+		void Add(unsigned int value) { Add((unsigned long long)value); }
+		void Add(long value) { Add((long long)value); }
+		void Add(unsigned long value) { Add((unsigned long long)value); }
+		void Add(long long value) { Put(LogArgumentInt, &value, sizeof(value)); }
+		void Add(unsigned long long value) { Put(LogArgumentUInt, &value, sizeof(value)); }
+		void Add(float value) { Add((double)value); }
+		void Add(double value) { Put(LogArgumentDouble, &value, sizeof(value)); }
+		void Add(const void *value) { Put(LogArgumentPointer, &value, sizeof(value)); }
+
+		void Add(const char *s)
+		{
+			if (s == nullptr)
+				s = "(null)";
+			PutString(LogArgumentString, s, strlen(s), sizeof(char));
+		}
+		void Add(char *s) { Add((const char *)s); }
+		void Add(const std::string &s)
+		{
+			PutString(LogArgumentString, s.c_str(), s.size(), sizeof(char));
+		}
+
+		void Add(const wchar_t *s)
+		{
+			if (s == nullptr)
+				s = L"(null)";
+			PutString(LogArgumentWideString, s, wcslen(s), sizeof(wchar_t));
+		}
+		void Add(wchar_t *s) { Add((const wchar_t *)s); }
+		void Add(const std::wstring &s)
+		{
+			PutString(LogArgumentWideString, s.c_str(), s.size(), sizeof(wchar_t));
+		}
+	};
+
+	//
+	// WriteLog
+	//
+	// Writes a log record with the given arguments. Use the XLL_LOG_xxx
+	// macros instead, which skip evaluating the arguments when the
+	// level is disabled.
+	//
+
+	template <typename... TArgs>
+	void WriteLog(LogLevel level, const char *format, const TArgs&... args) XLL_NOEXCEPT
+	{
+		LogRecord *record = ReserveLogRecord(level, format);
+		if (record != nullptr)
+		{
+			LogRecordWriter writer(record);
+			int dummy[] = { 0, (writer.Add(args), 0)... };
+			(void)dummy;
+			CommitLogRecord(record);
+		}
+	}
+}
+
+#define XLL_LOG(level, format, ...) \
+	do { if (::XLL_NAMESPACE::IsLogEnabled(level)) \
+		::XLL_NAMESPACE::WriteLog(level, format, __VA_ARGS__); } while (0)
+
+#if XLL_LOG_LEVEL <= XLL_LOG_LEVEL_TRACE
+#define XLL_LOG_TRACE(format, ...) XLL_LOG(::XLL_NAMESPACE::LogLevelTrace, format, __VA_ARGS__)
+#else
+#define XLL_LOG_TRACE(format, ...) ((void)0)
+#endif
+
+#if XLL_LOG_LEVEL <= XLL_LOG_LEVEL_DEBUG
+#define XLL_LOG_DEBUG(format, ...) XLL_LOG(::XLL_NAMESPACE::LogLevelDebug, format, __VA_ARGS__)
+#else
+#define XLL_LOG_DEBUG(format, ...) ((void)0)
+#endif
+
+#if XLL_LOG_LEVEL <= XLL_LOG_LEVEL_INFO
+#define XLL_LOG_INFO(format, ...) XLL_LOG(::XLL_NAMESPACE::LogLevelInfo, format, __VA_ARGS__)
+#else
+#define XLL_LOG_INFO(format, ...) ((void)0)
+#endif
+
+#if XLL_LOG_LEVEL <= XLL_LOG_LEVEL_WARNING
+#define XLL_LOG_WARNING(format, ...) XLL_LOG(::XLL_NAMESPACE::LogLevelWarning, format, __VA_ARGS__)
+#else
+#define XLL_LOG_WARNING(format, ...) ((void)0)
+#endif
+
+#if XLL_LOG_LEVEL <= XLL_LOG_LEVEL_ERROR
+#define XLL_LOG_ERROR(format, ...) XLL_LOG(::XLL_NAMESPACE::LogLevelError, format, __VA_ARGS__)
+#else
+#define XLL_LOG_ERROR(format, ...) ((void)0)
+#endif
@@ -0,0 +1,853 @@
+////////////////////////////////////////////////////////////////////////////
+// ObjectCache.cpp -- pass C++ objects between UDFs by handle
+
+#include "ObjectCache.h"
+#include "Conversion.h"
+#include <cassert>
+#include <cctype>
+#include <climits>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <set>
+#include <stdio.h>
+#include <typeindex>
+#include <unordered_map>
+
+namespace XLL_NAMESPACE
+{
+#if XLL_SUPPORT_THREAD_LOCAL
+	__declspec(thread) unsigned long long threadObjectCallStart;
+#endif
+
+	////////////////////////////////////////////////////////////////////////
+	// Binary encoding
+	//
+
+	void ObjectWriter::WriteBytes(const void *data, size_t size)
+	{
+		const unsigned char *p = static_cast<const unsigned char *>(data);
+		m_buffer.insert(m_buffer.end(), p, p + size);
+	}
+
+	void ObjectWriter::WriteSize(unsigned long long value)
+	{
+		while (value >= 0x80)
+		{
+			m_buffer.push_back((unsigned char)(value | 0x80));
+			value >>= 7;
+		}
+		m_buffer.push_back((unsigned char)value);
+	}
+
+	void ObjectWriter::WriteInt(long long value)
+	{
+		// Zigzag encoding, so that small negative numbers are short.
+		WriteSize(((unsigned long long)value << 1) ^ (unsigned long long)(value >> 63));
+	}
+
+	void ObjectWriter::WriteString(const wchar_t *s, size_t length)
+	{
+		WriteSize(length);
+		WriteBytes(s, length * sizeof(wchar_t));
+	}
+
+	void ObjectReader::ReadBytes(void *data, size_t size)
+	{
+		if (size > (size_t)(m_end - m_p))
+			throw std::runtime_error("Spilled object is truncated.");
+		memcpy(data, m_p, size);
+		m_p += size;
+	}
+
+	unsigned long long ObjectReader::ReadSize()
+	{
+		unsigned long long value = 0;
+		for (int shift = 0; shift < 64; shift += 7)
+		{
+			if (m_p == m_end)
+				break;
+			unsigned char b = *m_p++;
+			value |= (unsigned long long)(b & 0x7F) << shift;
+			if ((b & 0x80) == 0)
+				return value;
+		}
+		throw std::runtime_error("Spilled object is truncated.");
+	}
+
+	long long ObjectReader::ReadInt()
+	{
+		unsigned long long value = ReadSize();
+		return (long long)(value >> 1) ^ -(long long)(value & 1);
+	}
+
+	std::wstring ObjectReader::ReadString()
+	{
+		unsigned long long length = ReadSize();
+		if (length > (unsigned long long)(m_end - m_p) / sizeof(wchar_t))
+			throw std::runtime_error("Spilled object is truncated.");
+		std::wstring s((size_t)length, L'\0');
+		if (length > 0)
+			ReadBytes(&s[0], s.size() * sizeof(wchar_t));
+		return s;
+	}
+
+	//
+	// An XLOPER12 is written as its type followed by its value. Only
+	// values are supported; references cannot be spilled.
+	//
+
+	void SaveValue(const XLOPER12 &x, ObjectWriter &writer)
+	{
+		DWORD type = x.xltype & ~(xlbitDLLFree | xlbitXLFree);
+		writer.WriteSize(type);
+		switch (type)
+		{
+		case xltypeNum:
+			writer.WriteDouble(x.val.num);
+			break;
+		case xltypeStr:
+			writer.WriteString(x.val.str + 1, (unsigned short)x.val.str[0]);
+			break;
+		case xltypeBool:
+			writer.WriteSize(x.val.xbool ? 1 : 0);
+			break;
+		case xltypeErr:
+			writer.WriteSize(x.val.err);
+			break;
+		case xltypeInt:
+			writer.WriteInt(x.val.w);
+			break;
+		case xltypeMulti:
+			writer.WriteSize(x.val.array.rows);
+			writer.WriteSize(x.val.array.columns);
+			for (int i = 0; i < x.val.array.rows * x.val.array.columns; i++)
+				SaveValue(x.val.array.lparray[i], writer);
+			break;
+		case xltypeMissing:
+		case xltypeNil:
+			break;
+		default:
+			throw std::invalid_argument("Value cannot be spilled.");
+		}
+	}
+
+	// Reads a value into x, which must be empty. On failure, x holds
+	// the part read so far, which DeleteValue() frees.
+	void LoadValue(XLOPER12 &x, ObjectReader &reader)
+	{
+		DWORD type = (DWORD)reader.ReadSize();
+		switch (type)
+		{
+		case xltypeNum:
+			CreateValue(&x, reader.ReadDouble());
+			break;
+		case xltypeStr:
+			if (FAILED(CreateValue(&x, reader.ReadString())))
+				throw std::bad_alloc();
+			break;
+		case xltypeBool:
+			CreateValue(&x, reader.ReadSize() != 0);
+			break;
+		case xltypeErr:
+			x.xltype = xltypeErr;
+			x.val.err = (int)reader.ReadSize();
+			break;
+		case xltypeInt:
+			CreateValue(&x, (int)reader.ReadInt());
+			break;
+		case xltypeMulti:
+		{
+			unsigned long long rows = reader.ReadSize();
+			unsigned long long columns = reader.ReadSize();
+			if (rows == 0 || columns == 0 || rows > 1048576 || columns > 16384)
+				throw std::runtime_error("Spilled object is corrupt.");
+			size_t count = (size_t)(rows * columns);
+			LPXLOPER12 p = (LPXLOPER12)calloc(count, sizeof(XLOPER12));
+			if (p == nullptr)
+				throw std::bad_alloc();
+			x.xltype = xltypeMulti;
+			x.val.array.rows = (int)rows;
+			x.val.array.columns = (int)columns;
+			x.val.array.lparray = p;
+			for (size_t i = 0; i < count; i++)
+				LoadValue(p[i], reader);
+			break;
+		}
+		case xltypeMissing:
+		case xltypeNil:
+			x.xltype = type;
+			break;
+		default:
+			throw std::runtime_error("Spilled object is corrupt.");
+		}
+	}
+
+	void ObjectTraits<ExcelVariant>::Save(const ExcelVariant &value, ObjectWriter &writer)
+	{
+		SaveValue(value, writer);
+	}
+
+	std::shared_ptr<ExcelVariant> ObjectTraits<ExcelVariant>::Load(ObjectReader &reader)
+	{
+		std::shared_ptr<ExcelVariant> value = std::make_shared<ExcelVariant>();
+		LoadValue(*value, reader);
+		return value;
+	}
+
+	////////////////////////////////////////////////////////////////////////
+	// Cache
+	//
+	// The cache maps the number in a handle to the object, and each
+	// calling cell to the number of the object it owns. Numbers are
+	// never reused, so a handle that outlives its object cannot resolve
+	// to a newer object. Thread-safe UDFs may create and look up objects
+	// concurrently; the lock is held only to update the maps, and never
+	// while an object is destroyed, written or read.
+	//
+	// Objects in memory are ordered by their value for eviction, which
+	// is the GreedyDual-Size priority: an object used now is worth
+	// s_inflation plus its cost per byte, and s_inflation rises to the
+	// priority of each object evicted. Objects not used since are thus
+	// worth less and less compared to the ones used recently.
+	//
+	// A lookup only records the priority and time of the use in the
+	// object; the eviction order is brought up to date lazily, when an
+	// object that was used since it was ordered reaches the front. As
+	// a use only raises the priority, the front of the order is never
+	// worth more than it says. Without a budget nothing is evicted, and
+	// lookups record nothing.
+	//
+	// The spill file is only appended to, and is truncated when no
+	// spilled object is left. It is accessed under s_spillFileLock,
+	// which is taken before s_objectCacheLock when both are needed.
+	//
+
+	enum ObjectState
+	{
+		ObjectResident,   // in memory
+		ObjectSpilling,   // being written to the spill file
+		ObjectSpilled,    // in the spill file only
+		ObjectDropped,    // evicted without being spilled
+	};
+
+	struct CellKey
+	{
+		IDSHEET sheet;
+		RW row;
+		COL column;
+
+		bool operator==(const CellKey &other) const
+		{
+			return sheet == other.sheet && row == other.row && column == other.column;
+		}
+	};
+
+	struct CellKeyHash
+	{
+		size_t operator()(const CellKey &key) const
+		{
+			size_t h = std::hash<IDSHEET>()(key.sheet);
+			h = h * 31 + std::hash<RW>()(key.row);
+			h = h * 31 + std::hash<COL>()(key.column);
+			return h;
+		}
+	};
+
+	struct EvictionKey
+	{
+		double priority;
+		unsigned long long lastUse;
+		unsigned long long id;
+
+		bool operator<(const EvictionKey &other) const
+		{
+			if (priority != other.priority)
+				return priority < other.priority;
+			if (lastUse != other.lastUse)
+				return lastUse < other.lastUse;
+			return id < other.id;
+		}
+	};
+
+	// An object that is being spilled is no longer counted in
+	// s_residentBytes, but stays in memory until it is written.
+	struct CachedObject
+	{
+		std::shared_ptr<void> object;
+		const std::type_info *type;
+		SaveObjectFunc save;
+		LoadObjectFunc load;
+		ObjectState state;
+		size_t size;
+		double costNs;
+		EvictionKey key;            // place in the eviction order
+		double usePriority;         // priority as of the last use
+		unsigned long long lastUse; // time of the last use
+		unsigned long long spillOffset;
+		unsigned long spillLength;
+	};
+
+	struct SpillRequest
+	{
+		unsigned long long id;
+		std::shared_ptr<void> object;
+		SaveObjectFunc save;
+	};
+
+	typedef std::unordered_map<unsigned long long, CachedObject> ObjectMap;
+
+	static std::mutex s_objectCacheLock;
+	static ObjectMap s_objects;
+	static std::unordered_map<CellKey, unsigned long long, CellKeyHash> s_cellObjects;
+	static std::deque<unsigned long long> s_unownedObjects;
+	static std::unordered_map<std::type_index, std::wstring> s_handleTags;
+	static std::set<EvictionKey> s_evictionOrder;
+	static unsigned long long s_lastObjectId = 0;
+	static unsigned long long s_lastUse = 0;
+	static double s_inflation = 0;
+	static unsigned long long s_budgetBytes = 0;
+	static unsigned long long s_residentBytes = 0;
+	static unsigned long long s_spilledBytes = 0;
+	static unsigned long long s_spilledObjects = 0;
+	static unsigned long long s_evictions = 0;
+	static unsigned long long s_spills = 0;
+	static unsigned long long s_reloads = 0;
+	static double s_reloadTotalNs = 0;
+	static double s_reloadMaxNs = 0;
+
+	static std::mutex s_spillFileLock;
+	static HANDLE s_hSpillFile = INVALID_HANDLE_VALUE;
+	static unsigned long long s_spillFileSize = 0;
+
+	// Gets the top-left cell of the caller. Returns false if the caller
+	// is not a cell.
+	static bool GetCallingCell(CellKey &key)
+	{
+		XLOPER12 caller;
+		if (Excel12(xlfCaller, &caller, 0) != xlretSuccess)
+			return false;
+
+		bool isCell = false;
+		if (caller.xltype == xltypeRef && caller.val.mref.lpmref != nullptr &&
+			caller.val.mref.lpmref->count > 0)
+		{
+			key.sheet = caller.val.mref.idSheet;
+			key.row = caller.val.mref.lpmref->reftbl[0].rwFirst;
+			key.column = caller.val.mref.lpmref->reftbl[0].colFirst;
+			isCell = true;
+		}
+		else if (caller.xltype == xltypeSRef)
+		{
+			key.sheet = 0;
+			key.row = caller.val.sref.ref.rwFirst;
+			key.column = caller.val.sref.ref.colFirst;
+			isCell = true;
+		}
+		Excel12(xlFree, 0, 1, &caller);
+		return isCell;
+	}
+
+	// Returns the default handle prefix of a type: its name without
+	// namespace and template arguments, e.g. "Curve" for
+	// "class pricing::Curve". Called with the cache lock held.
+	static const std::wstring& GetDefaultHandleTag(const std::type_info &type)
+	{
+		std::wstring &tag = s_handleTags[std::type_index(type)];
+		if (tag.empty())
+		{
+			const char *name = type.name();
+			if (strncmp(name, "class ", 6) == 0)
+				name += 6;
+			else if (strncmp(name, "struct ", 7) == 0)
+				name += 7;
+			const char *end = strchr(name, '<');
+			if (end == nullptr)
+				end = name + strlen(name);
+			const char *begin = name;
+			for (const char *p = name; p + 1 < end; p++)
+			{
+				if (p[0] == ':' && p[1] == ':')
+					begin = p + 2;
+			}
+			for (const char *p = begin; p < end; p++)
+			{
+				if (isalnum((unsigned char)*p) || *p == '_')
+					tag += (wchar_t)*p;
+			}
+			if (tag.empty())
+				tag = L"Object";
+		}
+		return tag;
+	}
+
+	// Records that a resident object is used now, without moving it in
+	// the eviction order. Called with the cache lock held.
+	static void MarkObjectUsed(CachedObject &entry)
+	{
+		entry.usePriority = s_inflation + entry.costNs / (entry.size + 1);
+		entry.lastUse = ++s_lastUse;
+	}
+
+	// Puts a resident object at its place in the eviction order as if
+	// it was just used. Called with the cache lock held.
+	static void TouchObject(unsigned long long id, CachedObject &entry)
+	{
+		s_evictionOrder.erase(entry.key);
+		MarkObjectUsed(entry);
+		entry.key.priority = entry.usePriority;
+		entry.key.lastUse = entry.lastUse;
+		entry.key.id = id;
+		s_evictionOrder.insert(entry.key);
+	}
+
+	// Removes an object from the cache and moves its reference to
+	// garbage, to be released after the lock is released. Called with
+	// the cache lock held.
+	static void RemoveObject(ObjectMap::iterator it, std::vector<std::shared_ptr<void>> &garbage)
+	{
+		CachedObject &entry = it->second;
+		if (entry.state == ObjectResident)
+		{
+			s_evictionOrder.erase(entry.key);
+			s_residentBytes -= entry.size;
+		}
+		else if (entry.state == ObjectSpilled)
+		{
+			s_spilledBytes -= entry.spillLength;
+			s_spilledObjects--;
+		}
+		garbage.push_back(std::move(entry.object));
+		s_objects.erase(it);
+	}
+
+	// Evicts objects other than keepId until the resident objects fit
+	// in the budget. Objects worth spilling are added to spills, and
+	// stay in memory until they are written. Called with the cache lock
+	// held.
+	static void EvictObjects(unsigned long long keepId, std::vector<SpillRequest> &spills,
+		std::vector<std::shared_ptr<void>> &garbage)
+	{
+		std::set<EvictionKey>::iterator next = s_evictionOrder.begin();
+		while (s_budgetBytes != 0 && s_residentBytes > s_budgetBytes &&
+			next != s_evictionOrder.end())
+		{
+			if (next->id == keepId)
+			{
+				++next;
+				continue;
+			}
+			EvictionKey key = *next;
+			next = s_evictionOrder.erase(next);
+			CachedObject &entry = s_objects[key.id];
+			if (entry.lastUse != key.lastUse)
+			{
+				// Used since it was ordered; put it at its place and look
+				// at the front again.
+				entry.key.priority = entry.usePriority;
+				entry.key.lastUse = entry.lastUse;
+				s_evictionOrder.insert(entry.key);
+				next = s_evictionOrder.begin();
+				continue;
+			}
+			s_inflation = key.priority;
+			s_evictions++;
+
+			s_residentBytes -= entry.size;
+			if (entry.save != nullptr && entry.costNs >= XLL_OBJECT_SPILL_MIN_MS * 1e6)
+			{
+				entry.state = ObjectSpilling;
+				SpillRequest request = { key.id, entry.object, entry.save };
+				spills.push_back(std::move(request));
+			}
+			else
+			{
+				entry.state = ObjectDropped;
+				garbage.push_back(std::move(entry.object));
+			}
+		}
+	}
+
+	// Writes data to the end of the spill file and returns its offset.
+	// Called with the spill file lock held.
+	static bool AppendToSpillFile(const std::vector<unsigned char> &data, unsigned long long &offset)
+	{
+		if (s_hSpillFile == INVALID_HANDLE_VALUE)
+		{
+			wchar_t path[MAX_PATH + 1];
+			DWORD n = GetTempPathW(MAX_PATH - 40, path);
+			if (n == 0 || n >= MAX_PATH - 40)
+				return false;
+			swprintf_s(path + n, MAX_PATH + 1 - n, L"XllObjects-%lu-%p.tmp",
+				GetCurrentProcessId(), (void*)&s_hSpillFile);
+			s_hSpillFile = CreateFileW(path, GENERIC_READ | GENERIC_WRITE, 0, NULL,
+				CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+			if (s_hSpillFile == INVALID_HANDLE_VALUE)
+				return false;
+			s_spillFileSize = 0;
+		}
+
+		OVERLAPPED overlapped = {};
+		overlapped.Offset = (DWORD)s_spillFileSize;
+		overlapped.OffsetHigh = (DWORD)(s_spillFileSize >> 32);
+		DWORD written;
+		if (!WriteFile(s_hSpillFile, data.data(), (DWORD)data.size(), &written, &overlapped) ||
+			written != data.size())
+		{
+			return false;
+		}
+		offset = s_spillFileSize;
+		s_spillFileSize += data.size();
+		return true;
+	}
+
+	// Writes the objects to the spill file, and releases them from
+	// memory unless they were used or removed in the meantime.
+	static void SpillObjects(std::vector<SpillRequest> &spills)
+	{
+		std::vector<unsigned char> buffer;
+		for (SpillRequest &request : spills)
+		{
+			buffer.clear();
+			bool isSaved = false;
+			try
+			{
+				ObjectWriter writer(buffer);
+				request.save(request.object.get(), writer);
+				isSaved = (buffer.size() <= ULONG_MAX);
+			}
+			catch (...)
+			{
+			}
+			request.object.reset();
+
+			std::vector<std::shared_ptr<void>> garbage;
+			std::lock_guard<std::mutex> fileLock(s_spillFileLock);
+			{
+				std::lock_guard<std::mutex> lock(s_objectCacheLock);
+				if (s_spilledObjects == 0 && s_spillFileSize != 0)
+				{
+					// Nothing in the file is needed anymore.
+					LARGE_INTEGER zero = {};
+					if (SetFilePointerEx(s_hSpillFile, zero, NULL, FILE_BEGIN) &&
+						SetEndOfFile(s_hSpillFile))
+					{
+						s_spillFileSize = 0;
+					}
+				}
+			}
+
+			unsigned long long offset = 0;
+			if (isSaved)
+				isSaved = AppendToSpillFile(buffer, offset);
+
+			std::lock_guard<std::mutex> lock(s_objectCacheLock);
+			ObjectMap::iterator it = s_objects.find(request.id);
+			if (it == s_objects.end() || it->second.state != ObjectSpilling)
+				continue;
+			CachedObject &entry = it->second;
+			if (isSaved)
+			{
+				entry.state = ObjectSpilled;
+				entry.spillOffset = offset;
+				entry.spillLength = (unsigned long)buffer.size();
+				s_spilledBytes += entry.spillLength;
+				s_spilledObjects++;
+				s_spills++;
+			}
+			else
+			{
+				entry.state = ObjectDropped;
+			}
+			garbage.push_back(std::move(entry.object));
+		}
+	}
+
+	HRESULT CreateObjectHandle(LPXLOPER12 pv, const std::shared_ptr<void> &object,
+		const ObjectType &type, size_t size)
+	{
+		if (object == nullptr)
+			return E_POINTER;
+
+		double costNs = 0;
+#if XLL_SUPPORT_THREAD_LOCAL
+		if (threadObjectCallStart != 0)
+		{
+			costNs = TimestampToNanoseconds(ReadTimestamp() - threadObjectCallStart);
+			threadObjectCallStart = 0;
+		}
+#endif
+
+		CellKey cell;
+		bool isOwned = GetCallingCell(cell);
+
+		// Replaced and dropped objects are destroyed after the lock is
+		// released, because their destructors may take long.
+		std::vector<std::shared_ptr<void>> garbage;
+		std::vector<SpillRequest> spills;
+		wchar_t handle[64];
+		{
+			std::lock_guard<std::mutex> lock(s_objectCacheLock);
+			unsigned long long id = ++s_lastObjectId;
+			CachedObject &entry = s_objects[id];
+			entry.object = object;
+			entry.type = type.type;
+			entry.save = type.save;
+			entry.load = type.load;
+			entry.state = ObjectResident;
+			entry.size = size;
+			entry.costNs = costNs;
+			entry.key.id = 0; // not in the eviction order yet
+			entry.spillOffset = 0;
+			entry.spillLength = 0;
+			TouchObject(id, entry);
+			s_residentBytes += size;
+
+			unsigned long long replacedId = 0;
+			if (isOwned)
+			{
+				auto it = s_cellObjects.find(cell);
+				if (it != s_cellObjects.end())
+				{
+					replacedId = it->second;
+					it->second = id;
+				}
+				else
+				{
+					s_cellObjects.emplace(cell, id);
+				}
+			}
+			else
+			{
+				s_unownedObjects.push_back(id);
+				if (s_unownedObjects.size() > XLL_MAX_UNOWNED_OBJECTS)
+				{
+					replacedId = s_unownedObjects.front();
+					s_unownedObjects.pop_front();
+				}
+			}
+			if (replacedId != 0)
+			{
+				auto it = s_objects.find(replacedId);
+				if (it != s_objects.end())
+					RemoveObject(it, garbage);
+			}
+			EvictObjects(id, spills, garbage);
+
+			LPCWSTR tag = type.tag;
+			if (tag == nullptr)
+				tag = GetDefaultHandleTag(*type.type).c_str();
+			swprintf_s(handle, L"%.40ls:%llu", tag, id);
+		}
+		SpillObjects(spills);
+		return CreateValue(pv, (const wchar_t *)handle);
+	}
+
+	// Reads a spilled object back into memory. Returns the object, or
+	// null if it is no longer spilled.
+	static std::shared_ptr<void> ReloadObject(unsigned long long id)
+	{
+		unsigned long long start = ReadTimestamp();
+		std::vector<unsigned char> buffer;
+		LoadObjectFunc load;
+		{
+			std::lock_guard<std::mutex> fileLock(s_spillFileLock);
+			unsigned long long offset;
+			{
+				std::lock_guard<std::mutex> lock(s_objectCacheLock);
+				ObjectMap::iterator it = s_objects.find(id);
+				if (it == s_objects.end() || it->second.state != ObjectSpilled)
+					return nullptr;
+				offset = it->second.spillOffset;
+				buffer.resize(it->second.spillLength);
+				load = it->second.load;
+			}
+
+			OVERLAPPED overlapped = {};
+			overlapped.Offset = (DWORD)offset;
+			overlapped.OffsetHigh = (DWORD)(offset >> 32);
+			DWORD read;
+			if (!ReadFile(s_hSpillFile, buffer.data(), (DWORD)buffer.size(), &read, &overlapped) ||
+				read != buffer.size())
+			{
+				throw std::runtime_error("Cannot read spilled object.");
+			}
+		}
+
+		ObjectReader reader(buffer.data(), buffer.size());
+		std::shared_ptr<void> object = load(reader);
+		double elapsedNs = TimestampToNanoseconds(ReadTimestamp() - start);
+
+		std::vector<std::shared_ptr<void>> garbage;
+		std::vector<SpillRequest> spills;
+		{
+			std::lock_guard<std::mutex> lock(s_objectCacheLock);
+			ObjectMap::iterator it = s_objects.find(id);
+			if (it != s_objects.end())
+			{
+				CachedObject &entry = it->second;
+				if (entry.state == ObjectSpilled)
+				{
+					entry.object = object;
+					entry.state = ObjectResident;
+					s_spilledBytes -= entry.spillLength;
+					s_spilledObjects--;
+					s_residentBytes += entry.size;
+					TouchObject(id, entry);
+					s_reloads++;
+					s_reloadTotalNs += elapsedNs;
+					if (elapsedNs > s_reloadMaxNs)
+						s_reloadMaxNs = elapsedNs;
+					EvictObjects(id, spills, garbage);
+				}
+				else if (entry.object != nullptr)
+				{
+					// Another thread read it back first.
+					object = entry.object;
+				}
+			}
+		}
+		SpillObjects(spills);
+		return object;
+	}
+
+	std::shared_ptr<void> LookupObject(LPCWSTR handle, const std::type_info &type)
+	{
+		// The number follows the last colon; the prefix is only there for
+		// the user to read.
+		const wchar_t *colon = (handle != nullptr) ? wcsrchr(handle, L':') : nullptr;
+		if (colon == nullptr || colon[1] == 0)
+			throw std::invalid_argument("Argument is not an object handle.");
+
+		unsigned long long id = 0;
+		for (const wchar_t *p = colon + 1; *p != 0; p++)
+		{
+			if (*p < L'0' || *p > L'9' || id > (ULLONG_MAX - 9) / 10)
+				throw std::invalid_argument("Argument is not an object handle.");
+			id = id * 10 + (*p - L'0');
+		}
+
+		for (;;)
+		{
+			{
+				std::lock_guard<std::mutex> lock(s_objectCacheLock);
+				ObjectMap::iterator it = s_objects.find(id);
+				if (it == s_objects.end())
+					throw std::invalid_argument("Object handle does not refer to a cached object.");
+				CachedObject &entry = it->second;
+				if (*entry.type != type)
+					throw std::invalid_argument("Object handle refers to an object of another type.");
+				switch (entry.state)
+				{
+				case ObjectResident:
+					if (s_budgetBytes != 0)
+						MarkObjectUsed(entry);
+					return entry.object;
+				case ObjectSpilling:
+					// Used while being written; keep it in memory.
+					entry.state = ObjectResident;
+					s_residentBytes += entry.size;
+					TouchObject(id, entry);
+					return entry.object;
+				case ObjectDropped:
+					throw std::invalid_argument("Object was evicted from the cache; "
+						"recalculate the cell that created it.");
+				default:
+					break;
+				}
+			}
+
+			std::shared_ptr<void> object = ReloadObject(id);
+			if (object != nullptr)
+				return object;
+		}
+	}
+
+	size_t GetCachedObjectCount()
+	{
+		std::lock_guard<std::mutex> lock(s_objectCacheLock);
+		return s_objects.size();
+	}
+
+	void ClearObjectCache()
+	{
+		ObjectMap objects;
+		std::lock_guard<std::mutex> fileLock(s_spillFileLock);
+		{
+			std::lock_guard<std::mutex> lock(s_objectCacheLock);
+			objects.swap(s_objects);
+			s_cellObjects.clear();
+			s_unownedObjects.clear();
+			s_evictionOrder.clear();
+			s_residentBytes = 0;
+			s_spilledBytes = 0;
+			s_spilledObjects = 0;
+		}
+		if (s_hSpillFile != INVALID_HANDLE_VALUE)
+		{
+			// The file is deleted when it is closed.
+			CloseHandle(s_hSpillFile);
+			s_hSpillFile = INVALID_HANDLE_VALUE;
+			s_spillFileSize = 0;
+		}
+	}
+
+	void SetObjectCacheBudget(unsigned long long bytes)
+	{
+		std::vector<std::shared_ptr<void>> garbage;
+		std::vector<SpillRequest> spills;
+		{
+			std::lock_guard<std::mutex> lock(s_objectCacheLock);
+			s_budgetBytes = bytes;
+			EvictObjects(0, spills, garbage);
+		}
+		SpillObjects(spills);
+	}
+
+	bool ConfigureObjectCacheFromEnvironment()
+	{
+		WCHAR value[32];
+		DWORD n = GetEnvironmentVariableW(L"XLL_OBJECT_CACHE_BUDGET", value, ARRAYSIZE(value));
+		if (n == 0 || n >= ARRAYSIZE(value))
+			return false;
+		unsigned long long megabytes = wcstoull(value, nullptr, 10);
+		if (megabytes == 0)
+			return false;
+		SetObjectCacheBudget(megabytes << 20);
+		return true;
+	}
+
+	void GetObjectCacheStatistics(ObjectCacheStatistics &stats)
+	{
+		std::lock_guard<std::mutex> lock(s_objectCacheLock);
+		stats.budgetBytes = s_budgetBytes;
+		stats.residentBytes = s_residentBytes;
+		stats.residentObjects = s_evictionOrder.size();
+		stats.spilledBytes = s_spilledBytes;
+		stats.spilledObjects = s_spilledObjects;
+		stats.evictions = s_evictions;
+		stats.spills = s_spills;
+		stats.reloads = s_reloads;
+		stats.reloadTotalNs = s_reloadTotalNs;
+		stats.reloadMaxNs = s_reloadMaxNs;
+	}
+
+	void GetObjectCacheReport(ReportTable &table)
+	{
+		ObjectCacheStatistics stats;
+		GetObjectCacheStatistics(stats);
+
+		const double MB = 1024.0 * 1024.0;
+		table.AddRow(L"Budget (MB)", stats.budgetBytes / MB);
+		table.AddRow(L"Resident (MB)", stats.residentBytes / MB);
+		table.AddRow(L"Resident objects", (double)stats.residentObjects);
+		table.AddRow(L"Spilled (MB)", stats.spilledBytes / MB);
+		table.AddRow(L"Spilled objects", (double)stats.spilledObjects);
+		table.AddRow(L"Evictions", (double)stats.evictions);
+		table.AddRow(L"Spills", (double)stats.spills);
+		table.AddRow(L"Reloads", (double)stats.reloads);
+		table.AddRow(L"Mean reload (ms)",
+			(stats.reloads == 0) ? 0.0 : stats.reloadTotalNs / stats.reloads / 1e6);
+		table.AddRow(L"Max reload (ms)", stats.reloadMaxNs / 1e6);
+	}
+}
@@ -0,0 +1,413 @@
+////////////////////////////////////////////////////////////////////////////
+// ObjectCache.h -- pass C++ objects between UDFs by handle
+//
+// A UDF that builds a large intermediate result, such as a yield curve,
+// can return it as a handle instead of as an array. The object is kept
+// in a cache inside the XLL, and the cell shows a short string such as
+// "Curve:1234". A UDF that takes the cell as an argument receives the
+// object itself, looked up by the number in the handle, without copying
+// or marshalling its content:
+//
+//   xll::Handle<Curve> LoadCurve(SAFEARRAY *points)
+//   {
+//       return std::make_shared<Curve>(points);
+//   }
+//
+//   double Discount(xll::Handle<Curve> curve, double t)
+//   {
+//       return curve->Discount(t);
+//   }
+//
+// A UDF may also return a std::shared_ptr<T>, which is stored the same
+// way. An argument of type Handle<T> must refer to an object that was
+// returned as Handle<T> or std::shared_ptr<T>, with the same T; an
+// unknown handle or an object of another type fails the call with
+// #VALUE!. Objects must not be modified once they are returned.
+//
+// Each object is owned by the cell whose formula returned it, found
+// with xlfCaller. When the cell is calculated again and returns a new
+// object, the old one is released, so recalculation replaces objects
+// instead of accumulating them. A cell owns at most one object: with
+// nested calls such as =Price(Bootstrap(LoadCurve(A1:B10))), the curve
+// is released once Bootstrap has returned its own object. An object
+// stays alive while a UDF that received it is still running.
+//
+// Objects returned to a caller that is not a cell, such as a VBA macro,
+// are kept until XLL_MAX_UNOWNED_OBJECTS newer ones have been returned.
+// The objects of a cell whose formula is deleted are kept until the
+// cell returns another object or ClearObjectCache() is called; the
+// cache is cleared when the XLL is unloaded.
+//
+// The handle prefix is the unqualified name of T by default. Use
+// XLL_HANDLE_TAG(T, L"Name") at global scope to choose another one.
+//
+// Memory budget
+//
+// The cache can be given a budget, in bytes, for the objects it keeps
+// in memory: set the environment variable XLL_OBJECT_CACHE_BUDGET to
+// a number of megabytes before starting Excel, or call
+// SetObjectCacheBudget(). The size of an object is given by
+// ObjectTraits<T>::Size(). When the objects exceed the budget, the
+// cache evicts the object with the least value, where an object that
+// took longer to compute per byte, or that was used more recently, is
+// worth more (the GreedyDual-Size policy). The time to compute an
+// object is measured from the start of the UDF that returned it.
+//
+// An evicted object whose type defines ObjectTraits<T>::Save() and
+// Load(), and that took at least XLL_OBJECT_SPILL_MIN_MS to compute,
+// is written to a temporary file and read back when its handle is next
+// used. Other evicted objects are dropped; their handles fail with
+// #VALUE! until the cells that created them are calculated again.
+//
+// The built-in UDF XllObjectCacheReport() returns the budget, the
+// memory and file space in use, and the number of evictions, spills and
+// reloads with the time taken to reload. It is registered when a budget
+// is set by XLL_OBJECT_CACHE_BUDGET.
+//
+
+#pragma once
+
+#include "xlldef.h"
+#include "Marshal.h"
+#include "ExcelVariant.h"
+#include "Report.h"
+#include "Timestamp.h"
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <typeinfo>
+#include <type_traits>
+#include <vector>
+
+//
+// XLL_MAX_UNOWNED_OBJECTS
+//
+// Maximum number of objects kept for callers that are not cells. The
+// oldest one is released when the limit is exceeded.
+//
+
+#ifndef XLL_MAX_UNOWNED_OBJECTS
+#define XLL_MAX_UNOWNED_OBJECTS 1024
+#endif
+
+//
+// XLL_OBJECT_SPILL_MIN_MS
+//
+// Minimum number of milliseconds an object must have taken to compute
+// for it to be written to the spill file when evicted, rather than
+// dropped. This macro takes effect when XLL Connector itself is
+// compiled.
+//
+
+#ifndef XLL_OBJECT_SPILL_MIN_MS
+#define XLL_OBJECT_SPILL_MIN_MS 1
+#endif
+
+namespace XLL_NAMESPACE
+{
+	//
+	// ObjectWriter, ObjectReader
+	//
+	// Compact binary encoding of an object in the spill file. Sizes and
+	// integers are written as variable-length integers; doubles and
+	// arrays of plain data are copied as is. A reader throws
+	// std::runtime_error if it reads past the end of the object.
+	//
+
+	class ObjectWriter
+	{
+		std::vector<unsigned char> &m_buffer;
+
+	public:
+		explicit ObjectWriter(std::vector<unsigned char> &buffer)
+			: m_buffer(buffer)
+		{
+		}
+
+		void WriteBytes(const void *data, size_t size);
+		void WriteSize(unsigned long long value);
+		void WriteInt(long long value);
+		void WriteDouble(double value) { WriteBytes(&value, sizeof(value)); }
+		void WriteString(const wchar_t *s, size_t length);
+		void WriteString(const std::wstring &s) { WriteString(s.c_str(), s.size()); }
+
+		template <typename T>
+		void WriteVector(const std::vector<T> &v)
+		{
+			static_assert(std::is_pod<T>::value, "Element type must be plain data.");
+			WriteSize(v.size());
+			if (!v.empty())
+				WriteBytes(v.data(), v.size() * sizeof(T));
+		}
+	};
+
+	class ObjectReader
+	{
+		const unsigned char *m_p;
+		const unsigned char *m_end;
+
+	public:
+		ObjectReader(const unsigned char *data, size_t size)
+			: m_p(data), m_end(data + size)
+		{
+		}
+
+		void ReadBytes(void *data, size_t size);
+		unsigned long long ReadSize();
+		long long ReadInt();
+		double ReadDouble() { double value; ReadBytes(&value, sizeof(value)); return value; }
+		std::wstring ReadString();
+
+		template <typename T>
+		std::vector<T> ReadVector()
+		{
+			static_assert(std::is_pod<T>::value, "Element type must be plain data.");
+			unsigned long long count = ReadSize();
+			if (count > (unsigned long long)(m_end - m_p) / sizeof(T))
+				throw std::runtime_error("Spilled object is truncated.");
+			std::vector<T> v((size_t)count);
+			if (count > 0)
+				ReadBytes(v.data(), v.size() * sizeof(T));
+			return v;
+		}
+	};
+
+	//
+	// ObjectTraits<T>
+	//
+	// Tells the cache how much memory an object of type T holds, and
+	// how to spill it. Specialize this struct for your types:
+	//
+	//   Size(const T&)                 bytes held by the object, including
+	//                                  the memory it owns on the heap
+	//   IsSpillable                    nonzero if Save() and Load() exist
+	//   Save(const T&, ObjectWriter&)  writes the object
+	//   Load(ObjectReader&)            reads an object written by Save()
+	//                                  and returns a std::shared_ptr<T>
+	//
+	// The default implementation counts sizeof(T) and does not spill.
+	//
+
+	template <typename T>
+	struct ObjectTraits
+	{
+		enum { IsSpillable = 0 };
+		static size_t Size(const T &) { return sizeof(T); }
+	};
+
+	// Writes an XLOPER12 that holds a value, not a reference, and reads
+	// it back into an empty XLOPER12. Strings and arrays that are read
+	// are owned by the DLL.
+	void SaveValue(const XLOPER12 &value, ObjectWriter &writer);
+	void LoadValue(XLOPER12 &value, ObjectReader &reader);
+
+	// An ExcelVariant, such as a large array, can be cached and spilled.
+	template <>
+	struct ObjectTraits < ExcelVariant >
+	{
+		enum { IsSpillable = 1 };
+		static size_t Size(const ExcelVariant &value) { return GetValueSize(value); }
+		static void Save(const ExcelVariant &value, ObjectWriter &writer);
+		static std::shared_ptr<ExcelVariant> Load(ObjectReader &reader);
+	};
+
+	typedef void (*SaveObjectFunc)(const void *object, ObjectWriter &writer);
+	typedef std::shared_ptr<void> (*LoadObjectFunc)(ObjectReader &reader);
+
+	//
+	// ObjectType
+	//
+	// Type-erased description of the objects of a type, passed to the
+	// cache when an object is stored.
+	//
+
+	struct ObjectType
+	{
+		const std::type_info *type;
+		LPCWSTR tag;
+		SaveObjectFunc save;
+		LoadObjectFunc load;
+	};
+
+	// Stores an object in the cache, owned by the calling cell, and
+	// creates its handle string in pv. size is the number of bytes the
+	// object holds. Returns E_POINTER if object is null.
+	HRESULT CreateObjectHandle(LPXLOPER12 pv, const std::shared_ptr<void> &object,
+		const ObjectType &type, size_t size);
+
+	// Returns the object with the given handle, reading it back from
+	// the spill file if it was spilled. Throws std::invalid_argument if
+	// the handle does not refer to a cached object of the given type.
+	std::shared_ptr<void> LookupObject(LPCWSTR handle, const std::type_info &type);
+
+	// Returns the number of objects in the cache, including the ones
+	// that were spilled or dropped.
+	size_t GetCachedObjectCount();
+
+	// Releases all objects in the cache. Handles returned earlier no
+	// longer resolve.
+	void ClearObjectCache();
+
+	// Sets the number of bytes that objects in memory may take, and
+	// evicts objects until they fit. A budget of zero means no limit.
+	void SetObjectCacheBudget(unsigned long long bytes);
+
+	// Sets the budget from XLL_OBJECT_CACHE_BUDGET (in megabytes).
+	// Returns true if a budget is set.
+	bool ConfigureObjectCacheFromEnvironment();
+
+	struct ObjectCacheStatistics
+	{
+		unsigned long long budgetBytes;
+		unsigned long long residentBytes;
+		unsigned long long residentObjects;
+		unsigned long long spilledBytes;
+		unsigned long long spilledObjects;
+		unsigned long long evictions;
+		unsigned long long spills;
+		unsigned long long reloads;
+		double reloadTotalNs;
+		double reloadMaxNs;
+	};
+
+	void GetObjectCacheStatistics(ObjectCacheStatistics &stats);
+
+	// Fills a table with the statistics of the cache, one per row.
+	void GetObjectCacheReport(ReportTable &table);
+
+	//
+	// BeginObjectCall
+	//
+	// Records the start of a call to a UDF that returns an object, so
+	// that the cache knows how long the object took to compute. Called
+	// by the wrapper; the time is not recorded if thread-local storage
+	// is not supported.
+	//
+
+	inline void BeginObjectCall()
+	{
+#if XLL_SUPPORT_THREAD_LOCAL
+		__declspec(thread) extern unsigned long long threadObjectCallStart;
+		threadObjectCallStart = ReadTimestamp();
+#endif
+	}
+
+	//
+	// HandleTag<T>
+	//
+	// Prefix of the handles of objects of type T. Specialized by
+	// XLL_HANDLE_TAG().
+	//
+
+	template <typename T>
+	struct HandleTag
+	{
+		static LPCWSTR Get() { return nullptr; }
+	};
+
+	template <typename T, bool IsSpillable = (ObjectTraits<T>::IsSpillable != 0)>
+	struct ObjectSpiller
+	{
+		static void Save(const void *object, ObjectWriter &writer)
+		{
+			ObjectTraits<T>::Save(*static_cast<const T*>(object), writer);
+		}
+
+		static std::shared_ptr<void> Load(ObjectReader &reader)
+		{
+			return ObjectTraits<T>::Load(reader);
+		}
+
+		static ObjectType GetType()
+		{
+			ObjectType type = { &typeid(T), HandleTag<T>::Get(), Save, Load };
+			return type;
+		}
+	};
+
+	template <typename T>
+	struct ObjectSpiller < T, false >
+	{
+		static ObjectType GetType()
+		{
+			ObjectType type = { &typeid(T), HandleTag<T>::Get(), nullptr, nullptr };
+			return type;
+		}
+	};
+
+	//
+	// Handle<T>
+	//
+	// Shared reference to an object of type T that is passed to and
+	// from Excel as a handle string.
+	//
+
+	template <typename T>
+	class Handle
+	{
+		std::shared_ptr<T> m_object;
+
+	public:
+		Handle()
+		{
+		}
+
+		Handle(std::shared_ptr<T> object)
+			: m_object(std::move(object))
+		{
+		}
+
+		const std::shared_ptr<T>& object() const { return m_object; }
+
+		T* get() const { return m_object.get(); }
+
+		T* operator->() const { return m_object.get(); }
+
+		T& operator*() const { return *m_object; }
+
+		explicit operator bool() const { return m_object != nullptr; }
+	};
+
+	template <typename T>
+	HRESULT CreateValue(LPXLOPER12 pv, const std::shared_ptr<T> &object)
+	{
+		typedef typename std::remove_const<T>::type U;
+		return CreateObjectHandle(pv, std::const_pointer_cast<U>(object),
+			ObjectSpiller<U>::GetType(),
+			(object != nullptr) ? ObjectTraits<U>::Size(*object) : 0);
+	}
+
+	template <typename T>
+	HRESULT CreateValue(LPXLOPER12 pv, const Handle<T> &handle)
+	{
+		return CreateValue(pv, handle.object());
+	}
+
+	template <typename T>
+	struct ArgumentMarshaler < Handle<T> >
+	{
+		typedef Handle<T> UserType;
+		typedef LPCWSTR WireType;
+
+		static inline Handle<T> Marshal(LPCWSTR handle)
+		{
+			return Handle<T>(std::static_pointer_cast<T>(LookupObject(handle, typeid(T))));
+		}
+	};
+
+	template <typename T>
+	struct ArgumentMarshaler < const Handle<T> & > : ArgumentMarshaler < Handle<T> > {};
+
+	// ReturnsObject<T>::value is true if a UDF that returns T returns
+	// an object handle.
+	template <typename T> struct ReturnsObject : std::false_type {};
+	template <typename T> struct ReturnsObject < Handle<T> > : std::true_type {};
+	template <typename T> struct ReturnsObject < std::shared_ptr<T> > : std::true_type {};
+}
+
+#define XLL_HANDLE_TAG(type, tag) \
+	namespace XLL_NAMESPACE { \
+		template <> struct HandleTag<type> { \
+			static LPCWSTR Get() { return tag; } \
+		}; \
+	}
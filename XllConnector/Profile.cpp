@@ -0,0 +1,711 @@
+////////////////////////////////////////////////////////////////////////////
+// Profile.cpp -- per-UDF call counters and latency histograms
+
+#include "Profile.h"
+#include "FunctionInfo.h"
+#include "Conversion.h"
+#include "ThreadBuffer.h"
+#include <Windows.h>
+#include <new>
+#include <stdio.h>
+#include <cassert>
+#include <algorithm>
+#include <map>
+
+namespace XLL_NAMESPACE
+{
+	////////////////////////////////////////////////////////////////////////
+	// LatencyHistogram implementation
+
+	static int FloorLog2(unsigned long long value)
+	{
+		unsigned long index;
+#if defined(_WIN64)
+		_BitScanReverse64(&index, value);
+		return (int)index;
+#else
+		if (_BitScanReverse(&index, (unsigned long)(value >> 32)))
+			return (int)index + 32;
+		_BitScanReverse(&index, (unsigned long)value);
+		return (int)index;
+#endif
+	}
+
+	int LatencyHistogram::GetBucketIndex(unsigned long long value)
+	{
+		if (value < SubBucketCount)
+			return (int)value;
+
+		int exponent = FloorLog2(value);
+		if (exponent > MaxExponent)
+			return BucketCount - 1;
+
+		int subBucket = (int)(value >> (exponent - SubBucketBits)) & (SubBucketCount - 1);
+		return (exponent - SubBucketBits + 1) * SubBucketCount + subBucket;
+	}
+
+	unsigned long long LatencyHistogram::GetBucketUpperBound(int index)
+	{
+		if (index < SubBucketCount)
+			return (unsigned long long)index;
+
+		int exponent = index / SubBucketCount + SubBucketBits - 1;
+		int subBucket = index % SubBucketCount;
+		unsigned long long width = 1ull << (exponent - SubBucketBits);
+		return (SubBucketCount + subBucket) * width + (width - 1);
+	}
+
+	double PhaseStatistics::PercentileNs(double p) const
+	{
+		if (count == 0)
+			return 0.0;
+
+		unsigned long long rank = (unsigned long long)(p / 100.0 * count + 0.5);
+		if (rank < 1)
+			rank = 1;
+
+		unsigned long long seen = 0;
+		for (int i = 0; i < LatencyHistogram::BucketCount; i++)
+		{
+			seen += histogram[i];
+			if (seen >= rank)
+			{
+				double ns = TimestampToNanoseconds(LatencyHistogram::GetBucketUpperBound(i));
+				return (ns < maxNs) ? ns : maxNs;
+			}
+		}
+		return maxNs;
+	}
+
+	////////////////////////////////////////////////////////////////////////
+	// Per-thread buffers
+	//
+	// Each thread that calls a profiled UDF owns a ThreadProfile, which
+	// holds one FunctionCounters block per profiled UDF it has called.
+	// Blocks are allocated on the first call of a UDF on a thread and
+	// never freed, so that the statistics of threads that have exited
+	// still show up in the report. ThreadProfiles are linked into a
+	// lock-free list that readers walk to merge the statistics.
+	//
+
+	struct FunctionCounters
+	{
+		std::atomic<unsigned long long> calls;
+		std::atomic<unsigned long long> exceptions;
+		std::atomic<unsigned long long> totalTicks[ProfilePhaseCount];
+		std::atomic<unsigned long long> maxTicks[ProfilePhaseCount];
+		LatencyHistogram histograms[ProfilePhaseCount];
+	};
+
+	// Counters of the callbacks of one function number made by one
+	// caller. key is zero until the entry is claimed by the owning
+	// thread; see MakeCallbackKey().
+	struct CallbackCounters
+	{
+		std::atomic<unsigned int> key;
+		std::atomic<unsigned long long> calls;
+		std::atomic<unsigned long long> failures;
+		std::atomic<unsigned long long> totalTicks;
+		std::atomic<unsigned long long> maxTicks;
+	};
+
+	// Open-addressing hash table of CallbackCounters with linear probing.
+	// Callbacks that do not fit are not recorded.
+	struct CallbackTable
+	{
+		enum { Size = 1024 };
+		CallbackCounters entries[Size];
+	};
+
+	// Counters of one thread (see ThreadBuffer.h). Value-initialization
+	// zeroes them.
+	struct ThreadProfile : ThreadBufferNode<ThreadProfile>
+	{
+		std::atomic<FunctionCounters*> functions[XLL_MAX_PROFILED_FUNCTIONS];
+		std::atomic<CallbackTable*> callbacks;
+		int activeProfileId; // innermost profiled UDF running, plus one
+	};
+
+	typedef ThreadBufferList<ThreadProfile> ThreadProfiles;
+
+	static FunctionCounters* GetFunctionCounters(int profileId) XLL_NOEXCEPT
+	{
+		if (profileId < 0 || profileId >= XLL_MAX_PROFILED_FUNCTIONS)
+			return nullptr;
+
+		ThreadProfile *thread = ThreadProfiles::Get();
+		if (thread == nullptr)
+			return nullptr;
+
+		FunctionCounters *p = thread->functions[profileId].load(std::memory_order_relaxed);
+		if (p == nullptr)
+		{
+			p = new (std::nothrow) FunctionCounters();
+			if (p == nullptr)
+				return nullptr;
+			thread->functions[profileId].store(p, std::memory_order_release);
+		}
+		return p;
+	}
+
+	// Adds to a counter that has a single writer. This avoids the
+	// cost of an interlocked instruction.
+	static inline void AddRelaxed(std::atomic<unsigned long long> &counter,
+		unsigned long long value)
+	{
+		counter.store(counter.load(std::memory_order_relaxed) + value,
+			std::memory_order_relaxed);
+	}
+
+	////////////////////////////////////////////////////////////////////////
+	// Recording
+
+	static const FunctionInfo *s_profiledFunctions[XLL_MAX_PROFILED_FUNCTIONS];
+	static int s_profiledFunctionCount = 0;
+
+	int RegisterProfiledFunction(const FunctionInfo *info)
+	{
+		if (s_profiledFunctionCount >= XLL_MAX_PROFILED_FUNCTIONS)
+			return -1;
+		s_profiledFunctions[s_profiledFunctionCount] = info;
+		return s_profiledFunctionCount++;
+	}
+
+	int GetProfiledFunctionCount()
+	{
+		return s_profiledFunctionCount;
+	}
+
+	void RecordProfiledCall(int profileId, const unsigned long long t[4]) XLL_NOEXCEPT
+	{
+		FunctionCounters *p = GetFunctionCounters(profileId);
+		if (p == nullptr)
+			return;
+
+		unsigned long long elapsed[ProfilePhaseCount];
+		elapsed[ProfilePhaseMarshalIn] = t[1] - t[0];
+		elapsed[ProfilePhaseCompute] = t[2] - t[1];
+		elapsed[ProfilePhaseMarshalOut] = t[3] - t[2];
+		elapsed[ProfilePhaseTotal] = t[3] - t[0];
+
+		AddRelaxed(p->calls, 1);
+		for (int i = 0; i < ProfilePhaseCount; i++)
+		{
+			AddRelaxed(p->totalTicks[i], elapsed[i]);
+			if (elapsed[i] > p->maxTicks[i].load(std::memory_order_relaxed))
+				p->maxTicks[i].store(elapsed[i], std::memory_order_relaxed);
+			p->histograms[i].Record(elapsed[i]);
+		}
+	}
+
+	void RecordProfiledException(int profileId) XLL_NOEXCEPT
+	{
+		FunctionCounters *p = GetFunctionCounters(profileId);
+		if (p != nullptr)
+		{
+			AddRelaxed(p->exceptions, 1);
+		}
+	}
+
+	int EnterProfiledFunction(int profileId) XLL_NOEXCEPT
+	{
+		ThreadProfile *thread = ThreadProfiles::Get();
+		if (thread == nullptr)
+			return -1;
+		int previous = thread->activeProfileId - 1;
+		thread->activeProfileId = profileId + 1;
+		return previous;
+	}
+
+	void LeaveProfiledFunction(int previousProfileId) XLL_NOEXCEPT
+	{
+		ThreadProfile *thread = ThreadProfiles::Get();
+		if (thread != nullptr)
+			thread->activeProfileId = previousProfileId + 1;
+	}
+
+	////////////////////////////////////////////////////////////////////////
+	// Callback recording
+
+	std::atomic<bool> g_isCallbackProfilingEnabled(false);
+
+	void EnableCallbackProfiling(bool enable)
+	{
+		g_isCallbackProfilingEnabled.store(enable);
+	}
+
+	// The function number takes the low 16 bits (including the xlCommand
+	// and xlSpecial flags); the caller's profile id plus one takes the
+	// next 15 bits; the top bit marks the key as used.
+	static inline unsigned int MakeCallbackKey(int xlfn, int activeProfileId)
+	{
+		return 0x80000000u | ((unsigned int)activeProfileId << 16) | (xlfn & 0xFFFF);
+	}
+
+	static CallbackCounters* GetCallbackCounters(ThreadProfile *thread, unsigned int key) XLL_NOEXCEPT
+	{
+		CallbackTable *table = thread->callbacks.load(std::memory_order_relaxed);
+		if (table == nullptr)
+		{
+			// Value-initialization zeroes the counters.
+			table = new (std::nothrow) CallbackTable();
+			if (table == nullptr)
+				return nullptr;
+			thread->callbacks.store(table, std::memory_order_release);
+		}
+
+		unsigned int index = (key * 2654435761u) >> 22;
+		for (int probe = 0; probe < CallbackTable::Size; probe++)
+		{
+			CallbackCounters &entry = table->entries[(index + probe) & (CallbackTable::Size - 1)];
+			unsigned int k = entry.key.load(std::memory_order_relaxed);
+			if (k == key)
+				return &entry;
+			if (k == 0)
+			{
+				entry.key.store(key, std::memory_order_release);
+				return &entry;
+			}
+		}
+		return nullptr;
+	}
+
+	void RecordExcelCallback(int xlfn, int xlret, unsigned long long ticks) XLL_NOEXCEPT
+	{
+		ThreadProfile *thread = ThreadProfiles::Get();
+		if (thread == nullptr)
+			return;
+
+		CallbackCounters *p = GetCallbackCounters(thread,
+			MakeCallbackKey(xlfn, thread->activeProfileId));
+		if (p == nullptr)
+			return;
+
+		AddRelaxed(p->calls, 1);
+		if (xlret != xlretSuccess)
+			AddRelaxed(p->failures, 1);
+		AddRelaxed(p->totalTicks, ticks);
+		if (ticks > p->maxTicks.load(std::memory_order_relaxed))
+			p->maxTicks.store(ticks, std::memory_order_relaxed);
+	}
+
+#define XLL_FUNCTION_NAME(xlfn) { xlfn, XLL_CONCAT(L, #xlfn) }
+
+	static const struct
+	{
+		int xlfn;
+		LPCWSTR name;
+	} s_excelFunctionNames[] =
+	{
+		XLL_FUNCTION_NAME(xlFree),
+		XLL_FUNCTION_NAME(xlStack),
+		XLL_FUNCTION_NAME(xlCoerce),
+		XLL_FUNCTION_NAME(xlSet),
+		XLL_FUNCTION_NAME(xlSheetId),
+		XLL_FUNCTION_NAME(xlSheetNm),
+		XLL_FUNCTION_NAME(xlAbort),
+		XLL_FUNCTION_NAME(xlGetInst),
+		XLL_FUNCTION_NAME(xlGetHwnd),
+		XLL_FUNCTION_NAME(xlGetName),
+		XLL_FUNCTION_NAME(xlEnableXLMsgs),
+		XLL_FUNCTION_NAME(xlDisableXLMsgs),
+		XLL_FUNCTION_NAME(xlDefineBinaryName),
+		XLL_FUNCTION_NAME(xlGetBinaryName),
+		XLL_FUNCTION_NAME(xlEventRegister),
+		XLL_FUNCTION_NAME(xlRunningOnCluster),
+		XLL_FUNCTION_NAME(xlGetInstPtr),
+		XLL_FUNCTION_NAME(xlUDF),
+		XLL_FUNCTION_NAME(xlAsyncReturn),
+		XLL_FUNCTION_NAME(xlfCaller),
+		XLL_FUNCTION_NAME(xlfRegister),
+		XLL_FUNCTION_NAME(xlfUnregister),
+		XLL_FUNCTION_NAME(xlfEvaluate),
+		XLL_FUNCTION_NAME(xlfGetCell),
+		XLL_FUNCTION_NAME(xlfGetWorkspace),
+		XLL_FUNCTION_NAME(xlfGetDocument),
+		XLL_FUNCTION_NAME(xlfGetWindow),
+		XLL_FUNCTION_NAME(xlfGetWorkbook),
+		XLL_FUNCTION_NAME(xlfGetName),
+		XLL_FUNCTION_NAME(xlfGetDef),
+		XLL_FUNCTION_NAME(xlfSetName),
+		XLL_FUNCTION_NAME(xlfVolatile),
+		XLL_FUNCTION_NAME(xlfRtd),
+		XLL_FUNCTION_NAME(xlfIndex),
+		XLL_FUNCTION_NAME(xlcAlert),
+		XLL_FUNCTION_NAME(xlcOnTime),
+		XLL_FUNCTION_NAME(xlcCalculateNow),
+		XLL_FUNCTION_NAME(xlcCalculateDocument),
+	};
+
+#undef XLL_FUNCTION_NAME
+
+	LPCWSTR GetExcelFunctionName(int xlfn)
+	{
+		for (size_t i = 0; i < ARRAYSIZE(s_excelFunctionNames); i++)
+		{
+			if (s_excelFunctionNames[i].xlfn == xlfn)
+				return s_excelFunctionNames[i].name;
+		}
+		return nullptr;
+	}
+
+	////////////////////////////////////////////////////////////////////////
+	// Reporting
+
+	void GetProfileStatistics(std::vector<FunctionStatistics> &stats)
+	{
+		int n = s_profiledFunctionCount;
+		stats.clear();
+		stats.resize(n);
+
+		for (int id = 0; id < n; id++)
+		{
+			LPCWSTR name = s_profiledFunctions[id]->name;
+			stats[id].name = (name != nullptr) ? name : L"";
+		}
+
+		for (ThreadProfile *thread = ThreadProfiles::First(); thread != nullptr;
+			thread = thread->next)
+		{
+			for (int id = 0; id < n; id++)
+			{
+				const FunctionCounters *p = thread->functions[id].load(std::memory_order_acquire);
+				if (p == nullptr)
+					continue;
+
+				FunctionStatistics &f = stats[id];
+				f.calls += p->calls.load(std::memory_order_relaxed);
+				f.exceptions += p->exceptions.load(std::memory_order_relaxed);
+				for (int i = 0; i < ProfilePhaseCount; i++)
+				{
+					PhaseStatistics &phase = f.phases[i];
+					phase.totalNs += TimestampToNanoseconds(
+						p->totalTicks[i].load(std::memory_order_relaxed));
+					double maxNs = TimestampToNanoseconds(
+						p->maxTicks[i].load(std::memory_order_relaxed));
+					if (maxNs > phase.maxNs)
+						phase.maxNs = maxNs;
+					for (int k = 0; k < LatencyHistogram::BucketCount; k++)
+					{
+						unsigned int c = p->histograms[i].GetCount(k);
+						phase.histogram[k] += c;
+						phase.count += c;
+					}
+				}
+			}
+		}
+	}
+
+	void GetCallbackStatistics(std::vector<CallbackStatistics> &stats)
+	{
+		// Merge the per-thread entries by key.
+		std::map<unsigned int, CallbackStatistics> merged;
+		for (ThreadProfile *thread = ThreadProfiles::First(); thread != nullptr;
+			thread = thread->next)
+		{
+			const CallbackTable *table = thread->callbacks.load(std::memory_order_acquire);
+			if (table == nullptr)
+				continue;
+
+			for (int i = 0; i < CallbackTable::Size; i++)
+			{
+				const CallbackCounters &entry = table->entries[i];
+				unsigned int key = entry.key.load(std::memory_order_acquire);
+				if (key == 0)
+					continue;
+
+				CallbackStatistics &c = merged[key];
+				c.calls += entry.calls.load(std::memory_order_relaxed);
+				c.failures += entry.failures.load(std::memory_order_relaxed);
+				c.totalNs += TimestampToNanoseconds(
+					entry.totalTicks.load(std::memory_order_relaxed));
+				double maxNs = TimestampToNanoseconds(
+					entry.maxTicks.load(std::memory_order_relaxed));
+				if (maxNs > c.maxNs)
+					c.maxNs = maxNs;
+			}
+		}
+
+		// Group by function number, with a total row for each.
+		std::map<int, std::vector<CallbackStatistics>> groups;
+		for (auto &kv : merged)
+		{
+			CallbackStatistics &c = kv.second;
+			c.xlfn = (int)(kv.first & 0xFFFF);
+			int id = (int)((kv.first >> 16) & 0x7FFF) - 1;
+			if (id >= 0 && id < s_profiledFunctionCount && s_profiledFunctions[id]->name != nullptr)
+				c.caller = s_profiledFunctions[id]->name;
+
+			std::vector<CallbackStatistics> &group = groups[c.xlfn];
+			if (group.empty())
+			{
+				group.push_back(CallbackStatistics());
+				group[0].xlfn = c.xlfn;
+				group[0].caller = L"(all)";
+			}
+			CallbackStatistics &total = group[0];
+			total.calls += c.calls;
+			total.failures += c.failures;
+			total.totalNs += c.totalNs;
+			if (c.maxNs > total.maxNs)
+				total.maxNs = c.maxNs;
+			group.push_back(c);
+		}
+
+		std::vector<std::vector<CallbackStatistics>*> order;
+		for (auto &kv : groups)
+		{
+			std::sort(kv.second.begin() + 1, kv.second.end(),
+				[](const CallbackStatistics &a, const CallbackStatistics &b)
+			{
+				return a.totalNs > b.totalNs;
+			});
+			order.push_back(&kv.second);
+		}
+		std::sort(order.begin(), order.end(),
+			[](const std::vector<CallbackStatistics> *a, const std::vector<CallbackStatistics> *b)
+		{
+			return (*a)[0].totalNs > (*b)[0].totalNs;
+		});
+
+		stats.clear();
+		for (const std::vector<CallbackStatistics> *group : order)
+			stats.insert(stats.end(), group->begin(), group->end());
+	}
+
+	static std::wstring GetCallbackName(int xlfn)
+	{
+		LPCWSTR name = GetExcelFunctionName(xlfn);
+		return (name != nullptr) ? std::wstring(name) : L"xlfn " + std::to_wstring(xlfn);
+	}
+
+	static const LPCWSTR s_callbackReportColumns[] =
+	{
+		L"Callback",
+		L"Caller",
+		L"Calls",
+		L"Failures",
+		L"Total (us)",
+		L"Mean (us)",
+		L"Max (us)",
+	};
+
+	static const int CallbackReportColumnCount = ARRAYSIZE(s_callbackReportColumns);
+
+	static void GetCallbackReportRow(const CallbackStatistics &c, double values[])
+	{
+		values[0] = (double)c.calls;
+		values[1] = (double)c.failures;
+		values[2] = c.totalNs / 1000.0;
+		values[3] = c.MeanNs() / 1000.0;
+		values[4] = c.maxNs / 1000.0;
+	}
+
+	void GetCallbackReport(ReportTable &table)
+	{
+		std::vector<CallbackStatistics> stats;
+		GetCallbackStatistics(stats);
+
+		table.AddHeader(s_callbackReportColumns, CallbackReportColumnCount);
+		for (const CallbackStatistics &c : stats)
+		{
+			table.Add(GetCallbackName(c.xlfn));
+			table.Add(c.caller);
+
+			double values[CallbackReportColumnCount - 2];
+			GetCallbackReportRow(c, values);
+			for (int j = 0; j < CallbackReportColumnCount - 2; j++)
+				table.Add(values[j]);
+		}
+	}
+
+	static const LPCWSTR s_reportColumns[] =
+	{
+		L"Function",
+		L"Calls",
+		L"Exceptions",
+		L"Mean (us)",
+		L"P50 (us)",
+		L"P99 (us)",
+		L"Max (us)",
+		L"MarshalIn Mean (us)",
+		L"Compute Mean (us)",
+		L"Compute P99 (us)",
+		L"MarshalOut Mean (us)",
+	};
+
+	static const int ReportColumnCount = ARRAYSIZE(s_reportColumns);
+
+	// Fills the numeric columns of a report row, i.e. all columns
+	// except the first.
+	static void GetReportRow(const FunctionStatistics &f, double values[])
+	{
+		const PhaseStatistics &total = f.phases[ProfilePhaseTotal];
+		const PhaseStatistics &compute = f.phases[ProfilePhaseCompute];
+		values[0] = (double)f.calls;
+		values[1] = (double)f.exceptions;
+		values[2] = total.MeanNs() / 1000.0;
+		values[3] = total.PercentileNs(50) / 1000.0;
+		values[4] = total.PercentileNs(99) / 1000.0;
+		values[5] = total.maxNs / 1000.0;
+		values[6] = f.phases[ProfilePhaseMarshalIn].MeanNs() / 1000.0;
+		values[7] = compute.MeanNs() / 1000.0;
+		values[8] = compute.PercentileNs(99) / 1000.0;
+		values[9] = f.phases[ProfilePhaseMarshalOut].MeanNs() / 1000.0;
+	}
+
+	void GetProfileReport(ReportTable &table)
+	{
+		std::vector<FunctionStatistics> stats;
+		GetProfileStatistics(stats);
+
+		table.AddHeader(s_reportColumns, ReportColumnCount);
+		for (const FunctionStatistics &f : stats)
+		{
+			table.Add(f.name);
+
+			double values[ReportColumnCount - 1];
+			GetReportRow(f, values);
+			for (int j = 0; j < ReportColumnCount - 1; j++)
+				table.Add(values[j]);
+		}
+	}
+
+	HRESULT WriteProfileReport(LPCWSTR fileName)
+	{
+		std::vector<FunctionStatistics> stats;
+		GetProfileStatistics(stats);
+
+		// Write to a temporary file first so that readers never see
+		// a partially written report.
+		std::wstring tempFileName = std::wstring(fileName) + L".tmp";
+		FILE *fp = nullptr;
+		if (_wfopen_s(&fp, tempFileName.c_str(), L"w, ccs=UTF-8") != 0 || fp == nullptr)
+			return E_FAIL;
+
+		for (int j = 0; j < ReportColumnCount; j++)
+		{
+			fwprintf(fp, (j == 0) ? L"%s" : L",%s", s_reportColumns[j]);
+		}
+		fwprintf(fp, L"\n");
+
+		for (const FunctionStatistics &f : stats)
+		{
+			double values[ReportColumnCount - 1];
+			GetReportRow(f, values);
+			fwprintf(fp, L"\"%s\"", f.name.c_str());
+			for (int j = 0; j < ReportColumnCount - 1; j++)
+			{
+				fwprintf(fp, L",%.3f", values[j]);
+			}
+			fwprintf(fp, L"\n");
+		}
+
+		if (IsCallbackProfilingEnabled())
+		{
+			std::vector<CallbackStatistics> callbacks;
+			GetCallbackStatistics(callbacks);
+
+			fwprintf(fp, L"\n");
+			for (int j = 0; j < CallbackReportColumnCount; j++)
+			{
+				fwprintf(fp, (j == 0) ? L"%s" : L",%s", s_callbackReportColumns[j]);
+			}
+			fwprintf(fp, L"\n");
+
+			for (const CallbackStatistics &c : callbacks)
+			{
+				double values[CallbackReportColumnCount - 2];
+				GetCallbackReportRow(c, values);
+				fwprintf(fp, L"\"%s\",\"%s\"", GetCallbackName(c.xlfn).c_str(), c.caller.c_str());
+				for (int j = 0; j < CallbackReportColumnCount - 2; j++)
+				{
+					fwprintf(fp, L",%.3f", values[j]);
+				}
+				fwprintf(fp, L"\n");
+			}
+		}
+
+		bool ok = (ferror(fp) == 0);
+		fclose(fp);
+		if (!ok || !MoveFileExW(tempFileName.c_str(), fileName, MOVEFILE_REPLACE_EXISTING))
+			return E_FAIL;
+		return S_OK;
+	}
+
+	////////////////////////////////////////////////////////////////////////
+	// Periodic dump
+
+	static HANDLE s_hDumpThread = NULL;
+	static HANDLE s_hDumpStopEvent = NULL;
+	static WCHAR s_dumpFileName[MAX_PATH];
+	static DWORD s_dumpIntervalMs = 60000;
+
+	static DWORD WINAPI ProfileDumpThreadProc(LPVOID)
+	{
+		while (WaitForSingleObject(s_hDumpStopEvent, s_dumpIntervalMs) == WAIT_TIMEOUT)
+		{
+			WriteProfileReport(s_dumpFileName);
+		}
+		return 0;
+	}
+
+	void StartProfileDump()
+	{
+		if (s_hDumpThread != NULL)
+			return;
+		if (s_profiledFunctionCount == 0 && !IsCallbackProfilingEnabled())
+			return;
+
+		DWORD n = GetEnvironmentVariableW(L"XLL_PROFILE_FILE",
+			s_dumpFileName, ARRAYSIZE(s_dumpFileName));
+		if (n == 0 || n >= ARRAYSIZE(s_dumpFileName))
+			return;
+
+		WCHAR interval[32];
+		n = GetEnvironmentVariableW(L"XLL_PROFILE_INTERVAL", interval, ARRAYSIZE(interval));
+		if (n > 0 && n < ARRAYSIZE(interval))
+		{
+			DWORD seconds = wcstoul(interval, nullptr, 10);
+			if (seconds > 0)
+				s_dumpIntervalMs = seconds * 1000;
+		}
+
+		s_hDumpStopEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+		if (s_hDumpStopEvent == NULL)
+			return;
+
+		s_hDumpThread = CreateThread(NULL, 0, ProfileDumpThreadProc, NULL, 0, NULL);
+		if (s_hDumpThread == NULL)
+		{
+			CloseHandle(s_hDumpStopEvent);
+			s_hDumpStopEvent = NULL;
+		}
+	}
+
+	void StopProfileDump()
+	{
+		if (s_hDumpThread == NULL)
+			return;
+
+		SetEvent(s_hDumpStopEvent);
+		WaitForSingleObject(s_hDumpThread, INFINITE);
+		CloseHandle(s_hDumpThread);
+		CloseHandle(s_hDumpStopEvent);
+		s_hDumpThread = NULL;
+		s_hDumpStopEvent = NULL;
+
+		// Write the final report.
+		WriteProfileReport(s_dumpFileName);
+	}
+
+	void ConfigureProfilingFromEnvironment()
+	{
+		WCHAR value[32];
+		DWORD n = GetEnvironmentVariableW(L"XLL_PROFILE_CALLBACKS", value, ARRAYSIZE(value));
+		if (n > 0 && n < ARRAYSIZE(value) && wcstoul(value, nullptr, 10) != 0)
+		{
+			EnableCallbackProfiling(true);
+		}
+	}
+}
@@ -0,0 +1,290 @@
+////////////////////////////////////////////////////////////////////////////
+// Profile.h -- per-UDF call counters and latency histograms
+//
+// When a UDF is exported with the XLL_PROFILE attribute, its wrapper
+// records the number of calls, the number of exceptions, and the time
+// spent in each of the three phases of a call:
+//
+//   MarshalIn    converting the arguments from wire type to user type
+//   Compute      running the UDF itself
+//   MarshalOut   converting the return value to XLOPER12
+//
+// The data is kept in per-thread buffers that are written only by the
+// owning thread, so recording a call takes no lock and no interlocked
+// instruction. Reports merge the buffers of all threads.
+//
+// The report is available in two forms:
+//
+//   1) The built-in UDF XllProfileReport(), which returns the report
+//      as an array. It is registered if at least one UDF is profiled.
+//
+//   2) A CSV file written periodically by a background thread. Set
+//      the environment variable XLL_PROFILE_FILE to the path of the
+//      file, and optionally XLL_PROFILE_INTERVAL to the number of
+//      seconds between two dumps (default 60), before starting Excel.
+//
+// Callbacks into Excel made through Excel12() and Excel12v() can be
+// profiled as well, by setting XLL_PROFILE_CALLBACKS=1 or by calling
+// EnableCallbackProfiling(). Each callback is counted and timed by
+// function number and by the profiled UDF running on the thread, and
+// the result is returned by the built-in UDF XllCallbackReport() and
+// appended to the CSV file. When disabled, a callback costs one extra
+// load and branch. To measure against a simulated host, load the XLL
+// in a test process and pass a fake MdCallBack12 to SetExcel12EntryPt().
+//
+
+#pragma once
+
+#include "xlldef.h"
+#include "Timestamp.h"
+#include "Report.h"
+#include <atomic>
+#include <string>
+#include <vector>
+
+//
+// XLL_MAX_PROFILED_FUNCTIONS
+//
+// Maximum number of UDFs that may be profiled in one XLL. Functions
+// exported after the limit is reached are not profiled.
+//
+
+#ifndef XLL_MAX_PROFILED_FUNCTIONS
+#define XLL_MAX_PROFILED_FUNCTIONS 1024
+#endif
+
+namespace XLL_NAMESPACE
+{
+	struct FunctionInfo;
+
+	enum ProfilePhase
+	{
+		ProfilePhaseMarshalIn,
+		ProfilePhaseCompute,
+		ProfilePhaseMarshalOut,
+		ProfilePhaseTotal,
+		ProfilePhaseCount
+	};
+
+	//
+	// LatencyHistogram
+	//
+	// Log-linear histogram in the style of HdrHistogram. Values below
+	// 2^SubBucketBits are counted exactly; larger values are counted in
+	// buckets whose width is 1/2^SubBucketBits of their magnitude, so
+	// any percentile is accurate to within 12.5%.
+	//
+	// Values are timestamp ticks. Each histogram has a single writer;
+	// readers may observe a partially updated histogram, which is fine
+	// for reporting purposes.
+	//
+
+	class LatencyHistogram
+	{
+	public:
+		enum { SubBucketBits = 3 };
+		enum { SubBucketCount = 1 << SubBucketBits };
+		enum { MaxExponent = 47 };
+		enum { BucketCount = (MaxExponent - SubBucketBits + 2) * SubBucketCount };
+
+	private:
+		std::atomic<unsigned int> m_counts[BucketCount];
+
+	public:
+		LatencyHistogram()
+		{
+			for (int i = 0; i < BucketCount; i++)
+				m_counts[i].store(0, std::memory_order_relaxed);
+		}
+
+		static int GetBucketIndex(unsigned long long value);
+		static unsigned long long GetBucketUpperBound(int index);
+
+		void Record(unsigned long long value)
+		{
+			std::atomic<unsigned int> &count = m_counts[GetBucketIndex(value)];
+			count.store(count.load(std::memory_order_relaxed) + 1,
+				std::memory_order_relaxed);
+		}
+
+		unsigned int GetCount(int index) const
+		{
+			return m_counts[index].load(std::memory_order_relaxed);
+		}
+	};
+
+	//
+	// PhaseStatistics, FunctionStatistics
+	//
+	// Aggregated statistics of a profiled UDF, with times converted to
+	// nanoseconds.
+	//
+
+	struct PhaseStatistics
+	{
+		unsigned long long count;
+		double totalNs;
+		double maxNs;
+		std::vector<unsigned long long> histogram; // LatencyHistogram buckets
+
+		PhaseStatistics()
+			: count(0), totalNs(0), maxNs(0),
+			histogram(LatencyHistogram::BucketCount)
+		{
+		}
+
+		double MeanNs() const { return (count == 0) ? 0.0 : totalNs / count; }
+
+		// Returns the latency at the given percentile, 0 <= p <= 100.
+		double PercentileNs(double p) const;
+	};
+
+	struct FunctionStatistics
+	{
+		std::wstring name;
+		unsigned long long calls;
+		unsigned long long exceptions;
+		PhaseStatistics phases[ProfilePhaseCount];
+
+		FunctionStatistics() : calls(0), exceptions(0) {}
+	};
+
+	//
+	// Recording
+	//
+
+	// Assigns a profile id to a UDF. Returns -1 if the maximum number
+	// of profiled functions has been reached. Called at static
+	// initialization time.
+	int RegisterProfiledFunction(const FunctionInfo *info);
+
+	// Returns the number of profiled functions.
+	int GetProfiledFunctionCount();
+
+	// Records a successful call. t[0] is taken on entry, t[1] before the
+	// UDF is called, t[2] after it returns, and t[3] after the return
+	// value is converted.
+	void RecordProfiledCall(int profileId, const unsigned long long t[4]) XLL_NOEXCEPT;
+
+	// Records a call that ended with an exception.
+	void RecordProfiledException(int profileId) XLL_NOEXCEPT;
+
+	// Marks the given profiled UDF as running on the calling thread, so
+	// that callbacks into Excel are attributed to it. Returns the id of
+	// the UDF it replaces, which must be passed to LeaveProfiledFunction().
+	int EnterProfiledFunction(int profileId) XLL_NOEXCEPT;
+	void LeaveProfiledFunction(int previousProfileId) XLL_NOEXCEPT;
+
+	//
+	// ProfileTimer
+	//
+	// Collects the timestamps of one call to a profiled UDF. Nothing
+	// is recorded unless Commit() is called.
+	//
+
+	class ProfileTimer
+	{
+		int m_profileId;
+		int m_previousProfileId;
+		unsigned long long m_timestamps[4];
+
+	public:
+		explicit ProfileTimer(int profileId)
+			: m_profileId(profileId),
+			m_previousProfileId(EnterProfiledFunction(profileId))
+		{
+			m_timestamps[0] = ReadTimestamp();
+		}
+		~ProfileTimer()
+		{
+			LeaveProfiledFunction(m_previousProfileId);
+		}
+		ProfileTimer(const ProfileTimer &) = delete;
+		ProfileTimer& operator=(const ProfileTimer &) = delete;
+		void BeginCompute() { m_timestamps[1] = ReadTimestamp(); }
+		void EndCompute() { m_timestamps[2] = ReadTimestamp(); }
+		void Commit()
+		{
+			m_timestamps[3] = ReadTimestamp();
+			if (m_profileId >= 0)
+				RecordProfiledCall(m_profileId, m_timestamps);
+		}
+	};
+
+	//
+	// Callback profiling
+	//
+
+	extern std::atomic<bool> g_isCallbackProfilingEnabled;
+
+	inline bool IsCallbackProfilingEnabled()
+	{
+		return g_isCallbackProfilingEnabled.load(std::memory_order_relaxed);
+	}
+
+	void EnableCallbackProfiling(bool enable);
+
+	// Records a callback into Excel that took the given number of
+	// timestamp ticks and returned the given xlret code. Called by
+	// Excel12() and Excel12v().
+	void RecordExcelCallback(int xlfn, int xlret, unsigned long long ticks) XLL_NOEXCEPT;
+
+	// Returns the name of an Excel function number, e.g. L"xlCoerce",
+	// or nullptr if the number is not known.
+	LPCWSTR GetExcelFunctionName(int xlfn);
+
+	//
+	// CallbackStatistics
+	//
+	// Aggregated statistics of the callbacks of one function number made
+	// by one profiled UDF. caller is empty for callbacks made outside of
+	// any profiled UDF, or when the statistics are totals over callers.
+	//
+
+	struct CallbackStatistics
+	{
+		int xlfn;
+		std::wstring caller;
+		unsigned long long calls;
+		unsigned long long failures;
+		double totalNs;
+		double maxNs;
+
+		CallbackStatistics() : xlfn(0), calls(0), failures(0), totalNs(0), maxNs(0) {}
+
+		double MeanNs() const { return (calls == 0) ? 0.0 : totalNs / calls; }
+	};
+
+	//
+	// Reporting
+	//
+
+	// Merges the per-thread statistics of all profiled UDFs.
+	void GetProfileStatistics(std::vector<FunctionStatistics> &stats);
+
+	// Fills the profile report, one row per function plus a header row.
+	void GetProfileReport(ReportTable &table);
+
+	// Merges the per-thread callback statistics. For each function
+	// number, a row with the totals over all callers (with caller set to
+	// "(all)") is followed by one row per caller. Function numbers are
+	// sorted by total time, in descending order.
+	void GetCallbackStatistics(std::vector<CallbackStatistics> &stats);
+
+	// Fills the callback report, one row per entry of
+	// GetCallbackStatistics() plus a header row.
+	void GetCallbackReport(ReportTable &table);
+
+	// Writes the profile report to a CSV file, followed by the callback
+	// report if callback profiling is enabled.
+	HRESULT WriteProfileReport(LPCWSTR fileName);
+
+	// Enables callback profiling if XLL_PROFILE_CALLBACKS is set to a
+	// non-zero value. Called by xlAutoOpen().
+	void ConfigureProfilingFromEnvironment();
+
+	// Starts or stops the background thread that periodically writes
+	// the profile report to the file named by XLL_PROFILE_FILE.
+	void StartProfileDump();
+	void StopProfileDump();
+}
@@ -0,0 +1,87 @@
+////////////////////////////////////////////////////////////////////////////
+// Report.cpp -- tables returned by the built-in report UDFs
+
+#include "Report.h"
+#include "Conversion.h"
+#include <cassert>
+#include <cstdlib>
+
+namespace XLL_NAMESPACE
+{
+	void ReportTable::AddHeader(const LPCWSTR *names, int count)
+	{
+		assert(m_cells.empty());
+		m_columns = count;
+		for (int j = 0; j < count; j++)
+			Add(names[j]);
+	}
+
+	void ReportTable::Add(const std::wstring &text)
+	{
+		Cell cell = { text, 0.0, true };
+		m_cells.push_back(std::move(cell));
+	}
+
+	void ReportTable::Add(double number)
+	{
+		Cell cell = { std::wstring(), number, false };
+		m_cells.push_back(std::move(cell));
+	}
+
+	void ReportTable::AddRow(LPCWSTR name, double value)
+	{
+		assert(m_columns == 0 || m_columns == 2);
+		m_columns = 2;
+		Add(name);
+		Add(value);
+	}
+
+	int ReportTable::rows() const
+	{
+		return (m_columns == 0) ? 0 :
+			static_cast<int>((m_cells.size() + m_columns - 1) / m_columns);
+	}
+
+	HRESULT ReportTable::CreateValue(LPXLOPER12 result) const
+	{
+		assert(result != nullptr);
+
+		int rows = this->rows();
+		if (rows == 0)
+			return E_INVALIDARG;
+
+		int count = rows * m_columns;
+		LPXLOPER12 p = (LPXLOPER12)calloc(count, sizeof(XLOPER12));
+		if (p == nullptr)
+			return E_OUTOFMEMORY;
+
+		result->xltype = xltypeMulti;
+		result->val.array.rows = rows;
+		result->val.array.columns = m_columns;
+		result->val.array.lparray = p;
+
+		// Cells that are not created stay nil, so that the array can be
+		// deleted at any point.
+		for (int i = 0; i < count; i++)
+		{
+			p[i].xltype = xltypeNil;
+		}
+
+		HRESULT hr = S_OK;
+		for (size_t i = 0; i < m_cells.size() && SUCCEEDED(hr); i++)
+		{
+			const Cell &cell = m_cells[i];
+			hr = cell.isText ?
+				XLL_NAMESPACE::CreateValue(&p[i], cell.text) :
+				XLL_NAMESPACE::CreateValue(&p[i], cell.number);
+			if (FAILED(hr))
+				p[i].xltype = xltypeNil;
+		}
+
+		if (FAILED(hr))
+		{
+			DeleteValue(result);
+		}
+		return hr;
+	}
+}
@@ -0,0 +1,55 @@
+////////////////////////////////////////////////////////////////////////////
+// Report.h -- tables returned by the built-in report UDFs
+//
+// Each built-in report UDF, such as XllProfileReport(), returns a table
+// of text and numbers. The module that owns the statistics describes the
+// report by filling a ReportTable, cell by cell in row-major order or
+// row by row for a two-column table of names and values; the table is
+// converted to an XLOPER12 array in one place.
+//
+
+#pragma once
+
+#include "xlldef.h"
+#include <string>
+#include <vector>
+
+namespace XLL_NAMESPACE
+{
+	class ReportTable
+	{
+		struct Cell
+		{
+			std::wstring text;
+			double number;
+			bool isText;
+		};
+
+		int m_columns;
+		std::vector<Cell> m_cells;
+
+	public:
+		ReportTable()
+			: m_columns(0)
+		{
+		}
+
+		// Adds the header row, which sets the number of columns.
+		void AddHeader(const LPCWSTR *names, int count);
+
+		// Adds the next cell.
+		void Add(const std::wstring &text);
+		void Add(double number);
+
+		// Adds a row of a two-column table of names and values.
+		void AddRow(LPCWSTR name, double value);
+
+		int columns() const { return m_columns; }
+
+		int rows() const;
+
+		// Fills an XLOPER12 array with the table. Cells missing from the
+		// last row are empty. The array must be freed with DeleteValue().
+		HRESULT CreateValue(LPXLOPER12 result) const;
+	};
+}
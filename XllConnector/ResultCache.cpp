@@ -0,0 +1,906 @@
+////////////////////////////////////////////////////////////////////////////
+// ResultCache.cpp -- persistent cache of the results of expensive pure UDFs
+
+#include "ResultCache.h"
+#include "Conversion.h"
+#include "Timestamp.h"
+#include "Log.h"
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <climits>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+
+namespace XLL_NAMESPACE
+{
+	////////////////////////////////////////////////////////////////////////
+	// Keys
+	//
+	// The arguments are encoded as in the spill file of the object cache
+	// and hashed with MurmurHash3 (x64, 128-bit). The signature of the
+	// function is part of the key, so the encoding of the arguments needs
+	// no type tags.
+	//
+
+	static inline unsigned long long RotateLeft(unsigned long long x, int r)
+	{
+		return (x << r) | (x >> (64 - r));
+	}
+
+	static inline unsigned long long FinalMix(unsigned long long k)
+	{
+		k ^= k >> 33;
+		k *= 0xff51afd7ed558ccdULL;
+		k ^= k >> 33;
+		k *= 0xc4ceb9fe1a85ec53ULL;
+		k ^= k >> 33;
+		return k;
+	}
+
+	static ResultKey ComputeHash(const void *data, size_t size, unsigned long long seed)
+	{
+		const unsigned long long c1 = 0x87c37b91114253d5ULL;
+		const unsigned long long c2 = 0x4cf5ad432745937fULL;
+		const unsigned char *p = static_cast<const unsigned char *>(data);
+		unsigned long long h1 = seed;
+		unsigned long long h2 = seed;
+
+		size_t blockCount = size / 16;
+		for (size_t i = 0; i <= blockCount; i++)
+		{
+			// The last block is the tail padded with zeros, which is
+			// the same as processing the tail bytes by themselves.
+			unsigned long long k[2] = { 0, 0 };
+			if (i < blockCount)
+				memcpy(k, p + i * 16, 16);
+			else if (size % 16 != 0)
+				memcpy(k, p + i * 16, size % 16);
+			else
+				break;
+
+			k[0] *= c1; k[0] = RotateLeft(k[0], 31); k[0] *= c2; h1 ^= k[0];
+			if (i < blockCount)
+			{
+				h1 = RotateLeft(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+			}
+			k[1] *= c2; k[1] = RotateLeft(k[1], 33); k[1] *= c1; h2 ^= k[1];
+			if (i < blockCount)
+			{
+				h2 = RotateLeft(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+			}
+		}
+
+		h1 ^= size;
+		h2 ^= size;
+		h1 += h2;
+		h2 += h1;
+		h1 = FinalMix(h1);
+		h2 = FinalMix(h2);
+		h1 += h2;
+		h2 += h1;
+
+		ResultKey key = { h1, h2 };
+		return key;
+	}
+
+	ResultKeyBuilder::ResultKeyBuilder(const FunctionInfo &info)
+		: m_writer(m_buffer)
+	{
+		m_writer.WriteString(info.name, wcslen(info.name));
+		m_writer.WriteString(info.typeText, wcslen(info.typeText));
+		m_writer.WriteString(info.cacheVersion, wcslen(info.cacheVersion));
+	}
+
+	bool ResultKeyBuilder::Add(double value)
+	{
+		m_writer.WriteDouble(value);
+		return true;
+	}
+
+	bool ResultKeyBuilder::Add(int value)
+	{
+		m_writer.WriteInt(value);
+		return true;
+	}
+
+	bool ResultKeyBuilder::Add(const wchar_t *value)
+	{
+		if (value == nullptr)
+			return false;
+		m_writer.WriteString(value, wcslen(value));
+		return true;
+	}
+
+	bool ResultKeyBuilder::Add(FP12 *value)
+	{
+		if (value == nullptr || value->rows < 0 || value->columns < 0)
+			return false;
+		m_writer.WriteSize((unsigned int)value->rows);
+		m_writer.WriteSize((unsigned int)value->columns);
+		m_writer.WriteBytes(value->array,
+			sizeof(double) * (size_t)value->rows * (size_t)value->columns);
+		return true;
+	}
+
+	bool ResultKeyBuilder::Add(LPXLOPER12 value)
+	{
+		if (value == nullptr)
+			return false;
+		try
+		{
+			SaveValue(*value, m_writer);
+			return true;
+		}
+		catch (const std::exception &)
+		{
+			// A reference is not a value.
+			return false;
+		}
+	}
+
+	ResultKey ResultKeyBuilder::GetKey() const
+	{
+		return ComputeHash(m_buffer.data(), m_buffer.size(), 0);
+	}
+
+	////////////////////////////////////////////////////////////////////////
+	// Cache file
+	//
+	// The file is a header followed by records, each of which is a key,
+	// the length and checksum of the encoded result, and the encoded
+	// result. Records are only appended. When the file is opened, the
+	// headers of its records are read in order to build the index in
+	// memory, which maps each key to its last record; a record that is
+	// cut short, as written by a process that was killed, ends the file
+	// and is truncated. The content of a record is only read, and its
+	// checksum verified, when it is looked up.
+	//
+	// Lookups read records through a view of the file. A record appended
+	// after the view was mapped is read with ReadFile, and the cache
+	// thread is asked to map the file again; it maps the new view without
+	// the lock, and only takes the lock to swap it in.
+	//
+	// The index and the file are accessed under s_resultCacheLock, which
+	// lookups take shared, so that hits on several threads do not wait
+	// for each other. A lookup records the use of an entry in its atomic
+	// lastUse. The cache thread copies the records it keeps without the
+	// lock, which is safe because records are never modified, and takes
+	// the lock to copy the records appended meanwhile and replace the
+	// file. s_hFile only changes on the cache thread.
+	//
+
+#pragma pack(push, 1)
+	struct ResultFileHeader
+	{
+		char magic[4];
+		unsigned int version;
+		unsigned long long reserved;
+	};
+
+	struct ResultRecordHeader
+	{
+		unsigned long long keyLow;
+		unsigned long long keyHigh;
+		unsigned int length;
+		unsigned int checksum;
+	};
+#pragma pack(pop)
+
+	static const char ResultFileMagic[4] = { 'X', 'L', 'R', 'C' };
+	static const unsigned int ResultFileVersion = 1;
+
+	struct ResultEntry
+	{
+		unsigned long long offset; // of the record header
+		unsigned int length;       // of the encoded result
+		unsigned int checksum;     // of the encoded result
+		std::atomic<unsigned long long> lastUse; // set by lookups
+
+		ResultEntry()
+			: offset(), length(), checksum(), lastUse(0)
+		{
+		}
+
+		ResultEntry(unsigned long long offset, unsigned int length,
+			unsigned int checksum, unsigned long long lastUse)
+			: offset(offset), length(length), checksum(checksum), lastUse(lastUse)
+		{
+		}
+
+		ResultEntry(const ResultEntry &other)
+			: offset(other.offset), length(other.length), checksum(other.checksum),
+			lastUse(other.lastUse.load(std::memory_order_relaxed))
+		{
+		}
+
+		ResultEntry& operator=(const ResultEntry &other)
+		{
+			offset = other.offset;
+			length = other.length;
+			checksum = other.checksum;
+			lastUse.store(other.lastUse.load(std::memory_order_relaxed),
+				std::memory_order_relaxed);
+			return *this;
+		}
+	};
+
+	struct ResultKeyHash
+	{
+		size_t operator()(const ResultKey &key) const
+		{
+			return (size_t)(key.low ^ key.high);
+		}
+	};
+
+	typedef std::unordered_map<ResultKey, ResultEntry, ResultKeyHash> ResultMap;
+
+	static inline unsigned long long GetRecordSize(unsigned int length)
+	{
+		return sizeof(ResultRecordHeader) + length;
+	}
+
+	static inline unsigned int ComputeChecksum(const void *data, size_t size)
+	{
+		return (unsigned int)ComputeHash(data, size, 0x5843).low;
+	}
+
+	// Holds an SRW lock shared or exclusive for the lifetime of the object.
+	class ResultCacheLock
+	{
+		SRWLOCK &m_lock;
+		bool m_isShared;
+
+		ResultCacheLock(const ResultCacheLock &);
+		ResultCacheLock& operator=(const ResultCacheLock &);
+
+	public:
+		ResultCacheLock(SRWLOCK &lock, bool isShared)
+			: m_lock(lock), m_isShared(isShared)
+		{
+			if (m_isShared)
+				AcquireSRWLockShared(&m_lock);
+			else
+				AcquireSRWLockExclusive(&m_lock);
+		}
+
+		~ResultCacheLock()
+		{
+			if (m_isShared)
+				ReleaseSRWLockShared(&m_lock);
+			else
+				ReleaseSRWLockExclusive(&m_lock);
+		}
+	};
+
+	static SRWLOCK s_resultCacheLock = SRWLOCK_INIT;
+	static ResultMap s_results;
+	static std::wstring s_fileName;
+	static HANDLE s_hFile = INVALID_HANDLE_VALUE;
+	static HANDLE s_hMapping = NULL;
+	static const unsigned char *s_view = nullptr;
+	static unsigned long long s_viewSize = 0;
+	static unsigned long long s_fileSize = 0;
+	static unsigned long long s_maxFileSize = 0;
+	static std::atomic<unsigned long long> s_lastUse(0);
+	static bool s_isCompactionFailed = false;
+	static std::atomic<unsigned long long> s_hits(0);
+	static std::atomic<unsigned long long> s_misses(0);
+	static unsigned long long s_stores = 0;
+	static unsigned long long s_compactions = 0;
+	static std::atomic<unsigned long long> s_hitTotalNs(0);
+
+	static std::atomic<bool> s_isOpen(false);
+	static std::atomic<bool> s_isLoaded(false);
+	static HANDLE s_hCacheThread = NULL;
+	static HANDLE s_hStopEvent = NULL;
+	static HANDLE s_hCompactEvent = NULL;
+	static HANDLE s_hRemapEvent = NULL;
+	static HANDLE s_hLoadedEvent = NULL;
+
+	static bool ReadAt(HANDLE hFile, unsigned long long offset, void *data, size_t size)
+	{
+		OVERLAPPED overlapped = {};
+		overlapped.Offset = (DWORD)offset;
+		overlapped.OffsetHigh = (DWORD)(offset >> 32);
+		DWORD read;
+		return ReadFile(hFile, data, (DWORD)size, &read, &overlapped) && read == size;
+	}
+
+	static bool WriteAt(HANDLE hFile, unsigned long long offset, const void *data, size_t size)
+	{
+		OVERLAPPED overlapped = {};
+		overlapped.Offset = (DWORD)offset;
+		overlapped.OffsetHigh = (DWORD)(offset >> 32);
+		DWORD written;
+		return WriteFile(hFile, data, (DWORD)size, &written, &overlapped) && written == size;
+	}
+
+	static HANDLE OpenResultFile(LPCWSTR fileName, DWORD disposition)
+	{
+		// Other processes may read the file, but not write to it.
+		return CreateFileW(fileName, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ,
+			NULL, disposition, FILE_ATTRIBUTE_NORMAL, NULL);
+	}
+
+	static void UnmapResultFile()
+	{
+		if (s_view != nullptr)
+		{
+			UnmapViewOfFile(s_view);
+			s_view = nullptr;
+		}
+		if (s_hMapping != NULL)
+		{
+			CloseHandle(s_hMapping);
+			s_hMapping = NULL;
+		}
+		s_viewSize = 0;
+	}
+
+	// Maps the whole file. On failure, records are read with ReadFile.
+	static void MapResultFile()
+	{
+		UnmapResultFile();
+		if (s_hFile == INVALID_HANDLE_VALUE || s_fileSize == 0 || s_fileSize > SIZE_MAX)
+			return;
+		s_hMapping = CreateFileMappingW(s_hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (s_hMapping == NULL)
+			return;
+		s_view = (const unsigned char *)MapViewOfFile(s_hMapping, FILE_MAP_READ, 0, 0, 0);
+		if (s_view == nullptr)
+		{
+			CloseHandle(s_hMapping);
+			s_hMapping = NULL;
+			return;
+		}
+		s_viewSize = s_fileSize;
+	}
+
+	//
+	// RemapResultFile
+	//
+	// Maps the file again if records were appended after the view. The
+	// new view is mapped without the lock, and the old one is unmapped
+	// after it is replaced. Called on the cache thread.
+	//
+
+	static void RemapResultFile()
+	{
+		unsigned long long fileSize;
+		{
+			ResultCacheLock lock(s_resultCacheLock, true);
+			fileSize = s_fileSize;
+			if (s_hFile == INVALID_HANDLE_VALUE || fileSize <= s_viewSize ||
+				fileSize > SIZE_MAX)
+				return;
+		}
+
+		// The file may have grown since, which leaves the end of the
+		// view unused.
+		HANDLE hMapping = CreateFileMappingW(s_hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (hMapping == NULL)
+			return;
+		const unsigned char *view = (const unsigned char *)MapViewOfFile(
+			hMapping, FILE_MAP_READ, 0, 0, (SIZE_T)fileSize);
+		if (view == nullptr)
+		{
+			CloseHandle(hMapping);
+			return;
+		}
+
+		{
+			ResultCacheLock lock(s_resultCacheLock, false);
+			std::swap(view, s_view);
+			std::swap(hMapping, s_hMapping);
+			s_viewSize = fileSize;
+		}
+		if (view != nullptr)
+			UnmapViewOfFile(view);
+		if (hMapping != NULL)
+			CloseHandle(hMapping);
+	}
+
+	// Returns a pointer to the encoded result of an entry, which is
+	// either in the view or read into buffer. Called with the lock held
+	// shared.
+	static const unsigned char * ReadResultRecord(const ResultEntry &entry,
+		std::vector<unsigned char> &buffer)
+	{
+		unsigned long long start = entry.offset + sizeof(ResultRecordHeader);
+		unsigned long long end = start + entry.length;
+		if (end <= s_viewSize)
+			return s_view + start;
+
+		SetEvent(s_hRemapEvent);
+		buffer.resize(entry.length);
+		if (entry.length > 0 && !ReadAt(s_hFile, start, buffer.data(), buffer.size()))
+			return nullptr;
+		return buffer.data();
+	}
+
+	// Truncates the file to size. The file must not be mapped.
+	static bool TruncateResultFile(HANDLE hFile, unsigned long long size)
+	{
+		LARGE_INTEGER position;
+		position.QuadPart = (LONGLONG)size;
+		return SetFilePointerEx(hFile, position, NULL, FILE_BEGIN) && SetEndOfFile(hFile);
+	}
+
+	static bool WriteResultFileHeader(HANDLE hFile)
+	{
+		ResultFileHeader header = {};
+		memcpy(header.magic, ResultFileMagic, sizeof(header.magic));
+		header.version = ResultFileVersion;
+		return WriteAt(hFile, 0, &header, sizeof(header));
+	}
+
+	//
+	// LoadResultFile
+	//
+	// Opens the cache file and builds the index. Called on the cache
+	// thread before any lookup is served. Returns false if the file
+	// cannot be used.
+	//
+
+	static bool LoadResultFile()
+	{
+		HANDLE hFile = OpenResultFile(s_fileName.c_str(), OPEN_ALWAYS);
+		if (hFile == INVALID_HANDLE_VALUE)
+		{
+			XLL_LOG_WARNING("Cannot open result cache file %s (error %lu)",
+				s_fileName.c_str(), GetLastError());
+			return false;
+		}
+
+		LARGE_INTEGER fileSize;
+		if (!GetFileSizeEx(hFile, &fileSize))
+		{
+			CloseHandle(hFile);
+			return false;
+		}
+
+		ResultFileHeader header = {};
+		if ((unsigned long long)fileSize.QuadPart < sizeof(header) ||
+			!ReadAt(hFile, 0, &header, sizeof(header)) ||
+			memcmp(header.magic, ResultFileMagic, sizeof(header.magic)) != 0 ||
+			header.version != ResultFileVersion)
+		{
+			if (fileSize.QuadPart != 0)
+			{
+				XLL_LOG_WARNING("Result cache file %s is not valid and is cleared",
+					s_fileName.c_str());
+			}
+			if (!TruncateResultFile(hFile, 0) || !WriteResultFileHeader(hFile))
+			{
+				CloseHandle(hFile);
+				return false;
+			}
+			fileSize.QuadPart = sizeof(header);
+		}
+
+		ResultMap results;
+		unsigned long long lastUse = 0;
+		unsigned long long validSize = sizeof(header);
+		{
+			ResultCacheLock lock(s_resultCacheLock, false);
+			s_hFile = hFile;
+			s_fileSize = (unsigned long long)fileSize.QuadPart;
+			MapResultFile();
+
+			while (validSize + sizeof(ResultRecordHeader) <= s_fileSize)
+			{
+				ResultRecordHeader record;
+				if (validSize + sizeof(record) <= s_viewSize)
+					memcpy(&record, s_view + validSize, sizeof(record));
+				else if (!ReadAt(hFile, validSize, &record, sizeof(record)))
+					break;
+				// An encoded result is never empty; zeros are where a
+				// write was cut short.
+				if (record.length == 0 ||
+					validSize + GetRecordSize(record.length) > s_fileSize)
+					break;
+
+				ResultEntry entry = { validSize, record.length, record.checksum, ++lastUse };
+				ResultKey key = { record.keyLow, record.keyHigh };
+				results[key] = entry;
+				validSize += GetRecordSize(record.length);
+			}
+
+			if (validSize < s_fileSize)
+			{
+				XLL_LOG_WARNING("Result cache file %s is truncated from %llu to %llu bytes",
+					s_fileName.c_str(), s_fileSize, validSize);
+				UnmapResultFile();
+				if (!TruncateResultFile(hFile, validSize))
+				{
+					CloseHandle(hFile);
+					s_hFile = INVALID_HANDLE_VALUE;
+					s_fileSize = 0;
+					return false;
+				}
+				s_fileSize = validSize;
+				MapResultFile();
+			}
+
+			s_results.swap(results);
+			s_lastUse.store(lastUse);
+		}
+		return true;
+	}
+
+	//
+	// CompactResultFile
+	//
+	// Rewrites the file with the most recently used results that fit in
+	// half the maximum size, oldest first, so that the order of the
+	// records gives their last use when the file is loaded again.
+	//
+
+	static void CompactResultFile()
+	{
+		typedef std::pair<ResultKey, ResultEntry> KeyEntryPair;
+		std::vector<KeyEntryPair> entries;
+		unsigned long long snapshotSize;
+		{
+			ResultCacheLock lock(s_resultCacheLock, true);
+			if (s_hFile == INVALID_HANDLE_VALUE || s_fileSize <= s_maxFileSize)
+				return;
+			entries.assign(s_results.begin(), s_results.end());
+			snapshotSize = s_fileSize;
+		}
+
+		std::sort(entries.begin(), entries.end(),
+			[](const KeyEntryPair &a, const KeyEntryPair &b) {
+			return a.second.lastUse > b.second.lastUse;
+		});
+		unsigned long long keptSize = sizeof(ResultFileHeader);
+		size_t keptCount = 0;
+		while (keptCount < entries.size() &&
+			keptSize + GetRecordSize(entries[keptCount].second.length) <= s_maxFileSize / 2)
+		{
+			keptSize += GetRecordSize(entries[keptCount].second.length);
+			keptCount++;
+		}
+		entries.resize(keptCount);
+		std::reverse(entries.begin(), entries.end());
+
+		std::wstring tempFileName = s_fileName + L".tmp";
+		HANDLE hTemp = CreateFileW(tempFileName.c_str(), GENERIC_READ | GENERIC_WRITE, 0,
+			NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (hTemp == INVALID_HANDLE_VALUE)
+		{
+			XLL_LOG_WARNING("Cannot create file %s to compact the result cache (error %lu)",
+				tempFileName.c_str(), GetLastError());
+			ResultCacheLock lock(s_resultCacheLock, false);
+			s_isCompactionFailed = true;
+			return;
+		}
+
+		// Copy the records kept. s_hFile only changes on this thread.
+		ResultMap results;
+		unsigned long long tempSize = sizeof(ResultFileHeader);
+		bool ok = WriteResultFileHeader(hTemp);
+		std::vector<unsigned char> buffer;
+		for (size_t i = 0; i < entries.size() && ok; i++)
+		{
+			const ResultEntry &entry = entries[i].second;
+			buffer.resize((size_t)GetRecordSize(entry.length));
+			ok = ReadAt(s_hFile, entry.offset, buffer.data(), buffer.size()) &&
+				WriteAt(hTemp, tempSize, buffer.data(), buffer.size());
+			ResultEntry copied = { tempSize, entry.length, entry.checksum, entry.lastUse };
+			results[entries[i].first] = copied;
+			tempSize += buffer.size();
+		}
+
+		ResultCacheLock lock(s_resultCacheLock, false);
+
+		// Copy the records appended since the snapshot, and keep the
+		// last use of the records copied before. Entries that were not
+		// kept are dropped.
+		for (ResultMap::iterator it = s_results.begin(); it != s_results.end() && ok; ++it)
+		{
+			const ResultEntry &entry = it->second;
+			if (entry.offset < snapshotSize)
+			{
+				ResultMap::iterator kept = results.find(it->first);
+				if (kept != results.end())
+					kept->second.lastUse.store(entry.lastUse.load());
+				continue;
+			}
+			buffer.resize((size_t)GetRecordSize(entry.length));
+			ok = ReadAt(s_hFile, entry.offset, buffer.data(), buffer.size()) &&
+				WriteAt(hTemp, tempSize, buffer.data(), buffer.size());
+			ResultEntry copied = { tempSize, entry.length, entry.checksum, entry.lastUse };
+			results[it->first] = copied;
+			tempSize += buffer.size();
+		}
+		CloseHandle(hTemp);
+
+		if (ok)
+		{
+			UnmapResultFile();
+			CloseHandle(s_hFile);
+			ok = (MoveFileExW(tempFileName.c_str(), s_fileName.c_str(),
+				MOVEFILE_REPLACE_EXISTING) != FALSE);
+			if (ok)
+			{
+				s_results.swap(results);
+				s_fileSize = tempSize;
+				s_compactions++;
+			}
+			s_hFile = OpenResultFile(s_fileName.c_str(), OPEN_EXISTING);
+			if (s_hFile == INVALID_HANDLE_VALUE)
+			{
+				XLL_LOG_WARNING("Cannot reopen result cache file %s (error %lu)",
+					s_fileName.c_str(), GetLastError());
+				s_results.clear();
+				s_fileSize = 0;
+			}
+			MapResultFile();
+		}
+
+		if (!ok)
+		{
+			XLL_LOG_WARNING("Cannot compact result cache file %s", s_fileName.c_str());
+			DeleteFileW(tempFileName.c_str());
+			s_isCompactionFailed = true;
+		}
+	}
+
+	static DWORD WINAPI ResultCacheThreadProc(LPVOID)
+	{
+		if (!LoadResultFile())
+		{
+			// Another Excel process may be using the file.
+			XLL_LOG_WARNING("Result cache is disabled because %s cannot be used",
+				s_fileName.c_str());
+			s_isOpen.store(false);
+			SetEvent(s_hLoadedEvent);
+			return 0;
+		}
+		s_isLoaded.store(true);
+		SetEvent(s_hLoadedEvent);
+
+		HANDLE handles[3] = { s_hStopEvent, s_hCompactEvent, s_hRemapEvent };
+		for (;;)
+		{
+			CompactResultFile();
+			RemapResultFile();
+			DWORD result = WaitForMultipleObjects(3, handles, FALSE, INFINITE);
+			if (result != WAIT_OBJECT_0 + 1 && result != WAIT_OBJECT_0 + 2)
+				break;
+		}
+		return 0;
+	}
+
+	// Waits until the index is built. Returns false if the cache is not
+	// open, or the file could not be loaded.
+	static bool WaitForResultCache()
+	{
+		if (s_isLoaded.load(std::memory_order_acquire))
+			return true;
+		if (!s_isOpen.load())
+			return false;
+		WaitForSingleObject(s_hLoadedEvent, INFINITE);
+		return s_isLoaded.load();
+	}
+
+	bool IsResultCacheOpen()
+	{
+		return s_isOpen.load(std::memory_order_relaxed);
+	}
+
+	bool LookupResult(const ResultKey &key, LPXLOPER12 result)
+	{
+		assert(result != nullptr);
+
+		if (!WaitForResultCache())
+			return false;
+
+		unsigned long long start = ReadTimestamp();
+		unsigned long long offset;
+		bool isLoaded = false;
+		result->xltype = xltypeNil;
+		{
+			ResultCacheLock lock(s_resultCacheLock, true);
+			ResultMap::iterator it = s_results.find(key);
+			if (it == s_results.end())
+			{
+				s_misses++;
+				return false;
+			}
+
+			ResultEntry &entry = it->second;
+			offset = entry.offset;
+			std::vector<unsigned char> buffer;
+			const unsigned char *data = ReadResultRecord(entry, buffer);
+			if (data != nullptr && ComputeChecksum(data, entry.length) == entry.checksum)
+			{
+				try
+				{
+					ObjectReader reader(data, entry.length);
+					LoadValue(*result, reader);
+					isLoaded = true;
+				}
+				catch (const std::exception &)
+				{
+				}
+			}
+			if (isLoaded)
+				entry.lastUse.store(++s_lastUse, std::memory_order_relaxed);
+		}
+
+		if (!isLoaded)
+		{
+			DeleteValue(result);
+			ResultCacheLock lock(s_resultCacheLock, false);
+			ResultMap::iterator it = s_results.find(key);
+			if (it != s_results.end() && it->second.offset == offset)
+				s_results.erase(it);
+			s_misses++;
+			return false;
+		}
+
+		if (result->xltype & (xltypeStr | xltypeMulti))
+			result->xltype |= xlbitDLLFree;
+		s_hits++;
+		s_hitTotalNs += (unsigned long long)TimestampToNanoseconds(ReadTimestamp() - start);
+		return true;
+	}
+
+	void StoreResult(const ResultKey &key, const XLOPER12 &result)
+	{
+		if (!WaitForResultCache())
+			return;
+
+		std::vector<unsigned char> buffer(sizeof(ResultRecordHeader));
+		try
+		{
+			ObjectWriter writer(buffer);
+			SaveValue(result, writer);
+		}
+		catch (const std::exception &)
+		{
+			return;
+		}
+
+		size_t length = buffer.size() - sizeof(ResultRecordHeader);
+		if (length > UINT_MAX)
+			return;
+		ResultRecordHeader record;
+		record.keyLow = key.low;
+		record.keyHigh = key.high;
+		record.length = (unsigned int)length;
+		record.checksum = ComputeChecksum(buffer.data() + sizeof(record), length);
+		memcpy(buffer.data(), &record, sizeof(record));
+
+		ResultCacheLock lock(s_resultCacheLock, false);
+		if (s_hFile == INVALID_HANDLE_VALUE || buffer.size() > s_maxFileSize / 4)
+			return;
+
+		// If compaction falls behind or fails, stop adding results
+		// rather than let the file grow without limit.
+		if (s_fileSize + buffer.size() > s_maxFileSize + s_maxFileSize / 2)
+			return;
+
+		if (!WriteAt(s_hFile, s_fileSize, buffer.data(), buffer.size()))
+			return;
+
+		ResultEntry entry = { s_fileSize, record.length, record.checksum, ++s_lastUse };
+		s_results[key] = entry;
+		s_fileSize += buffer.size();
+		s_stores++;
+
+		if (s_fileSize > s_maxFileSize && !s_isCompactionFailed)
+			SetEvent(s_hCompactEvent);
+	}
+
+	BOOL OpenResultCache(LPCWSTR fileName, unsigned long long maxFileSize)
+	{
+		if (s_hCacheThread != NULL || fileName == nullptr || maxFileSize == 0)
+			return FALSE;
+
+		s_fileName = fileName;
+		s_maxFileSize = maxFileSize;
+		s_isCompactionFailed = false;
+		s_hStopEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+		s_hCompactEvent = CreateEventW(NULL, FALSE, FALSE, NULL);
+		s_hRemapEvent = CreateEventW(NULL, FALSE, FALSE, NULL);
+		s_hLoadedEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+		if (s_hStopEvent != NULL && s_hCompactEvent != NULL && s_hRemapEvent != NULL &&
+			s_hLoadedEvent != NULL)
+		{
+			s_isOpen.store(true);
+			s_hCacheThread = CreateThread(NULL, 0, ResultCacheThreadProc, NULL, 0, NULL);
+		}
+		if (s_hCacheThread == NULL)
+		{
+			s_isOpen.store(false);
+			CloseResultCache();
+			return FALSE;
+		}
+		return TRUE;
+	}
+
+	void CloseResultCache()
+	{
+		if (s_hCacheThread != NULL)
+		{
+			SetEvent(s_hStopEvent);
+			WaitForSingleObject(s_hCacheThread, INFINITE);
+			CloseHandle(s_hCacheThread);
+			s_hCacheThread = NULL;
+		}
+		s_isOpen.store(false);
+		s_isLoaded.store(false);
+
+		HANDLE *events[4] = { &s_hStopEvent, &s_hCompactEvent, &s_hRemapEvent, &s_hLoadedEvent };
+		for (HANDLE *p : events)
+		{
+			if (*p != NULL)
+			{
+				CloseHandle(*p);
+				*p = NULL;
+			}
+		}
+
+		ResultCacheLock lock(s_resultCacheLock, false);
+		UnmapResultFile();
+		if (s_hFile != INVALID_HANDLE_VALUE)
+		{
+			CloseHandle(s_hFile);
+			s_hFile = INVALID_HANDLE_VALUE;
+		}
+		s_results.clear();
+		s_fileSize = 0;
+	}
+
+	bool ConfigureResultCacheFromEnvironment()
+	{
+		WCHAR fileName[MAX_PATH];
+		DWORD n = GetEnvironmentVariableW(L"XLL_RESULT_CACHE_FILE", fileName, ARRAYSIZE(fileName));
+		if (n == 0 || n >= ARRAYSIZE(fileName))
+			return false;
+
+		unsigned long long megabytes = 256;
+		WCHAR value[32];
+		n = GetEnvironmentVariableW(L"XLL_RESULT_CACHE_SIZE", value, ARRAYSIZE(value));
+		if (n > 0 && n < ARRAYSIZE(value))
+			megabytes = wcstoull(value, nullptr, 10);
+		if (megabytes == 0)
+			return false;
+
+		return OpenResultCache(fileName, megabytes << 20) != FALSE;
+	}
+
+	void GetResultCacheStatistics(ResultCacheStatistics &stats)
+	{
+		ResultCacheLock lock(s_resultCacheLock, true);
+		stats.maxFileBytes = s_maxFileSize;
+		stats.fileBytes = s_fileSize;
+		stats.results = s_results.size();
+		stats.hits = s_hits.load();
+		stats.misses = s_misses.load();
+		stats.stores = s_stores;
+		stats.compactions = s_compactions;
+		stats.hitTotalNs = (double)s_hitTotalNs.load();
+	}
+
+	void GetResultCacheReport(ReportTable &table)
+	{
+		ResultCacheStatistics stats;
+		GetResultCacheStatistics(stats);
+
+		const double MB = 1024.0 * 1024.0;
+		table.AddRow(L"Max file size (MB)", stats.maxFileBytes / MB);
+		table.AddRow(L"File size (MB)", stats.fileBytes / MB);
+		table.AddRow(L"Results", (double)stats.results);
+		table.AddRow(L"Hits", (double)stats.hits);
+		table.AddRow(L"Misses", (double)stats.misses);
+		table.AddRow(L"Stores", (double)stats.stores);
+		table.AddRow(L"Compactions", (double)stats.compactions);
+		table.AddRow(L"Mean hit (us)", (stats.hits == 0) ? 0.0 : stats.hitTotalNs / stats.hits / 1e3);
+	}
+}
@@ -0,0 +1,179 @@
+////////////////////////////////////////////////////////////////////////////
+// ResultCache.h -- persistent cache of the results of expensive pure UDFs
+//
+// A pure UDF that takes minutes to compute returns the same result every
+// time a workbook is opened. Mark such a function as cacheable, with a
+// version tag, to keep its results in a file that outlives the Excel
+// session:
+//
+//   EXPORT_XLL_FUNCTION(PriceBasket, XLL_NOT_VOLATILE | XLL_THREADSAFE)
+//   .Cacheable(L"2");
+//
+// Each result is stored under a 128-bit key computed from the function
+// name, its signature, the version tag, and the values of the arguments.
+// When the function is called with the same arguments again, in this or
+// a later session, the result is read from the file instead of being
+// computed. Change the version tag whenever the function would return
+// different results for the same arguments, such as after fixing a bug;
+// results stored under the old tag are then never read and are removed
+// when the file is compacted.
+//
+// Only mark functions whose result depends on their arguments alone.
+// Functions that take or return object handles, and calls with an
+// argument that is a reference, are never cached, because a handle or a
+// reference does not identify its content across sessions. Calls that
+// throw an exception are not cached.
+//
+// To enable the cache, set the environment variable XLL_RESULT_CACHE_FILE
+// to the path of the cache file before starting Excel, and optionally
+// XLL_RESULT_CACHE_SIZE to its maximum size in megabytes (256 by
+// default), or call OpenResultCache(). Only one Excel process can use
+// a cache file at a time; another one logs a warning and runs with the
+// cache disabled.
+//
+// The file is opened and its index is built on a background thread
+// when the XLL is loaded; a cacheable function called before the index
+// is ready waits for it. Results are appended to the file, and read
+// through a memory-mapped view of it, so a cache hit costs a hash
+// lookup under a shared lock and the decoding of the result; the view
+// is extended by the background thread. When the file grows beyond its
+// maximum size, the background thread rewrites it with the most recently
+// used results that fit in half the size.
+//
+// The built-in UDF XllResultCacheReport() returns the size of the file,
+// the number of results, and the number of hits, misses, stores and
+// compactions with the mean time of a hit. It is registered when the
+// cache is enabled by XLL_RESULT_CACHE_FILE.
+//
+
+#pragma once
+
+#include "xlldef.h"
+#include "FunctionInfo.h"
+#include "ObjectCache.h"
+#include "Report.h"
+#include <type_traits>
+#include <vector>
+
+namespace XLL_NAMESPACE
+{
+	struct ResultKey
+	{
+		unsigned long long low;
+		unsigned long long high;
+
+		bool operator==(const ResultKey &other) const
+		{
+			return low == other.low && high == other.high;
+		}
+	};
+
+	//
+	// ResultKeyBuilder
+	//
+	// Computes the key of a call from the function and the wire values
+	// of its arguments. Add() returns false for an argument that cannot
+	// be part of a key, in which case the call is not cached.
+	//
+
+	class ResultKeyBuilder
+	{
+		std::vector<unsigned char> m_buffer;
+		ObjectWriter m_writer;
+
+	public:
+		explicit ResultKeyBuilder(const FunctionInfo &info);
+
+		bool Add(double value);
+		bool Add(int value);
+		bool Add(const wchar_t *value);
+		bool Add(FP12 *value);
+		bool Add(LPXLOPER12 value);
+
+		template <typename T>
+		bool Add(T)
+		{
+			return false;
+		}
+
+		ResultKey GetKey() const;
+	};
+
+	template <typename... TWire>
+	inline bool MakeResultKey(ResultKey &key, const FunctionInfo &info, TWire... args)
+	{
+		ResultKeyBuilder builder(info);
+		bool added[] = { true, builder.Add(args)... };
+		for (bool b : added)
+		{
+			if (!b)
+				return false;
+		}
+		key = builder.GetKey();
+		return true;
+	}
+
+	//
+	// IsCacheableArgument<T>, IsCacheableResult<T>
+	//
+	// Whether a UDF that takes or returns T can be cached. Object
+	// handles are only valid in the session that created them.
+	//
+
+	template <typename T> struct IsCacheableArgument : std::true_type {};
+	template <typename T> struct IsCacheableArgument < Handle<T> > : std::false_type {};
+	template <typename T> struct IsCacheableArgument < const Handle<T> & > : std::false_type {};
+
+	template <typename... T> struct AreCacheableArguments;
+
+	template <>
+	struct AreCacheableArguments<> : std::true_type {};
+
+	template <typename T, typename... TRest>
+	struct AreCacheableArguments<T, TRest...> : std::integral_constant<bool,
+		IsCacheableArgument<T>::value && AreCacheableArguments<TRest...>::value> {};
+
+	template <typename T>
+	struct IsCacheableResult : std::integral_constant<bool, !ReturnsObject<T>::value> {};
+
+	// Returns true if the result cache is open.
+	bool IsResultCacheOpen();
+
+	// Reads the result stored under key into result, which must be
+	// empty. Returns false if no result is stored.
+	bool LookupResult(const ResultKey &key, LPXLOPER12 result);
+
+	// Stores a result under key. Results that contain references are
+	// not stored.
+	void StoreResult(const ResultKey &key, const XLOPER12 &result);
+
+	// Opens the cache file, creating it if it does not exist, and
+	// starts the thread that builds the index and compacts the file.
+	// The file is kept at most maxFileSize bytes.
+	BOOL OpenResultCache(LPCWSTR fileName, unsigned long long maxFileSize);
+
+	// Stops the background thread and closes the cache file.
+	void CloseResultCache();
+
+	// Opens the cache named by XLL_RESULT_CACHE_FILE, with the maximum
+	// size given by XLL_RESULT_CACHE_SIZE (in megabytes). Returns true
+	// if the cache is opened.
+	bool ConfigureResultCacheFromEnvironment();
+
+	struct ResultCacheStatistics
+	{
+		unsigned long long maxFileBytes;
+		unsigned long long fileBytes;
+		unsigned long long results;
+		unsigned long long hits;
+		unsigned long long misses;
+		unsigned long long stores;
+		unsigned long long compactions;
+		double hitTotalNs;
+	};
+
+	void GetResultCacheStatistics(ResultCacheStatistics &stats);
+
+	// Fills a table with the statistics of the cache, one per row.
+	void GetResultCacheReport(ReportTable &table);
+}
@@ -0,0 +1,520 @@
+////////////////////////////////////////////////////////////////////////////
+// SharedData.cpp -- read-only datasets shared by all Excel processes
+
+#include "SharedData.h"
+#include "Log.h"
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+
+namespace XLL_NAMESPACE
+{
+	//
+	// The processes find the datasets through a directory, a small block
+	// of shared memory that maps each name to its current version. Each
+	// version is a separate named file mapping, which Windows destroys when
+	// the last handle and view of it are closed; no process needs to know
+	// which others still use a version.
+	//
+	// Names are claimed under a named mutex and never released, so a
+	// reader can find a name without the mutex. The current version of a
+	// name is switched with a compare-and-swap that only moves it forward.
+	// Versions are numbered from a counter in the directory, so that each
+	// version has a distinct mapping name.
+	//
+	// A lookup takes no lock when this process has already mapped the
+	// current version: the slot of a name is remembered in a small hash
+	// table, since a slot never changes its name, and the version this
+	// process mapped is read with atomic_load. s_sharedDataLock is taken
+	// only to open the directory or to map another version.
+	//
+	// The layout version is part of the object names, so that add-ins
+	// built with different layouts do not see each other's data.
+	//
+
+#define XLL_SHARED_DATA_PREFIX L"Local\\XllConnector.SharedData.1"
+
+	struct SharedDataSlot
+	{
+		LONG volatile isUsed;
+		LONG reserved;
+		LONGLONG volatile version;  // current version, or zero if none
+		wchar_t name[MaxSharedDatasetName + 1];
+	};
+
+	struct SharedDataDirectory
+	{
+		LONGLONG volatile lastVersion;
+		LONGLONG reserved;
+		SharedDataSlot slots[MaxSharedDatasets];
+	};
+
+	// Header at the start of each version; the elements follow.
+	struct SharedDataHeader
+	{
+		char magic[4];              // "XLSD"
+		unsigned int elementSize;
+		unsigned long long count;
+		unsigned long long version;
+		unsigned char reserved[40];
+	};
+
+	static_assert(sizeof(SharedDataHeader) == 64, "SharedDataHeader must be 64 bytes.");
+
+	// What this process holds of a dataset: the version it last mapped,
+	// which is read and replaced with atomic_load and atomic_store, and
+	// the mapping of the version it last published, kept open so that
+	// the version exists until it is replaced.
+	struct LocalDataset
+	{
+		std::shared_ptr<const SharedDataBlock> mapped;
+		HANDLE hPublished;
+		unsigned long long publishedVersion;
+	};
+
+	// Number of entries of the table of slots by name; a power of two.
+	static const int SlotTableSize = 2 * MaxSharedDatasets;
+
+	static std::mutex s_sharedDataLock;
+	static HANDLE s_hDirectoryMapping;
+	static HANDLE s_hDirectoryLock;
+	static SharedDataDirectory * volatile s_directory;
+	static LocalDataset s_datasets[MaxSharedDatasets];
+	static LONG volatile s_slotTable[SlotTableSize]; // slot + 1, or zero
+
+	// Maps the directory, creating it if this is the first process.
+	// Must be called with s_sharedDataLock held.
+	static HRESULT OpenDirectory()
+	{
+		if (s_directory != nullptr)
+			return S_OK;
+
+		HANDLE hMapping = CreateFileMappingW(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+			0, sizeof(SharedDataDirectory), XLL_SHARED_DATA_PREFIX);
+		if (hMapping == NULL)
+			return HRESULT_FROM_WIN32(GetLastError());
+
+		void *view = MapViewOfFile(hMapping, FILE_MAP_WRITE, 0, 0, sizeof(SharedDataDirectory));
+		if (view == NULL)
+		{
+			HRESULT hr = HRESULT_FROM_WIN32(GetLastError());
+			CloseHandle(hMapping);
+			return hr;
+		}
+
+		HANDLE hLock = CreateMutexW(NULL, FALSE, XLL_SHARED_DATA_PREFIX L".Lock");
+		if (hLock == NULL)
+		{
+			HRESULT hr = HRESULT_FROM_WIN32(GetLastError());
+			UnmapViewOfFile(view);
+			CloseHandle(hMapping);
+			return hr;
+		}
+
+		s_hDirectoryMapping = hMapping;
+		s_hDirectoryLock = hLock;
+		InterlockedExchangePointer((PVOID volatile *)&s_directory, view);
+		return S_OK;
+	}
+
+	// Returns the slot of a name, or -1 if the name is not published.
+	static int FindSlot(LPCWSTR name)
+	{
+		for (int i = 0; i < MaxSharedDatasets; i++)
+		{
+			SharedDataSlot &slot = s_directory->slots[i];
+			if (slot.isUsed == 0)
+				break;
+			if (wcscmp(slot.name, name) == 0)
+				return i;
+		}
+		return -1;
+	}
+
+	static unsigned int HashName(LPCWSTR name)
+	{
+		unsigned int hash = 2166136261U;
+		for (; *name != L'\0'; name++)
+		{
+			hash ^= (unsigned int)*name;
+			hash *= 16777619U;
+		}
+		return hash;
+	}
+
+	// Returns the slot of a name from the table, or -1 if it has not been
+	// looked up by this process yet.
+	static int FindCachedSlot(LPCWSTR name, unsigned int hash)
+	{
+		for (int n = 0; n < SlotTableSize; n++)
+		{
+			LONG entry = s_slotTable[(hash + n) & (SlotTableSize - 1)];
+			if (entry == 0)
+				break;
+			if (wcscmp(s_directory->slots[entry - 1].name, name) == 0)
+				return entry - 1;
+		}
+		return -1;
+	}
+
+	// Adds the slot of a name to the table. Another thread may add it at
+	// the same time, which leaves a harmless duplicate.
+	static void CacheSlot(unsigned int hash, int slot)
+	{
+		for (int n = 0; n < SlotTableSize; n++)
+		{
+			LONG volatile &entry = s_slotTable[(hash + n) & (SlotTableSize - 1)];
+			LONG previous = InterlockedCompareExchange(&entry, slot + 1, 0);
+			if (previous == 0 || previous == slot + 1)
+				return;
+		}
+	}
+
+	// Returns the slot of a name, claiming a free slot if necessary, or
+	// -1 if the directory is full.
+	static int ClaimSlot(LPCWSTR name)
+	{
+		DWORD wait = WaitForSingleObject(s_hDirectoryLock, INFINITE);
+		if (wait != WAIT_OBJECT_0 && wait != WAIT_ABANDONED)
+			return -1;
+
+		int i = FindSlot(name);
+		if (i < 0)
+		{
+			for (i = 0; i < MaxSharedDatasets && s_directory->slots[i].isUsed != 0; i++)
+			{
+			}
+			if (i < MaxSharedDatasets)
+			{
+				SharedDataSlot &slot = s_directory->slots[i];
+				wcsncpy(slot.name, name, MaxSharedDatasetName);
+				slot.name[MaxSharedDatasetName] = L'\0';
+				MemoryBarrier();
+				InterlockedExchange(&slot.isUsed, 1);
+			}
+			else
+			{
+				i = -1;
+			}
+		}
+
+		ReleaseMutex(s_hDirectoryLock);
+		return i;
+	}
+
+	static unsigned long long ReadVersion(int slot)
+	{
+#if defined(_WIN64)
+		// An aligned 64-bit read is atomic, and volatile gives it acquire
+		// semantics; it does not take the cache line as a locked
+		// instruction would.
+		return (unsigned long long)s_directory->slots[slot].version;
+#else
+		return (unsigned long long)InterlockedCompareExchange64(
+			&s_directory->slots[slot].version, 0, 0);
+#endif
+	}
+
+	static void FormatSegmentName(wchar_t (&name)[96], int slot, unsigned long long version)
+	{
+		swprintf_s(name, XLL_SHARED_DATA_PREFIX L".%d.%llu", slot, version);
+	}
+
+	// Maps a version of a dataset read-only. Returns false if the version
+	// no longer exists or is not valid.
+	static bool MapSegment(int slot, unsigned long long version, SharedDataBlock &block)
+	{
+		wchar_t segmentName[96];
+		FormatSegmentName(segmentName, slot, version);
+
+		HANDLE hMapping = OpenFileMappingW(FILE_MAP_READ, FALSE, segmentName);
+		if (hMapping == NULL)
+			return false;
+		void *view = MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+		DWORD error = GetLastError();
+		CloseHandle(hMapping);
+		if (view == NULL)
+		{
+			XLL_LOG_WARNING("Cannot map shared dataset %ls (error %lu)",
+				s_directory->slots[slot].name, error);
+			return false;
+		}
+
+		std::shared_ptr<const void> segment(view, [](const void *p) { UnmapViewOfFile(p); });
+
+		MEMORY_BASIC_INFORMATION mbi;
+		if (VirtualQuery(view, &mbi, sizeof(mbi)) != sizeof(mbi) ||
+			mbi.RegionSize < sizeof(SharedDataHeader))
+		{
+			return false;
+		}
+
+		const SharedDataHeader *header = static_cast<const SharedDataHeader *>(view);
+		if (memcmp(header->magic, "XLSD", 4) != 0 || header->version != version ||
+			header->elementSize == 0 ||
+			header->count > (mbi.RegionSize - sizeof(SharedDataHeader)) / header->elementSize)
+		{
+			XLL_LOG_WARNING("Shared dataset %ls is not valid", s_directory->slots[slot].name);
+			return false;
+		}
+
+		block.segment = std::move(segment);
+		block.data = header + 1;
+		block.elementSize = header->elementSize;
+		block.count = (size_t)header->count;
+		block.version = version;
+		return true;
+	}
+
+	// Closes the version this process published if it has been replaced,
+	// so that it is freed once the other processes stop using it.
+	static void ReleasePublished(LocalDataset &local, unsigned long long currentVersion)
+	{
+		if (local.hPublished != NULL && local.publishedVersion != currentVersion)
+		{
+			CloseHandle(local.hPublished);
+			local.hPublished = NULL;
+			local.publishedVersion = 0;
+		}
+	}
+
+	HRESULT GetSharedData(LPCWSTR name, SharedDataBlock &block)
+	{
+		if (name == nullptr)
+			return E_INVALIDARG;
+
+		if (s_directory == nullptr)
+		{
+			std::lock_guard<std::mutex> lock(s_sharedDataLock);
+			HRESULT hr = OpenDirectory();
+			if (FAILED(hr))
+				return hr;
+		}
+
+		unsigned int hash = HashName(name);
+		int slot = FindCachedSlot(name, hash);
+		if (slot < 0)
+		{
+			slot = FindSlot(name);
+			if (slot < 0)
+				return S_FALSE;
+			CacheSlot(hash, slot);
+		}
+
+		LocalDataset &local = s_datasets[slot];
+		unsigned long long version = ReadVersion(slot);
+		if (version == 0)
+			return S_FALSE;
+		std::shared_ptr<const SharedDataBlock> current = std::atomic_load(&local.mapped);
+		if (current != nullptr && current->version == version)
+		{
+			block = *current;
+			return S_OK;
+		}
+
+		// A version may be freed between reading its number and opening
+		// it, if the publisher has just replaced it; read the number again.
+		std::lock_guard<std::mutex> lock(s_sharedDataLock);
+		for (int attempt = 0; attempt < 3; attempt++)
+		{
+			version = ReadVersion(slot);
+			if (version == 0)
+				return S_FALSE;
+
+			current = std::atomic_load(&local.mapped);
+			if (current != nullptr && current->version == version)
+			{
+				block = *current;
+				return S_OK;
+			}
+
+			std::shared_ptr<SharedDataBlock> mapped = std::make_shared<SharedDataBlock>();
+			if (MapSegment(slot, version, *mapped))
+			{
+				// Releasing the old view lets the old version be freed.
+				std::atomic_store(&local.mapped, std::shared_ptr<const SharedDataBlock>(mapped));
+				ReleasePublished(local, version);
+				block = *mapped;
+				return S_OK;
+			}
+
+			if (ReadVersion(slot) == version)
+				break;
+		}
+
+		// The current version is gone: every process that had it has
+		// exited or closed it.
+		std::atomic_store(&local.mapped, std::shared_ptr<const SharedDataBlock>());
+		return S_FALSE;
+	}
+
+	SharedDataWriter::SharedDataWriter()
+		: m_slot(-1), m_version(0), m_hMapping(NULL), m_view(nullptr), m_size(0)
+	{
+	}
+
+	SharedDataWriter::~SharedDataWriter()
+	{
+		Discard();
+	}
+
+	void SharedDataWriter::Discard()
+	{
+		if (m_view != nullptr)
+			UnmapViewOfFile(m_view);
+		if (m_hMapping != NULL)
+			CloseHandle(m_hMapping);
+		m_slot = -1;
+		m_version = 0;
+		m_hMapping = NULL;
+		m_view = nullptr;
+		m_size = 0;
+	}
+
+	void *SharedDataWriter::data() const
+	{
+		return (m_view != nullptr) ? static_cast<SharedDataHeader *>(m_view) + 1 : nullptr;
+	}
+
+	HRESULT SharedDataWriter::Create(LPCWSTR name, size_t elementSize, size_t count)
+	{
+		Discard();
+
+		if (name == nullptr || name[0] == L'\0' || wcslen(name) > MaxSharedDatasetName)
+			return E_INVALIDARG;
+		if (elementSize == 0 || elementSize > UINT_MAX ||
+			count > (SIZE_MAX - sizeof(SharedDataHeader)) / elementSize)
+		{
+			return E_INVALIDARG;
+		}
+
+		int slot;
+		unsigned long long version;
+		{
+			std::lock_guard<std::mutex> lock(s_sharedDataLock);
+			HRESULT hr = OpenDirectory();
+			if (FAILED(hr))
+				return hr;
+			slot = ClaimSlot(name);
+			if (slot < 0)
+				return E_OUTOFMEMORY;
+			version = (unsigned long long)InterlockedIncrement64(&s_directory->lastVersion);
+		}
+
+		wchar_t segmentName[96];
+		FormatSegmentName(segmentName, slot, version);
+
+		unsigned long long totalSize = sizeof(SharedDataHeader) + (unsigned long long)elementSize * count;
+		HANDLE hMapping = CreateFileMappingW(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+			(DWORD)(totalSize >> 32), (DWORD)totalSize, segmentName);
+		if (hMapping == NULL)
+			return HRESULT_FROM_WIN32(GetLastError());
+		if (GetLastError() == ERROR_ALREADY_EXISTS)
+		{
+			CloseHandle(hMapping);
+			return HRESULT_FROM_WIN32(ERROR_ALREADY_EXISTS);
+		}
+
+		void *view = MapViewOfFile(hMapping, FILE_MAP_WRITE, 0, 0, 0);
+		if (view == NULL)
+		{
+			HRESULT hr = HRESULT_FROM_WIN32(GetLastError());
+			CloseHandle(hMapping);
+			return hr;
+		}
+
+		SharedDataHeader *header = static_cast<SharedDataHeader *>(view);
+		memcpy(header->magic, "XLSD", 4);
+		header->elementSize = (unsigned int)elementSize;
+		header->count = count;
+		header->version = version;
+
+		m_slot = slot;
+		m_version = version;
+		m_hMapping = hMapping;
+		m_view = view;
+		m_size = elementSize * count;
+		return S_OK;
+	}
+
+	HRESULT SharedDataWriter::Commit(unsigned long long *version)
+	{
+		if (m_view == nullptr)
+			return E_UNEXPECTED;
+
+		// Readers map the data read-only from now on.
+		UnmapViewOfFile(m_view);
+		m_view = nullptr;
+
+		std::lock_guard<std::mutex> lock(s_sharedDataLock);
+		SharedDataSlot &slot = s_directory->slots[m_slot];
+		LONGLONG current = InterlockedCompareExchange64(&slot.version, 0, 0);
+		for (;;)
+		{
+			if ((unsigned long long)current > m_version)
+			{
+				Discard();
+				return S_FALSE;
+			}
+			LONGLONG previous = InterlockedCompareExchange64(&slot.version,
+				(LONGLONG)m_version, current);
+			if (previous == current)
+				break;
+			current = previous;
+		}
+
+		LocalDataset &local = s_datasets[m_slot];
+		ReleasePublished(local, m_version);
+		local.hPublished = m_hMapping;
+		local.publishedVersion = m_version;
+
+		if (version != nullptr)
+			*version = m_version;
+		m_hMapping = NULL;
+		Discard();
+		return S_OK;
+	}
+
+	HRESULT PublishSharedData(LPCWSTR name, const void *data, size_t elementSize,
+		size_t count, unsigned long long *version)
+	{
+		if (data == nullptr && count != 0)
+			return E_INVALIDARG;
+
+		SharedDataWriter writer;
+		HRESULT hr = writer.Create(name, elementSize, count);
+		if (FAILED(hr))
+			return hr;
+		if (writer.size() != 0)
+			memcpy(writer.data(), data, writer.size());
+		return writer.Commit(version);
+	}
+
+	void CloseSharedData()
+	{
+		std::lock_guard<std::mutex> lock(s_sharedDataLock);
+		for (int i = 0; i < MaxSharedDatasets; i++)
+		{
+			LocalDataset &local = s_datasets[i];
+			std::atomic_store(&local.mapped, std::shared_ptr<const SharedDataBlock>());
+			if (local.hPublished != NULL)
+				CloseHandle(local.hPublished);
+			local.hPublished = NULL;
+			local.publishedVersion = 0;
+		}
+
+		if (s_directory != nullptr)
+		{
+			UnmapViewOfFile(s_directory);
+			CloseHandle(s_hDirectoryMapping);
+			CloseHandle(s_hDirectoryLock);
+			s_directory = nullptr;
+			s_hDirectoryMapping = NULL;
+			s_hDirectoryLock = NULL;
+		}
+		for (int i = 0; i < SlotTableSize; i++)
+			s_slotTable[i] = 0;
+	}
+}
@@ -0,0 +1,209 @@
+////////////////////////////////////////////////////////////////////////////
+// SharedData.h -- read-only datasets shared by all Excel processes
+//
+// When several Excel processes on one machine load the same add-in, each
+// of them would otherwise keep its own copy of large reference data such
+// as market data. A shared dataset is instead published once, by any of
+// the processes, into a named block of shared memory, and every process
+// maps the same physical pages read-only:
+//
+//   // In the process that loads the data:
+//   std::vector<double> quotes = LoadQuotes();
+//   xll::PublishSharedArray(L"MyAddin.Quotes", quotes.data(), quotes.size());
+//
+//   // In a UDF of any process; the argument is the dataset name:
+//   double Quote(xll::SharedArray<double> quotes, int i)
+//   {
+//       return quotes[i];
+//   }
+//
+// A SharedArray<T> points directly into the shared memory; the data is
+// neither copied nor converted. T must be plain data, and the element
+// size must match the one the dataset was published with.
+//
+// Datasets are immutable. Publishing a dataset again under the same name
+// creates a new version in a new block of memory and then switches the
+// name to it atomically. A SharedArray obtained earlier keeps the version
+// it refers to, so a UDF never sees a dataset change under it; the next
+// lookup in each process returns the new version. A version is freed by
+// the operating system when the last process has stopped using it: the
+// publisher releases it when it publishes a newer version, and each
+// process when it first looks up the name after the switch.
+//
+// The memory is backed by the paging file and belongs to the Windows
+// session, so only the processes of the same user share it. A dataset
+// exists while at least one process has it mapped; if the publisher
+// exits before any other process has looked the dataset up, it is lost
+// and must be published again. At most MaxSharedDatasets names can be
+// published. A 32-bit Excel may not be able to map a large dataset.
+//
+
+#pragma once
+
+#include "xlldef.h"
+#include "Marshal.h"
+#include "ResultCache.h"
+#include <memory>
+#include <stdexcept>
+#include <type_traits>
+
+namespace XLL_NAMESPACE
+{
+	// Maximum number of dataset names, and maximum length of a name.
+	static const int MaxSharedDatasets = 256;
+	static const int MaxSharedDatasetName = 63;
+
+	//
+	// SharedDataBlock
+	//
+	// One version of a dataset mapped into this process. The view is
+	// unmapped when the last copy of segment is released.
+	//
+
+	struct SharedDataBlock
+	{
+		std::shared_ptr<const void> segment;
+		const void *data;
+		size_t elementSize;
+		size_t count;
+		unsigned long long version;
+	};
+
+	// Looks up the current version of a dataset. Returns S_FALSE if no
+	// dataset has been published under the name, or if it has been lost.
+	HRESULT GetSharedData(LPCWSTR name, SharedDataBlock &block);
+
+	//
+	// SharedDataWriter
+	//
+	// Publishes a new version of a dataset without an intermediate copy:
+	// Create() allocates the shared memory, the caller fills data(), and
+	// Commit() makes it the current version. A writer destroyed without
+	// Commit() discards the data.
+	//
+
+	class SharedDataWriter
+	{
+		int m_slot;
+		unsigned long long m_version;
+		HANDLE m_hMapping;
+		void *m_view;
+		size_t m_size;
+
+	public:
+		SharedDataWriter();
+		~SharedDataWriter();
+
+		SharedDataWriter(const SharedDataWriter &) = delete;
+		SharedDataWriter& operator=(const SharedDataWriter &) = delete;
+
+		HRESULT Create(LPCWSTR name, size_t elementSize, size_t count);
+
+		void *data() const;
+
+		size_t size() const { return m_size; }
+
+		// Switches the dataset to this version. Returns S_FALSE if another
+		// process has meanwhile published a newer version, which is kept.
+		HRESULT Commit(unsigned long long *version = nullptr);
+
+		void Discard();
+	};
+
+	// Publishes count elements at data as the new version of a dataset.
+	HRESULT PublishSharedData(LPCWSTR name, const void *data, size_t elementSize,
+		size_t count, unsigned long long *version = nullptr);
+
+	// Releases the datasets published or mapped by this process. Arrays
+	// that are still referenced stay valid until they are released.
+	void CloseSharedData();
+
+	//
+	// SharedArray<T>
+	//
+	// Read-only view of a shared dataset whose elements are of type T.
+	// Copies share the same mapping.
+	//
+
+	template <typename T>
+	class SharedArray
+	{
+		static_assert(std::is_pod<T>::value, "Element type must be plain data.");
+
+		std::shared_ptr<const void> m_segment;
+		const T *m_data;
+		size_t m_size;
+		unsigned long long m_version;
+
+	public:
+		SharedArray()
+			: m_data(nullptr), m_size(0), m_version(0)
+		{
+		}
+
+		explicit SharedArray(const SharedDataBlock &block)
+			: m_segment(block.segment), m_data(static_cast<const T*>(block.data)),
+			m_size(block.count), m_version(block.version)
+		{
+		}
+
+		const T* data() const { return m_data; }
+
+		size_t size() const { return m_size; }
+
+		bool empty() const { return m_size == 0; }
+
+		const T* begin() const { return m_data; }
+
+		const T* end() const { return m_data + m_size; }
+
+		const T& operator[](size_t i) const { return m_data[i]; }
+
+		unsigned long long version() const { return m_version; }
+
+		explicit operator bool() const { return m_segment != nullptr; }
+	};
+
+	// Returns the current version of a dataset of elements of type T.
+	// Throws std::invalid_argument if the dataset does not exist or its
+	// element size is not sizeof(T).
+	template <typename T>
+	SharedArray<T> GetSharedArray(LPCWSTR name)
+	{
+		SharedDataBlock block;
+		if (GetSharedData(name, block) != S_OK)
+			throw std::invalid_argument("Shared dataset does not exist.");
+		if (block.elementSize != sizeof(T))
+			throw std::invalid_argument("Shared dataset has a different element type.");
+		return SharedArray<T>(block);
+	}
+
+	template <typename T>
+	HRESULT PublishSharedArray(LPCWSTR name, const T *data, size_t count,
+		unsigned long long *version = nullptr)
+	{
+		static_assert(std::is_pod<T>::value, "Element type must be plain data.");
+		return PublishSharedData(name, data, sizeof(T), count, version);
+	}
+
+	// A UDF argument of type SharedArray<T> is passed from Excel as the
+	// name of the dataset.
+	template <typename T>
+	struct ArgumentMarshaler < SharedArray<T> >
+	{
+		typedef SharedArray<T> UserType;
+		typedef LPCWSTR WireType;
+
+		static inline SharedArray<T> Marshal(LPCWSTR name)
+		{
+			return GetSharedArray<T>(name);
+		}
+	};
+
+	template <typename T>
+	struct ArgumentMarshaler < const SharedArray<T> & > : ArgumentMarshaler < SharedArray<T> > {};
+
+	// The result depends on the data, not on the name of the dataset.
+	template <typename T> struct IsCacheableArgument < SharedArray<T> > : std::false_type {};
+	template <typename T> struct IsCacheableArgument < const SharedArray<T> & > : std::false_type {};
+}
@@ -0,0 +1,180 @@
+////////////////////////////////////////////////////////////////////////////
+// ThreadBuffer.h -- per-thread buffers of the profiler, tracer and logger
+//
+// Code running on a recalc thread records statistics, trace events and
+// log records into memory that only that thread writes to, so that it
+// never waits for another thread. ThreadBufferList<T> gives each thread
+// its own T, created on first use and never freed; a background thread
+// or a report walks the list to read them. RingBuffer<T, Size> is a
+// single-producer single-consumer queue of records that a background
+// thread drains.
+//
+
+#pragma once
+
+#include "xlldef.h"
+#include <Windows.h>
+#include <atomic>
+#include <new>
+
+namespace XLL_NAMESPACE
+{
+	//
+	// ThreadBufferNode<T>
+	//
+	// Base of the per-thread object T, which links it into the list.
+	//
+
+	template <typename T>
+	struct ThreadBufferNode
+	{
+		T *next;
+		DWORD threadId;
+	};
+
+	//
+	// ThreadBufferList<T>
+	//
+	// Lock-free list of the per-thread objects of type T. T must derive
+	// from ThreadBufferNode<T>. It is value-initialized, so that plain
+	// counters start at zero.
+	//
+
+	template <typename T>
+	class ThreadBufferList
+	{
+		static std::atomic<T*> s_first;
+#if XLL_SUPPORT_THREAD_LOCAL
+		static __declspec(thread) T *t_current;
+#else
+		static DWORD s_tlsIndex;
+#endif
+
+	public:
+		// Returns the object of the calling thread, or nullptr if it
+		// cannot be allocated.
+		static T* Get() XLL_NOEXCEPT
+		{
+#if XLL_SUPPORT_THREAD_LOCAL
+			T *p = t_current;
+#else
+			T *p = (T*)TlsGetValue(s_tlsIndex);
+#endif
+			if (p == nullptr)
+			{
+				p = new (std::nothrow) T();
+				if (p == nullptr)
+					return nullptr;
+				p->threadId = GetCurrentThreadId();
+
+				T *head = s_first.load();
+				do
+				{
+					p->next = head;
+				} while (!s_first.compare_exchange_weak(head, p));
+
+#if XLL_SUPPORT_THREAD_LOCAL
+				t_current = p;
+#else
+				TlsSetValue(s_tlsIndex, p);
+#endif
+			}
+			return p;
+		}
+
+		// Returns the most recently created object; the others follow
+		// through next.
+		static T* First() XLL_NOEXCEPT
+		{
+			return s_first.load();
+		}
+	};
+
+	template <typename T>
+	std::atomic<T*> ThreadBufferList<T>::s_first(nullptr);
+
+#if XLL_SUPPORT_THREAD_LOCAL
+	template <typename T>
+	__declspec(thread) T *ThreadBufferList<T>::t_current;
+#else
+	template <typename T>
+	DWORD ThreadBufferList<T>::s_tlsIndex = TlsAlloc();
+#endif
+
+	//
+	// RingBuffer<T, Size>
+	//
+	// The owning thread is the only writer of head and of the records;
+	// the thread that drains the buffer is the only writer of tail. If
+	// the buffer is full, the record is dropped and counted.
+	//
+
+	template <typename T, unsigned int Size>
+	class RingBuffer
+	{
+		static_assert((Size & (Size - 1)) == 0, "Size must be a power of two.");
+
+		std::atomic<unsigned int> m_head;
+		std::atomic<unsigned int> m_tail;
+		std::atomic<unsigned long long> m_dropped;
+		T m_records[Size];
+
+	public:
+		// Returns a slot to write the next record to, or nullptr if the
+		// buffer is full. The record becomes visible to the draining
+		// thread when Publish() is called. Owning thread only.
+		T* Reserve() XLL_NOEXCEPT
+		{
+			unsigned int head = m_head.load(std::memory_order_relaxed);
+			unsigned int tail = m_tail.load(std::memory_order_acquire);
+			if (head - tail >= Size)
+			{
+				m_dropped.store(m_dropped.load(std::memory_order_relaxed) + 1,
+					std::memory_order_relaxed);
+				return nullptr;
+			}
+			return &m_records[head & (Size - 1)];
+		}
+
+		// Publishes the record returned by the last Reserve().
+		void Publish() XLL_NOEXCEPT
+		{
+			m_head.store(m_head.load(std::memory_order_relaxed) + 1,
+				std::memory_order_release);
+		}
+
+		// Returns true if no published record is waiting. Draining
+		// thread only.
+		bool empty() const XLL_NOEXCEPT
+		{
+			return m_head.load(std::memory_order_acquire) ==
+				m_tail.load(std::memory_order_relaxed);
+		}
+
+		// Calls f(record) for each published record in order, then
+		// releases their slots. Draining thread only.
+		template <typename Func>
+		void Drain(Func f)
+		{
+			unsigned int head = m_head.load(std::memory_order_acquire);
+			unsigned int tail = m_tail.load(std::memory_order_relaxed);
+			for (; tail != head; ++tail)
+			{
+				f(m_records[tail & (Size - 1)]);
+			}
+			m_tail.store(tail, std::memory_order_release);
+		}
+
+		// Releases the published records without reading them.
+		void Discard() XLL_NOEXCEPT
+		{
+			m_tail.store(m_head.load(std::memory_order_acquire),
+				std::memory_order_release);
+		}
+
+		unsigned long long dropped() const XLL_NOEXCEPT
+		{
+			return m_dropped.load(std::memory_order_relaxed);
+		}
+	};
+}
@@ -0,0 +1,55 @@
+////////////////////////////////////////////////////////////////////////////
+// Timestamp.cpp -- calibrate the time-stamp counter
+
+#include "Timestamp.h"
+#include <Windows.h>
+
+namespace XLL_NAMESPACE
+{
+	struct TimestampReference
+	{
+		LARGE_INTEGER counter;
+		unsigned long long timestamp;
+
+		TimestampReference()
+		{
+			QueryPerformanceCounter(&counter);
+			timestamp = ReadTimestamp();
+		}
+	};
+
+	// Taken at static initialization time.
+	static const TimestampReference s_origin;
+
+	double GetTimestampFrequency()
+	{
+		// Measure over at least 10 milliseconds, then keep the result.
+		// The frequency is computed on the reporting path only, so the
+		// occasional Sleep() does not affect instrumented calls.
+		static volatile double s_frequency = 0.0;
+		if (s_frequency != 0.0)
+			return s_frequency;
+
+		LARGE_INTEGER counterFrequency;
+		QueryPerformanceFrequency(&counterFrequency);
+
+		TimestampReference now;
+		LONGLONG elapsed = now.counter.QuadPart - s_origin.counter.QuadPart;
+		if (elapsed < counterFrequency.QuadPart / 100)
+		{
+			Sleep(10);
+			now = TimestampReference();
+			elapsed = now.counter.QuadPart - s_origin.counter.QuadPart;
+		}
+
+		double frequency = (double)(now.timestamp - s_origin.timestamp) *
+			counterFrequency.QuadPart / elapsed;
+		s_frequency = frequency;
+		return frequency;
+	}
+
+	unsigned long long GetTimestampOrigin()
+	{
+		return s_origin.timestamp;
+	}
+}
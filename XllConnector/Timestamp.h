@@ -0,0 +1,45 @@
+////////////////////////////////////////////////////////////////////////////
+// Timestamp.h -- cheap high-resolution timestamps for instrumentation
+
+#pragma once
+
+#include "xlldef.h"
+#include <intrin.h>
+
+//
+// ReadTimestamp
+//
+// Returns the value of the processor's time-stamp counter (TSC).
+//
+// Reading the TSC takes a few nanoseconds, which is several times
+// cheaper than QueryPerformanceCounter(). All processors that run
+// Excel 2007 or later have an invariant TSC, which ticks at a
+// constant rate on every core. Timestamps are therefore comparable
+// across threads.
+//
+// The tick rate is not known in advance. It is measured against
+// QueryPerformanceCounter() from the time this library is loaded
+// until GetTimestampFrequency() is called; the longer the interval,
+// the more accurate the result. Use TimestampToNanoseconds() to
+// convert a difference of two timestamps to nanoseconds.
+//
+
+namespace XLL_NAMESPACE
+{
+	inline unsigned long long ReadTimestamp()
+	{
+		return __rdtsc();
+	}
+
+	// Returns the number of timestamp ticks per second.
+	double GetTimestampFrequency();
+
+	// Converts a number of timestamp ticks to nanoseconds.
+	inline double TimestampToNanoseconds(unsigned long long ticks)
+	{
+		return ticks * (1e9 / GetTimestampFrequency());
+	}
+
+	// Returns the timestamp taken when this library was loaded.
+	unsigned long long GetTimestampOrigin();
+}
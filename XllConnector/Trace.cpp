@@ -0,0 +1,317 @@
+////////////////////////////////////////////////////////////////////////////
+// Trace.cpp -- scoped tracing of code running inside UDFs
+
+#include "Trace.h"
+#include "ThreadBuffer.h"
+#include <Windows.h>
+#include <stdio.h>
+#include <string>
+
+namespace XLL_NAMESPACE
+{
+	std::atomic<bool> g_isTracingEnabled(false);
+
+	static_assert((XLL_TRACE_BUFFER_SIZE & (XLL_TRACE_BUFFER_SIZE - 1)) == 0,
+		"XLL_TRACE_BUFFER_SIZE must be a power of two.");
+
+	////////////////////////////////////////////////////////////////////////
+	// Per-thread ring buffers
+	//
+	// Each thread that records an event owns a TraceBuffer (see
+	// ThreadBuffer.h), which the flush thread drains.
+	//
+
+	struct TraceEvent
+	{
+		const void *name;
+		unsigned long long timestamp;
+		union
+		{
+			unsigned long long duration; // TraceEventSpan
+			double value;                // TraceEventCounter
+		};
+		unsigned short type;
+		unsigned short isWideName;
+		unsigned int depth;
+	};
+
+	struct TraceBuffer : ThreadBufferNode<TraceBuffer>
+	{
+		unsigned int depth;
+		bool isNamed;
+		RingBuffer<TraceEvent, XLL_TRACE_BUFFER_SIZE> events;
+	};
+
+	typedef ThreadBufferList<TraceBuffer> TraceBuffers;
+
+	////////////////////////////////////////////////////////////////////////
+	// Recording
+
+	void TraceScope::BeginImpl(const void *name, bool isWideName) XLL_NOEXCEPT
+	{
+		TraceBuffer *buffer = TraceBuffers::Get();
+		if (buffer == nullptr || name == nullptr)
+			return;
+
+		++buffer->depth;
+		m_name = name;
+		m_isWideName = isWideName;
+		m_start = ReadTimestamp();
+	}
+
+	void TraceScope::EndImpl() XLL_NOEXCEPT
+	{
+		unsigned long long end = ReadTimestamp();
+		TraceBuffer *buffer = TraceBuffers::Get();
+		if (buffer == nullptr)
+			return;
+
+		unsigned int depth = buffer->depth--;
+		TraceEvent *e = buffer->events.Reserve();
+		if (e != nullptr)
+		{
+			e->name = m_name;
+			e->timestamp = m_start;
+			e->duration = end - m_start;
+			e->type = TraceEventSpan;
+			e->isWideName = m_isWideName;
+			e->depth = depth;
+			buffer->events.Publish();
+		}
+		m_name = nullptr;
+	}
+
+	static void RecordInstant(TraceEventType type, const char *name, double value) XLL_NOEXCEPT
+	{
+		if (!IsTracingEnabled() || name == nullptr)
+			return;
+
+		TraceBuffer *buffer = TraceBuffers::Get();
+		if (buffer == nullptr)
+			return;
+
+		TraceEvent *e = buffer->events.Reserve();
+		if (e != nullptr)
+		{
+			e->name = name;
+			e->timestamp = ReadTimestamp();
+			e->value = value;
+			e->type = (unsigned short)type;
+			e->isWideName = 0;
+			e->depth = buffer->depth;
+			buffer->events.Publish();
+		}
+	}
+
+	void TraceCounter(const char *name, double value) XLL_NOEXCEPT
+	{
+		RecordInstant(TraceEventCounter, name, value);
+	}
+
+	void TraceMarker(const char *name) XLL_NOEXCEPT
+	{
+		RecordInstant(TraceEventMarker, name, 0.0);
+	}
+
+	unsigned long long GetDroppedTraceEventCount()
+	{
+		unsigned long long n = 0;
+		for (TraceBuffer *p = TraceBuffers::First(); p != nullptr; p = p->next)
+			n += p->events.dropped();
+		return n;
+	}
+
+	////////////////////////////////////////////////////////////////////////
+	// Writing Chrome trace-event JSON
+	//
+	// The file is a JSON array of events. Spans are written as complete
+	// ("X") events when they end, so that a dropped event never leaves
+	// an unmatched begin or end behind.
+	//
+
+	static FILE *s_traceFile = nullptr;
+	static bool s_isFirstTraceEvent = true;
+	static DWORD s_mainThreadId = 0;
+	static HANDLE s_hFlushThread = NULL;
+	static HANDLE s_hFlushStopEvent = NULL;
+
+	static void WriteJsonString(FILE *fp, const void *name, bool isWideName)
+	{
+		std::string s;
+		if (isWideName)
+		{
+			const wchar_t *w = (const wchar_t*)name;
+			int n = WideCharToMultiByte(CP_UTF8, 0, w, -1, nullptr, 0, nullptr, nullptr);
+			if (n > 1)
+			{
+				s.resize(n);
+				WideCharToMultiByte(CP_UTF8, 0, w, -1, &s[0], n, nullptr, nullptr);
+				s.resize(n - 1);
+			}
+		}
+		else
+		{
+			s = (const char*)name;
+		}
+
+		fputc('"', fp);
+		for (char c : s)
+		{
+			if (c == '"' || c == '\\')
+				fprintf(fp, "\\%c", c);
+			else if ((unsigned char)c < 0x20)
+				fprintf(fp, "\\u%04x", (unsigned char)c);
+			else
+				fputc(c, fp);
+		}
+		fputc('"', fp);
+	}
+
+	static void BeginJsonEvent(FILE *fp)
+	{
+		fputs(s_isFirstTraceEvent ? "\n" : ",\n", fp);
+		s_isFirstTraceEvent = false;
+	}
+
+	static double TimestampToMicroseconds(unsigned long long timestamp)
+	{
+		return TimestampToNanoseconds(timestamp - GetTimestampOrigin()) / 1000.0;
+	}
+
+	static void WriteTraceEvent(FILE *fp, DWORD pid, DWORD tid, const TraceEvent &e)
+	{
+		BeginJsonEvent(fp);
+		fputs("{\"name\":", fp);
+		WriteJsonString(fp, e.name, e.isWideName != 0);
+		switch (e.type)
+		{
+		case TraceEventSpan:
+			fprintf(fp, ",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%lu,\"tid\":%lu,"
+				"\"args\":{\"depth\":%u}}",
+				TimestampToMicroseconds(e.timestamp),
+				TimestampToNanoseconds(e.duration) / 1000.0, pid, tid, e.depth);
+			break;
+		case TraceEventCounter:
+			fprintf(fp, ",\"ph\":\"C\",\"ts\":%.3f,\"pid\":%lu,\"tid\":%lu,"
+				"\"args\":{\"value\":%.17g}}",
+				TimestampToMicroseconds(e.timestamp), pid, tid, e.value);
+			break;
+		default:
+			fprintf(fp, ",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":%lu,\"tid\":%lu}",
+				TimestampToMicroseconds(e.timestamp), pid, tid);
+			break;
+		}
+	}
+
+	// Writes all published events to the trace file. Called only by
+	// the flush thread, or by StopTracing() after the flush thread
+	// has exited.
+	static void FlushTraceBuffers()
+	{
+		FILE *fp = s_traceFile;
+		DWORD pid = GetCurrentProcessId();
+		for (TraceBuffer *p = TraceBuffers::First(); p != nullptr; p = p->next)
+		{
+			if (p->events.empty())
+				continue;
+
+			if (!p->isNamed)
+			{
+				BeginJsonEvent(fp);
+				fprintf(fp, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%lu,\"tid\":%lu,"
+					"\"args\":{\"name\":\"%s %lu\"}}", pid, p->threadId,
+					(p->threadId == s_mainThreadId) ? "Main thread" : "Recalc thread",
+					p->threadId);
+				p->isNamed = true;
+			}
+
+			DWORD threadId = p->threadId;
+			p->events.Drain([fp, pid, threadId](const TraceEvent &e)
+			{
+				WriteTraceEvent(fp, pid, threadId, e);
+			});
+		}
+		fflush(fp);
+	}
+
+	static DWORD WINAPI TraceFlushThreadProc(LPVOID)
+	{
+		while (WaitForSingleObject(s_hFlushStopEvent, 200) == WAIT_TIMEOUT)
+		{
+			FlushTraceBuffers();
+		}
+		return 0;
+	}
+
+	BOOL StartTracing(LPCWSTR fileName)
+	{
+		if (s_traceFile != nullptr)
+			return FALSE;
+
+		FILE *fp = nullptr;
+		if (_wfopen_s(&fp, fileName, L"wb") != 0 || fp == nullptr)
+			return FALSE;
+
+		s_hFlushStopEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+		if (s_hFlushStopEvent == NULL)
+		{
+			fclose(fp);
+			return FALSE;
+		}
+
+		// Discard events left over from a previous trace.
+		for (TraceBuffer *p = TraceBuffers::First(); p != nullptr; p = p->next)
+		{
+			p->events.Discard();
+			p->isNamed = false;
+		}
+
+		fputs("[", fp);
+		s_traceFile = fp;
+		s_isFirstTraceEvent = true;
+		s_mainThreadId = GetCurrentThreadId();
+
+		s_hFlushThread = CreateThread(NULL, 0, TraceFlushThreadProc, NULL, 0, NULL);
+		if (s_hFlushThread == NULL)
+		{
+			CloseHandle(s_hFlushStopEvent);
+			s_hFlushStopEvent = NULL;
+			fclose(fp);
+			s_traceFile = nullptr;
+			return FALSE;
+		}
+
+		g_isTracingEnabled.store(true);
+		return TRUE;
+	}
+
+	void StopTracing()
+	{
+		if (s_traceFile == nullptr)
+			return;
+
+		g_isTracingEnabled.store(false);
+
+		SetEvent(s_hFlushStopEvent);
+		WaitForSingleObject(s_hFlushThread, INFINITE);
+		CloseHandle(s_hFlushThread);
+		CloseHandle(s_hFlushStopEvent);
+		s_hFlushThread = NULL;
+		s_hFlushStopEvent = NULL;
+
+		FlushTraceBuffers();
+		fputs("\n]\n", s_traceFile);
+		fclose(s_traceFile);
+		s_traceFile = nullptr;
+	}
+
+	void StartTracingFromEnvironment()
+	{
+		WCHAR fileName[MAX_PATH];
+		DWORD n = GetEnvironmentVariableW(L"XLL_TRACE_FILE", fileName, ARRAYSIZE(fileName));
+		if (n > 0 && n < ARRAYSIZE(fileName))
+		{
+			StartTracing(fileName);
+		}
+	}
+}
@@ -0,0 +1,145 @@
+////////////////////////////////////////////////////////////////////////////
+// Trace.h -- scoped tracing of code running inside UDFs
+//
+// Profiling (see Profile.h) tells how long a UDF takes as a whole.
+// Tracing tells where the time goes inside it. Mark the interesting
+// phases of a UDF with XLL_TRACE_SCOPE, e.g.
+//
+//   double PriceSwap(...)
+//   {
+//       { XLL_TRACE_SCOPE("LoadCurve"); ... }
+//       { XLL_TRACE_SCOPE("Price"); ... }
+//       XLL_TRACE_COUNTER("CashFlows", n);
+//   }
+//
+// Each UDF wrapper also emits a span for the whole call, so spans in
+// user code nest under the UDF that runs them.
+//
+// While tracing is not started, a traced scope costs a load and a
+// branch. When started, each event is written to a per-thread ring
+// buffer with a TSC timestamp; no lock is taken. A background thread
+// drains the buffers into a file in Chrome trace-event format, which
+// can be opened in chrome://tracing or https://ui.perfetto.dev. If a
+// buffer is full, the event is dropped and counted.
+//
+// Tracing is started in xlAutoOpen() if the environment variable
+// XLL_TRACE_FILE names the output file, or by calling StartTracing().
+//
+// Names passed to the tracing functions are stored by pointer, so
+// they must be string literals or otherwise outlive the trace.
+//
+
+#pragma once
+
+#include "xlldef.h"
+#include "Timestamp.h"
+#include <atomic>
+
+//
+// XLL_TRACE_BUFFER_SIZE
+//
+// Number of events in the ring buffer of each thread. Must be a power
+// of two. Takes effect when XLL Connector itself is compiled.
+//
+
+#ifndef XLL_TRACE_BUFFER_SIZE
+#define XLL_TRACE_BUFFER_SIZE 16384
+#endif
+
+namespace XLL_NAMESPACE
+{
+	enum TraceEventType
+	{
+		TraceEventSpan,     // a scope with a duration
+		TraceEventCounter,  // a named value at a point in time
+		TraceEventMarker,   // a named point in time
+	};
+
+	extern std::atomic<bool> g_isTracingEnabled;
+
+	inline bool IsTracingEnabled()
+	{
+		return g_isTracingEnabled.load(std::memory_order_relaxed);
+	}
+
+	// Starts writing trace events to the given file, replacing its
+	// contents. Returns FALSE if tracing is already started or if the
+	// file cannot be created.
+	BOOL StartTracing(LPCWSTR fileName);
+
+	// Stops tracing, writes all pending events and closes the file.
+	void StopTracing();
+
+	// Starts tracing if XLL_TRACE_FILE is set. Called by xlAutoOpen().
+	void StartTracingFromEnvironment();
+
+	// Returns the number of events dropped because a buffer was full.
+	unsigned long long GetDroppedTraceEventCount();
+
+	// Records a counter or marker. Does nothing if tracing is stopped.
+	void TraceCounter(const char *name, double value) XLL_NOEXCEPT;
+	void TraceMarker(const char *name) XLL_NOEXCEPT;
+
+	//
+	// TraceScope
+	//
+	// Records a span from construction (or Begin()) to destruction.
+	// The name may be narrow (UTF-8) or wide.
+	//
+
+	class TraceScope
+	{
+		const void *m_name;
+		bool m_isWideName;
+		unsigned long long m_start;
+
+		void BeginImpl(const void *name, bool isWideName) XLL_NOEXCEPT;
+		void EndImpl() XLL_NOEXCEPT;
+
+	public:
+		TraceScope() : m_name(nullptr) {}
+
+		explicit TraceScope(const char *name) : m_name(nullptr)
+		{
+			if (IsTracingEnabled())
+				BeginImpl(name, false);
+		}
+
+		TraceScope(const TraceScope &) = delete;
+		TraceScope& operator=(const TraceScope &) = delete;
+
+		// Begins a span with a wide name, e.g. the name of a UDF.
+		void Begin(const wchar_t *name)
+		{
+			if (IsTracingEnabled())
+				BeginImpl(name, true);
+		}
+
+		~TraceScope()
+		{
+			if (m_name != nullptr)
+				EndImpl();
+		}
+	};
+}
+
+#if XLL_ENABLE_TRACING
+
+#define XLL_TRACE_SCOPE(name) \
+	::XLL_NAMESPACE::TraceScope XLL_CONCAT(_xllTraceScope, __LINE__)(name)
+
+#define XLL_TRACE_COUNTER(name, value) \
+	do { if (::XLL_NAMESPACE::IsTracingEnabled()) \
+		::XLL_NAMESPACE::TraceCounter(name, (double)(value)); } while (0)
+
+#define XLL_TRACE_MARKER(name) \
+	do { if (::XLL_NAMESPACE::IsTracingEnabled()) \
+		::XLL_NAMESPACE::TraceMarker(name); } while (0)
+
+#else
+
+#define XLL_TRACE_SCOPE(name) ((void)0)
+#define XLL_TRACE_COUNTER(name, value) ((void)0)
+#define XLL_TRACE_MARKER(name) ((void)0)
+
+#endif
@@ -20,7 +20,8 @@ namespace XLL_NAMESPACE
 		static_assert((Attributes & ~(
 			XLL_VOLATILE | XLL_NOT_VOLATILE |
 			XLL_THREADSAFE | XLL_NOT_THREADSAFE |
-			XLL_HEAVY | XLL_LIGHT)) == 0,
+			XLL_HEAVY | XLL_LIGHT |
+			XLL_PROFILE | XLL_NOT_PROFILE)) == 0,
 			"Unknown attributes specified.");
 
 		static_assert(XLL_NO_MORE_THAN_ONE_BIT_SET(
@@ -35,6 +36,10 @@ namespace XLL_NAMESPACE
 			Attributes & (XLL_HEAVY | XLL_LIGHT)),
 			"Only one of XLL_HEAVY and XLL_LIGHT may be set.");
 
+		static_assert(XLL_NO_MORE_THAN_ONE_BIT_SET(
+			Attributes & (XLL_PROFILE | XLL_NOT_PROFILE)),
+			"Only one of XLL_PROFILE and XLL_NOT_PROFILE may be set.");
+
 		enum
 		{
 			volatility_value =
@@ -59,7 +64,15 @@ namespace XLL_NAMESPACE
 			(XLL_DEFAULT_HEAVY) ? XLL_HEAVY : 0
 		};
 
-		enum { value = volatility_value | threadsafe_value | heaviness_value };
+		enum
+		{
+			profile_value =
+			(Attributes & XLL_PROFILE) ? XLL_PROFILE :
+			(Attributes & XLL_NOT_PROFILE) ? 0 :
+			(XLL_DEFAULT_PROFILE) ? XLL_PROFILE : 0
+		};
+
+		enum { value = volatility_value | threadsafe_value | heaviness_value | profile_value };
 	};
 }
 
@@ -74,7 +87,7 @@ namespace XLL_NAMESPACE
 	template <int Attributes>
 	struct FunctionAttributes
 	{
-		static_assert((Attributes & ~(XLL_VOLATILE | XLL_THREADSAFE | XLL_HEAVY)) == 0,
+		static_assert((Attributes & ~(XLL_VOLATILE | XLL_THREADSAFE | XLL_HEAVY | XLL_PROFILE)) == 0,
 			"Invalid attributes specified.");
 
 		enum { IsVolatile = (Attributes & XLL_VOLATILE) ? 1 : 0 };
@@ -82,6 +95,8 @@ namespace XLL_NAMESPACE
 		enum { IsThreadSafe = (Attributes & XLL_THREADSAFE) ? 1 : 0 };
 
 		enum { IsHeavy = (Attributes & XLL_HEAVY) ? 1 : 0 };
+
+		enum { IsProfiled = (Attributes & XLL_PROFILE) ? 1 : 0 };
 	};
 }
 
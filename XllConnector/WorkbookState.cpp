@@ -0,0 +1,236 @@
+////////////////////////////////////////////////////////////////////////////
+// WorkbookState.cpp -- keep serialized add-in state inside the workbook
+
+#include "WorkbookState.h"
+#include "WorkbookStateFormat.h"
+#include "Log.h"
+#include <climits>
+#include <map>
+#include <string>
+
+namespace XLL_NAMESPACE
+{
+	//
+	// States that could not be written when they were saved, by workbook
+	// and name. An empty blob stands for a deleted name. Each is written
+	// when its workbook is active again, and dropped if the XLL is closed
+	// before.
+	//
+	// The name of the workbook of each sheet is remembered until the
+	// states are next flushed, so that finding the active workbook costs
+	// a single callback.
+	//
+
+	typedef std::pair<std::wstring, std::wstring> WorkbookStateKey;
+
+	static std::mutex s_pendingLock;
+	static std::map<WorkbookStateKey, std::vector<unsigned char>> s_pendingStates;
+	static std::map<IDSHEET, std::wstring> s_workbookNames;
+
+	HRESULT GetActiveWorkbookName(std::wstring &workbook)
+	{
+		XLOPER12 xSheet;
+		if (Excel12(xlSheetId, &xSheet, 0) != xlretSuccess)
+			return E_FAIL;
+		IDSHEET idSheet = (xSheet.xltype == xltypeRef) ? xSheet.val.mref.idSheet : 0;
+		Excel12(xlFree, 0, 1, &xSheet);
+		if (idSheet == 0)
+			return E_FAIL;
+
+		{
+			std::lock_guard<std::mutex> lock(s_pendingLock);
+			auto it = s_workbookNames.find(idSheet);
+			if (it != s_workbookNames.end())
+			{
+				workbook = it->second;
+				return S_OK;
+			}
+		}
+
+		// The name of a sheet is "[Book1.xlsx]Sheet1".
+		XLMREF12 mref = { 1, { { 0, 0, 0, 0 } } };
+		XLOPER12 xRef;
+		xRef.xltype = xltypeRef;
+		xRef.val.mref.idSheet = idSheet;
+		xRef.val.mref.lpmref = &mref;
+		XLOPER12 xName;
+		if (Excel12(xlSheetNm, &xName, 1, &xRef) != xlretSuccess)
+			return E_FAIL;
+		std::wstring sheetName;
+		if (xName.xltype == xltypeStr && xName.val.str != nullptr)
+			sheetName.assign(xName.val.str + 1, (unsigned short)xName.val.str[0]);
+		Excel12(xlFree, 0, 1, &xName);
+
+		size_t end = sheetName.find(L']');
+		if (sheetName.empty() || sheetName[0] != L'[' || end == std::wstring::npos)
+			return E_FAIL;
+		workbook = sheetName.substr(1, end - 1);
+
+		std::lock_guard<std::mutex> lock(s_pendingLock);
+		s_workbookNames[idSheet] = workbook;
+		return S_OK;
+	}
+
+	// Defines or, if blob is empty, deletes the binary name. Returns the
+	// Excel12 return code.
+	static int DefineBinaryName(LPCWSTR name, const std::vector<unsigned char> &blob)
+	{
+		ExcelVariant xName(name);
+		XLOPER12 xData;
+		if (blob.empty())
+		{
+			xData.xltype = xltypeMissing;
+		}
+		else
+		{
+			xData.xltype = xltypeBigData;
+			xData.val.bigdata.h.lpbData = const_cast<BYTE *>(blob.data());
+			xData.val.bigdata.cbData = (long)blob.size();
+		}
+		return Excel12(xlDefineBinaryName, 0, 2, &xName, &xData);
+	}
+
+	static HRESULT WriteOrQueue(LPCWSTR name, std::vector<unsigned char> &blob)
+	{
+		std::wstring workbook;
+		if (FAILED(GetActiveWorkbookName(workbook)))
+			return E_FAIL;
+
+		std::lock_guard<std::mutex> lock(s_pendingLock);
+
+		// A state queued earlier must not overwrite this one later.
+		WorkbookStateKey key(workbook, name);
+		s_pendingStates.erase(key);
+
+		int ret = DefineBinaryName(name, blob);
+		if (ret == xlretSuccess)
+			return S_OK;
+
+		XLL_LOG_DEBUG("Workbook state %ls of %ls is queued (xlDefineBinaryName returned %d)",
+			name, workbook.c_str(), ret);
+		s_pendingStates[key].swap(blob);
+		return S_FALSE;
+	}
+
+	HRESULT SaveWorkbookState(LPCWSTR name, const void *data, size_t size)
+	{
+		if (name == nullptr || (data == nullptr && size != 0))
+			return E_INVALIDARG;
+		if (size > INT_MAX - sizeof(WorkbookStateHeader))
+			return E_INVALIDARG;
+
+		std::vector<unsigned char> blob;
+		EncodeWorkbookState(data, size, blob);
+		return WriteOrQueue(name, blob);
+	}
+
+	HRESULT DeleteWorkbookState(LPCWSTR name)
+	{
+		if (name == nullptr)
+			return E_INVALIDARG;
+
+		std::vector<unsigned char> blob;
+		return WriteOrQueue(name, blob);
+	}
+
+	HRESULT LoadWorkbookState(LPCWSTR name, std::vector<unsigned char> &data)
+	{
+		if (name == nullptr)
+			return E_INVALIDARG;
+
+		std::wstring workbook;
+		if (FAILED(GetActiveWorkbookName(workbook)))
+			return E_FAIL;
+
+		std::vector<unsigned char> blob;
+		{
+			std::lock_guard<std::mutex> lock(s_pendingLock);
+			auto it = s_pendingStates.find(WorkbookStateKey(workbook, name));
+			if (it != s_pendingStates.end())
+			{
+				if (it->second.empty())
+					return S_FALSE;
+				blob = it->second;
+			}
+		}
+
+		if (blob.empty())
+		{
+			ExcelVariant xName(name);
+			XLOPER12 result;
+			int ret = Excel12(xlGetBinaryName, &result, 1, &xName);
+			if (ret == xlretFailed)
+				return S_FALSE;
+			if (ret != xlretSuccess)
+				return E_FAIL;
+			if (result.xltype != xltypeBigData)
+			{
+				Excel12(xlFree, 0, 1, &result);
+				return S_FALSE;
+			}
+
+			HANDLE hData = result.val.bigdata.h.hdata;
+			long cbData = result.val.bigdata.cbData;
+			const BYTE *p = (hData != NULL) ? (const BYTE *)GlobalLock(hData) : NULL;
+			if (p != NULL && cbData > 0)
+				blob.assign(p, p + cbData);
+			if (p != NULL)
+				GlobalUnlock(hData);
+			Excel12(xlFree, 0, 1, &result);
+
+			if (blob.empty())
+				return S_FALSE;
+		}
+
+		if (!DecodeWorkbookState(blob.data(), blob.size(), data))
+		{
+			XLL_LOG_WARNING("Workbook state %ls is not valid and is ignored", name);
+			data.clear();
+			return S_FALSE;
+		}
+		return S_OK;
+	}
+
+	void FlushWorkbookState()
+	{
+		{
+			std::lock_guard<std::mutex> lock(s_pendingLock);
+			s_workbookNames.clear();
+			if (s_pendingStates.empty())
+				return;
+		}
+
+		std::wstring workbook;
+		if (FAILED(GetActiveWorkbookName(workbook)))
+			return;
+
+		std::lock_guard<std::mutex> lock(s_pendingLock);
+		for (auto it = s_pendingStates.begin(); it != s_pendingStates.end(); )
+		{
+			if (it->first.first != workbook)
+			{
+				++it;
+				continue;
+			}
+			int ret = DefineBinaryName(it->first.second.c_str(), it->second);
+			if (ret != xlretSuccess)
+			{
+				XLL_LOG_WARNING("Cannot write workbook state %ls of %ls (xlDefineBinaryName returned %d)",
+					it->first.second.c_str(), workbook.c_str(), ret);
+			}
+			it = s_pendingStates.erase(it);
+		}
+	}
+
+	void ClearWorkbookState()
+	{
+		std::lock_guard<std::mutex> lock(s_pendingLock);
+		for (auto it = s_pendingStates.begin(); it != s_pendingStates.end(); ++it)
+		{
+			XLL_LOG_WARNING("Workbook state %ls of %ls is not written, because the workbook "
+				"is not active", it->first.second.c_str(), it->first.first.c_str());
+		}
+		s_pendingStates.clear();
+		s_workbookNames.clear();
+	}
+}
@@ -0,0 +1,186 @@
+////////////////////////////////////////////////////////////////////////////
+// WorkbookState.h -- keep serialized add-in state inside the workbook
+//
+// State that is expensive to compute and belongs to a workbook, such as
+// calibrated model parameters or a precomputed index, can be saved in the
+// workbook itself as a binary name (xlDefineBinaryName). It is then saved
+// and reopened with the workbook, without any external file, and read
+// back with xlGetBinaryName when it is first needed:
+//
+//   static xll::WorkbookState<Model> s_model(L"MyAddin.Model");
+//
+//   double Price(...)
+//   {
+//       std::shared_ptr<const Model> model = s_model.Get();
+//       if (model == nullptr)
+//       {
+//           model = Calibrate(...);
+//           s_model.Set(model);
+//       }
+//       return model->Price(...);
+//   }
+//
+// The type is written with ObjectTraits<T>::Save() and read with Load()
+// (see ObjectCache.h), and compressed with the codec in Compression.h.
+//
+// Binary names belong to the workbook that is active when they are
+// defined or read. A WorkbookState reads its name the first time Get() is
+// called with a given workbook active, and keeps the object of each
+// workbook in memory afterwards. Prefix the name with the name of the
+// add-in, as binary names are shared by all add-ins.
+//
+// Excel may not allow a binary name to be defined while it calculates.
+// If so, the state is kept with the name of its workbook, and written
+// when a calculation ends with that workbook active, by the calculation
+// event command that XLL Connector registers; in Excel 2007, which has
+// no calculation events, call FlushWorkbookState() from a command. A
+// state whose workbook is not active again before the XLL is closed is
+// dropped with a warning. Functions that use a WorkbookState should not
+// be registered as thread-safe, since xlGetBinaryName is called on the
+// calling thread.
+//
+
+#pragma once
+
+#include "xlldef.h"
+#include "ObjectCache.h"
+#include "Log.h"
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace XLL_NAMESPACE
+{
+	// Compresses size bytes at data and writes them to the binary name
+	// of the active workbook, now if Excel allows it or else when the
+	// calculation ends.
+	HRESULT SaveWorkbookState(LPCWSTR name, const void *data, size_t size);
+
+	// Reads the binary name of the active workbook and decompresses it
+	// into data. Returns S_FALSE if the name is not defined or its data
+	// is not valid, and E_FAIL if Excel does not allow the name to be
+	// read now. A state saved and
+	// not yet written is returned as is.
+	HRESULT LoadWorkbookState(LPCWSTR name, std::vector<unsigned char> &data);
+
+	// Deletes the binary name of the active workbook, now if Excel
+	// allows it or else when the calculation ends.
+	HRESULT DeleteWorkbookState(LPCWSTR name);
+
+	// Gets the name of the active workbook, e.g. "Book1.xlsx", to which
+	// the functions above apply.
+	HRESULT GetActiveWorkbookName(std::wstring &workbook);
+
+	// Writes the states of the active workbook that were saved or deleted
+	// during a calculation. The states of other workbooks stay queued.
+	// Must be called from a command.
+	void FlushWorkbookState();
+
+	// Drops the states that are still queued, logging each one.
+	void ClearWorkbookState();
+
+	//
+	// WorkbookState<T>
+	//
+	// Object of type T kept in a binary name and restored on first use
+	// in each workbook. ObjectTraits<T> must define Save() and Load().
+	//
+
+	template <typename T>
+	class WorkbookState
+	{
+		static_assert(ObjectTraits<T>::IsSpillable != 0,
+			"Specialize xll::ObjectTraits<T> with Save() and Load() to keep T in a workbook.");
+
+		LPCWSTR m_name;
+		std::mutex m_lock;
+
+		// Object of each workbook whose name has been read, which is null
+		// if the workbook has none.
+		std::map<std::wstring, std::shared_ptr<const T>> m_objects;
+
+	public:
+		explicit WorkbookState(LPCWSTR name)
+			: m_name(name)
+		{
+		}
+
+		WorkbookState(const WorkbookState &) = delete;
+		WorkbookState& operator=(const WorkbookState &) = delete;
+
+		LPCWSTR name() const { return m_name; }
+
+		// Returns the object of the active workbook, reading it on first
+		// use, or nullptr if the workbook has none.
+		std::shared_ptr<const T> Get()
+		{
+			std::wstring workbook;
+			if (FAILED(GetActiveWorkbookName(workbook)))
+				return nullptr;
+
+			std::lock_guard<std::mutex> lock(m_lock);
+			auto it = m_objects.find(workbook);
+			if (it != m_objects.end())
+				return it->second;
+
+			std::shared_ptr<const T> object;
+			std::vector<unsigned char> data;
+			HRESULT hr = LoadWorkbookState(m_name, data);
+			if (hr == S_OK)
+			{
+				try
+				{
+					ObjectReader reader(data.data(), data.size());
+					object = ObjectTraits<T>::Load(reader);
+				}
+				catch (const std::exception &ex)
+				{
+					XLL_LOG_WARNING("Workbook state %ls is ignored: %s", m_name, ex.what());
+				}
+			}
+			// Try again next time if the name cannot be read now.
+			if (SUCCEEDED(hr))
+				m_objects[workbook] = object;
+			return object;
+		}
+
+		// Replaces the object of the active workbook and writes it to the
+		// workbook.
+		HRESULT Set(std::shared_ptr<const T> object)
+		{
+			std::wstring workbook;
+			if (FAILED(GetActiveWorkbookName(workbook)))
+				return E_FAIL;
+
+			HRESULT hr;
+			if (object != nullptr)
+			{
+				std::vector<unsigned char> data;
+				ObjectWriter writer(data);
+				ObjectTraits<T>::Save(*object, writer);
+				hr = SaveWorkbookState(m_name, data.data(), data.size());
+			}
+			else
+			{
+				hr = DeleteWorkbookState(m_name);
+			}
+
+			if (SUCCEEDED(hr))
+			{
+				std::lock_guard<std::mutex> lock(m_lock);
+				m_objects[workbook] = std::move(object);
+			}
+			return hr;
+		}
+
+		// Forgets the objects in memory, so that the next Get() reads the
+		// binary name again, e.g. after a workbook is reopened.
+		void Reload()
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+			m_objects.clear();
+		}
+	};
+}
@@ -0,0 +1,79 @@
+////////////////////////////////////////////////////////////////////////////
+// WorkbookStateFormat.cpp -- binary format of a workbook state
+
+#include "WorkbookStateFormat.h"
+#include "Compression.h"
+#include <climits>
+#include <cstring>
+
+namespace XLL_NAMESPACE
+{
+	static unsigned int ComputeChecksum(const void *data, size_t size)
+	{
+		const unsigned char *p = static_cast<const unsigned char *>(data);
+		unsigned int hash = 2166136261U;
+		for (size_t i = 0; i < size; i++)
+		{
+			hash ^= p[i];
+			hash *= 16777619U;
+		}
+		return hash;
+	}
+
+	void EncodeWorkbookState(const void *data, size_t size, std::vector<unsigned char> &blob)
+	{
+		WorkbookStateHeader header;
+		memcpy(header.magic, "XLWS", 4);
+		header.version = WorkbookStateVersion;
+		header.codec = WorkbookStateCompressed;
+		header.reserved = 0;
+		header.size = (unsigned int)size;
+		header.checksum = ComputeChecksum(data, size);
+
+		blob.assign((const unsigned char *)&header, (const unsigned char *)(&header + 1));
+		CompressBytes(data, size, blob);
+		if (blob.size() >= sizeof(header) + size)
+		{
+			header.codec = WorkbookStateRaw;
+			blob.assign((const unsigned char *)&header, (const unsigned char *)(&header + 1));
+			blob.insert(blob.end(), (const unsigned char *)data, (const unsigned char *)data + size);
+		}
+	}
+
+	bool DecodeWorkbookState(const unsigned char *blob, size_t blobSize, std::vector<unsigned char> &data)
+	{
+		WorkbookStateHeader header;
+		if (blobSize < sizeof(header))
+			return false;
+		memcpy(&header, blob, sizeof(header));
+		if (memcmp(header.magic, "XLWS", 4) != 0 || header.version != WorkbookStateVersion)
+			return false;
+
+		// Check the size before allocating it, so that a damaged name
+		// cannot make Get() run out of memory. A byte of compressed data
+		// expands to at most 255 bytes.
+		const unsigned char *body = blob + sizeof(header);
+		size_t bodySize = blobSize - sizeof(header);
+		if (header.size > INT_MAX - sizeof(header))
+			return false;
+		if (header.codec == WorkbookStateRaw)
+		{
+			if (bodySize != header.size)
+				return false;
+			data.assign(body, body + bodySize);
+		}
+		else if (header.codec == WorkbookStateCompressed)
+		{
+			if (header.size / 255 > bodySize)
+				return false;
+			data.resize(header.size);
+			if (!DecompressBytes(body, bodySize, data.data(), data.size()))
+				return false;
+		}
+		else
+		{
+			return false;
+		}
+		return ComputeChecksum(data.data(), data.size()) == header.checksum;
+	}
+}
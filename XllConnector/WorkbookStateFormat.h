@@ -0,0 +1,51 @@
+////////////////////////////////////////////////////////////////////////////
+// WorkbookStateFormat.h -- binary format of a workbook state
+//
+// A binary name written by WorkbookState holds a header followed by the
+// data, compressed unless compression does not make it smaller. The
+// checksum is that of the uncompressed data, so that a name written by
+// another version or damaged in the file is not loaded.
+//
+// The format does not depend on Excel, so that it can be tested on its
+// own.
+//
+
+#pragma once
+
+#if defined(_WIN32)
+#include "xlldef.h"
+#elif !defined(XLL_NAMESPACE)
+#define XLL_NAMESPACE xll
+#endif
+#include <cstddef>
+#include <vector>
+
+namespace XLL_NAMESPACE
+{
+#pragma pack(push, 1)
+	struct WorkbookStateHeader
+	{
+		char magic[4];              // "XLWS"
+		unsigned char version;      // 1
+		unsigned char codec;        // WorkbookStateRaw or WorkbookStateCompressed
+		unsigned short reserved;
+		unsigned int size;          // size of uncompressed data
+		unsigned int checksum;      // FNV-1a hash of uncompressed data
+	};
+#pragma pack(pop)
+
+	static_assert(sizeof(WorkbookStateHeader) == 16, "WorkbookStateHeader must be 16 bytes.");
+
+	static const unsigned char WorkbookStateVersion = 1;
+	static const unsigned char WorkbookStateRaw = 0;
+	static const unsigned char WorkbookStateCompressed = 1;
+
+	// Replaces blob with the header and the encoded form of size bytes at
+	// data. The caller must check that size fits in the header.
+	void EncodeWorkbookState(const void *data, size_t size, std::vector<unsigned char> &blob);
+
+	// Replaces data with the data encoded in blobSize bytes at blob.
+	// Returns false if the blob is not valid, without allocating more than
+	// its header and size allow.
+	bool DecodeWorkbookState(const unsigned char *blob, size_t blobSize, std::vector<unsigned char> &data);
+}
@@ -7,7 +7,12 @@
 #include "FunctionInfo.h"
 #include "Conversion.h"
 #include "Marshal.h"
+#include "ObjectCache.h"
+#include "ResultCache.h"
 #include "Invoke.h"
+#include "Profile.h"
+#include "Trace.h"
+#include "Log.h"
 
 //
 // strip_cc, strip_cc_t
@@ -165,6 +170,12 @@ namespace XLL_NAMESPACE
 	struct XLWrapper < Func, func, Attributes, TRet(TArgs...) > 
 		: FunctionAttributes<Attributes>
 	{
+		enum
+		{
+			IsCacheable = IsCacheableResult<TRet>::value &&
+				AreCacheableArguments<TArgs...>::value
+		};
+
 		//
 		// EntryPoint
 		//
@@ -178,6 +189,11 @@ namespace XLL_NAMESPACE
 		EntryPoint(typename ArgumentMarshaler<TArgs>::WireType... args) 
 		XLL_NOEXCEPT
 		{
+#if XLL_ENABLE_TRACING
+			TraceScope traceScope;
+			if (IsTracingEnabled())
+				traceScope.Begin(GetFunctionInfo().name);
+#endif
 			try
 			{
 				if (IsHeavy && IsDialogBoxOpen())
@@ -185,32 +201,129 @@ namespace XLL_NAMESPACE
 					return const_cast<LPXLOPER12>(&Constants::ErrNA);
 				}
 
-				LPXLOPER12 pvRetVal = AllocateReturnValue(IsThreadSafe);
-				HRESULT hr = CreateValue(pvRetVal,
-					func(ArgumentMarshaler<TArgs>::Marshal(args)...));
-				if (FAILED(hr))
+				if (ReturnsObject<TRet>::value)
 				{
-					throw std::invalid_argument(
-						"Cannot convert return value to XLOPER12.");
+					BeginObjectCall();
 				}
-				// TODO: delete malloc-ed return value on return
-				return pvRetVal;
+
+				if (IsCacheable && GetFunctionInfo().cacheVersion != nullptr &&
+					IsResultCacheOpen())
+				{
+					return CachedCall(args...);
+				}
+
+				return Call(args...);
 			}
-			catch (const std::exception &)
+			catch (const std::exception &ex)
 			{
-				// todo: report exception
+				XLL_LOG_ERROR("%s: %s", GetFunctionInfo().name, ex.what());
+				if (IsProfiled)
+					RecordProfiledException(GetFunctionInfo().profileId);
 			}
 			catch (...)
 			{
-				// todo: report exception
+				XLL_LOG_ERROR("%s: unknown exception", GetFunctionInfo().name);
+				if (IsProfiled)
+					RecordProfiledException(GetFunctionInfo().profileId);
 			}
 			return const_cast<LPXLOPER12>(&Constants::ErrValue);
 		}
 
+		//
+		// Call
+		//
+		// Marshals the arguments, calls the function, and marshals its
+		// return value.
+		//
+
+		static LPXLOPER12 Call(
+			typename ArgumentMarshaler<TArgs>::WireType... args)
+		{
+			if (IsProfiled)
+			{
+				return ProfiledCall(args...);
+			}
+
+			LPXLOPER12 pvRetVal = AllocateReturnValue(IsThreadSafe);
+			HRESULT hr = CreateValue(pvRetVal,
+				func(ArgumentMarshaler<TArgs>::Marshal(args)...));
+			if (FAILED(hr))
+			{
+				throw std::invalid_argument(
+					"Cannot convert return value to XLOPER12.");
+			}
+			// TODO: delete malloc-ed return value on return
+			return pvRetVal;
+		}
+
+		//
+		// CachedCall
+		//
+		// Returns the result stored in the persistent result cache for
+		// the same arguments, or calls the function and stores its
+		// result. Calls whose arguments cannot be hashed are not cached.
+		//
+
+		static LPXLOPER12 CachedCall(
+			typename ArgumentMarshaler<TArgs>::WireType... args)
+		{
+			ResultKey key;
+			if (!MakeResultKey(key, GetFunctionInfo(), args...))
+			{
+				return Call(args...);
+			}
+
+			XLOPER12 cached;
+			if (LookupResult(key, &cached))
+			{
+				LPXLOPER12 pvRetVal = AllocateReturnValue(IsThreadSafe);
+				*pvRetVal = cached;
+				return pvRetVal;
+			}
+
+			LPXLOPER12 pvRetVal = Call(args...);
+			StoreResult(key, *pvRetVal);
+			return pvRetVal;
+		}
+
+		//
+		// ProfiledCall
+		//
+		// Same as Call, but records the time spent
+		// in each phase of the call. The arguments are marshaled when
+		// Compute() is called, so the time before Compute() starts is
+		// the time spent on marshaling the arguments.
+		//
+
+		static LPXLOPER12 ProfiledCall(
+			typename ArgumentMarshaler<TArgs>::WireType... args)
+		{
+			ProfileTimer timer(GetFunctionInfo().profileId);
+			LPXLOPER12 pvRetVal = AllocateReturnValue(IsThreadSafe);
+			HRESULT hr = CreateValue(pvRetVal,
+				Compute(timer, ArgumentMarshaler<TArgs>::Marshal(args)...));
+			if (FAILED(hr))
+			{
+				throw std::invalid_argument(
+					"Cannot convert return value to XLOPER12.");
+			}
+			timer.Commit();
+			return pvRetVal;
+		}
+
+		template <typename... TAdapters>
+		static TRet Compute(ProfileTimer &timer, TAdapters&&... adapters)
+		{
+			timer.BeginCompute();
+			TRet result = func(std::forward<TAdapters>(adapters)...);
+			timer.EndCompute();
+			return result;
+		}
+
 		static inline FunctionInfo& GetFunctionInfo(FARPROC stub = 0)
 		{
 			static FunctionInfo& s_info = 
-				FunctionInfo::Create<Attributes>(EntryPoint, stub);
+				FunctionInfo::Create<Attributes>(EntryPoint, stub, IsCacheable != 0);
 			return s_info;
 		}
 	};
@@ -250,12 +363,6 @@ namespace
 	};
 }
 
-#define XLL_CONCAT_(x,y) x##y
-#define XLL_CONCAT(x,y) XLL_CONCAT_(x,y)
-
-#define XLL_QUOTE_(x) #x
-#define XLL_QUOTE(x) XLL_QUOTE_(x)
-
 //
 // EXPORT_XLL_FUNCTION, EXPORT_XLL_FUNCTION_AS
 //
@@ -287,11 +394,27 @@ namespace
 		XLL_CONCAT(L,XLL_QUOTE(name)), (FARPROC)(XLL_STUB_NAME(name)))
 #endif
 
+//
+// JmpInstruction
+//
+// Exported stub that jumps to the wrapper's entry point through a
+// pointer, so that a profiler can redirect the call by replacing the
+// pointer. On x86, the operand of FF 25 is the absolute address of
+// the pointer. On x64, it is relative to the next instruction; the
+// stub uses a displacement of zero and stores the target right after
+// the instruction.
+//
+
 #pragma pack(push, 1)
 struct JmpInstruction
 {
 	unsigned char opcode[2]; // FF 25: Jump near, absolute indirect
+#if defined(_WIN64)
+	int displacement;        // 0: the target follows the instruction
+	void *target;
+#else
 	void *ptr;
+#endif
 };
 #pragma pack(pop)
 
@@ -302,6 +425,16 @@ struct JmpInstruction
 	::XLL_NAMESPACE::XLWrapper <decltype(f), f, \
 	::XLL_NAMESPACE::NormalizeAttributes<__VA_ARGS__>::value >
 
+#if defined(_WIN64)
+#define EXPORT_XLL_FUNCTION_AS(f, name, ...) \
+	extern "C" __declspec(dllexport, allocate(".xllstub")) \
+	JmpInstruction XLL_STUB_NAME(name) = { { 0xFF, 0x25 }, 0, \
+		(void *)XLL_WRAPPER(f, __VA_ARGS__)::EntryPoint }; \
+	::XLL_NAMESPACE::FunctionInfoBuilder \
+		XLLocalWrapper<decltype(f), f, __VA_ARGS__>::functionInfoBuilder = \
+		XLLocalWrapper<decltype(f), f, __VA_ARGS__>::BuildFunctionInfo( \
+		XLL_CONCAT(L,XLL_QUOTE(name)), (FARPROC)&XLL_STUB_NAME(name))
+#else
 #define EXPORT_XLL_FUNCTION_AS(f, name, ...) \
 	static auto XLL_CONCAT(XLL_STUB_NAME(name),_EntryPoint) = \
 		XLL_WRAPPER(f, __VA_ARGS__)::EntryPoint; \
@@ -312,6 +445,7 @@ struct JmpInstruction
 		XLLocalWrapper<decltype(f), f, __VA_ARGS__>::functionInfoBuilder = \
 		XLLocalWrapper<decltype(f), f, __VA_ARGS__>::BuildFunctionInfo( \
 		XLL_CONCAT(L,XLL_QUOTE(name)), (FARPROC)&XLL_STUB_NAME(name))
+#endif
 
 #else
 
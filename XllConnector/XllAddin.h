@@ -5,4 +5,10 @@
 #include "Invoke.h"
 #include "ExcelVariant.h"
 #include "Marshal.h"
-#include "Wrapper.h"
\ No newline at end of file
+#include "ObjectCache.h"
+#include "WorkbookState.h"
+#include "SharedData.h"
+#include "Wrapper.h"
+#include "Profile.h"
+#include "Trace.h"
+#include "Log.h"
\ No newline at end of file
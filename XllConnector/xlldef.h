@@ -16,13 +16,14 @@
 // Defines attributes of a UDF, which determines how the wrapper is
 // generated and how it is called by Excel.
 //
-// You may override XLL_DEFAULT_VOLATILE/THREADSAFE/HEAVY at
+// You may override XLL_DEFAULT_VOLATILE/THREADSAFE/HEAVY/PROFILE at
 // translation unit level BEFORE #include <XllDef.h> to alter the
 // defaults attributes for functions exported from that translation
 // unit.
 //
-// For each individual export, you may set XLL_[NOT_]VOLATILE and/or
-// XLL_[NOT_]THREADSAFE to specify the behavior of that UDF.
+// For each individual export, you may set XLL_[NOT_]VOLATILE,
+// XLL_[NOT_]THREADSAFE, XLL_HEAVY/XLL_LIGHT and/or XLL_[NOT_]PROFILE
+// to specify the behavior of that UDF.
 //
 
 //
@@ -82,6 +83,23 @@
 #define XLL_DEFAULT_HEAVY 1
 #endif
 
+//
+// XLL_PROFILE, XLL_NOT_PROFILE, XLL_DEFAULT_PROFILE
+//
+// Specifies whether the wrapper records call counts and latency
+// histograms for the function. See Profile.h for how to retrieve
+// the data.
+//
+// XLL Connector does not profile a UDF by default.
+//
+
+#define XLL_PROFILE         0x10
+#define XLL_NOT_PROFILE     0x1000
+
+#ifndef XLL_DEFAULT_PROFILE
+#define XLL_DEFAULT_PROFILE 0
+#endif
+
 //
 // XLL_GENERATE_WRAPPER_STUB, XLL_WRAPPER_STUB_PREFIX
 //
@@ -109,6 +127,66 @@
 #define XLL_WRAPPER_STUB_PREFIX XL12
 #endif
 
+//
+// XLL_DIALOG_STATE_CACHE_MS
+//
+// Maximum number of milliseconds for which XLL Connector caches the
+// result that the Function Wizard is not open. While a dialog box is
+// open, the window list is queried on every call of a heavy function,
+// so a heavy function called from a cell never returns #N/A because of
+// a stale answer.
+//
+// Excel raises no event when a dialog box opens, so a heavy function
+// called from the Function Wizard may be evaluated if the wizard was
+// opened less than this interval ago. The cache is also discarded
+// whenever a calculation ends or is canceled. Define it as 0 to query
+// the window list on every call of a heavy function.
+//
+// This macro takes effect when XLL Connector itself is compiled.
+//
+
+#ifndef XLL_DIALOG_STATE_CACHE_MS
+#define XLL_DIALOG_STATE_CACHE_MS 100
+#endif
+
+//
+// XLL_ENABLE_TRACING
+//
+// Controls whether the tracing macros in Trace.h generate code, and
+// whether UDF wrappers emit a trace span for each call. If defined
+// to zero, tracing has no cost at all; otherwise, each traced scope
+// costs a load and a branch while tracing is not started.
+//
+
+#ifndef XLL_ENABLE_TRACING
+#define XLL_ENABLE_TRACING 1
+#endif
+
+//
+// XLL_LOG_LEVEL
+//
+// Minimum severity of log records that are compiled in (see Log.h).
+// Records of a lower level generate no code and their arguments are
+// not evaluated. Defaults to XLL_LOG_LEVEL_DEBUG in debug builds and
+// XLL_LOG_LEVEL_INFO in release builds. May be overridden at
+// translation unit level.
+//
+
+#define XLL_LOG_LEVEL_TRACE    0
+#define XLL_LOG_LEVEL_DEBUG    1
+#define XLL_LOG_LEVEL_INFO     2
+#define XLL_LOG_LEVEL_WARNING  3
+#define XLL_LOG_LEVEL_ERROR    4
+#define XLL_LOG_LEVEL_OFF      5
+
+#ifndef XLL_LOG_LEVEL
+#ifdef _DEBUG
+#define XLL_LOG_LEVEL XLL_LOG_LEVEL_DEBUG
+#else
+#define XLL_LOG_LEVEL XLL_LOG_LEVEL_INFO
+#endif
+#endif
+
 //
 // ALL THE FOLLOWING ARE IMPLEMENTATION DETAILS THAT YOU SHOULDN'T ALTER.
 //
@@ -138,3 +216,16 @@
 //
 
 #define XLL_NOEXCEPT throw()
+
+//
+// XLL_CONCAT, XLL_QUOTE
+//
+// Token pasting and stringizing helpers that expand their arguments
+// first.
+//
+
+#define XLL_CONCAT_(x,y) x##y
+#define XLL_CONCAT(x,y) XLL_CONCAT_(x,y)
+
+#define XLL_QUOTE_(x) #x
+#define XLL_QUOTE(x) XLL_QUOTE_(x)
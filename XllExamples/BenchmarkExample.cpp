@@ -0,0 +1,146 @@
+////////////////////////////////////////////////////////////////////////////
+// BenchmarkExample.cpp
+//
+// This file measures the per-call overhead that XLL Connector adds to
+// a UDF. Each benchmark calls the entry point registered with Excel for
+// an exported empty function in a loop, as Excel would, and returns the
+// average time per call in nanoseconds.
+//
+// Heavy functions (the default) check whether the Function Wizard is
+// open before each call; light functions do not. Compare
+//
+//   =HeavyCallOverhead(1000000)
+//   =LightCallOverhead(1000000)
+//   =DialogProbeOverhead(1000)
+//
+// to see the cost of that check with the cached dialog state, and the
+// cost of probing the windows of the process on every call.
+//
+// =LogCallOverhead(500) measures the cost of writing a debug-level log
+// record. Start Excel with XLL_LOG_FILE set and XLL_LOG_LEVEL=debug to
+// measure records being written, or without to measure the disabled
+// check. More iterations than XLL_LOG_BUFFER_SIZE fill the buffer and
+// measure the cost of dropping records instead.
+//
+// =CallbackOverhead(100000) measures a round trip into Excel. Start
+// Excel with XLL_PROFILE_CALLBACKS=1 to see the callbacks counted in
+// =XllCallbackReport().
+
+// Compile debug-level log records in, even in release builds.
+#define XLL_LOG_LEVEL XLL_LOG_LEVEL_DEBUG
+
+#include "XllAddin.h"
+
+double BenchmarkHeavyNoop()
+{
+	return 0.0;
+}
+
+double BenchmarkLightNoop()
+{
+	return 0.0;
+}
+
+EXPORT_XLL_FUNCTION(BenchmarkHeavyNoop, XLL_HEAVY)
+.Description(L"Returns zero. Called by HeavyCallOverhead.");
+
+EXPORT_XLL_FUNCTION(BenchmarkLightNoop, XLL_LIGHT)
+.Description(L"Returns zero. Called by LightCallOverhead.");
+
+typedef LPXLOPER12 (__stdcall *NoopEntryPoint)();
+
+// Returns the entry point registered with Excel for a function, which is
+// its exported stub unless stubs are not generated.
+static NoopEntryPoint GetRegisteredEntryPoint(LPCWSTR name)
+{
+	for (const xll::FunctionInfo &info : xll::FunctionInfo::registry())
+	{
+		if (info.name != nullptr && wcscmp(info.name, name) == 0)
+			return (NoopEntryPoint)info.entryPoint;
+	}
+	throw std::logic_error("function is not registered");
+}
+
+template <typename Func>
+static double MeasureNanosecondsPerCall(int iterations, Func func)
+{
+	if (iterations <= 0)
+		throw std::invalid_argument("iterations must be positive");
+
+	LARGE_INTEGER frequency, start, end;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&start);
+	for (int i = 0; i < iterations; i++)
+	{
+		func();
+	}
+	QueryPerformanceCounter(&end);
+
+	double seconds = (double)(end.QuadPart - start.QuadPart) / frequency.QuadPart;
+	return seconds * 1e9 / iterations;
+}
+
+double HeavyCallOverhead(int iterations)
+{
+	NoopEntryPoint entryPoint = GetRegisteredEntryPoint(L"BenchmarkHeavyNoop");
+	return MeasureNanosecondsPerCall(iterations, [entryPoint]()
+	{
+		entryPoint();
+	});
+}
+
+double LightCallOverhead(int iterations)
+{
+	NoopEntryPoint entryPoint = GetRegisteredEntryPoint(L"BenchmarkLightNoop");
+	return MeasureNanosecondsPerCall(iterations, [entryPoint]()
+	{
+		entryPoint();
+	});
+}
+
+double DialogProbeOverhead(int iterations)
+{
+	return MeasureNanosecondsPerCall(iterations, []()
+	{
+		xll::InvalidateDialogState();
+		xll::IsDialogBoxOpen();
+	});
+}
+
+double LogCallOverhead(int iterations)
+{
+	int i = 0;
+	return MeasureNanosecondsPerCall(iterations, [&i]()
+	{
+		XLL_LOG_DEBUG("LogCallOverhead iteration %d of %s", ++i, "benchmark");
+	});
+}
+
+double CallbackOverhead(int iterations)
+{
+	return MeasureNanosecondsPerCall(iterations, []()
+	{
+		XLOPER12 xHwnd;
+		Excel12(xlGetHwnd, &xHwnd, 0);
+	});
+}
+
+EXPORT_XLL_FUNCTION(HeavyCallOverhead, XLL_LIGHT)
+.Description(L"Returns the average overhead in nanoseconds of calling a heavy UDF.")
+.Arg(L"iterations", L"number of calls to make");
+
+EXPORT_XLL_FUNCTION(LightCallOverhead, XLL_LIGHT)
+.Description(L"Returns the average overhead in nanoseconds of calling a light UDF.")
+.Arg(L"iterations", L"number of calls to make");
+
+EXPORT_XLL_FUNCTION(DialogProbeOverhead, XLL_LIGHT)
+.Description(L"Returns the average time in nanoseconds to probe for the Function Wizard without caching.")
+.Arg(L"iterations", L"number of probes to make");
+
+EXPORT_XLL_FUNCTION(LogCallOverhead, XLL_LIGHT)
+.Description(L"Returns the average time in nanoseconds to write a debug-level log record.")
+.Arg(L"iterations", L"number of records to write");
+
+EXPORT_XLL_FUNCTION(CallbackOverhead, XLL_LIGHT)
+.Description(L"Returns the average time in nanoseconds of a callback into Excel.")
+.Arg(L"iterations", L"number of callbacks to make");
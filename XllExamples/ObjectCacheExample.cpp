@@ -0,0 +1,154 @@
+////////////////////////////////////////////////////////////////////////////
+// ObjectCacheExample.cpp
+//
+// This file demonstrates how to pass a C++ object from one UDF to
+// another by handle. Enter the times and zero rates of a curve in two
+// columns, say A1:B5, and then
+//
+//   C1: =MakeCurve(A1:B5)          shows a handle such as Curve:1
+//   C2: =CurveDiscount(C1, 2.5)    discount factor at t = 2.5
+//   C3: =CurvePointCount(C1)
+//
+// The curve is built once when C1 is calculated; C2 and C3 receive the
+// object itself, not a copy of the points. Changing A1:B5 builds a new
+// curve with a new handle and releases the old one.
+//
+// =CachedObjectCount() returns the number of objects in the cache.
+//
+// ObjectTraits<Curve> tells the cache how much memory a curve holds and
+// how to write it to the spill file. Start Excel with, for example,
+// XLL_OBJECT_CACHE_BUDGET=1024 to keep at most 1 GB of curves in memory;
+// =XllObjectCacheReport() then shows the evictions and spills.
+
+#include "XllAddin.h"
+#include <cmath>
+#include <algorithm>
+#include <vector>
+
+class Curve
+{
+	std::vector<double> m_times;
+	std::vector<double> m_rates;
+
+public:
+	Curve(std::vector<double> times, std::vector<double> rates)
+		: m_times(std::move(times)), m_rates(std::move(rates))
+	{
+	}
+
+	size_t size() const { return m_times.size(); }
+
+	const std::vector<double>& times() const { return m_times; }
+
+	const std::vector<double>& rates() const { return m_rates; }
+
+	// Returns the zero rate at time t, interpolated linearly and held
+	// flat beyond the first and last points.
+	double ZeroRate(double t) const
+	{
+		if (t <= m_times.front())
+			return m_rates.front();
+		if (t >= m_times.back())
+			return m_rates.back();
+		size_t i = std::upper_bound(m_times.begin(), m_times.end(), t) - m_times.begin();
+		double w = (t - m_times[i - 1]) / (m_times[i] - m_times[i - 1]);
+		return m_rates[i - 1] + w * (m_rates[i] - m_rates[i - 1]);
+	}
+
+	double Discount(double t) const
+	{
+		return std::exp(-ZeroRate(t) * t);
+	}
+};
+
+namespace xll
+{
+	template <>
+	struct ObjectTraits < Curve >
+	{
+		enum { IsSpillable = 1 };
+
+		static size_t Size(const Curve &curve)
+		{
+			return sizeof(Curve) + 2 * sizeof(double) * curve.size();
+		}
+
+		static void Save(const Curve &curve, ObjectWriter &writer)
+		{
+			writer.WriteVector(curve.times());
+			writer.WriteVector(curve.rates());
+		}
+
+		static std::shared_ptr<Curve> Load(ObjectReader &reader)
+		{
+			std::vector<double> times = reader.ReadVector<double>();
+			std::vector<double> rates = reader.ReadVector<double>();
+			return std::make_shared<Curve>(std::move(times), std::move(rates));
+		}
+	};
+}
+
+// Builds a curve from a two-column range of increasing times and their
+// zero rates.
+xll::Handle<Curve> MakeCurve(SAFEARRAY *points)
+{
+	if (SafeArrayGetDim(points) != 2 || points->rgsabound[1].cElements != 2)
+		throw std::invalid_argument("points must have two columns");
+
+	size_t rows = points->rgsabound[0].cElements;
+	if (rows == 0)
+		throw std::invalid_argument("points must not be empty");
+
+	VARIANT *data;
+	HRESULT hr = SafeArrayAccessData(points, (void**)&data);
+	if (FAILED(hr))
+		throw std::invalid_argument("Cannot access data");
+
+	// Elements are stored in row-major order (see ArrayExample.cpp).
+	std::vector<double> times(rows), rates(rows);
+	bool ok = true;
+	for (size_t i = 0; i < rows && ok; i++)
+	{
+		ok = (V_VT(&data[2 * i]) == VT_R8 && V_VT(&data[2 * i + 1]) == VT_R8);
+		if (ok)
+		{
+			times[i] = V_R8(&data[2 * i]);
+			rates[i] = V_R8(&data[2 * i + 1]);
+			ok = (i == 0 || times[i] > times[i - 1]);
+		}
+	}
+	SafeArrayUnaccessData(points);
+	if (!ok)
+		throw std::invalid_argument("points must be numbers with increasing times");
+
+	return std::make_shared<Curve>(std::move(times), std::move(rates));
+}
+
+EXPORT_XLL_FUNCTION(MakeCurve, XLL_NOT_VOLATILE | XLL_THREADSAFE)
+.Description(L"Builds a zero curve and returns its handle.")
+.Arg(L"Points", L"Two columns of increasing times and their zero rates");
+
+double CurveDiscount(xll::Handle<Curve> curve, double t)
+{
+	return curve->Discount(t);
+}
+
+EXPORT_XLL_FUNCTION(CurveDiscount, XLL_NOT_VOLATILE | XLL_THREADSAFE)
+.Description(L"Returns the discount factor of a curve at a given time.")
+.Arg(L"Curve", L"Handle returned by MakeCurve")
+.Arg(L"Time", L"Time in years");
+
+int CurvePointCount(const xll::Handle<Curve> &curve)
+{
+	return (int)curve->size();
+}
+
+EXPORT_XLL_FUNCTION(CurvePointCount, XLL_NOT_VOLATILE | XLL_THREADSAFE)
+.Arg(L"Curve", L"Handle returned by MakeCurve");
+
+int CachedObjectCount()
+{
+	return (int)xll::GetCachedObjectCount();
+}
+
+EXPORT_XLL_FUNCTION(CachedObjectCount);
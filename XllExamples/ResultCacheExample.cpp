@@ -0,0 +1,50 @@
+////////////////////////////////////////////////////////////////////////////
+// ResultCacheExample.cpp
+//
+// This file demonstrates how to keep the results of a slow pure function
+// across Excel sessions. Start Excel with, for example,
+//
+//   XLL_RESULT_CACHE_FILE=%LOCALAPPDATA%\XllExamples.cache
+//
+// and enter =MonteCarloCall(100, 110, 0.2, 1, 10000000). The first call
+// takes a few seconds; after Excel is restarted and the workbook opened
+// again, the result is read from the cache file. =XllResultCacheReport()
+// shows the hits and misses.
+//
+// The simulation uses a fixed seed, so the result depends only on the
+// arguments. Bump the version passed to Cacheable() if the algorithm
+// changes.
+
+#include "XllAddin.h"
+#include <algorithm>
+#include <cmath>
+#include <random>
+
+// Estimates the price of a European call option under Black-Scholes
+// with zero interest rate by Monte Carlo simulation.
+double MonteCarloCall(double spot, double strike, double vol, double maturity, int paths)
+{
+	if (spot <= 0 || strike <= 0 || vol <= 0 || maturity <= 0 || paths <= 0)
+		throw std::invalid_argument("arguments must be positive");
+
+	std::mt19937_64 engine(20150601);
+	std::normal_distribution<double> normal;
+	double drift = -0.5 * vol * vol * maturity;
+	double diffusion = vol * std::sqrt(maturity);
+	double sum = 0;
+	for (int i = 0; i < paths; i++)
+	{
+		double s = spot * std::exp(drift + diffusion * normal(engine));
+		sum += std::max(s - strike, 0.0);
+	}
+	return sum / paths;
+}
+
+EXPORT_XLL_FUNCTION(MonteCarloCall, XLL_NOT_VOLATILE | XLL_THREADSAFE)
+.Description(L"Prices a call option by Monte Carlo simulation.")
+.Arg(L"Spot", L"Price of the underlying")
+.Arg(L"Strike", L"Strike price")
+.Arg(L"Vol", L"Volatility per year")
+.Arg(L"Maturity", L"Time to maturity in years")
+.Arg(L"Paths", L"Number of simulated paths")
+.Cacheable(L"1");
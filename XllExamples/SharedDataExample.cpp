@@ -0,0 +1,79 @@
+////////////////////////////////////////////////////////////////////////////
+// SharedDataExample.cpp
+//
+// This file demonstrates how several Excel processes can share one copy
+// of a large dataset. Start two instances of Excel (e.g. with "excel /x")
+// and load the add-in in both. In the first one, enter
+//
+//   A1: =PublishRandomWalk("XllExamples.Walk", 10000000)
+//
+// which generates 80 MB of data and publishes it. In the second one,
+//
+//   A1: =SharedSum("XllExamples.Walk")
+//   A2: =SharedValue("XllExamples.Walk", 12345)
+//
+// read the same memory without loading the data again. Recalculating the
+// first cell publishes a new version; the second instance sees it when
+// it is next recalculated with Ctrl+Alt+F9, and the old version is then
+// freed.
+
+#include "XllAddin.h"
+#include <random>
+
+// Publishes a random walk of the given length and returns its version.
+double PublishRandomWalk(const wchar_t *name, int count)
+{
+	if (count <= 0)
+		throw std::invalid_argument("count must be positive");
+
+	xll::SharedDataWriter writer;
+	HRESULT hr = writer.Create(name, sizeof(double), count);
+	if (FAILED(hr))
+		throw std::runtime_error("Cannot create shared dataset");
+
+	// Fill the shared memory directly rather than copy a vector into it.
+	double *data = static_cast<double *>(writer.data());
+	std::mt19937_64 engine(std::random_device{}());
+	std::normal_distribution<double> normal;
+	double x = 0;
+	for (int i = 0; i < count; i++)
+	{
+		x += normal(engine);
+		data[i] = x;
+	}
+
+	unsigned long long version;
+	hr = writer.Commit(&version);
+	if (hr != S_OK)
+		throw std::runtime_error("A newer version has been published");
+	return (double)version;
+}
+
+EXPORT_XLL_FUNCTION(PublishRandomWalk, XLL_NOT_VOLATILE | XLL_THREADSAFE)
+.Description(L"Publishes a random walk to all Excel processes.")
+.Arg(L"Name", L"Name of the dataset")
+.Arg(L"Count", L"Number of steps");
+
+double SharedSum(xll::SharedArray<double> data)
+{
+	double sum = 0;
+	for (double x : data)
+		sum += x;
+	return sum;
+}
+
+EXPORT_XLL_FUNCTION(SharedSum, XLL_NOT_VOLATILE | XLL_THREADSAFE)
+.Description(L"Returns the sum of a shared dataset.")
+.Arg(L"Name", L"Name of the dataset");
+
+double SharedValue(const xll::SharedArray<double> &data, int index)
+{
+	if (index < 0 || (size_t)index >= data.size())
+		throw std::invalid_argument("index is out of range");
+	return data[index];
+}
+
+EXPORT_XLL_FUNCTION(SharedValue, XLL_NOT_VOLATILE | XLL_THREADSAFE)
+.Description(L"Returns an element of a shared dataset.")
+.Arg(L"Name", L"Name of the dataset")
+.Arg(L"Index", L"Zero-based index of the element");
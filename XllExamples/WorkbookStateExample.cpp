@@ -0,0 +1,126 @@
+////////////////////////////////////////////////////////////////////////////
+// WorkbookStateExample.cpp
+//
+// This file demonstrates how to keep the result of a slow calibration in
+// the workbook, so that it survives saving and reopening the workbook.
+// Enter two columns of x and y values, say A1:B100, and then
+//
+//   C1: =CalibratedSlope(A1:B100)
+//
+// The first calculation fits the slope slowly and saves the calibration
+// as a binary name in the workbook. After the workbook is saved, closed
+// and opened again, the calibration is read back from the workbook on
+// first use and the slope is returned at once, as long as the points
+// have not changed.
+//
+// CalibratedSlope is not registered as thread-safe, because binary names
+// can only be read from the main calculation thread.
+
+#include "XllAddin.h"
+#include <vector>
+
+struct Calibration
+{
+	std::vector<double> points;  // x and y of each point, row by row
+	std::vector<double> params;  // slope and intercept
+};
+
+namespace xll
+{
+	template <>
+	struct ObjectTraits < Calibration >
+	{
+		enum { IsSpillable = 1 };
+
+		static size_t Size(const Calibration &c)
+		{
+			return sizeof(Calibration) + sizeof(double) * (c.points.size() + c.params.size());
+		}
+
+		static void Save(const Calibration &c, ObjectWriter &writer)
+		{
+			writer.WriteVector(c.points);
+			writer.WriteVector(c.params);
+		}
+
+		static std::shared_ptr<Calibration> Load(ObjectReader &reader)
+		{
+			std::shared_ptr<Calibration> c = std::make_shared<Calibration>();
+			c->points = reader.ReadVector<double>();
+			c->params = reader.ReadVector<double>();
+			return c;
+		}
+	};
+}
+
+static xll::WorkbookState<Calibration> s_calibration(L"XllExamples.Calibration");
+
+// Fits y = a * x + b by least squares, taking a while to stand for a
+// real calibration.
+static std::vector<double> FitLine(const std::vector<double> &points)
+{
+	Sleep(2000);
+
+	size_t n = points.size() / 2;
+	double sx = 0, sy = 0, sxx = 0, sxy = 0;
+	for (size_t i = 0; i < n; i++)
+	{
+		double x = points[2 * i], y = points[2 * i + 1];
+		sx += x;
+		sy += y;
+		sxx += x * x;
+		sxy += x * y;
+	}
+	double d = n * sxx - sx * sx;
+	if (d == 0)
+		throw std::invalid_argument("x values must not all be equal");
+
+	std::vector<double> params(2);
+	params[0] = (n * sxy - sx * sy) / d;
+	params[1] = (sy - params[0] * sx) / n;
+	return params;
+}
+
+// Returns the slope of the line fitted to a two-column range of points,
+// calibrating again only if the points differ from the saved ones.
+double CalibratedSlope(SAFEARRAY *points)
+{
+	if (SafeArrayGetDim(points) != 2 || points->rgsabound[1].cElements != 2)
+		throw std::invalid_argument("points must have two columns");
+
+	size_t rows = points->rgsabound[0].cElements;
+	if (rows < 2)
+		throw std::invalid_argument("points must have at least two rows");
+
+	VARIANT *data;
+	HRESULT hr = SafeArrayAccessData(points, (void**)&data);
+	if (FAILED(hr))
+		throw std::invalid_argument("Cannot access data");
+
+	// Elements are stored in row-major order (see ArrayExample.cpp).
+	std::vector<double> values(2 * rows);
+	bool ok = true;
+	for (size_t i = 0; i < 2 * rows && ok; i++)
+	{
+		ok = (V_VT(&data[i]) == VT_R8);
+		if (ok)
+			values[i] = V_R8(&data[i]);
+	}
+	SafeArrayUnaccessData(points);
+	if (!ok)
+		throw std::invalid_argument("points must be numbers");
+
+	std::shared_ptr<const Calibration> saved = s_calibration.Get();
+	if (saved != nullptr && saved->points == values && saved->params.size() == 2)
+		return saved->params[0];
+
+	std::shared_ptr<Calibration> c = std::make_shared<Calibration>();
+	c->params = FitLine(values);
+	c->points = std::move(values);
+	s_calibration.Set(c);
+	return c->params[0];
+}
+
+EXPORT_XLL_FUNCTION(CalibratedSlope, XLL_NOT_VOLATILE)
+.Description(L"Fits a line to points and keeps the fit in the workbook.")
+.Arg(L"Points", L"Two columns of x and y values");
@@ -0,0 +1,283 @@
+////////////////////////////////////////////////////////////////////////////
+// Advise.cpp -- recommend changes to the registered function attributes
+//
+// advise reads the type text that each function was registered with and
+// the time it took in each recalculation, and estimates how much shorter
+// the recalculations would be if a function were registered as
+// thread-safe ('$') or no longer as volatile ('!').
+//
+// The estimate uses a simple model of multi-threaded recalculation. In
+// each recalculation, the functions that are not thread-safe take M on
+// the main thread, and the thread-safe functions take S spread over N
+// calculation threads, so the functions take at least
+//
+//     T(M, S) = max(M, (M + S) / N).
+//
+// The rest of the measured duration is Excel's own work and the
+// dependencies between cells, and is assumed not to change. Registering
+// a function as thread-safe moves its time from M to S; registering it
+// as non-volatile removes its time, if its arguments do not change
+// between recalculations. The savings of each change are estimated
+// separately, so they do not add up when both are made.
+//
+
+#include "Commands.h"
+#include "TraceReader.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <thread>
+
+// Time spent in the recalculations, split as in the model above.
+struct RecalcTime
+{
+	double duration;
+	double mainOnly;
+	double threadSafe;
+};
+
+// Time of the top-level calls of a function, which include the calls
+// nested in them, scaled up if only a sample of the calls was recorded.
+struct FunctionTime
+{
+	uint32_t functionId;
+	double calls;
+	double ticks;
+};
+
+struct AttributeAdvice
+{
+	uint32_t functionId;
+	const char *change;
+	const char *note;
+	double calls;
+	double ticks;
+	double savedTicks;
+};
+
+static double EstimateCalcTicks(double mainOnly, double threadSafe, double threads)
+{
+	return std::max(mainOnly, (mainOnly + threadSafe) / threads);
+}
+
+static std::vector<FunctionTime> CollectFunctionTimes(const TraceData &data)
+{
+	std::vector<FunctionTime> times(data.functions.size());
+	for (size_t i = 0; i < times.size(); i++)
+	{
+		FunctionTime t = { (uint32_t)i, 0.0, 0.0 };
+		times[i] = t;
+	}
+
+	std::vector<CallTreeEntry> tree;
+	BuildCallTree(data, tree);
+	for (const CallTreeEntry &entry : tree)
+	{
+		uint32_t functionId = data.calls[entry.call].functionId;
+		if (entry.parent != CallTreeEntry::NoParent || functionId >= times.size())
+			continue;
+		times[functionId].calls += data.sampleInterval;
+		times[functionId].ticks += (double)entry.inclusiveTicks * data.sampleInterval;
+	}
+
+	// Counting mode does not tell which calls are top-level, so the
+	// inclusive time of each function is taken; this counts a function
+	// that is only called by other functions twice.
+	for (size_t i = 0; i < data.counts.size() && i < times.size(); i++)
+	{
+		times[i].calls += (double)data.counts[i].calls;
+		times[i].ticks += (double)data.counts[i].inclusiveTicks;
+	}
+	return times;
+}
+
+// Estimates the time saved over all recalculations by moving a share of
+// the time of one kind of functions to another kind, or by removing it.
+// fromMainOnly tells which kind the time is taken from; toThreadSafe
+// tells whether it is added to the thread-safe time.
+static double EstimateSaving(const std::vector<RecalcTime> &recalcs, double threads,
+	double share, bool fromMainOnly, bool toThreadSafe)
+{
+	double saved = 0.0;
+	for (const RecalcTime &r : recalcs)
+	{
+		double moved = share * (fromMainOnly ? r.mainOnly : r.threadSafe);
+		double mainOnly = r.mainOnly - (fromMainOnly ? moved : 0.0);
+		double threadSafe = r.threadSafe - (fromMainOnly ? 0.0 : moved) + (toThreadSafe ? moved : 0.0);
+		saved += EstimateCalcTicks(r.mainOnly, r.threadSafe, threads) -
+			EstimateCalcTicks(mainOnly, threadSafe, threads);
+	}
+	return saved;
+}
+
+static void PrintAdviseUsage()
+{
+	fprintf(stderr, "usage: XllProfTool advise <trace.xlpt> [--output <file.csv>] [--threads <n>]\n");
+}
+
+int AdviseCommand(int argc, char *argv[])
+{
+	const char *traceFileName = nullptr;
+	const char *outputFileName = "-";
+	int threadCount = 0;
+
+	for (int i = 0; i < argc; i++)
+	{
+		const char *arg = argv[i];
+		if (strcmp(arg, "--output") == 0 && i + 1 < argc)
+			outputFileName = argv[++i];
+		else if (strcmp(arg, "--threads") == 0 && i + 1 < argc)
+			threadCount = atoi(argv[++i]);
+		else if (arg[0] != '-' && traceFileName == nullptr)
+			traceFileName = arg;
+		else
+		{
+			fprintf(stderr, "error: unexpected argument %s\n", arg);
+			return 2;
+		}
+	}
+
+	if (traceFileName == nullptr || threadCount < 0)
+	{
+		PrintAdviseUsage();
+		return 2;
+	}
+
+	TraceData data;
+	std::string error;
+	if (!ReadTraceFile(traceFileName, data, error))
+	{
+		fprintf(stderr, "error: %s\n", error.c_str());
+		return 1;
+	}
+
+	std::vector<FunctionTime> times = CollectFunctionTimes(data);
+	double mainOnlyTicks = 0.0, threadSafeTicks = 0.0;
+	bool hasTypeText = false;
+	for (const FunctionTime &t : times)
+	{
+		const std::string &typeText = data.functions[t.functionId].typeText;
+		hasTypeText = hasTypeText || !typeText.empty();
+		if (typeText.empty())
+			continue;
+		if (typeText.find('$') != std::string::npos)
+			threadSafeTicks += t.ticks;
+		else
+			mainOnlyTicks += t.ticks;
+	}
+	if (!hasTypeText)
+	{
+		fprintf(stderr, "error: the trace does not have the type text of the functions; "
+			"record it again with this version of XllProfiler\n");
+		return 1;
+	}
+
+	// Use the number of threads that made calls in a recalculation,
+	// unless it was only the main thread because no function was
+	// thread-safe.
+	std::vector<RecalcTime> recalcs;
+	uint32_t observedThreads = 1;
+	for (const TraceRecalc &recalc : data.recalcs)
+	{
+		const TraceRecalcRecord &r = recalc.summary;
+		RecalcTime t = { (double)(r.endTicks - r.startTicks),
+			(double)(r.busyTicks - r.threadSafeTicks), (double)r.threadSafeTicks };
+		recalcs.push_back(t);
+		observedThreads = std::max(observedThreads, r.threadCount);
+	}
+	if (threadCount == 0)
+	{
+		threadCount = (int)observedThreads;
+		if (threadCount == 1)
+		{
+			threadCount = std::max(2, (int)std::thread::hardware_concurrency());
+			fprintf(stderr, "note: the recalculations used one thread; assuming %d "
+				"calculation threads, use --threads to change\n", threadCount);
+		}
+	}
+	if (recalcs.empty())
+	{
+		// Without recalculation summaries, treat the whole trace as one
+		// recalculation that only consists of the function calls.
+		fprintf(stderr, "note: the trace has no recalculations; the savings are "
+			"relative to the time of the functions alone\n");
+		RecalcTime t = { EstimateCalcTicks(mainOnlyTicks, threadSafeTicks, threadCount),
+			mainOnlyTicks, threadSafeTicks };
+		recalcs.push_back(t);
+	}
+
+	std::vector<AttributeAdvice> advice;
+	for (const FunctionTime &t : times)
+	{
+		const std::string &typeText = data.functions[t.functionId].typeText;
+		if (typeText.empty() || t.calls == 0)
+			continue;
+
+		bool isThreadSafe = (typeText.find('$') != std::string::npos);
+		bool isVolatile = (typeText.find('!') != std::string::npos);
+		double kindTicks = isThreadSafe ? threadSafeTicks : mainOnlyTicks;
+		double share = (kindTicks > 0) ? t.ticks / kindTicks : 0.0;
+		if (!isThreadSafe)
+		{
+			AttributeAdvice a = { t.functionId, "add $",
+				(typeText.find('#') != std::string::npos) ?
+					"also requires removing #, which Excel does not allow with $" : "",
+				t.calls, t.ticks, EstimateSaving(recalcs, threadCount, share, true, true) };
+			advice.push_back(a);
+		}
+		if (isVolatile)
+		{
+			AttributeAdvice a = { t.functionId, "remove !",
+				"upper bound if its arguments rarely change; excludes dependent cells",
+				t.calls, t.ticks, EstimateSaving(recalcs, threadCount, share, !isThreadSafe, false) };
+			advice.push_back(a);
+		}
+	}
+	std::stable_sort(advice.begin(), advice.end(), [](const AttributeAdvice &a, const AttributeAdvice &b) {
+		return a.savedTicks > b.savedTicks;
+	});
+
+	double totalTicks = 0.0;
+	for (const RecalcTime &r : recalcs)
+		totalTicks += r.duration;
+
+	FILE *fp = (strcmp(outputFileName, "-") == 0) ? stdout : fopen(outputFileName, "wb");
+	if (fp == nullptr)
+	{
+		fprintf(stderr, "error: cannot create %s\n", outputFileName);
+		return 1;
+	}
+
+	fputs("Rank,Function,DLL,Type,Change,Calls,Time (ms),Saving (ms),Saving (%),Speedup,Note\n", fp);
+	int rank = 0;
+	for (const AttributeAdvice &a : advice)
+	{
+		const TraceFunctionInfo &f = data.functions[a.functionId];
+		fprintf(fp, "%d,", ++rank);
+		WriteCsvString(fp, f.name);
+		fputc(',', fp);
+		WriteCsvString(fp, f.dllName);
+		fputc(',', fp);
+		WriteCsvString(fp, f.typeText);
+		fprintf(fp, ",%s,%.0f,%.3f,%.3f,%.1f,%.2f,", a.change, a.calls,
+			data.TicksToMicroseconds(a.ticks) / 1000.0,
+			data.TicksToMicroseconds(a.savedTicks) / 1000.0,
+			(totalTicks > 0) ? a.savedTicks / totalTicks * 100.0 : 0.0,
+			(totalTicks > a.savedTicks) ? totalTicks / (totalTicks - a.savedTicks) : 0.0);
+		WriteCsvString(fp, a.note);
+		fputc('\n', fp);
+	}
+
+	// The combined effect of making every function thread-safe, which
+	// is less than the sum of the separate savings.
+	double allSaved = EstimateSaving(recalcs, threadCount, 1.0, true, true);
+	fprintf(stderr, "note: %u recalculations took %.3f ms; with every function thread-safe "
+		"and %d threads, about %.3f ms\n", (unsigned)data.recalcs.size(),
+		data.TicksToMicroseconds(totalTicks) / 1000.0, threadCount,
+		data.TicksToMicroseconds(totalTicks - allSaved) / 1000.0);
+
+	if (fp != stdout)
+		fclose(fp);
+	return 0;
+}
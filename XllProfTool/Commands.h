@@ -0,0 +1,30 @@
+////////////////////////////////////////////////////////////////////////////
+// Commands.h -- subcommands of XllProfTool
+//
+// Each command receives the arguments that follow its name and returns
+// the exit status of the program.
+//
+
+#pragma once
+
+#include <stdio.h>
+#include <string>
+
+// Converts a trace file to Chrome trace-event JSON, folded stacks and
+// a per-function summary.
+int ConvertCommand(int argc, char *argv[]);
+
+// Replays a corpus of captured arguments against an add-in and reports
+// the latency of each function.
+int ReplayCommand(int argc, char *argv[]);
+
+// Compares two traces or summaries and reports the functions that got
+// slower.
+int DiffCommand(int argc, char *argv[]);
+
+// Estimates the recalculation time saved by registering functions as
+// thread-safe or non-volatile, and lists the changes by saving.
+int AdviseCommand(int argc, char *argv[]);
+
+// Writes a string as a quoted CSV field.
+void WriteCsvString(FILE *fp, const std::string &s);
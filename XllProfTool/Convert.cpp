@@ -0,0 +1,588 @@
+////////////////////////////////////////////////////////////////////////////
+// Convert.cpp -- convert a trace file to other formats
+
+#include "Commands.h"
+#include "TraceReader.h"
+#include "Hotspots.h"
+#include "Recalcs.h"
+#include "Memory.h"
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <map>
+
+static void WriteJsonString(FILE *fp, const std::string &s)
+{
+	fputc('"', fp);
+	for (unsigned char c : s)
+	{
+		if (c == '"' || c == '\\')
+			fprintf(fp, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(fp, "\\u%04x", c);
+		else
+			fputc(c, fp);
+	}
+	fputc('"', fp);
+}
+
+// Excel functions that add-ins commonly call back, by function number.
+static const struct
+{
+	int xlfn;
+	const char *name;
+} s_excelFunctionNames[] =
+{
+	{ 0x4000, "xlFree" },
+	{ 0x4001, "xlStack" },
+	{ 0x4002, "xlCoerce" },
+	{ 0x4003, "xlSet" },
+	{ 0x4004, "xlSheetId" },
+	{ 0x4005, "xlSheetNm" },
+	{ 0x4006, "xlAbort" },
+	{ 0x4007, "xlGetInst" },
+	{ 0x4008, "xlGetHwnd" },
+	{ 0x4009, "xlGetName" },
+	{ 0x400A, "xlEnableXLMsgs" },
+	{ 0x400B, "xlDisableXLMsgs" },
+	{ 0x400C, "xlDefineBinaryName" },
+	{ 0x400D, "xlGetBinaryName" },
+	{ 0x400E, "xlGetFmlaInfo" },
+	{ 0x400F, "xlGetMouseInfo" },
+	{ 0x4010, "xlAsyncReturn" },
+	{ 0x4011, "xlEventRegister" },
+	{ 0x4012, "xlRunningOnCluster" },
+	{ 0x4013, "xlGetInstPtr" },
+	{ 29, "xlfIndex" },
+	{ 88, "xlfSetName" },
+	{ 89, "xlfCaller" },
+	{ 107, "xlfGetName" },
+	{ 145, "xlfGetDef" },
+	{ 149, "xlfRegister" },
+	{ 185, "xlfGetCell" },
+	{ 186, "xlfGetWorkspace" },
+	{ 187, "xlfGetWindow" },
+	{ 188, "xlfGetDocument" },
+	{ 201, "xlfUnregister" },
+	{ 237, "xlfVolatile" },
+	{ 255, "xlUDF" },
+	{ 257, "xlfEvaluate" },
+	{ 268, "xlfGetWorkbook" },
+	{ 379, "xlfRtd" },
+	{ 0x8000 | 31, "xlcCalculateNow" },
+	{ 0x8000 | 118, "xlcAlert" },
+	{ 0x8000 | 148, "xlcOnTime" },
+	{ 0x8000 | 167, "xlcCalculateDocument" },
+};
+
+// Returns the name of an Excel function, or "xlfn <number>". The
+// xlIntl and xlPrompt flags are ignored.
+static std::string GetExcelFunctionName(int xlfn)
+{
+	int number = xlfn & ~(0x2000 | 0x1000);
+	for (const auto &f : s_excelFunctionNames)
+	{
+		if (f.xlfn == number)
+			return f.name;
+	}
+	return "xlfn " + std::to_string((long long)xlfn);
+}
+
+// Writes one complete ("X") event per call, which chrome://tracing and
+// Perfetto display as nested spans per thread. Callbacks into Excel
+// appear nested in the calls that made them.
+static void WriteChromeTrace(FILE *fp, const TraceData &data)
+{
+	fputs("{\"traceEvents\":[", fp);
+	bool first = true;
+	for (const TraceCallEvent &e : data.calls)
+	{
+		fputs(first ? "\n" : ",\n", fp);
+		first = false;
+		fputs("{\"name\":", fp);
+		WriteJsonString(fp, data.GetFunctionName(e.functionId));
+		fprintf(fp, ",\"cat\":\"udf\",\"ph\":\"X\",\"pid\":%u,\"tid\":%u,"
+			"\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"depth\":%u}}",
+			data.processId, e.threadId,
+			data.TimestampToMicroseconds(e.enterTicks),
+			data.TicksToMicroseconds((double)(e.exitTicks - e.enterTicks)),
+			e.depth);
+	}
+	for (const TraceCallbackEvent &e : data.callbacks)
+	{
+		fputs(first ? "\n" : ",\n", fp);
+		first = false;
+		fputs("{\"name\":", fp);
+		WriteJsonString(fp, GetExcelFunctionName(e.xlfn));
+		fprintf(fp, ",\"cat\":\"callback\",\"ph\":\"X\",\"pid\":%u,\"tid\":%u,"
+			"\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"caller\":",
+			data.processId, e.threadId,
+			data.TimestampToMicroseconds(e.enterTicks),
+			data.TicksToMicroseconds((double)(e.exitTicks - e.enterTicks)));
+		WriteJsonString(fp, data.GetFunctionName(e.functionId));
+		fprintf(fp, ",\"result\":%d}}", e.result);
+	}
+	for (const TraceRecalc &recalc : data.recalcs)
+	{
+		// Shown on a track of their own, as thread 0 is never a real thread.
+		const TraceRecalcRecord &r = recalc.summary;
+		fputs(first ? "\n" : ",\n", fp);
+		first = false;
+		fprintf(fp, "{\"name\":\"Recalc %u\",\"cat\":\"recalc\",\"ph\":\"X\",\"pid\":%u,\"tid\":0,"
+			"\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"calls\":%llu,\"threads\":%u,\"canceled\":%s}}",
+			r.recalcId, data.processId,
+			data.TimestampToMicroseconds(r.startTicks),
+			data.TicksToMicroseconds((double)(r.endTicks - r.startTicks)),
+			(unsigned long long)r.calls, r.threadCount,
+			(r.status == TraceRecalcCanceled) ? "true" : "false");
+	}
+	fputs("\n],\"displayTimeUnit\":\"ns\"}\n", fp);
+}
+
+// Writes one line per distinct call stack, with the frames separated
+// by semicolons followed by the self time of the innermost frame in
+// nanoseconds. This is the input format of flamegraph.pl and of most
+// flame graph viewers.
+static void WriteFoldedStacks(FILE *fp, const TraceData &data, const std::vector<CallTreeEntry> &tree)
+{
+	std::vector<std::string> stacks(tree.size());
+	std::map<std::string, double> folded;
+	for (size_t i = 0; i < tree.size(); i++)
+	{
+		const CallTreeEntry &entry = tree[i];
+		std::string name = data.GetFunctionName(data.calls[entry.call].functionId);
+		std::replace(name.begin(), name.end(), ';', ':');
+		std::replace(name.begin(), name.end(), ' ', '_');
+		stacks[i] = (entry.parent == CallTreeEntry::NoParent) ?
+			name : stacks[entry.parent] + ";" + name;
+		folded[stacks[i]] += data.TicksToMicroseconds((double)entry.selfTicks) * 1000.0;
+	}
+
+	for (const auto &kv : folded)
+	{
+		fprintf(fp, "%s %.0f\n", kv.first.c_str(), kv.second);
+	}
+}
+
+void WriteCsvString(FILE *fp, const std::string &s)
+{
+	fputc('"', fp);
+	for (char c : s)
+	{
+		if (c == '"')
+			fputc('"', fp);
+		fputc(c, fp);
+	}
+	fputc('"', fp);
+}
+
+// Writes the mean processor counts per call of a function, and its IPC.
+static void WriteHardwareColumns(FILE *fp, const TraceData &data, uint32_t functionId)
+{
+	static const int s_columns[] =
+	{
+		TraceHardwareCycles,
+		TraceHardwareInstructions,
+		-1, // IPC
+		TraceHardwareL1DataMisses,
+		TraceHardwareLastLevelMisses,
+		TraceHardwareBranchMisses,
+	};
+
+	const TraceFunctionHardware *h = (functionId < data.hardware.size() &&
+		data.hardware[functionId].calls > 0) ? &data.hardware[functionId] : nullptr;
+	for (int counter : s_columns)
+	{
+		fputc(',', fp);
+		if (h == nullptr)
+			continue;
+		if (counter >= 0)
+		{
+			if (h->available & (1u << counter))
+				fprintf(fp, "%.1f", (double)h->counts[counter] / h->calls);
+		}
+		else
+		{
+			const unsigned int mask = (1u << TraceHardwareCycles) | (1u << TraceHardwareInstructions);
+			if ((h->available & mask) == mask && h->counts[TraceHardwareCycles] > 0)
+			{
+				fprintf(fp, "%.2f", (double)h->counts[TraceHardwareInstructions] /
+					h->counts[TraceHardwareCycles]);
+			}
+		}
+	}
+}
+
+struct FunctionSummary
+{
+	uint32_t functionId;
+	unsigned long long calls;
+	double inclusiveTicks;
+	double selfTicks;
+	uint64_t maxTicks;
+};
+
+// Writes a CSV table of the call count, and inclusive and self time,
+// of each function, sorted by self time. Time spent in recursive calls
+// is counted once in the inclusive time of the outermost call. If only
+// a sample of the calls was recorded, the counts and total times are
+// scaled up to estimate those of all calls. The maximum time is not
+// known for calls recorded in counting mode. If processor counters were
+// read, the mean counts per call and the instructions per cycle (IPC)
+// follow, and are left empty where a counter was not available.
+static void WriteSummary(FILE *fp, const TraceData &data, const std::vector<CallTreeEntry> &tree)
+{
+	std::vector<FunctionSummary> summary(data.functions.size());
+	for (size_t i = 0; i < summary.size(); i++)
+	{
+		FunctionSummary s = { (uint32_t)i, 0, 0.0, 0.0, 0 };
+		summary[i] = s;
+	}
+
+	for (size_t index = 0; index < tree.size(); index++)
+	{
+		const CallTreeEntry &entry = tree[index];
+		const TraceCallEvent &e = data.calls[entry.call];
+		if (e.functionId >= summary.size())
+		{
+			size_t n = summary.size();
+			summary.resize(e.functionId + 1);
+			for (size_t i = n; i < summary.size(); i++)
+			{
+				FunctionSummary s = { (uint32_t)i, 0, 0.0, 0.0, 0 };
+				summary[i] = s;
+			}
+		}
+
+		FunctionSummary &s = summary[e.functionId];
+		uint64_t ticks = entry.inclusiveTicks;
+		s.calls++;
+		s.selfTicks += (double)entry.selfTicks;
+		s.maxTicks = std::max(s.maxTicks, ticks);
+
+		// Only count the inclusive time of a call if the function is
+		// not already on the stack.
+		if (!IsRecursiveCall(data, tree, index))
+			s.inclusiveTicks += (double)ticks;
+	}
+
+	for (FunctionSummary &s : summary)
+	{
+		s.calls *= data.sampleInterval;
+		s.inclusiveTicks *= data.sampleInterval;
+		s.selfTicks *= data.sampleInterval;
+	}
+
+	for (size_t i = 0; i < data.counts.size(); i++)
+	{
+		if (i >= summary.size())
+		{
+			FunctionSummary s = { (uint32_t)i, 0, 0.0, 0.0, 0 };
+			summary.push_back(s);
+		}
+		FunctionSummary &s = summary[i];
+		s.calls += data.counts[i].calls;
+		s.inclusiveTicks += (double)data.counts[i].inclusiveTicks;
+		s.selfTicks += (double)data.counts[i].selfTicks;
+	}
+
+	std::sort(summary.begin(), summary.end(), [](const FunctionSummary &a, const FunctionSummary &b) {
+		return a.selfTicks > b.selfTicks;
+	});
+
+	bool hasHardware = !data.hardware.empty();
+	fputs("Function,DLL,Calls,Inclusive (ms),Self (ms),Mean (us),Mean Self (us),Max (us)", fp);
+	if (hasHardware)
+		fputs(",Cycles/Call,Instructions/Call,IPC,L1D Misses/Call,LLC Misses/Call,Branch Misses/Call", fp);
+	fputc('\n', fp);
+	for (const FunctionSummary &s : summary)
+	{
+		if (s.calls == 0)
+			continue;
+		std::string dllName = (s.functionId < data.functions.size()) ?
+			data.functions[s.functionId].dllName : std::string();
+		WriteCsvString(fp, data.GetFunctionName(s.functionId));
+		fputc(',', fp);
+		WriteCsvString(fp, dllName);
+		fprintf(fp, ",%llu,%.3f,%.3f,%.3f,%.3f,", s.calls,
+			data.TicksToMicroseconds(s.inclusiveTicks) / 1000.0,
+			data.TicksToMicroseconds(s.selfTicks) / 1000.0,
+			data.TicksToMicroseconds(s.inclusiveTicks / s.calls),
+			data.TicksToMicroseconds(s.selfTicks / s.calls));
+		if (s.maxTicks > 0)
+			fprintf(fp, "%.3f", data.TicksToMicroseconds((double)s.maxTicks));
+		if (hasHardware)
+			WriteHardwareColumns(fp, data, s.functionId);
+		fputc('\n', fp);
+	}
+}
+
+struct CallbackSummary
+{
+	int xlfn;
+	uint32_t functionId;
+	double calls;
+	double failures;
+	double ticks;
+	uint64_t maxTicks;
+};
+
+// Writes a CSV table of the callbacks into Excel made by each function,
+// sorted by total time. Callbacks made outside any instrumented call
+// are listed with the caller "(none)". Callbacks in sampled calls are
+// scaled up like the summary. A failure is a callback that did not
+// return xlretSuccess.
+static void WriteCallbackSummary(FILE *fp, const TraceData &data)
+{
+	std::map<std::pair<int, uint32_t>, CallbackSummary> groups;
+	for (const TraceCallbackEvent &e : data.callbacks)
+	{
+		CallbackSummary &s = groups[std::make_pair(e.xlfn, e.functionId)];
+		double scale = (e.functionId != TraceNoFunction) ? data.sampleInterval : 1.0;
+		uint64_t ticks = e.exitTicks - e.enterTicks;
+		s.xlfn = e.xlfn;
+		s.functionId = e.functionId;
+		s.calls += scale;
+		if (e.result != 0)
+			s.failures += scale;
+		s.ticks += (double)ticks * scale;
+		s.maxTicks = std::max(s.maxTicks, ticks);
+	}
+
+	std::vector<CallbackSummary> summary;
+	for (const auto &kv : groups)
+		summary.push_back(kv.second);
+	std::sort(summary.begin(), summary.end(), [](const CallbackSummary &a, const CallbackSummary &b) {
+		return a.ticks > b.ticks;
+	});
+
+	fputs("Callback,Caller,Calls,Failures,Total (ms),Mean (us),Max (us)\n", fp);
+	for (const CallbackSummary &s : summary)
+	{
+		WriteCsvString(fp, GetExcelFunctionName(s.xlfn));
+		fputc(',', fp);
+		WriteCsvString(fp, data.GetFunctionName(s.functionId));
+		fprintf(fp, ",%.0f,%.0f,%.3f,%.3f,%.3f\n", s.calls, s.failures,
+			data.TicksToMicroseconds(s.ticks) / 1000.0,
+			data.TicksToMicroseconds(s.ticks / s.calls),
+			data.TicksToMicroseconds((double)s.maxTicks));
+	}
+}
+
+static FILE* OpenOutput(const char *fileName)
+{
+	if (strcmp(fileName, "-") == 0)
+		return stdout;
+	FILE *fp = fopen(fileName, "wb");
+	if (fp == nullptr)
+		fprintf(stderr, "error: cannot create %s\n", fileName);
+	return fp;
+}
+
+static void CloseOutput(FILE *fp)
+{
+	if (fp != stdout)
+		fclose(fp);
+	else
+		fflush(fp);
+}
+
+int ConvertCommand(int argc, char *argv[])
+{
+	const char *traceFileName = nullptr;
+	const char *chromeFileName = nullptr;
+	const char *foldedFileName = nullptr;
+	const char *summaryFileName = nullptr;
+	const char *callbacksFileName = nullptr;
+	const char *hotspotsFileName = nullptr;
+	const char *heatMapFileName = nullptr;
+	const char *recalcsFileName = nullptr;
+	const char *recalcThreadsFileName = nullptr;
+	const char *memoryFileName = nullptr;
+
+	for (int i = 0; i < argc; i++)
+	{
+		const char *arg = argv[i];
+		if (strcmp(arg, "--chrome") == 0 && i + 1 < argc)
+			chromeFileName = argv[++i];
+		else if (strcmp(arg, "--folded") == 0 && i + 1 < argc)
+			foldedFileName = argv[++i];
+		else if (strcmp(arg, "--summary") == 0 && i + 1 < argc)
+			summaryFileName = argv[++i];
+		else if (strcmp(arg, "--callbacks") == 0 && i + 1 < argc)
+			callbacksFileName = argv[++i];
+		else if (strcmp(arg, "--hotspots") == 0 && i + 1 < argc)
+			hotspotsFileName = argv[++i];
+		else if (strcmp(arg, "--heatmap") == 0 && i + 1 < argc)
+			heatMapFileName = argv[++i];
+		else if (strcmp(arg, "--recalcs") == 0 && i + 1 < argc)
+			recalcsFileName = argv[++i];
+		else if (strcmp(arg, "--recalc-threads") == 0 && i + 1 < argc)
+			recalcThreadsFileName = argv[++i];
+		else if (strcmp(arg, "--memory") == 0 && i + 1 < argc)
+			memoryFileName = argv[++i];
+		else if (arg[0] != '-' && traceFileName == nullptr)
+			traceFileName = arg;
+		else
+		{
+			fprintf(stderr, "error: unexpected argument %s\n", arg);
+			return 2;
+		}
+	}
+
+	if (traceFileName == nullptr)
+	{
+		fprintf(stderr, "usage: XllProfTool convert <trace.xlpt> "
+			"[--chrome <file.json>] [--folded <file.txt>] [--summary <file.csv>]\n"
+			"       [--callbacks <file.csv>] [--hotspots <file.csv>] [--heatmap <file.csv>]\n"
+			"       [--recalcs <file.csv>] [--recalc-threads <file.csv>]\n"
+			"       [--memory <file.csv>]\n");
+		return 2;
+	}
+	if (chromeFileName == nullptr && foldedFileName == nullptr && summaryFileName == nullptr &&
+		callbacksFileName == nullptr && hotspotsFileName == nullptr && heatMapFileName == nullptr &&
+		recalcsFileName == nullptr && recalcThreadsFileName == nullptr &&
+		memoryFileName == nullptr)
+		summaryFileName = "-";
+
+	TraceData data;
+	std::string error;
+	if (!ReadTraceFile(traceFileName, data, error))
+	{
+		fprintf(stderr, "error: %s\n", error.c_str());
+		return 1;
+	}
+	if (data.droppedCalls > 0)
+	{
+		fprintf(stderr, "warning: %llu calls were dropped while recording\n",
+			data.droppedCalls);
+	}
+	if (data.sampleInterval > 1)
+	{
+		fprintf(stderr, "note: 1 in %u top-level calls was recorded; the summary "
+			"is scaled accordingly\n", data.sampleInterval);
+	}
+	if (data.calls.empty() && !data.counts.empty() &&
+		(chromeFileName != nullptr || foldedFileName != nullptr))
+	{
+		fprintf(stderr, "warning: the trace was recorded in counting mode and "
+			"only has a summary\n");
+	}
+
+	if (data.cells.empty() && (hotspotsFileName != nullptr || heatMapFileName != nullptr))
+	{
+		fprintf(stderr, "warning: the trace has no calling cells; set "
+			"XLL_PROFILER_CALLERS=1 to record them\n");
+	}
+	if (data.recalcs.empty() && (recalcsFileName != nullptr || recalcThreadsFileName != nullptr))
+	{
+		fprintf(stderr, "warning: the trace has no recalculations; they are "
+			"only recorded while the add-in is loaded in Excel\n");
+	}
+
+	std::vector<CallTreeEntry> tree;
+	BuildCallTree(data, tree);
+
+	int status = 0;
+	if (chromeFileName != nullptr)
+	{
+		if (FILE *fp = OpenOutput(chromeFileName))
+		{
+			WriteChromeTrace(fp, data);
+			CloseOutput(fp);
+		}
+		else
+			status = 1;
+	}
+	if (foldedFileName != nullptr)
+	{
+		if (FILE *fp = OpenOutput(foldedFileName))
+		{
+			WriteFoldedStacks(fp, data, tree);
+			CloseOutput(fp);
+		}
+		else
+			status = 1;
+	}
+	if (summaryFileName != nullptr)
+	{
+		if (FILE *fp = OpenOutput(summaryFileName))
+		{
+			WriteSummary(fp, data, tree);
+			CloseOutput(fp);
+		}
+		else
+			status = 1;
+	}
+	if (callbacksFileName != nullptr)
+	{
+		if (data.callbacks.empty())
+		{
+			fprintf(stderr, "warning: the trace has no callbacks; set "
+				"XLL_PROFILER_CALLBACKS=1 to record them\n");
+		}
+		if (FILE *fp = OpenOutput(callbacksFileName))
+		{
+			WriteCallbackSummary(fp, data);
+			CloseOutput(fp);
+		}
+		else
+			status = 1;
+	}
+	if (hotspotsFileName != nullptr)
+	{
+		if (FILE *fp = OpenOutput(hotspotsFileName))
+		{
+			WriteHotspots(fp, data, tree);
+			CloseOutput(fp);
+		}
+		else
+			status = 1;
+	}
+	if (heatMapFileName != nullptr)
+	{
+		if (FILE *fp = OpenOutput(heatMapFileName))
+		{
+			WriteHeatMap(fp, data, tree);
+			CloseOutput(fp);
+		}
+		else
+			status = 1;
+	}
+	if (recalcsFileName != nullptr)
+	{
+		if (FILE *fp = OpenOutput(recalcsFileName))
+		{
+			WriteRecalcSummary(fp, data);
+			CloseOutput(fp);
+		}
+		else
+			status = 1;
+	}
+	if (recalcThreadsFileName != nullptr)
+	{
+		if (FILE *fp = OpenOutput(recalcThreadsFileName))
+		{
+			WriteRecalcThreads(fp, data);
+			CloseOutput(fp);
+		}
+		else
+			status = 1;
+	}
+	if (memoryFileName != nullptr)
+	{
+		if (data.memory.empty())
+		{
+			fprintf(stderr, "warning: the trace has no allocation counts; set "
+				"XLL_PROFILER_MEMORY=1 to record them\n");
+		}
+		if (FILE *fp = OpenOutput(memoryFileName))
+		{
+			WriteMemorySummary(fp, data);
+			CloseOutput(fp);
+		}
+		else
+			status = 1;
+	}
+	return status;
+}
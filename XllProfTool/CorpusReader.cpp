@@ -0,0 +1,186 @@
+////////////////////////////////////////////////////////////////////////////
+// CorpusReader.cpp -- load a corpus of captured arguments
+
+#include "CorpusReader.h"
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+class CorpusParser
+{
+	const unsigned char *m_p;
+	const unsigned char *m_end;
+
+public:
+	CorpusParser(const void *data, size_t size)
+		: m_p(static_cast<const unsigned char*>(data)), m_end(m_p + size)
+	{
+	}
+
+	bool Bytes(void *data, size_t size)
+	{
+		if ((size_t)(m_end - m_p) < size)
+			return false;
+		memcpy(data, m_p, size);
+		m_p += size;
+		return true;
+	}
+
+	bool UInt32(uint32_t &value) { return Bytes(&value, sizeof(value)); }
+	bool Int32(int32_t &value) { return Bytes(&value, sizeof(value)); }
+
+	bool String(std::string &s)
+	{
+		const unsigned char *end = std::find(m_p, m_end, '\0');
+		if (end == m_end)
+			return false;
+		s.assign(m_p, end);
+		m_p = end + 1;
+		return true;
+	}
+
+	bool Value(CorpusValue &value)
+	{
+		unsigned char tag;
+		if (!Bytes(&tag, 1))
+			return false;
+
+		value.tag = (CorpusValueTag)tag;
+		switch (tag)
+		{
+		case CorpusNumber:
+			return Bytes(&value.number, sizeof(value.number));
+		case CorpusInteger:
+		case CorpusError:
+			return Int32(value.integer);
+		case CorpusBoolean:
+			{
+				unsigned char b;
+				if (!Bytes(&b, 1))
+					return false;
+				value.integer = b;
+				return true;
+			}
+		case CorpusString:
+			{
+				uint32_t length;
+				if (!UInt32(length) || (size_t)(m_end - m_p) / 2 < length)
+					return false;
+				value.text.resize(length);
+				return length == 0 || Bytes(&value.text[0], length * 2);
+			}
+		case CorpusMissing:
+		case CorpusNil:
+		case CorpusUnsupported:
+			return true;
+		case CorpusArray:
+			{
+				if (!UInt32(value.rows) || !UInt32(value.columns))
+					return false;
+				size_t count = (size_t)value.rows * value.columns;
+				if (count > (size_t)(m_end - m_p)) // each value takes a byte at least
+					return false;
+				value.elements.resize(count);
+				for (CorpusValue &element : value.elements)
+				{
+					if (!Value(element))
+						return false;
+				}
+				return true;
+			}
+		case CorpusNumberArray:
+			{
+				if (!UInt32(value.rows) || !UInt32(value.columns))
+					return false;
+				size_t count = (size_t)value.rows * value.columns;
+				if (count > (size_t)(m_end - m_p) / sizeof(double))
+					return false;
+				value.numbers.resize(count);
+				return count == 0 || Bytes(&value.numbers[0], count * sizeof(double));
+			}
+		default:
+			return false;
+		}
+	}
+};
+
+bool ReadCorpusFile(const char *fileName, CorpusData &data, std::string &error)
+{
+	FILE *fp = fopen(fileName, "rb");
+	if (fp == nullptr)
+	{
+		error = std::string("cannot open ") + fileName;
+		return false;
+	}
+
+	CorpusFileHeader header;
+	if (fread(&header, sizeof(header), 1, fp) != 1 ||
+		header.magic != XLL_CORPUS_FILE_MAGIC ||
+		header.version != XLL_CORPUS_FILE_VERSION)
+	{
+		fclose(fp);
+		error = std::string(fileName) + " is not a corpus file of a supported version";
+		return false;
+	}
+	data.sampleInterval = header.sampleInterval;
+
+	TraceChunkHeader chunk;
+	std::vector<char> payload;
+	while (fread(&chunk, sizeof(chunk), 1, fp) == 1)
+	{
+		payload.resize(chunk.size);
+		if (chunk.size > 0 && fread(&payload[0], 1, chunk.size, fp) != chunk.size)
+			break; // truncated
+
+		CorpusParser parser(payload.data(), payload.size());
+		switch (chunk.type)
+		{
+		case CorpusChunkFunction:
+			{
+				CorpusFunctionRecord record;
+				CorpusFunction f;
+				if (parser.Bytes(&record, sizeof(record)) &&
+					parser.String(f.name) && parser.String(f.dllName) &&
+					parser.String(f.entryPointName) && parser.String(f.typeText))
+				{
+					ParseTypeText(f.typeText.c_str(), f.signature);
+					if (record.functionId >= data.functions.size())
+						data.functions.resize(record.functionId + 1);
+					data.functions[record.functionId] = f;
+				}
+			}
+			break;
+
+		case CorpusChunkCall:
+			{
+				CorpusCallRecord record;
+				if (!parser.Bytes(&record, sizeof(record)) ||
+					record.argumentCount > payload.size())
+					break;
+
+				CorpusCall call;
+				call.functionId = record.functionId;
+				call.threadId = record.threadId;
+				call.arguments.resize(record.argumentCount);
+				bool ok = true;
+				for (CorpusValue &value : call.arguments)
+				{
+					if (!parser.Value(value))
+					{
+						ok = false;
+						break;
+					}
+				}
+				if (ok)
+					data.calls.push_back(std::move(call));
+			}
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	fclose(fp);
+	return true;
+}
@@ -0,0 +1,57 @@
+////////////////////////////////////////////////////////////////////////////
+// CorpusReader.h -- load a corpus of captured arguments
+
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "CorpusFormat.h"
+
+struct CorpusValue
+{
+	CorpusValueTag tag;
+	double number;               // CorpusNumber
+	int32_t integer;             // CorpusInteger, CorpusBoolean, CorpusError
+	std::vector<uint16_t> text;  // CorpusString, in UTF-16
+	uint32_t rows;               // CorpusArray, CorpusNumberArray
+	uint32_t columns;
+	std::vector<CorpusValue> elements; // CorpusArray
+	std::vector<double> numbers;       // CorpusNumberArray
+
+	CorpusValue() : tag(CorpusMissing), number(0), integer(0), rows(0), columns(0)
+	{
+	}
+};
+
+struct CorpusFunction
+{
+	std::string name;
+	std::string dllName;
+	std::string entryPointName;
+	std::string typeText;
+	FunctionSignature signature;
+};
+
+struct CorpusCall
+{
+	uint32_t functionId;
+	uint32_t threadId;
+	std::vector<CorpusValue> arguments;
+};
+
+struct CorpusData
+{
+	uint32_t sampleInterval;
+	std::vector<CorpusFunction> functions; // indexed by function id
+	std::vector<CorpusCall> calls;
+
+	CorpusData() : sampleInterval(0)
+	{
+	}
+};
+
+// Reads a corpus file. A file that ends in the middle of a chunk is
+// read up to the last complete chunk. Returns false and sets error if
+// the file cannot be read or is not a corpus file.
+bool ReadCorpusFile(const char *fileName, CorpusData &data, std::string &error);
@@ -0,0 +1,590 @@
+////////////////////////////////////////////////////////////////////////////
+// Diff.cpp -- compare two profiles of the same add-in
+//
+// diff compares a baseline profile with a new one, function by function,
+// and tells whether the new one is slower by more than chance. Each
+// profile is either a trace file, or a summary CSV written by convert or
+// replay. Functions are matched by their registered name.
+//
+// Traces recorded in event or sampling mode keep the time of each call,
+// so the two sets of call times are compared with the Mann-Whitney U
+// test, which makes no assumption about their distribution; latencies
+// are typically skewed and heavy-tailed, which rules out a t-test.
+// Traces recorded in counting mode and summary CSVs only have totals,
+// so for those the change is reported without a p-value and is judged
+// by the threshold alone.
+//
+// The exit status is 3 if any function regressed, so that the command
+// can gate a build.
+//
+
+#include "Commands.h"
+#include "Diff.h"
+#include "TraceReader.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <map>
+
+// Exit status if a function regressed; 1 and 2 mean error and usage.
+static const int DiffRegressed = 3;
+
+// Number of call times per function that are kept for the significance
+// test. A larger sample only makes a tiny difference significant, and
+// the test sorts the two samples together.
+static const size_t MaxTestSamples = 20000;
+
+//
+// ProfileEntry
+//
+// Timings of the calls of a function in one profile. The percentiles
+// are NaN if the profile does not have them, and samples is empty if
+// the profile does not have the time of each call.
+//
+
+struct ProfileEntry
+{
+	double calls;
+	double totalMicroseconds;
+	double p50Microseconds;
+	double p99Microseconds;
+	std::vector<double> samples; // call times in microseconds
+	unsigned long long seen;     // calls offered to the sample
+
+	ProfileEntry() : calls(0), totalMicroseconds(0), p50Microseconds(NAN),
+		p99Microseconds(NAN), seen(0)
+	{
+	}
+
+	double GetMeanMicroseconds() const
+	{
+		return (calls > 0) ? totalMicroseconds / calls : NAN;
+	}
+};
+
+typedef std::map<std::string, ProfileEntry> Profile;
+
+// Reservoir sampling with a fixed seed, so that the p-values of two runs
+// of the command on the same files agree.
+static void AddSample(ProfileEntry &entry, double value, uint32_t &random)
+{
+	entry.seen++;
+	if (entry.samples.size() < MaxTestSamples)
+	{
+		entry.samples.push_back(value);
+		return;
+	}
+	random ^= random << 13;
+	random ^= random >> 17;
+	random ^= random << 5;
+	unsigned long long slot = random % entry.seen;
+	if (slot < MaxTestSamples)
+		entry.samples[(size_t)slot] = value;
+}
+
+// Returns the p-th percentile of sorted values by the nearest-rank method.
+static double Percentile(const std::vector<double> &sorted, double p)
+{
+	if (sorted.empty())
+		return NAN;
+	size_t rank = (size_t)ceil(p / 100.0 * sorted.size());
+	return sorted[(rank > 0) ? rank - 1 : 0];
+}
+
+// Computes the timings of each function from a trace, the same way as
+// the summary written by convert.
+static void LoadTraceProfile(const TraceData &data, Profile &profile)
+{
+	std::vector<CallTreeEntry> tree;
+	BuildCallTree(data, tree);
+
+	// Percentiles are computed from all recorded calls rather than from
+	// the reservoir.
+	std::map<std::string, std::vector<double>> times;
+	uint32_t random = 2463534242u;
+	for (size_t index = 0; index < tree.size(); index++)
+	{
+		const CallTreeEntry &entry = tree[index];
+		std::string name = data.GetFunctionName(data.calls[entry.call].functionId);
+		double us = data.TicksToMicroseconds((double)entry.inclusiveTicks);
+		ProfileEntry &p = profile[name];
+		p.calls += data.sampleInterval;
+		if (!IsRecursiveCall(data, tree, index))
+			p.totalMicroseconds += us * data.sampleInterval;
+		times[name].push_back(us);
+		AddSample(p, us, random);
+	}
+
+	for (auto &kv : times)
+	{
+		std::sort(kv.second.begin(), kv.second.end());
+		ProfileEntry &p = profile[kv.first];
+		p.p50Microseconds = Percentile(kv.second, 50);
+		p.p99Microseconds = Percentile(kv.second, 99);
+	}
+
+	for (size_t i = 0; i < data.counts.size(); i++)
+	{
+		if (data.counts[i].calls == 0)
+			continue;
+		ProfileEntry &p = profile[data.GetFunctionName((uint32_t)i)];
+		p.calls += (double)data.counts[i].calls;
+		p.totalMicroseconds += data.TicksToMicroseconds((double)data.counts[i].inclusiveTicks);
+	}
+}
+
+// Splits a line of a CSV file into fields.
+static std::vector<std::string> SplitCsvLine(const std::string &line)
+{
+	std::vector<std::string> fields(1);
+	bool quoted = false;
+	for (size_t i = 0; i < line.size(); i++)
+	{
+		char c = line[i];
+		if (quoted)
+		{
+			if (c != '"')
+				fields.back() += c;
+			else if (i + 1 < line.size() && line[i + 1] == '"')
+				fields.back() += line[++i];
+			else
+				quoted = false;
+		}
+		else if (c == '"')
+			quoted = true;
+		else if (c == ',')
+			fields.push_back(std::string());
+		else if (c != '\r' && c != '\n')
+			fields.back() += c;
+	}
+	return fields;
+}
+
+// Reads a summary written by convert or replay. The columns are found
+// by name, so that columns added later do not break the command.
+static bool LoadSummaryProfile(FILE *fp, const char *fileName, Profile &profile, std::string &error)
+{
+	std::vector<std::string> lines;
+	std::string line;
+	for (int c; (c = fgetc(fp)) != EOF; )
+	{
+		if (c == '\n')
+		{
+			lines.push_back(line);
+			line.clear();
+		}
+		else
+			line += (char)c;
+	}
+	if (!line.empty())
+		lines.push_back(line);
+
+	if (lines.empty())
+	{
+		error = std::string(fileName) + " is empty";
+		return false;
+	}
+
+	int nameColumn = -1, callsColumn = -1, totalColumn = -1;
+	int p50Column = -1, p99Column = -1;
+	std::vector<std::string> header = SplitCsvLine(lines[0]);
+	for (size_t i = 0; i < header.size(); i++)
+	{
+		const std::string &h = header[i];
+		if (h == "Function")
+			nameColumn = (int)i;
+		else if (h == "Calls")
+			callsColumn = (int)i;
+		else if (h == "Inclusive (ms)" || h == "Total (ms)")
+			totalColumn = (int)i;
+		else if (h == "P50 (us)")
+			p50Column = (int)i;
+		else if (h == "P99 (us)")
+			p99Column = (int)i;
+	}
+	if (nameColumn < 0 || callsColumn < 0 || totalColumn < 0)
+	{
+		error = std::string(fileName) + " is neither a trace nor a summary";
+		return false;
+	}
+
+	for (size_t n = 1; n < lines.size(); n++)
+	{
+		std::vector<std::string> fields = SplitCsvLine(lines[n]);
+		if (fields.size() < header.size())
+			continue;
+		// A function registered by two add-ins under the same name is
+		// merged; its percentiles are then those of the last one.
+		ProfileEntry &p = profile[fields[nameColumn]];
+		p.calls += atof(fields[callsColumn].c_str());
+		p.totalMicroseconds += atof(fields[totalColumn].c_str()) * 1000.0;
+		if (p50Column >= 0 && !fields[p50Column].empty())
+			p.p50Microseconds = atof(fields[p50Column].c_str());
+		if (p99Column >= 0 && !fields[p99Column].empty())
+			p.p99Microseconds = atof(fields[p99Column].c_str());
+	}
+	return true;
+}
+
+// Loads a trace file or a summary CSV, telling them apart by the magic
+// number at the start of a trace.
+static bool LoadProfile(const char *fileName, Profile &profile, std::string &error)
+{
+	FILE *fp = fopen(fileName, "rb");
+	if (fp == nullptr)
+	{
+		error = std::string("cannot open ") + fileName;
+		return false;
+	}
+	uint32_t magic = 0;
+	bool isTrace = fread(&magic, sizeof(magic), 1, fp) == 1 && magic == XLL_TRACE_FILE_MAGIC;
+	if (isTrace)
+	{
+		fclose(fp);
+		TraceData data;
+		if (!ReadTraceFile(fileName, data, error))
+			return false;
+		if (data.droppedCalls > 0)
+		{
+			fprintf(stderr, "warning: %llu calls were dropped while recording %s\n",
+				data.droppedCalls, fileName);
+		}
+		LoadTraceProfile(data, profile);
+		return true;
+	}
+
+	rewind(fp);
+	bool ok = LoadSummaryProfile(fp, fileName, profile, error);
+	fclose(fp);
+	return ok;
+}
+
+//
+// Mann-Whitney U test
+//
+// Ranks the two samples together and compares the sum of the ranks of
+// the new sample with its expectation if both came from the same
+// distribution. For samples of more than a few dozen values the U
+// statistic is close to normal; the variance is corrected for ties,
+// which are common in timings quantized to timer ticks. Returns the
+// two-sided p-value, and sets shift to the probability that a call
+// from the new sample is slower than one from the base sample, plus
+// half the probability of a tie; 0.5 means no shift.
+//
+
+double MannWhitneyTest(const std::vector<double> &base, const std::vector<double> &next,
+	double &shift)
+{
+	struct Value
+	{
+		double time;
+		bool isNew;
+	};
+
+	std::vector<Value> values;
+	values.reserve(base.size() + next.size());
+	for (double t : base)
+	{
+		Value v = { t, false };
+		values.push_back(v);
+	}
+	for (double t : next)
+	{
+		Value v = { t, true };
+		values.push_back(v);
+	}
+	std::sort(values.begin(), values.end(), [](const Value &a, const Value &b) {
+		return a.time < b.time;
+	});
+
+	double rankSum = 0.0;
+	double tieCorrection = 0.0;
+	for (size_t i = 0; i < values.size(); )
+	{
+		size_t j = i;
+		while (j < values.size() && values[j].time == values[i].time)
+			j++;
+		double rank = (i + 1 + j) / 2.0; // mean of ranks i+1 .. j
+		for (size_t k = i; k < j; k++)
+		{
+			if (values[k].isNew)
+				rankSum += rank;
+		}
+		double t = (double)(j - i);
+		tieCorrection += t * t * t - t;
+		i = j;
+	}
+
+	double n1 = (double)next.size();
+	double n2 = (double)base.size();
+	double n = n1 + n2;
+	double u = rankSum - n1 * (n1 + 1) / 2.0;
+	double mean = n1 * n2 / 2.0;
+	double variance = n1 * n2 / 12.0 * ((n + 1) - tieCorrection / (n * (n - 1)));
+	shift = u / (n1 * n2);
+	if (variance <= 0.0)
+		return 1.0;
+
+	// Continuity correction.
+	double d = fabs(u - mean) - 0.5;
+	double z = (d > 0.0) ? d / sqrt(variance) : 0.0;
+	return erfc(z / sqrt(2.0));
+}
+
+enum DiffMetric
+{
+	MetricMean,
+	MetricP50,
+	MetricP99,
+	MetricTotal,
+};
+
+static const char *const s_metricNames[] = { "mean", "p50", "p99", "total" };
+
+static double GetMetric(const ProfileEntry &entry, DiffMetric metric)
+{
+	switch (metric)
+	{
+	case MetricMean:
+		return entry.GetMeanMicroseconds();
+	case MetricP50:
+		return entry.p50Microseconds;
+	case MetricP99:
+		return entry.p99Microseconds;
+	case MetricTotal:
+		return entry.totalMicroseconds;
+	default:
+		return NAN;
+	}
+}
+
+// Returns the relative change from base to next in percent, or NaN if
+// it is not defined.
+static double PercentChange(double base, double next)
+{
+	if (isnan(base) || isnan(next) || base <= 0.0)
+		return NAN;
+	return (next - base) / base * 100.0;
+}
+
+static void WriteNumber(FILE *fp, double value, const char *format)
+{
+	fputc(',', fp);
+	if (!isnan(value))
+		fprintf(fp, format, value);
+}
+
+struct FunctionDiff
+{
+	std::string name;
+	const ProfileEntry *base;
+	const ProfileEntry *next;
+	double change;    // of the metric, in percent
+	double pValue;    // NaN if not tested
+	const char *verdict;
+	int order;        // regressions first
+};
+
+// Writes a CSV table with the base and new timings of each function and
+// their relative change, followed by the p-value of the Mann-Whitney
+// test and a verdict.
+static void WriteDiff(FILE *fp, const std::vector<FunctionDiff> &diffs)
+{
+	fputs("Function,Base Calls,New Calls,Calls Change (%),"
+		"Base Mean (us),New Mean (us),Mean Change (%),"
+		"Base P50 (us),New P50 (us),P50 Change (%),"
+		"Base P99 (us),New P99 (us),P99 Change (%),"
+		"Base Total (ms),New Total (ms),Total Change (%),"
+		"P-Value,Verdict\n", fp);
+
+	const ProfileEntry none;
+	for (const FunctionDiff &d : diffs)
+	{
+		const ProfileEntry &base = d.base ? *d.base : none;
+		const ProfileEntry &next = d.next ? *d.next : none;
+		WriteCsvString(fp, d.name);
+		fprintf(fp, ",%.0f,%.0f", base.calls, next.calls);
+		WriteNumber(fp, PercentChange(base.calls, next.calls), "%.1f");
+		WriteNumber(fp, base.GetMeanMicroseconds(), "%.3f");
+		WriteNumber(fp, next.GetMeanMicroseconds(), "%.3f");
+		WriteNumber(fp, PercentChange(base.GetMeanMicroseconds(), next.GetMeanMicroseconds()), "%.1f");
+		WriteNumber(fp, base.p50Microseconds, "%.3f");
+		WriteNumber(fp, next.p50Microseconds, "%.3f");
+		WriteNumber(fp, PercentChange(base.p50Microseconds, next.p50Microseconds), "%.1f");
+		WriteNumber(fp, base.p99Microseconds, "%.3f");
+		WriteNumber(fp, next.p99Microseconds, "%.3f");
+		WriteNumber(fp, PercentChange(base.p99Microseconds, next.p99Microseconds), "%.1f");
+		WriteNumber(fp, base.totalMicroseconds / 1000.0, "%.3f");
+		WriteNumber(fp, next.totalMicroseconds / 1000.0, "%.3f");
+		WriteNumber(fp, PercentChange(base.totalMicroseconds, next.totalMicroseconds), "%.1f");
+		WriteNumber(fp, d.pValue, "%.3g");
+		fprintf(fp, ",%s\n", d.verdict);
+	}
+}
+
+static void PrintDiffUsage()
+{
+	fprintf(stderr, "usage: XllProfTool diff <base> <new> [--output <file.csv>]\n"
+		"         [--metric mean|p50|p99|total] [--threshold <percent>]\n"
+		"         [--alpha <p>] [--min-calls <n>]\n"
+		"\n"
+		"<base> and <new> are trace files or summaries written by convert or\n"
+		"replay. A function regressed if the metric grew by more than the\n"
+		"threshold (default 10%%) and, where the call times are known, the\n"
+		"Mann-Whitney test rejects no change at level alpha (default 0.01).\n"
+		"Functions with fewer calls than min-calls (default 10) in either\n"
+		"profile are reported but never regress. The exit status is 3 if a\n"
+		"function regressed.\n");
+}
+
+int DiffCommand(int argc, char *argv[])
+{
+	const char *baseFileName = nullptr;
+	const char *newFileName = nullptr;
+	const char *outputFileName = "-";
+	DiffMetric metric = MetricMean;
+	double threshold = 10.0;
+	double alpha = 0.01;
+	double minCalls = 10;
+
+	for (int i = 0; i < argc; i++)
+	{
+		const char *arg = argv[i];
+		if (strcmp(arg, "--output") == 0 && i + 1 < argc)
+			outputFileName = argv[++i];
+		else if (strcmp(arg, "--threshold") == 0 && i + 1 < argc)
+			threshold = atof(argv[++i]);
+		else if (strcmp(arg, "--alpha") == 0 && i + 1 < argc)
+			alpha = atof(argv[++i]);
+		else if (strcmp(arg, "--min-calls") == 0 && i + 1 < argc)
+			minCalls = atof(argv[++i]);
+		else if (strcmp(arg, "--metric") == 0 && i + 1 < argc)
+		{
+			const char *name = argv[++i];
+			size_t k = 0;
+			while (k < sizeof(s_metricNames) / sizeof(s_metricNames[0]) &&
+				strcmp(name, s_metricNames[k]) != 0)
+				k++;
+			if (k == sizeof(s_metricNames) / sizeof(s_metricNames[0]))
+			{
+				fprintf(stderr, "error: unknown metric %s\n", name);
+				return 2;
+			}
+			metric = (DiffMetric)k;
+		}
+		else if (arg[0] != '-' && baseFileName == nullptr)
+			baseFileName = arg;
+		else if (arg[0] != '-' && newFileName == nullptr)
+			newFileName = arg;
+		else
+		{
+			fprintf(stderr, "error: unexpected argument %s\n", arg);
+			return 2;
+		}
+	}
+
+	if (baseFileName == nullptr || newFileName == nullptr ||
+		threshold < 0.0 || alpha <= 0.0 || alpha >= 1.0)
+	{
+		PrintDiffUsage();
+		return 2;
+	}
+
+	Profile baseProfile, newProfile;
+	std::string error;
+	if (!LoadProfile(baseFileName, baseProfile, error) ||
+		!LoadProfile(newFileName, newProfile, error))
+	{
+		fprintf(stderr, "error: %s\n", error.c_str());
+		return 1;
+	}
+
+	std::map<std::string, FunctionDiff> merged;
+	for (const auto &kv : baseProfile)
+	{
+		FunctionDiff d = { kv.first, &kv.second, nullptr, NAN, NAN, "removed", 3 };
+		merged[kv.first] = d;
+	}
+	for (const auto &kv : newProfile)
+	{
+		auto it = merged.find(kv.first);
+		if (it == merged.end())
+		{
+			FunctionDiff d = { kv.first, nullptr, &kv.second, NAN, NAN, "added", 3 };
+			merged[kv.first] = d;
+		}
+		else
+			it->second.next = &kv.second;
+	}
+
+	std::vector<FunctionDiff> diffs;
+	int regressions = 0;
+	for (auto &kv : merged)
+	{
+		FunctionDiff &d = kv.second;
+		if (d.base != nullptr && d.next != nullptr)
+		{
+			d.change = PercentChange(GetMetric(*d.base, metric), GetMetric(*d.next, metric));
+
+			// Only the time of a single call can be tested; the total also
+			// depends on how often the function was called.
+			double shift = 0.5;
+			if (metric != MetricTotal && d.base->samples.size() >= 2 && d.next->samples.size() >= 2)
+				d.pValue = MannWhitneyTest(d.base->samples, d.next->samples, shift);
+
+			bool enoughCalls = d.base->calls >= minCalls && d.next->calls >= minCalls;
+			bool significant = isnan(d.pValue) || d.pValue < alpha;
+			d.verdict = "unchanged";
+			d.order = 2;
+			if (isnan(d.change))
+			{
+				d.verdict = "unknown";
+			}
+			else if (enoughCalls && significant && d.change > threshold &&
+				(isnan(d.pValue) || shift > 0.5))
+			{
+				d.verdict = "regressed";
+				d.order = 0;
+				regressions++;
+			}
+			else if (enoughCalls && significant && d.change < -threshold &&
+				(isnan(d.pValue) || shift < 0.5))
+			{
+				d.verdict = "improved";
+				d.order = 1;
+			}
+		}
+		diffs.push_back(d);
+	}
+
+	// Regressions first, then by the time at stake.
+	std::stable_sort(diffs.begin(), diffs.end(), [](const FunctionDiff &a, const FunctionDiff &b) {
+		if (a.order != b.order)
+			return a.order < b.order;
+		double ta = std::max(a.base ? a.base->totalMicroseconds : 0.0, a.next ? a.next->totalMicroseconds : 0.0);
+		double tb = std::max(b.base ? b.base->totalMicroseconds : 0.0, b.next ? b.next->totalMicroseconds : 0.0);
+		return ta > tb;
+	});
+
+	FILE *fp = (strcmp(outputFileName, "-") == 0) ? stdout : fopen(outputFileName, "wb");
+	if (fp == nullptr)
+	{
+		fprintf(stderr, "error: cannot create %s\n", outputFileName);
+		return 1;
+	}
+	WriteDiff(fp, diffs);
+	if (fp != stdout)
+		fclose(fp);
+	else
+		fflush(fp);
+
+	if (regressions > 0)
+	{
+		fprintf(stderr, "%d function%s regressed by more than %g%% in %s time\n",
+			regressions, (regressions == 1) ? "" : "s", threshold, s_metricNames[metric]);
+		return DiffRegressed;
+	}
+	return 0;
+}
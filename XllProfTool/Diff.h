@@ -0,0 +1,14 @@
+////////////////////////////////////////////////////////////////////////////
+// Diff.h -- significance test used by the diff command
+
+#pragma once
+
+#include <vector>
+
+// Compares two samples of call times with the Mann-Whitney U test, with
+// the variance corrected for ties and a continuity correction. Returns
+// the two-sided p-value, and sets shift to U / (n1 * n2), where U counts
+// the pairs in which the call from next is slower than the call from
+// base, plus half the ties; 0.5 means no shift.
+double MannWhitneyTest(const std::vector<double> &base, const std::vector<double> &next,
+	double &shift);
@@ -0,0 +1,241 @@
+////////////////////////////////////////////////////////////////////////////
+// FakeHost.cpp -- load an XLL outside Excel
+
+#include "FakeHost.h"
+
+#if defined(_WIN32)
+
+#include <set>
+
+typedef void (PASCAL *SetExcel12EntryPtProc)(EXCEL12PROC);
+typedef int (WINAPI *AutoProc)();
+typedef void (WINAPI *AutoFree12Proc)(LPXLOPER12);
+
+static FakeHost *s_host = nullptr;
+
+// Strings and arrays returned to the XLL, which it releases with xlFree.
+static std::set<void*> s_allocations;
+
+static std::wstring ToWideString(const std::string &s)
+{
+	if (s.empty())
+		return std::wstring();
+	int n = MultiByteToWideChar(CP_UTF8, 0, s.c_str(), (int)s.size(), NULL, 0);
+	std::wstring result(n, L'\0');
+	MultiByteToWideChar(CP_UTF8, 0, s.c_str(), (int)s.size(), &result[0], n);
+	return result;
+}
+
+static std::wstring GetString(const XLOPER12 *px)
+{
+	if (px == nullptr || (px->xltype & ~(xlbitXLFree | xlbitDLLFree)) != xltypeStr)
+		return std::wstring();
+	return std::wstring(&px->val.str[1], (unsigned short)px->val.str[0]);
+}
+
+static void SetString(LPXLOPER12 result, const std::wstring &s)
+{
+	size_t length = (s.size() < 32767) ? s.size() : 32767;
+	XCHAR *p = new XCHAR[length + 1];
+	p[0] = (XCHAR)length;
+	memcpy(&p[1], s.c_str(), length * sizeof(XCHAR));
+	s_allocations.insert(p);
+	result->xltype = xltypeStr;
+	result->val.str = p;
+}
+
+static void FreeValue(LPXLOPER12 px)
+{
+	if (px == nullptr)
+		return;
+	switch (px->xltype & ~(xlbitXLFree | xlbitDLLFree))
+	{
+	case xltypeStr:
+		if (s_allocations.erase(px->val.str))
+			delete[] px->val.str;
+		break;
+	case xltypeMulti:
+		if (s_allocations.erase(px->val.array.lparray))
+		{
+			int n = px->val.array.rows * px->val.array.columns;
+			for (int i = 0; i < n; i++)
+				FreeValue(&px->val.array.lparray[i]);
+			delete[] px->val.array.lparray;
+		}
+		break;
+	}
+}
+
+FakeHost::FakeHost() : m_hModule(NULL)
+{
+}
+
+FakeHost::~FakeHost()
+{
+	Unload();
+}
+
+int PASCAL FakeHost::Callback(int xlfn, int count, LPXLOPER12 opers[], LPXLOPER12 result)
+{
+	if (s_host == nullptr)
+		return xlretFailed;
+	return s_host->HandleCallback(xlfn, count, opers, result);
+}
+
+int FakeHost::HandleCallback(int xlfn, int count, LPXLOPER12 opers[], LPXLOPER12 result)
+{
+	XLOPER12 dummy;
+	if (result == nullptr)
+		result = &dummy;
+
+	switch (xlfn)
+	{
+	case xlFree:
+		for (int i = 0; i < count; i++)
+			FreeValue(opers[i]);
+		return xlretSuccess;
+
+	case xlGetName:
+		SetString(result, m_path);
+		return xlretSuccess;
+
+	case xlfRegister:
+		if (count >= 3)
+		{
+			RegisteredFunction f;
+			f.procedure = GetString(opers[1]);
+			f.typeText = GetString(opers[2]);
+			if (count >= 4)
+				f.functionText = GetString(opers[3]);
+			m_functions.push_back(f);
+			result->xltype = xltypeNum;
+			result->val.num = (double)m_functions.size();
+			return xlretSuccess;
+		}
+		return xlretInvCount;
+
+	case xlfUnregister:
+	case xlfSetName:
+	case xlEventRegister:
+		result->xltype = xltypeBool;
+		result->val.xbool = TRUE;
+		return xlretSuccess;
+
+	case xlAbort:
+		result->xltype = xltypeBool;
+		result->val.xbool = FALSE;
+		return xlretSuccess;
+
+	case xlGetHwnd:
+		result->xltype = xltypeInt;
+		result->val.w = 0;
+		return xlretSuccess;
+
+	case xlCoerce:
+		// Values are passed through; references cannot be resolved.
+		if (count >= 1 && opers[0] != nullptr &&
+			!(opers[0]->xltype & (xltypeRef | xltypeSRef)))
+		{
+			// Strings are copied so that xlFree can release them. Arrays
+			// are returned as is; xlFree leaves them alone.
+			*result = *opers[0];
+			result->xltype &= ~(xlbitXLFree | xlbitDLLFree);
+			if (result->xltype == xltypeStr)
+				SetString(result, GetString(opers[0]));
+			return xlretSuccess;
+		}
+		return xlretUncalced;
+
+	default:
+		result->xltype = xltypeErr;
+		result->val.err = xlerrNA;
+		return xlretFailed;
+	}
+}
+
+bool FakeHost::Load(const std::wstring &path, std::string &error)
+{
+	if (s_host != nullptr)
+	{
+		error = "another add-in is already loaded";
+		return false;
+	}
+
+	HMODULE hModule = LoadLibraryW(path.c_str());
+	if (hModule == NULL)
+	{
+		error = "cannot load the add-in (error " + std::to_string((unsigned long long)GetLastError()) + ")";
+		return false;
+	}
+
+	SetExcel12EntryPtProc setEntryPoint = (SetExcel12EntryPtProc)
+		GetProcAddress(hModule, "SetExcel12EntryPt");
+	if (setEntryPoint == NULL)
+	{
+		FreeLibrary(hModule);
+		error = "the add-in does not export SetExcel12EntryPt";
+		return false;
+	}
+
+	WCHAR fullPath[MAX_PATH];
+	DWORD n = GetModuleFileNameW(hModule, fullPath, ARRAYSIZE(fullPath));
+	m_path = (n > 0 && n < ARRAYSIZE(fullPath)) ? std::wstring(fullPath, n) : path;
+	m_hModule = hModule;
+	m_functions.clear();
+	s_host = this;
+	setEntryPoint(Callback);
+
+	AutoProc autoOpen = (AutoProc)GetProcAddress(hModule, "xlAutoOpen");
+	if (autoOpen != NULL)
+		autoOpen();
+	return true;
+}
+
+void FakeHost::Unload()
+{
+	if (m_hModule == NULL)
+		return;
+
+	AutoProc autoClose = (AutoProc)GetProcAddress(m_hModule, "xlAutoClose");
+	if (autoClose != NULL)
+		autoClose();
+
+	FreeLibrary(m_hModule);
+	m_hModule = NULL;
+	s_host = nullptr;
+}
+
+FARPROC FakeHost::GetProcedure(const std::string &entryPointName) const
+{
+	if (m_hModule == NULL || entryPointName.empty())
+		return NULL;
+	if (entryPointName[0] == '#')
+	{
+		WORD ordinal = (WORD)atoi(entryPointName.c_str() + 1);
+		return GetProcAddress(m_hModule, MAKEINTRESOURCEA(ordinal));
+	}
+	return GetProcAddress(m_hModule, entryPointName.c_str());
+}
+
+const FakeHost::RegisteredFunction* FakeHost::FindRegisteredFunction(const std::string &entryPointName) const
+{
+	std::wstring procedure = ToWideString(entryPointName);
+	for (const RegisteredFunction &f : m_functions)
+	{
+		if (f.procedure == procedure)
+			return &f;
+	}
+	return nullptr;
+}
+
+void FakeHost::FreeReturnValue(LPXLOPER12 px) const
+{
+	if (px == nullptr || !(px->xltype & xlbitDLLFree))
+		return;
+
+	AutoFree12Proc autoFree = (AutoFree12Proc)GetProcAddress(m_hModule, "xlAutoFree12");
+	if (autoFree != NULL)
+		autoFree(px);
+}
+
+#endif
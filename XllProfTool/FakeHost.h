@@ -0,0 +1,70 @@
+////////////////////////////////////////////////////////////////////////////
+// FakeHost.h -- load an XLL outside Excel
+//
+// FakeHost loads an XLL into the current process and passes it a
+// stand-in for Excel's MdCallBack12 through the SetExcel12EntryPt()
+// procedure that XLLs built with XLL Connector export. The stand-in
+// records the functions registered by xlAutoOpen, answers the requests
+// that add-ins make while loading and calculating (xlGetName, xlFree,
+// xlCoerce of values, xlAbort, ...), and fails all other requests with
+// xlretFailed.
+//
+// Only one FakeHost may exist at a time. Windows only.
+//
+
+#pragma once
+
+#if defined(_WIN32)
+
+#include <Windows.h>
+#include "XLCALL.H"
+#include <string>
+#include <vector>
+
+class FakeHost
+{
+public:
+	struct RegisteredFunction
+	{
+		std::wstring procedure;
+		std::wstring typeText;
+		std::wstring functionText;
+	};
+
+private:
+	HMODULE m_hModule;
+	std::wstring m_path;
+	std::vector<RegisteredFunction> m_functions;
+
+	FakeHost(const FakeHost &) = delete;
+	FakeHost& operator=(const FakeHost &) = delete;
+
+	static int PASCAL Callback(int xlfn, int count, LPXLOPER12 opers[], LPXLOPER12 result);
+	int HandleCallback(int xlfn, int count, LPXLOPER12 opers[], LPXLOPER12 result);
+
+public:
+	FakeHost();
+	~FakeHost();
+
+	// Loads the XLL and calls its xlAutoOpen. Returns false and sets
+	// error if the XLL cannot be loaded or does not export
+	// SetExcel12EntryPt.
+	bool Load(const std::wstring &path, std::string &error);
+
+	// Calls xlAutoClose and unloads the XLL.
+	void Unload();
+
+	// Returns the address of an exported procedure, given by name or
+	// by "#ordinal", or NULL if it is not exported.
+	FARPROC GetProcedure(const std::string &entryPointName) const;
+
+	// Returns the registration of a procedure, or nullptr if the XLL
+	// did not register it.
+	const RegisteredFunction* FindRegisteredFunction(const std::string &entryPointName) const;
+
+	// Releases a value returned by a UDF, by calling xlAutoFree12 if
+	// the xlbitDLLFree bit is set.
+	void FreeReturnValue(LPXLOPER12 px) const;
+};
+
+#endif
@@ -0,0 +1,221 @@
+////////////////////////////////////////////////////////////////////////////
+// Hotspots.cpp -- aggregate the time of recorded calls by calling cell
+
+#include "Hotspots.h"
+#include "Commands.h"
+#include <algorithm>
+#include <map>
+#include <set>
+#include <string>
+#include <tuple>
+
+// Largest grid written for one sheet by WriteHeatMap().
+static const double MaxHeatMapCells = 1e7;
+
+// Time charged to a cell by the top-level calls of one function.
+struct CellTime
+{
+	uint32_t cellId;
+	uint32_t functionId;
+	double calls;
+	double ticks;
+};
+
+// Collects the time of the top-level calls by cell and function. If only
+// a sample of the calls was recorded, the counts and times are scaled up
+// to estimate those of all calls.
+static std::vector<CellTime> CollectCellTimes(const TraceData &data, const std::vector<CallTreeEntry> &tree)
+{
+	std::map<std::pair<uint32_t, uint32_t>, CellTime> times;
+	for (const CallTreeEntry &entry : tree)
+	{
+		const TraceCallEvent &e = data.calls[entry.call];
+		if (entry.parent != CallTreeEntry::NoParent || e.cellId == 0 || e.cellId >= data.cells.size())
+			continue;
+
+		CellTime &t = times[std::make_pair(e.cellId, e.functionId)];
+		t.cellId = e.cellId;
+		t.functionId = e.functionId;
+		t.calls += data.sampleInterval;
+		t.ticks += (double)entry.inclusiveTicks * data.sampleInterval;
+	}
+
+	std::vector<CellTime> result;
+	for (const auto &kv : times)
+		result.push_back(kv.second);
+	return result;
+}
+
+// Returns the letters of a zero-based column, such as "AB".
+static std::string GetColumnName(uint32_t column)
+{
+	std::string name;
+	for (uint32_t n = column + 1; n > 0; n = (n - 1) / 26)
+		name.insert(name.begin(), (char)('A' + (n - 1) % 26));
+	return name;
+}
+
+static std::string GetCellName(uint32_t row, uint32_t column)
+{
+	return GetColumnName(column) + std::to_string((unsigned long long)row + 1);
+}
+
+static std::string GetSheetName(const std::string &name)
+{
+	return name.empty() ? "(unknown)" : name;
+}
+
+struct CellRange
+{
+	uint32_t functionId;
+	uint32_t column;
+	uint32_t firstRow;
+	uint32_t lastRow;
+	size_t cells;
+	double calls;
+	double ticks;
+};
+
+struct SheetTime
+{
+	std::string name;
+	std::set<uint32_t> cellIds;
+	double calls;
+	double ticks;
+	std::vector<CellRange> ranges;
+};
+
+void WriteHotspots(FILE *fp, const TraceData &data, const std::vector<CallTreeEntry> &tree)
+{
+	// Sort by sheet, function, column and row, so that the cells of a
+	// range are adjacent.
+	std::vector<CellTime> times = CollectCellTimes(data, tree);
+	std::sort(times.begin(), times.end(), [&data](const CellTime &a, const CellTime &b) {
+		const TraceCellInfo &ca = data.cells[a.cellId];
+		const TraceCellInfo &cb = data.cells[b.cellId];
+		return std::tie(ca.sheetName, a.functionId, ca.column, ca.row) <
+			std::tie(cb.sheetName, b.functionId, cb.column, cb.row);
+	});
+
+	std::map<std::string, SheetTime> sheets;
+	double totalTicks = 0.0;
+	for (const CellTime &t : times)
+	{
+		const TraceCellInfo &cell = data.cells[t.cellId];
+		SheetTime &sheet = sheets[cell.sheetName];
+		sheet.name = cell.sheetName;
+		sheet.cellIds.insert(t.cellId);
+		sheet.calls += t.calls;
+		sheet.ticks += t.ticks;
+		totalTicks += t.ticks;
+
+		if (!sheet.ranges.empty())
+		{
+			CellRange &r = sheet.ranges.back();
+			if (r.functionId == t.functionId && r.column == cell.column && r.lastRow + 1 == cell.row)
+			{
+				r.lastRow = cell.row;
+				r.cells++;
+				r.calls += t.calls;
+				r.ticks += t.ticks;
+				continue;
+			}
+		}
+		CellRange r = { t.functionId, cell.column, cell.row, cell.row, 1, t.calls, t.ticks };
+		sheet.ranges.push_back(r);
+	}
+
+	std::vector<SheetTime*> order;
+	for (auto &kv : sheets)
+	{
+		std::sort(kv.second.ranges.begin(), kv.second.ranges.end(),
+			[](const CellRange &a, const CellRange &b) { return a.ticks > b.ticks; });
+		order.push_back(&kv.second);
+	}
+	std::sort(order.begin(), order.end(),
+		[](const SheetTime *a, const SheetTime *b) { return a->ticks > b->ticks; });
+
+	fputs("Sheet,Range,Function,Cells,Calls,Total (ms),Mean (us),Share (%)\n", fp);
+	for (const SheetTime *sheet : order)
+	{
+		WriteCsvString(fp, GetSheetName(sheet->name));
+		fprintf(fp, ",\"(all)\",,%llu,%.0f,%.3f,%.3f,%.1f\n",
+			(unsigned long long)sheet->cellIds.size(), sheet->calls,
+			data.TicksToMicroseconds(sheet->ticks) / 1000.0,
+			data.TicksToMicroseconds(sheet->ticks / sheet->calls),
+			(totalTicks > 0) ? sheet->ticks / totalTicks * 100.0 : 0.0);
+
+		for (const CellRange &r : sheet->ranges)
+		{
+			std::string range = GetCellName(r.firstRow, r.column);
+			if (r.lastRow != r.firstRow)
+				range += ":" + GetCellName(r.lastRow, r.column);
+			WriteCsvString(fp, GetSheetName(sheet->name));
+			fputc(',', fp);
+			WriteCsvString(fp, range);
+			fputc(',', fp);
+			WriteCsvString(fp, data.GetFunctionName(r.functionId));
+			fprintf(fp, ",%llu,%.0f,%.3f,%.3f,%.1f\n",
+				(unsigned long long)r.cells, r.calls,
+				data.TicksToMicroseconds(r.ticks) / 1000.0,
+				data.TicksToMicroseconds(r.ticks / r.calls),
+				(totalTicks > 0) ? r.ticks / totalTicks * 100.0 : 0.0);
+		}
+	}
+}
+
+void WriteHeatMap(FILE *fp, const TraceData &data, const std::vector<CallTreeEntry> &tree)
+{
+	// Time of each cell by sheet, summed over functions.
+	std::map<std::string, std::map<std::pair<uint32_t, uint32_t>, double>> sheets;
+	for (const CellTime &t : CollectCellTimes(data, tree))
+	{
+		const TraceCellInfo &cell = data.cells[t.cellId];
+		sheets[cell.sheetName][std::make_pair(cell.row, cell.column)] += t.ticks;
+	}
+
+	bool first = true;
+	for (const auto &sheet : sheets)
+	{
+		const auto &cells = sheet.second;
+		uint32_t minRow = cells.begin()->first.first;
+		uint32_t maxRow = cells.rbegin()->first.first;
+		uint32_t minColumn = UINT32_MAX, maxColumn = 0;
+		for (const auto &kv : cells)
+		{
+			minColumn = std::min(minColumn, kv.first.second);
+			maxColumn = std::max(maxColumn, kv.first.second);
+		}
+		if ((double)(maxRow - minRow + 1) * (maxColumn - minColumn + 1) > MaxHeatMapCells)
+		{
+			fprintf(stderr, "warning: the heat map of %s is too large and is skipped\n",
+				GetSheetName(sheet.first).c_str());
+			continue;
+		}
+
+		if (!first)
+			fputc('\n', fp);
+		first = false;
+
+		WriteCsvString(fp, GetSheetName(sheet.first));
+		for (uint32_t column = minColumn; column <= maxColumn; column++)
+			fprintf(fp, ",%s", GetColumnName(column).c_str());
+		fputc('\n', fp);
+
+		auto it = cells.begin();
+		for (uint32_t row = minRow; row <= maxRow; row++)
+		{
+			fprintf(fp, "%u", row + 1);
+			for (uint32_t column = minColumn; column <= maxColumn; column++)
+			{
+				fputc(',', fp);
+				if (it != cells.end() && it->first.first == row && it->first.second == column)
+				{
+					fprintf(fp, "%.3f", data.TicksToMicroseconds(it->second) / 1000.0);
+					++it;
+				}
+			}
+			fputc('\n', fp);
+		}
+	}
+}
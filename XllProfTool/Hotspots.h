@@ -0,0 +1,25 @@
+////////////////////////////////////////////////////////////////////////////
+// Hotspots.h -- aggregate the time of recorded calls by calling cell
+//
+// A trace recorded with XLL_PROFILER_CALLERS=1 tells which worksheet
+// cell made each top-level call. The time of a top-level call, which
+// includes the calls nested in it, is charged to that cell. Cells in
+// the same column of a sheet that call the same function from
+// consecutive rows, as a formula filled down does, are reported as one
+// range.
+//
+
+#pragma once
+
+#include <stdio.h>
+#include <vector>
+#include "TraceReader.h"
+
+// Writes a CSV table with the total time of each sheet, followed by the
+// ranges of cells on it, both sorted by time.
+void WriteHotspots(FILE *fp, const TraceData &data, const std::vector<CallTreeEntry> &tree);
+
+// Writes the time of each cell in milliseconds as a grid per sheet,
+// covering the cells that made calls. The grids are separated by an
+// empty line, and start with the sheet name and the column letters.
+void WriteHeatMap(FILE *fp, const TraceData &data, const std::vector<CallTreeEntry> &tree);
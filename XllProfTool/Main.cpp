@@ -0,0 +1,54 @@
+////////////////////////////////////////////////////////////////////////////
+// Main.cpp -- offline analysis of XllProfiler traces
+//
+// Apart from replay, which loads the add-in, XllProfTool only uses the
+// standard library, so that traces recorded on a workstation can be
+// analyzed on any build machine.
+//
+
+#include "Commands.h"
+#include <stdio.h>
+#include <string.h>
+
+struct Command
+{
+	const char *name;
+	int (*run)(int argc, char *argv[]);
+	const char *description;
+};
+
+static const Command s_commands[] =
+{
+	{ "convert", ConvertCommand, "convert a trace to Chrome JSON, folded stacks or a summary" },
+	{ "replay", ReplayCommand, "replay captured arguments against an add-in" },
+	{ "diff", DiffCommand, "compare two traces or summaries for regressions" },
+	{ "advise", AdviseCommand, "recommend thread-safe and volatile attribute changes" },
+};
+
+static void PrintUsage()
+{
+	fprintf(stderr, "usage: XllProfTool <command> [arguments]\n\ncommands:\n");
+	for (const Command &command : s_commands)
+	{
+		fprintf(stderr, "  %-10s %s\n", command.name, command.description);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 2)
+	{
+		PrintUsage();
+		return 2;
+	}
+
+	for (const Command &command : s_commands)
+	{
+		if (strcmp(argv[1], command.name) == 0)
+			return command.run(argc - 2, argv + 2);
+	}
+
+	fprintf(stderr, "error: unknown command %s\n", argv[1]);
+	PrintUsage();
+	return 2;
+}
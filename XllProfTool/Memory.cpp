@@ -0,0 +1,55 @@
+////////////////////////////////////////////////////////////////////////////
+// Memory.cpp -- report the heap allocations and results of each function
+
+#include "Memory.h"
+#include "Commands.h"
+#include <algorithm>
+
+static double PerCall(uint64_t value, uint64_t calls)
+{
+	return (calls > 0) ? (double)value / calls : 0.0;
+}
+
+void WriteMemorySummary(FILE *fp, const TraceData &data)
+{
+	std::vector<uint32_t> order;
+	for (uint32_t i = 0; i < data.memory.size(); i++)
+	{
+		if (data.memory[i].calls > 0 || data.memory[i].returns > 0 || data.memory[i].releases > 0)
+			order.push_back(i);
+	}
+	std::sort(order.begin(), order.end(), [&data](uint32_t a, uint32_t b) {
+		return data.memory[a].allocatedBytes > data.memory[b].allocatedBytes;
+	});
+
+	fputs("Function,DLL,Calls,Allocations/Call,Allocated Bytes/Call,Frees/Call,Freed Bytes/Call,"
+		"Returns,Bytes/Return,Released,Mean Hold (us),Max Hold (us),Live Returns,Live Bytes\n", fp);
+	for (uint32_t functionId : order)
+	{
+		const TraceFunctionMemory &m = data.memory[functionId];
+		std::string dllName = (functionId < data.functions.size()) ?
+			data.functions[functionId].dllName : std::string();
+		WriteCsvString(fp, data.GetFunctionName(functionId));
+		fputc(',', fp);
+		WriteCsvString(fp, dllName);
+
+		// Results returned before recording started are not tracked, so
+		// the live counts cannot be negative.
+		uint64_t liveReturns = (m.returns > m.releases) ? m.returns - m.releases : 0;
+		uint64_t liveBytes = (m.returnedBytes > m.releasedBytes) ? m.returnedBytes - m.releasedBytes : 0;
+		fprintf(fp, ",%llu,%.2f,%.1f,%.2f,%.1f,%llu,%.1f,%llu,",
+			(unsigned long long)m.calls,
+			PerCall(m.allocations, m.calls), PerCall(m.allocatedBytes, m.calls),
+			PerCall(m.frees, m.calls), PerCall(m.freedBytes, m.calls),
+			(unsigned long long)m.returns, PerCall(m.returnedBytes, m.returns),
+			(unsigned long long)m.releases);
+		if (m.releases > 0)
+		{
+			fprintf(fp, "%.3f,%.3f", data.TicksToMicroseconds(PerCall(m.holdTicks, m.releases)),
+				data.TicksToMicroseconds((double)m.maxHoldTicks));
+		}
+		else
+			fputc(',', fp);
+		fprintf(fp, ",%llu,%llu\n", (unsigned long long)liveReturns, (unsigned long long)liveBytes);
+	}
+}
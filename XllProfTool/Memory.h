@@ -0,0 +1,20 @@
+////////////////////////////////////////////////////////////////////////////
+// Memory.h -- report the heap allocations and results of each function
+//
+// A trace recorded with XLL_PROFILER_MEMORY=1 counts the heap
+// allocations that each function makes through the C runtime or the
+// Windows heap, including those of the calls nested in it, and the
+// results it returns for Excel to free with xlAutoFree12. Every call is
+// counted in every mode, so the numbers are not scaled in sampling mode.
+//
+
+#pragma once
+
+#include <stdio.h>
+#include "TraceReader.h"
+
+// Writes a CSV table with the allocations per call of each function, and
+// the size of the results it returned, how long Excel held them before
+// releasing them, and those not yet released when recording stopped,
+// sorted by the bytes allocated.
+void WriteMemorySummary(FILE *fp, const TraceData &data);
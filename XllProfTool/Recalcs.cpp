@@ -0,0 +1,66 @@
+////////////////////////////////////////////////////////////////////////////
+// Recalcs.cpp -- report the recalculations recorded by XllProfiler
+
+#include "Recalcs.h"
+
+static const char* GetRecalcStatusName(uint32_t status)
+{
+	switch (status)
+	{
+	case TraceRecalcEnded:
+		return "ended";
+	case TraceRecalcCanceled:
+		return "canceled";
+	default:
+		return "unknown";
+	}
+}
+
+static double Percent(double part, double whole)
+{
+	return (whole > 0.0) ? part / whole * 100.0 : 0.0;
+}
+
+void WriteRecalcSummary(FILE *fp, const TraceData &data)
+{
+	fputs("Recalc,Status,Start (s),Duration (ms),Threads,Calls,UDF (ms),"
+		"Thread-Safe (ms),Main Thread Only (ms),Utilization (%),Main Thread Only (%)\n", fp);
+	for (const TraceRecalc &recalc : data.recalcs)
+	{
+		const TraceRecalcRecord &r = recalc.summary;
+		double duration = data.TicksToMicroseconds((double)(r.endTicks - r.startTicks));
+		double busy = data.TicksToMicroseconds((double)r.busyTicks);
+		double threadSafe = data.TicksToMicroseconds((double)r.threadSafeTicks);
+		double mainOnly = busy - threadSafe;
+		fprintf(fp, "%u,%s,%.3f,%.3f,%u,%llu,%.3f,%.3f,%.3f,%.1f,%.1f\n",
+			r.recalcId, GetRecalcStatusName(r.status),
+			data.TimestampToMicroseconds(r.startTicks) / 1e6,
+			duration / 1000.0, r.threadCount, (unsigned long long)r.calls,
+			busy / 1000.0, threadSafe / 1000.0, mainOnly / 1000.0,
+			Percent(busy, duration * r.threadCount),
+			Percent(mainOnly, duration));
+	}
+}
+
+void WriteRecalcThreads(FILE *fp, const TraceData &data)
+{
+	fputs("Recalc,Thread,Calls,Busy (ms),Idle (ms),Thread-Safe (ms),Main Thread Only (ms),"
+		"Utilization (%),First Call (ms),Last Return (ms)\n", fp);
+	for (const TraceRecalc &recalc : data.recalcs)
+	{
+		const TraceRecalcRecord &r = recalc.summary;
+		double duration = data.TicksToMicroseconds((double)(r.endTicks - r.startTicks));
+		for (const TraceRecalcThreadRecord &t : recalc.threads)
+		{
+			double busy = data.TicksToMicroseconds((double)t.busyTicks);
+			double threadSafe = data.TicksToMicroseconds((double)t.threadSafeTicks);
+			double idle = (duration > busy) ? duration - busy : 0.0;
+			fprintf(fp, "%u,%u,%llu,%.3f,%.3f,%.3f,%.3f,%.1f,%.3f,%.3f\n",
+				r.recalcId, t.threadId, (unsigned long long)t.calls,
+				busy / 1000.0, idle / 1000.0, threadSafe / 1000.0, (busy - threadSafe) / 1000.0,
+				Percent(busy, duration),
+				data.TicksToMicroseconds((double)(int64_t)(t.firstTicks - r.startTicks)) / 1000.0,
+				data.TicksToMicroseconds((double)(int64_t)(t.lastTicks - r.startTicks)) / 1000.0);
+		}
+	}
+}
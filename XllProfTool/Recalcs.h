@@ -0,0 +1,25 @@
+////////////////////////////////////////////////////////////////////////////
+// Recalcs.h -- report the recalculations recorded by XllProfiler
+//
+// XllProfiler writes a summary of each recalculation when Excel reports
+// its end (see TraceRecalcRecord). The summaries cover every top-level
+// call in every mode, so they are not scaled in sampling mode.
+//
+
+#pragma once
+
+#include <stdio.h>
+#include "TraceReader.h"
+
+// Writes a CSV table with one row per recalculation: its duration, the
+// time spent in instrumented functions on all threads, split into
+// thread-safe functions and functions that only run on the main thread,
+// the mean utilization of the threads that made calls, and the share
+// of the recalculation taken by the main-thread-only functions, which
+// more calculation threads cannot shorten.
+void WriteRecalcSummary(FILE *fp, const TraceData &data);
+
+// Writes a CSV table with one row per thread and recalculation: how long
+// the thread was busy in instrumented calls and idle, and when its
+// first and last call started and ended.
+void WriteRecalcThreads(FILE *fp, const TraceData &data);
@@ -0,0 +1,431 @@
+////////////////////////////////////////////////////////////////////////////
+// Replay.cpp -- replay captured calls against a build of an add-in
+
+#include "Commands.h"
+#include "CorpusReader.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#if defined(_WIN32)
+
+#include "FakeHost.h"
+#include <algorithm>
+#include <map>
+#include <memory>
+
+//
+// ReplayArguments
+//
+// Native argument values rebuilt from the captured values of a call.
+// The buffers that the arguments point to are owned by this object.
+//
+
+class ReplayArguments
+{
+	std::vector<ArgumentType> m_types;
+	std::vector<uint64_t> m_values; // one per argument; doubles are bit-copied
+	std::vector<std::unique_ptr<XCHAR[]>> m_strings;
+	std::vector<std::unique_ptr<XLOPER12[]>> m_xlopers;
+	std::vector<std::unique_ptr<double[]>> m_arrays;
+
+	XCHAR* MakeString(const CorpusValue &value, bool isCounted)
+	{
+		size_t length = std::min(value.text.size(), (size_t)32767);
+		m_strings.emplace_back(new XCHAR[length + 1]);
+		XCHAR *p = m_strings.back().get();
+		XCHAR *q = isCounted ? p + 1 : p;
+		for (size_t i = 0; i < length; i++)
+			q[i] = (XCHAR)value.text[i];
+		if (isCounted)
+			p[0] = (XCHAR)length;
+		else
+			p[length] = 0;
+		return p;
+	}
+
+	void MakeXloper(const CorpusValue &value, XLOPER12 &x)
+	{
+		switch (value.tag)
+		{
+		case CorpusNumber:
+			x.xltype = xltypeNum;
+			x.val.num = value.number;
+			break;
+		case CorpusInteger:
+			x.xltype = xltypeInt;
+			x.val.w = value.integer;
+			break;
+		case CorpusBoolean:
+			x.xltype = xltypeBool;
+			x.val.xbool = value.integer;
+			break;
+		case CorpusError:
+			x.xltype = xltypeErr;
+			x.val.err = value.integer;
+			break;
+		case CorpusString:
+			x.xltype = xltypeStr;
+			x.val.str = MakeString(value, true);
+			break;
+		case CorpusNil:
+			x.xltype = xltypeNil;
+			break;
+		case CorpusArray:
+			{
+				size_t count = value.elements.size();
+				m_xlopers.emplace_back(new XLOPER12[count > 0 ? count : 1]);
+				XLOPER12 *elements = m_xlopers.back().get();
+				for (size_t i = 0; i < count; i++)
+					MakeXloper(value.elements[i], elements[i]);
+				x.xltype = xltypeMulti;
+				x.val.array.rows = (RW)value.rows;
+				x.val.array.columns = (COL)value.columns;
+				x.val.array.lparray = elements;
+			}
+			break;
+		default:
+			x.xltype = xltypeMissing;
+			break;
+		}
+	}
+
+	void* MakeNumberArray(const CorpusValue &value)
+	{
+		// FP12 is two INT32 followed by the doubles; allocate in doubles
+		// to keep the alignment.
+		size_t count = value.numbers.size();
+		m_arrays.emplace_back(new double[1 + std::max(count, (size_t)1)]);
+		FP12 *p = reinterpret_cast<FP12*>(m_arrays.back().get());
+		p->rows = (INT32)value.rows;
+		p->columns = (INT32)value.columns;
+		if (count > 0)
+			memcpy(p->array, &value.numbers[0], count * sizeof(double));
+		return p;
+	}
+
+public:
+	// Returns false if a value cannot be converted to the argument type.
+	bool Build(const FunctionSignature &signature, const CorpusCall &call)
+	{
+		if (call.arguments.size() != signature.arguments.size())
+			return false;
+
+		for (size_t i = 0; i < call.arguments.size(); i++)
+		{
+			const CorpusValue &value = call.arguments[i];
+			ArgumentType type = signature.arguments[i];
+			uint64_t slot = 0;
+			switch (type)
+			{
+			case ArgumentDouble:
+				if (value.tag != CorpusNumber)
+					return false;
+				memcpy(&slot, &value.number, sizeof(double));
+				break;
+			case ArgumentInt32:
+			case ArgumentInt16:
+			case ArgumentUInt16:
+			case ArgumentBoolean:
+				if (value.tag != CorpusInteger && value.tag != CorpusBoolean)
+					return false;
+				slot = (uint64_t)(int64_t)value.integer;
+				break;
+			case ArgumentString:
+			case ArgumentCountedString:
+				if (value.tag != CorpusString)
+					return false;
+				slot = (uint64_t)(uintptr_t)MakeString(value, type == ArgumentCountedString);
+				break;
+			case ArgumentXloper:
+				if (value.tag == CorpusUnsupported)
+					return false;
+				m_xlopers.emplace_back(new XLOPER12[1]);
+				MakeXloper(value, m_xlopers.back()[0]);
+				slot = (uint64_t)(uintptr_t)m_xlopers.back().get();
+				break;
+			case ArgumentArray:
+				if (value.tag != CorpusNumberArray)
+					return false;
+				slot = (uint64_t)(uintptr_t)MakeNumberArray(value);
+				break;
+			default:
+				return false;
+			}
+			m_types.push_back(type);
+			m_values.push_back(slot);
+		}
+		return true;
+	}
+
+	const std::vector<ArgumentType>& types() const { return m_types; }
+	const std::vector<uint64_t>& values() const { return m_values; }
+};
+
+// Maximum number of arguments of a replayed call.
+static const size_t MaxReplayArguments = 32;
+
+struct ReplayResult
+{
+	double floating;
+	uintptr_t integer;
+};
+
+#if defined(_M_X64)
+
+// A procedure called through a variadic prototype receives each double
+// argument in both the integer and the vector register of its position,
+// and the callee cleans nothing up, so passing every argument as a
+// bit-copied double, followed by unused ones, matches any signature of
+// up to MaxReplayArguments integer, pointer or double arguments.
+typedef double (*VariadicDoubleProc)(...);
+typedef uintptr_t (*VariadicIntegerProc)(...);
+
+static ReplayResult CallProcedure(FARPROC proc, const ReplayArguments &args, bool returnsDouble)
+{
+	double a[MaxReplayArguments] = {};
+	const std::vector<uint64_t> &values = args.values();
+	memcpy(a, values.data(), values.size() * sizeof(uint64_t));
+
+	ReplayResult result = { 0.0, 0 };
+#define REPLAY_ARGUMENTS a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7], \
+	a[8], a[9], a[10], a[11], a[12], a[13], a[14], a[15], \
+	a[16], a[17], a[18], a[19], a[20], a[21], a[22], a[23], \
+	a[24], a[25], a[26], a[27], a[28], a[29], a[30], a[31]
+	if (returnsDouble)
+		result.floating = ((VariadicDoubleProc)proc)(REPLAY_ARGUMENTS);
+	else
+		result.integer = ((VariadicIntegerProc)proc)(REPLAY_ARGUMENTS);
+#undef REPLAY_ARGUMENTS
+	return result;
+}
+
+#elif defined(_M_IX86)
+
+// Pushes the arguments onto the stack and calls a __stdcall procedure,
+// which pops them. Doubles take two stack slots; all other arguments
+// take one.
+static ReplayResult CallProcedure(FARPROC proc, const ReplayArguments &args, bool returnsDouble)
+{
+	std::vector<uint32_t> words;
+	for (size_t i = 0; i < args.values().size(); i++)
+	{
+		uint64_t value = args.values()[i];
+		words.push_back((uint32_t)value);
+		if (args.types()[i] == ArgumentDouble)
+			words.push_back((uint32_t)(value >> 32));
+	}
+
+	const uint32_t *pWords = words.data();
+	size_t count = words.size();
+	double floating = 0.0;
+	uint32_t integer = 0;
+	__asm
+	{
+		mov ecx, count
+		mov edx, pWords
+		lea edx, [edx + ecx * 4]
+	push_argument:
+		test ecx, ecx
+		jz call_procedure
+		sub edx, 4
+		push dword ptr [edx]
+		dec ecx
+		jmp push_argument
+	call_procedure:
+		call proc
+		mov integer, eax
+	}
+	if (returnsDouble)
+	{
+		__asm fstp floating
+	}
+
+	ReplayResult result = { floating, integer };
+	return result;
+}
+
+#else
+#error Replay does not support this processor architecture.
+#endif
+
+struct ReplayStatistics
+{
+	std::string name;
+	std::vector<double> samples; // microseconds
+};
+
+static double Percentile(const std::vector<double> &sorted, double p)
+{
+	if (sorted.empty())
+		return 0.0;
+	size_t index = (size_t)(p * (sorted.size() - 1) + 0.5);
+	return sorted[index];
+}
+
+static void WriteReplaySummary(FILE *fp, std::map<uint32_t, ReplayStatistics> &statistics)
+{
+	fprintf(fp, "Function,Calls,Total (ms),Mean (us),P50 (us),P99 (us)\n");
+	for (auto &kv : statistics)
+	{
+		std::vector<double> &samples = kv.second.samples;
+		std::sort(samples.begin(), samples.end());
+		double total = 0.0;
+		for (double x : samples)
+			total += x;
+
+		WriteCsvString(fp, kv.second.name);
+		fprintf(fp, ",%u,%.3f,%.3f,%.3f,%.3f\n",
+			(unsigned int)samples.size(),
+			total / 1000.0,
+			total / samples.size(),
+			Percentile(samples, 0.5),
+			Percentile(samples, 0.99));
+	}
+}
+
+static unsigned long long ReadPerformanceCounter()
+{
+	LARGE_INTEGER t;
+	QueryPerformanceCounter(&t);
+	return (unsigned long long)t.QuadPart;
+}
+
+int ReplayCommand(int argc, char *argv[])
+{
+	const char *corpusFileName = nullptr;
+	const char *addinFileName = nullptr;
+	const char *summaryFileName = "-";
+	unsigned int repeat = 1;
+
+	for (int i = 0; i < argc; i++)
+	{
+		const char *arg = argv[i];
+		if (strcmp(arg, "--repeat") == 0 && i + 1 < argc)
+			repeat = (unsigned int)strtoul(argv[++i], nullptr, 10);
+		else if (strcmp(arg, "--summary") == 0 && i + 1 < argc)
+			summaryFileName = argv[++i];
+		else if (arg[0] != '-' && corpusFileName == nullptr)
+			corpusFileName = arg;
+		else if (arg[0] != '-' && addinFileName == nullptr)
+			addinFileName = arg;
+		else
+		{
+			fprintf(stderr, "error: unexpected argument %s\n", arg);
+			return 2;
+		}
+	}
+
+	if (corpusFileName == nullptr || addinFileName == nullptr || repeat == 0)
+	{
+		fprintf(stderr, "usage: XllProfTool replay <corpus.xlpc> <addin.xll> "
+			"[--repeat <n>] [--summary <file.csv>]\n");
+		return 2;
+	}
+
+	CorpusData corpus;
+	std::string error;
+	if (!ReadCorpusFile(corpusFileName, corpus, error))
+	{
+		fprintf(stderr, "error: %s\n", error.c_str());
+		return 1;
+	}
+
+	std::wstring addinPath(addinFileName, addinFileName + strlen(addinFileName));
+	FakeHost host;
+	if (!host.Load(addinPath, error))
+	{
+		fprintf(stderr, "error: %s: %s\n", addinFileName, error.c_str());
+		return 1;
+	}
+
+	// Resolve the procedures, and check that the add-in still registers
+	// them with the same types.
+	std::vector<FARPROC> procedures(corpus.functions.size());
+	for (size_t i = 0; i < corpus.functions.size(); i++)
+	{
+		const CorpusFunction &f = corpus.functions[i];
+		if (f.entryPointName.empty())
+			continue;
+
+		const FakeHost::RegisteredFunction *registered = host.FindRegisteredFunction(f.entryPointName);
+		std::wstring typeText(f.typeText.begin(), f.typeText.end());
+		if (registered != nullptr && registered->typeText != typeText)
+		{
+			fprintf(stderr, "warning: %s is now registered with different types; skipped\n",
+				f.name.c_str());
+			continue;
+		}
+		if (f.signature.arguments.size() > MaxReplayArguments)
+		{
+			fprintf(stderr, "warning: %s has too many arguments; skipped\n", f.name.c_str());
+			continue;
+		}
+		procedures[i] = host.GetProcedure(f.entryPointName);
+		if (procedures[i] == NULL)
+			fprintf(stderr, "warning: %s is not exported; skipped\n", f.name.c_str());
+	}
+
+	// Build the arguments of every call up front so that only the
+	// calls themselves are timed.
+	std::vector<std::unique_ptr<ReplayArguments>> arguments(corpus.calls.size());
+	for (size_t i = 0; i < corpus.calls.size(); i++)
+	{
+		const CorpusCall &call = corpus.calls[i];
+		if (call.functionId >= procedures.size() || procedures[call.functionId] == NULL)
+			continue;
+		std::unique_ptr<ReplayArguments> args(new ReplayArguments);
+		if (args->Build(corpus.functions[call.functionId].signature, call))
+			arguments[i] = std::move(args);
+	}
+
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency(&frequency);
+	std::map<uint32_t, ReplayStatistics> statistics;
+	for (unsigned int r = 0; r < repeat; r++)
+	{
+		for (size_t i = 0; i < corpus.calls.size(); i++)
+		{
+			if (!arguments[i])
+				continue;
+
+			const CorpusCall &call = corpus.calls[i];
+			const CorpusFunction &f = corpus.functions[call.functionId];
+			bool returnsDouble = (f.signature.returnType == ArgumentDouble);
+
+			unsigned long long start = ReadPerformanceCounter();
+			ReplayResult result = CallProcedure(procedures[call.functionId], *arguments[i], returnsDouble);
+			unsigned long long end = ReadPerformanceCounter();
+
+			if (f.signature.returnType == ArgumentXloper)
+				host.FreeReturnValue((LPXLOPER12)result.integer);
+
+			ReplayStatistics &s = statistics[call.functionId];
+			s.name = f.name;
+			s.samples.push_back((end - start) * 1e6 / frequency.QuadPart);
+		}
+	}
+
+	host.Unload();
+
+	FILE *fp = (strcmp(summaryFileName, "-") == 0) ? stdout : fopen(summaryFileName, "wb");
+	if (fp == nullptr)
+	{
+		fprintf(stderr, "error: cannot create %s\n", summaryFileName);
+		return 1;
+	}
+	WriteReplaySummary(fp, statistics);
+	if (fp != stdout)
+		fclose(fp);
+	return 0;
+}
+
+#else
+
+int ReplayCommand(int, char *[])
+{
+	fprintf(stderr, "error: replay loads the add-in and is only supported on Windows\n");
+	return 1;
+}
+
+#endif
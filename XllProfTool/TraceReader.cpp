@@ -0,0 +1,304 @@
+////////////////////////////////////////////////////////////////////////////
+// TraceReader.cpp -- load a trace file written by XllProfiler
+
+#include "TraceReader.h"
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+std::string TraceData::GetFunctionName(uint32_t functionId) const
+{
+	if (functionId == TraceNoFunction)
+		return "(none)";
+	if (functionId < functions.size() && !functions[functionId].name.empty())
+		return functions[functionId].name;
+	return "#" + std::to_string((unsigned long long)functionId);
+}
+
+bool ReadTraceFile(const char *fileName, TraceData &data, std::string &error)
+{
+	FILE *fp = fopen(fileName, "rb");
+	if (fp == nullptr)
+	{
+		error = std::string("cannot open ") + fileName;
+		return false;
+	}
+
+	TraceFileHeader header;
+	if (fread(&header, sizeof(header), 1, fp) != 1 ||
+		header.magic != XLL_TRACE_FILE_MAGIC)
+	{
+		fclose(fp);
+		error = std::string(fileName) + " is not a trace file";
+		return false;
+	}
+	if (header.version != XLL_TRACE_FILE_VERSION)
+	{
+		fclose(fp);
+		error = std::string(fileName) + " has unsupported version " +
+			std::to_string((unsigned long long)header.version);
+		return false;
+	}
+	if (!(header.ticksPerSecond > 0))
+	{
+		fclose(fp);
+		error = std::string(fileName) + " has no clock calibration; the "
+			"profiler stopped before the first write";
+		return false;
+	}
+
+	data.ticksPerSecond = header.ticksPerSecond;
+	data.startTicks = header.startTicks;
+	data.processId = header.processId;
+	data.sampleInterval = (header.sampleInterval > 1) ? header.sampleInterval : 1;
+
+	TraceChunkHeader chunk;
+	std::vector<char> payload;
+	while (fread(&chunk, sizeof(chunk), 1, fp) == 1)
+	{
+		payload.resize(chunk.size);
+		if (chunk.size > 0 && fread(&payload[0], 1, chunk.size, fp) != chunk.size)
+			break; // truncated
+
+		switch (chunk.type)
+		{
+		case TraceChunkFunction:
+			if (chunk.size > sizeof(TraceFunctionRecord))
+			{
+				TraceFunctionRecord record;
+				memcpy(&record, &payload[0], sizeof(record));
+
+				// Up to three null-terminated strings follow the record.
+				const char *p = &payload[sizeof(record)];
+				const char *end = &payload[0] + payload.size();
+				const char *name = p;
+				const char *nameEnd = std::find(name, end, '\0');
+				const char *dllName = (nameEnd < end) ? nameEnd + 1 : end;
+				const char *dllNameEnd = std::find(dllName, end, '\0');
+				const char *typeText = (dllNameEnd < end) ? dllNameEnd + 1 : end;
+				const char *typeTextEnd = std::find(typeText, end, '\0');
+
+				if (record.functionId >= data.functions.size())
+					data.functions.resize(record.functionId + 1);
+				data.functions[record.functionId].name.assign(name, nameEnd);
+				data.functions[record.functionId].dllName.assign(dllName, dllNameEnd);
+				data.functions[record.functionId].typeText.assign(typeText, typeTextEnd);
+			}
+			break;
+
+		case TraceChunkCalls:
+			{
+				size_t count = chunk.size / sizeof(TraceCallEvent);
+				size_t offset = data.calls.size();
+				data.calls.resize(offset + count);
+				if (count > 0)
+					memcpy(&data.calls[offset], &payload[0], count * sizeof(TraceCallEvent));
+			}
+			break;
+
+		case TraceChunkCell:
+			if (chunk.size > sizeof(TraceCellRecord))
+			{
+				TraceCellRecord record;
+				memcpy(&record, &payload[0], sizeof(record));
+
+				// The sheet name follows the record.
+				const char *name = &payload[sizeof(record)];
+				const char *end = &payload[0] + payload.size();
+				if (record.cellId >= data.cells.size())
+					data.cells.resize(record.cellId + 1);
+				TraceCellInfo &cell = data.cells[record.cellId];
+				cell.sheetName.assign(name, std::find(name, end, '\0'));
+				cell.row = record.row;
+				cell.column = record.column;
+			}
+			break;
+
+		case TraceChunkRecalc:
+			if (chunk.size >= sizeof(TraceRecalcRecord))
+			{
+				TraceRecalc recalc;
+				memcpy(&recalc.summary, &payload[0], sizeof(recalc.summary));
+				size_t count = (chunk.size - sizeof(TraceRecalcRecord)) / sizeof(TraceRecalcThreadRecord);
+				recalc.threads.resize(count);
+				if (count > 0)
+				{
+					memcpy(&recalc.threads[0], &payload[sizeof(TraceRecalcRecord)],
+						count * sizeof(TraceRecalcThreadRecord));
+				}
+				data.recalcs.push_back(recalc);
+			}
+			break;
+
+		case TraceChunkCallbacks:
+			{
+				size_t count = chunk.size / sizeof(TraceCallbackEvent);
+				size_t offset = data.callbacks.size();
+				data.callbacks.resize(offset + count);
+				if (count > 0)
+					memcpy(&data.callbacks[offset], &payload[0], count * sizeof(TraceCallbackEvent));
+			}
+			break;
+
+		case TraceChunkDropped:
+			if (chunk.size >= sizeof(TraceDroppedRecord))
+			{
+				TraceDroppedRecord record;
+				memcpy(&record, &payload[0], sizeof(record));
+				data.droppedCalls += record.count;
+			}
+			break;
+
+		case TraceChunkCounters:
+			for (size_t offset = 0; offset + sizeof(TraceCounterRecord) <= chunk.size;
+				offset += sizeof(TraceCounterRecord))
+			{
+				TraceCounterRecord record;
+				memcpy(&record, &payload[offset], sizeof(record));
+				if (record.functionId >= data.counts.size())
+				{
+					TraceFunctionCounts zero = { 0, 0, 0 };
+					data.counts.resize(record.functionId + 1, zero);
+				}
+				TraceFunctionCounts &c = data.counts[record.functionId];
+				c.calls += record.calls;
+				c.inclusiveTicks += record.inclusiveTicks;
+				c.selfTicks += record.selfTicks;
+			}
+			break;
+
+		case TraceChunkHardware:
+			for (size_t offset = 0; offset + sizeof(TraceHardwareRecord) <= chunk.size;
+				offset += sizeof(TraceHardwareRecord))
+			{
+				TraceHardwareRecord record;
+				memcpy(&record, &payload[offset], sizeof(record));
+				if (record.functionId >= data.hardware.size())
+				{
+					TraceFunctionHardware zero = {};
+					data.hardware.resize(record.functionId + 1, zero);
+				}
+				TraceFunctionHardware &h = data.hardware[record.functionId];
+				h.available |= record.available;
+				h.calls += record.calls;
+				for (int i = 0; i < TraceHardwareCounterCount; i++)
+					h.counts[i] += record.counts[i];
+			}
+			break;
+
+		case TraceChunkMemory:
+			for (size_t offset = 0; offset + sizeof(TraceMemoryRecord) <= chunk.size;
+				offset += sizeof(TraceMemoryRecord))
+			{
+				TraceMemoryRecord record;
+				memcpy(&record, &payload[offset], sizeof(record));
+				if (record.functionId >= data.memory.size())
+				{
+					TraceFunctionMemory zero = {};
+					data.memory.resize(record.functionId + 1, zero);
+				}
+				TraceFunctionMemory &m = data.memory[record.functionId];
+				m.calls += record.calls;
+				m.allocations += record.allocations;
+				m.allocatedBytes += record.allocatedBytes;
+				m.frees += record.frees;
+				m.freedBytes += record.freedBytes;
+				m.returns += record.returns;
+				m.returnedBytes += record.returnedBytes;
+				m.releases += record.releases;
+				m.releasedBytes += record.releasedBytes;
+				m.holdTicks += record.holdTicks;
+				m.maxHoldTicks = std::max(m.maxHoldTicks, record.maxHoldTicks);
+			}
+			break;
+
+		case TraceChunkOverhead:
+			if (chunk.size >= sizeof(TraceOverheadRecord))
+				memcpy(&data.overhead, &payload[0], sizeof(data.overhead));
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	fclose(fp);
+	return true;
+}
+
+void BuildCallTree(const TraceData &data, std::vector<CallTreeEntry> &tree)
+{
+	const std::vector<TraceCallEvent> &calls = data.calls;
+
+	// Sort by thread, then by start time; a caller starts no later and
+	// ends no earlier than its callees, so ties on the start time are
+	// broken by putting the longer call first.
+	std::vector<size_t> order(calls.size());
+	for (size_t i = 0; i < order.size(); i++)
+		order[i] = i;
+	std::sort(order.begin(), order.end(), [&calls](size_t a, size_t b) {
+		const TraceCallEvent &x = calls[a];
+		const TraceCallEvent &y = calls[b];
+		if (x.threadId != y.threadId)
+			return x.threadId < y.threadId;
+		if (x.enterTicks != y.enterTicks)
+			return x.enterTicks < y.enterTicks;
+		if (x.exitTicks != y.exitTicks)
+			return x.exitTicks > y.exitTicks;
+		return x.depth < y.depth;
+	});
+
+	tree.clear();
+	tree.reserve(calls.size());
+	std::vector<size_t> stack; // indices into tree of the open calls
+	for (size_t i = 0; i < order.size(); i++)
+	{
+		const TraceCallEvent &e = calls[order[i]];
+		if (i > 0 && calls[order[i - 1]].threadId != e.threadId)
+			stack.clear();
+
+		// Close the calls that ended before this one started.
+		while (!stack.empty() && calls[tree[stack.back()].call].exitTicks <= e.enterTicks)
+			stack.pop_back();
+
+		CallTreeEntry entry;
+		entry.call = order[i];
+		entry.parent = stack.empty() ? CallTreeEntry::NoParent : stack.back();
+		entry.inclusiveTicks = 0;
+		entry.selfTicks = 0;
+
+		stack.push_back(tree.size());
+		tree.push_back(entry);
+	}
+
+	// Subtract the overhead bottom-up. Each call is slowed down by the
+	// inner overhead of its own instrumentation and by the outer
+	// overhead of each nested call.
+	std::vector<double> descendants(tree.size(), 0.0);
+	std::vector<uint64_t> childTicks(tree.size(), 0);
+	for (size_t i = tree.size(); i-- > 0; )
+	{
+		CallTreeEntry &entry = tree[i];
+		const TraceCallEvent &e = calls[entry.call];
+		double overhead = data.overhead.innerTicks + descendants[i] * data.overhead.outerTicks;
+		double elapsed = (double)(e.exitTicks - e.enterTicks);
+		entry.inclusiveTicks = (elapsed > overhead) ? (uint64_t)(elapsed - overhead + 0.5) : 0;
+		entry.selfTicks = entry.inclusiveTicks - std::min(entry.inclusiveTicks, childTicks[i]);
+		if (entry.parent != CallTreeEntry::NoParent)
+		{
+			descendants[entry.parent] += 1.0 + descendants[i];
+			childTicks[entry.parent] += entry.inclusiveTicks;
+		}
+	}
+}
+
+bool IsRecursiveCall(const TraceData &data, const std::vector<CallTreeEntry> &tree, size_t index)
+{
+	uint32_t functionId = data.calls[tree[index].call].functionId;
+	for (size_t p = tree[index].parent; p != CallTreeEntry::NoParent; p = tree[p].parent)
+	{
+		if (data.calls[tree[p].call].functionId == functionId)
+			return true;
+	}
+	return false;
+}
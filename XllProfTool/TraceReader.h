@@ -0,0 +1,141 @@
+////////////////////////////////////////////////////////////////////////////
+// TraceReader.h -- load a trace file written by XllProfiler
+
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "TraceFormat.h"
+
+struct TraceFunctionInfo
+{
+	std::string name;
+	std::string dllName;
+	std::string typeText;   // empty if not recorded
+};
+
+// A worksheet cell that calls are attributed to. row and column are
+// zero-based.
+struct TraceCellInfo
+{
+	std::string sheetName;
+	uint32_t row;
+	uint32_t column;
+};
+
+// Calls of a function counted in counting mode, summed over threads.
+struct TraceFunctionCounts
+{
+	uint64_t calls;
+	uint64_t inclusiveTicks;
+	uint64_t selfTicks;
+};
+
+// Processor counters read around the calls of a function, summed over
+// threads.
+struct TraceFunctionHardware
+{
+	uint32_t available; // bit i set if counter i was read on some thread
+	uint64_t calls;
+	uint64_t counts[TraceHardwareCounterCount];
+};
+
+// Heap allocations and returned results of a function, summed over
+// threads (see TraceMemoryRecord).
+struct TraceFunctionMemory
+{
+	uint64_t calls;
+	uint64_t allocations;
+	uint64_t allocatedBytes;
+	uint64_t frees;
+	uint64_t freedBytes;
+	uint64_t returns;
+	uint64_t returnedBytes;
+	uint64_t releases;
+	uint64_t releasedBytes;
+	uint64_t holdTicks;
+	uint64_t maxHoldTicks;  // over all threads
+};
+
+// Summary of a recalculation and the activity of each thread in it.
+struct TraceRecalc
+{
+	TraceRecalcRecord summary;
+	std::vector<TraceRecalcThreadRecord> threads;
+};
+
+struct TraceData
+{
+	double ticksPerSecond;
+	uint64_t startTicks;
+	uint32_t processId;
+	uint32_t sampleInterval;                  // 1 if all calls are recorded
+	TraceOverheadRecord overhead;             // per call, in ticks
+	std::vector<TraceFunctionInfo> functions; // indexed by function id
+	std::vector<TraceCallEvent> calls;        // in the order written
+	std::vector<TraceFunctionCounts> counts;  // indexed by function id
+	std::vector<TraceFunctionHardware> hardware; // indexed by function id
+	std::vector<TraceFunctionMemory> memory;  // indexed by function id
+	std::vector<TraceCallbackEvent> callbacks; // in the order written
+	std::vector<TraceCellInfo> cells;         // indexed by cell id; 0 is unused
+	std::vector<TraceRecalc> recalcs;         // in the order written
+	unsigned long long droppedCalls;
+
+	TraceData() : ticksPerSecond(0), startTicks(0), processId(0),
+		sampleInterval(1), droppedCalls(0)
+	{
+		overhead.innerTicks = 0.0;
+		overhead.outerTicks = 0.0;
+	}
+
+	// Returns the name of a function, "#id" if it is not defined, or
+	// "(none)" for TraceNoFunction.
+	std::string GetFunctionName(uint32_t functionId) const;
+
+	// Converts a difference of two timestamps to microseconds.
+	double TicksToMicroseconds(double ticks) const
+	{
+		return ticks * 1e6 / ticksPerSecond;
+	}
+
+	// Converts a timestamp to microseconds since recording started.
+	double TimestampToMicroseconds(uint64_t ticks) const
+	{
+		return TicksToMicroseconds((double)(int64_t)(ticks - startTicks));
+	}
+};
+
+// Reads a trace file. A file that ends in the middle of a chunk, as
+// left by a process that did not exit cleanly, is read up to the last
+// complete chunk. Returns false and sets error if the file cannot be
+// read or is not a trace file.
+bool ReadTraceFile(const char *fileName, TraceData &data, std::string &error);
+
+//
+// CallTreeEntry
+//
+// Position of a recorded call in the call tree of its thread, and its
+// inclusive time and the time spent in the call itself excluding
+// recorded callees, with the instrumentation overhead subtracted.
+//
+
+struct CallTreeEntry
+{
+	size_t call;        // index into TraceData::calls
+	size_t parent;      // index into the tree, or NoParent for a root call
+	uint64_t inclusiveTicks;
+	uint64_t selfTicks;
+
+	static const size_t NoParent = (size_t)-1;
+};
+
+// Reconstructs the nesting of the recorded calls. The entries are
+// sorted by thread and then by start time, so a parent always precedes
+// its children.
+void BuildCallTree(const TraceData &data, std::vector<CallTreeEntry> &tree);
+
+// Returns true if the function of a call in the tree is already on the
+// stack, so that the time of the call is part of the inclusive time of
+// an outer call of the same function.
+bool IsRecursiveCall(const TraceData &data, const std::vector<CallTreeEntry> &tree, size_t index);
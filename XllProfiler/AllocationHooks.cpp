@@ -0,0 +1,351 @@
+////////////////////////////////////////////////////////////////////////////
+// AllocationHooks.cpp -- count the heap allocations of add-ins
+
+#include "AllocationHooks.h"
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+// Maximum number of C runtime DLLs whose heap functions can be hooked,
+// such as ucrtbase.dll and msvcr120.dll. Each one needs wrappers of its
+// own that forward to its functions.
+static const int MaxRuntimes = 4;
+
+typedef void* (__cdecl *MallocProc)(size_t size);
+typedef void* (__cdecl *CallocProc)(size_t count, size_t size);
+typedef void* (__cdecl *ReallocProc)(void *block, size_t size);
+typedef void (__cdecl *FreeProc)(void *block);
+typedef size_t (__cdecl *MsizeProc)(void *block);
+typedef LPVOID (WINAPI *HeapAllocProc)(HANDLE hHeap, DWORD dwFlags, SIZE_T dwBytes);
+typedef LPVOID (WINAPI *HeapReAllocProc)(HANDLE hHeap, DWORD dwFlags, LPVOID lpMem, SIZE_T dwBytes);
+typedef BOOL (WINAPI *HeapFreeProc)(HANDLE hHeap, DWORD dwFlags, LPVOID lpMem);
+
+// Heap functions of a C runtime DLL, which the wrappers forward to.
+// They are set before any import is redirected to a wrapper.
+struct RuntimeHeap
+{
+	char dllName[64];
+	MallocProc malloc;
+	CallocProc calloc;
+	ReallocProc realloc;
+	FreeProc free;
+	MsizeProc msize;
+};
+
+static RuntimeHeap s_runtimes[MaxRuntimes];
+static int s_runtimeCount;
+
+static HeapAllocProc s_heapAlloc;
+static HeapReAllocProc s_heapReAlloc;
+static HeapFreeProc s_heapFree;
+
+static __declspec(thread) AllocationCounts t_counts;
+
+static inline void CountAllocation(size_t bytes)
+{
+	t_counts.allocations++;
+	t_counts.allocatedBytes += bytes;
+}
+
+static inline void CountFree(size_t bytes)
+{
+	t_counts.frees++;
+	t_counts.freedBytes += bytes;
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Wrappers
+
+template <int N>
+struct RuntimeHooks
+{
+	static size_t GetBlockSize(void *block)
+	{
+		MsizeProc msize = s_runtimes[N].msize;
+		return (msize != nullptr) ? msize(block) : 0;
+	}
+
+	static void* __cdecl Malloc(size_t size)
+	{
+		void *p = s_runtimes[N].malloc(size);
+		if (p != nullptr)
+			CountAllocation(size);
+		return p;
+	}
+
+	static void* __cdecl Calloc(size_t count, size_t size)
+	{
+		void *p = s_runtimes[N].calloc(count, size);
+		if (p != nullptr)
+			CountAllocation(count * size);
+		return p;
+	}
+
+	// realloc(block, 0) frees the block and returns NULL; a failed
+	// realloc leaves the block alone.
+	static void* __cdecl Realloc(void *block, size_t size)
+	{
+		size_t oldSize = (block != nullptr) ? GetBlockSize(block) : 0;
+		void *p = s_runtimes[N].realloc(block, size);
+		if (block != nullptr && (p != nullptr || size == 0))
+			CountFree(oldSize);
+		if (p != nullptr)
+			CountAllocation(size);
+		return p;
+	}
+
+	static void __cdecl Free(void *block)
+	{
+		if (block != nullptr)
+			CountFree(GetBlockSize(block));
+		s_runtimes[N].free(block);
+	}
+};
+
+struct RuntimeHookSet
+{
+	void *malloc;
+	void *calloc;
+	void *realloc;
+	void *free;
+};
+
+#define RUNTIME_HOOK_SET(n) { (void *)RuntimeHooks<n>::Malloc, (void *)RuntimeHooks<n>::Calloc, \
+	(void *)RuntimeHooks<n>::Realloc, (void *)RuntimeHooks<n>::Free }
+
+static const RuntimeHookSet s_runtimeHooks[MaxRuntimes] =
+{
+	RUNTIME_HOOK_SET(0), RUNTIME_HOOK_SET(1), RUNTIME_HOOK_SET(2), RUNTIME_HOOK_SET(3)
+};
+
+static LPVOID WINAPI HookedHeapAlloc(HANDLE hHeap, DWORD dwFlags, SIZE_T dwBytes)
+{
+	LPVOID p = s_heapAlloc(hHeap, dwFlags, dwBytes);
+	if (p != nullptr)
+		CountAllocation(dwBytes);
+	return p;
+}
+
+static LPVOID WINAPI HookedHeapReAlloc(HANDLE hHeap, DWORD dwFlags, LPVOID lpMem, SIZE_T dwBytes)
+{
+	SIZE_T oldSize = HeapSize(hHeap, dwFlags & HEAP_NO_SERIALIZE, lpMem);
+	LPVOID p = s_heapReAlloc(hHeap, dwFlags, lpMem, dwBytes);
+	if (p != nullptr)
+	{
+		CountFree((oldSize != (SIZE_T)-1) ? oldSize : 0);
+		CountAllocation(dwBytes);
+	}
+	return p;
+}
+
+static BOOL WINAPI HookedHeapFree(HANDLE hHeap, DWORD dwFlags, LPVOID lpMem)
+{
+	if (lpMem != nullptr)
+	{
+		SIZE_T size = HeapSize(hHeap, dwFlags & HEAP_NO_SERIALIZE, lpMem);
+		CountFree((size != (SIZE_T)-1) ? size : 0);
+	}
+	return s_heapFree(hHeap, dwFlags, lpMem);
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Import table
+
+struct HookedImport
+{
+	HMODULE hModule;
+	void **slot;
+	void *original;
+	void *hook;
+};
+
+static std::vector<HMODULE> s_hookedModules;
+static std::vector<HookedImport> s_hookedImports;
+
+static bool IsRuntimeDll(const char *dllName)
+{
+	return _strnicmp(dllName, "msvcr", 5) == 0 ||
+		_strnicmp(dllName, "ucrtbase", 8) == 0 ||
+		_strnicmp(dllName, "api-ms-win-crt-heap-", 20) == 0;
+}
+
+// Returns the index of the runtime DLL with the given name, adding it
+// if necessary, or -1 if there are too many.
+static int FindRuntime(const char *dllName)
+{
+	for (int i = 0; i < s_runtimeCount; i++)
+	{
+		if (_stricmp(s_runtimes[i].dllName, dllName) == 0)
+			return i;
+	}
+	if (s_runtimeCount == MaxRuntimes || strlen(dllName) >= sizeof(s_runtimes[0].dllName))
+		return -1;
+
+	RuntimeHeap &runtime = s_runtimes[s_runtimeCount];
+	strcpy_s(runtime.dllName, dllName);
+	HMODULE hRuntime = GetModuleHandleA(dllName);
+	if (hRuntime != NULL)
+		runtime.msize = (MsizeProc)GetProcAddress(hRuntime, "_msize");
+	return s_runtimeCount++;
+}
+
+// Returns the wrapper of an imported function, or NULL if it is not
+// hooked. Stores the address of the imported function for the wrapper
+// to forward to.
+static void* GetHook(int runtime, const char *name, void *original)
+{
+	if (runtime >= 0)
+	{
+		RuntimeHeap &r = s_runtimes[runtime];
+		const RuntimeHookSet &hooks = s_runtimeHooks[runtime];
+		if (strcmp(name, "malloc") == 0)
+		{
+			if (r.malloc == nullptr)
+				r.malloc = (MallocProc)original;
+			return hooks.malloc;
+		}
+		if (strcmp(name, "calloc") == 0)
+		{
+			if (r.calloc == nullptr)
+				r.calloc = (CallocProc)original;
+			return hooks.calloc;
+		}
+		if (strcmp(name, "realloc") == 0)
+		{
+			if (r.realloc == nullptr)
+				r.realloc = (ReallocProc)original;
+			return hooks.realloc;
+		}
+		if (strcmp(name, "free") == 0)
+		{
+			if (r.free == nullptr)
+				r.free = (FreeProc)original;
+			return hooks.free;
+		}
+		return nullptr;
+	}
+
+	if (strcmp(name, "HeapAlloc") == 0)
+	{
+		if (s_heapAlloc == nullptr)
+			s_heapAlloc = (HeapAllocProc)original;
+		return (void *)HookedHeapAlloc;
+	}
+	if (strcmp(name, "HeapReAlloc") == 0)
+	{
+		if (s_heapReAlloc == nullptr)
+			s_heapReAlloc = (HeapReAllocProc)original;
+		return (void *)HookedHeapReAlloc;
+	}
+	if (strcmp(name, "HeapFree") == 0)
+	{
+		if (s_heapFree == nullptr)
+			s_heapFree = (HeapFreeProc)original;
+		return (void *)HookedHeapFree;
+	}
+	return nullptr;
+}
+
+// Swaps the pointer in an import slot, which the loader usually leaves
+// read-only.
+static bool PatchImport(void **slot, void *expected, void *value)
+{
+	DWORD oldProtect;
+	if (!VirtualProtect(slot, sizeof(void *), PAGE_READWRITE, &oldProtect))
+		return false;
+	bool ok = (InterlockedCompareExchangePointer(slot, value, expected) == expected);
+	VirtualProtect(slot, sizeof(void *), oldProtect, &oldProtect);
+	return ok;
+}
+
+int HookAllocator(HMODULE hModule)
+{
+	if (hModule == NULL ||
+		std::find(s_hookedModules.begin(), s_hookedModules.end(), hModule) != s_hookedModules.end())
+		return 0;
+
+	const BYTE *base = (const BYTE *)hModule;
+	const IMAGE_DOS_HEADER *dosHeader = (const IMAGE_DOS_HEADER *)base;
+	if (dosHeader->e_magic != IMAGE_DOS_SIGNATURE)
+		return 0;
+	const IMAGE_NT_HEADERS *ntHeaders = (const IMAGE_NT_HEADERS *)(base + dosHeader->e_lfanew);
+	if (ntHeaders->Signature != IMAGE_NT_SIGNATURE)
+		return 0;
+	s_hookedModules.push_back(hModule);
+
+	const IMAGE_DATA_DIRECTORY &directory =
+		ntHeaders->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT];
+	if (directory.VirtualAddress == 0)
+		return 0;
+
+	int count = 0;
+	const IMAGE_IMPORT_DESCRIPTOR *descriptor =
+		(const IMAGE_IMPORT_DESCRIPTOR *)(base + directory.VirtualAddress);
+	for (; descriptor->Name != 0; descriptor++)
+	{
+		// The names of the imports are only known if the module keeps
+		// its import name table.
+		if (descriptor->OriginalFirstThunk == 0)
+			continue;
+
+		const char *dllName = (const char *)(base + descriptor->Name);
+		int runtime = IsRuntimeDll(dllName) ? FindRuntime(dllName) : -1;
+		const IMAGE_THUNK_DATA *names = (const IMAGE_THUNK_DATA *)(base + descriptor->OriginalFirstThunk);
+		IMAGE_THUNK_DATA *slots = (IMAGE_THUNK_DATA *)(base + descriptor->FirstThunk);
+		for (; names->u1.AddressOfData != 0; names++, slots++)
+		{
+			if (IMAGE_SNAP_BY_ORDINAL(names->u1.Ordinal))
+				continue;
+
+			const IMAGE_IMPORT_BY_NAME *import = (const IMAGE_IMPORT_BY_NAME *)(base + names->u1.AddressOfData);
+			const char *name = (const char *)import->Name;
+			void **slot = (void **)&slots->u1.Function;
+			void *original = *slot;
+			if (runtime >= 0 && strcmp(name, "_msize") == 0)
+			{
+				s_runtimes[runtime].msize = (MsizeProc)original;
+				continue;
+			}
+
+			void *hook = GetHook(runtime, name, original);
+			if (hook != nullptr && PatchImport(slot, original, hook))
+			{
+				HookedImport hooked = { hModule, slot, original, hook };
+				s_hookedImports.push_back(hooked);
+				count++;
+			}
+		}
+	}
+
+	WCHAR msg[MAX_PATH + 100];
+	WCHAR moduleName[MAX_PATH];
+	if (GetModuleFileNameW(hModule, moduleName, ARRAYSIZE(moduleName)) == 0)
+		moduleName[0] = L'\0';
+	swprintf_s(msg, L"XllProfiler: hooked %d heap functions imported by %s\n", count, moduleName);
+	OutputDebugStringW(msg);
+	return count;
+}
+
+void RemoveAllocationHooks()
+{
+	for (const HookedImport &hooked : s_hookedImports)
+	{
+		// Skip modules that were unloaded, or unloaded and loaded again
+		// at a different address.
+		HMODULE hModule;
+		if (GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS |
+			GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT,
+			(LPCWSTR)hooked.slot, &hModule) && hModule == hooked.hModule)
+		{
+			PatchImport(hooked.slot, hooked.hook, hooked.original);
+		}
+	}
+	s_hookedImports.clear();
+	s_hookedModules.clear();
+}
+
+void ReadAllocationCounts(AllocationCounts &counts)
+{
+	counts = t_counts;
+}
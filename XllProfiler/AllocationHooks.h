@@ -0,0 +1,40 @@
+////////////////////////////////////////////////////////////////////////////
+// AllocationHooks.h -- count the heap allocations of add-ins
+//
+// The hooks replace the entries of malloc, calloc, realloc and free, and
+// of HeapAlloc, HeapReAlloc and HeapFree, in the import address table
+// of a profiled XLL with wrappers that count the calls and bytes on the
+// calling thread. The profiler reads the counts around each instrumented
+// call, so that the allocations made while a function runs, including
+// those of operator new, which calls malloc, are charged to it.
+//
+// Only calls through the import table are seen: allocations made by a
+// C runtime that is linked statically into the XLL, or by other DLLs
+// that the XLL calls, are not counted. The size of a freed block is
+// read with _msize or HeapSize before it is freed.
+//
+
+#pragma once
+
+#include <Windows.h>
+#include <stdint.h>
+
+// Allocations made on a thread since it started.
+struct AllocationCounts
+{
+	uint64_t allocations;
+	uint64_t allocatedBytes;
+	uint64_t frees;
+	uint64_t freedBytes;
+};
+
+// Redirects the heap functions imported by a module to the counting
+// wrappers, if not done already. Returns the number of imports
+// redirected.
+int HookAllocator(HMODULE hModule);
+
+// Restores the imports of all modules that are still loaded.
+void RemoveAllocationHooks();
+
+// Reads the allocations made by the calling thread through the hooks.
+void ReadAllocationCounts(AllocationCounts &counts);
@@ -0,0 +1,329 @@
+////////////////////////////////////////////////////////////////////////////
+// ArgumentCapture.cpp -- capture the arguments of instrumented calls
+
+#include "ArgumentCapture.h"
+#include "XLCALL.H"
+#include <stdio.h>
+#include <string.h>
+#include <mutex>
+#include <vector>
+
+static std::atomic<bool> s_isCapturing(false);
+static unsigned int s_sampleInterval = 100;
+static unsigned int s_maxCallsPerFunction = 1000;
+
+// Protects the file and the function list below.
+static std::mutex s_captureMutex;
+static FILE *s_corpusFile = nullptr;
+static std::vector<CaptureFunction*> s_functions;
+static std::vector<std::string> s_functionChunks; // serialized definitions
+static size_t s_functionsWritten = 0;
+
+////////////////////////////////////////////////////////////////////////////
+// Serialization
+
+class CorpusWriter
+{
+	std::vector<unsigned char> &m_buffer;
+
+public:
+	explicit CorpusWriter(std::vector<unsigned char> &buffer) : m_buffer(buffer)
+	{
+	}
+
+	void Bytes(const void *data, size_t size)
+	{
+		const unsigned char *p = static_cast<const unsigned char*>(data);
+		m_buffer.insert(m_buffer.end(), p, p + size);
+	}
+
+	void Tag(CorpusValueTag tag)
+	{
+		m_buffer.push_back((unsigned char)tag);
+	}
+
+	void UInt32(uint32_t value) { Bytes(&value, sizeof(value)); }
+	void Int32(int32_t value) { Bytes(&value, sizeof(value)); }
+	void Double(double value) { Bytes(&value, sizeof(value)); }
+
+	void Number(double value)
+	{
+		Tag(CorpusNumber);
+		Double(value);
+	}
+
+	void Integer(int32_t value)
+	{
+		Tag(CorpusInteger);
+		Int32(value);
+	}
+
+	void String(const wchar_t *s, size_t length)
+	{
+		Tag(CorpusString);
+		UInt32((uint32_t)length);
+		Bytes(s, length * sizeof(wchar_t));
+	}
+
+	void Xloper(const XLOPER12 *px)
+	{
+		if (px == nullptr)
+		{
+			Tag(CorpusMissing);
+			return;
+		}
+
+		switch (px->xltype & ~(xlbitXLFree | xlbitDLLFree))
+		{
+		case xltypeNum:
+			Number(px->val.num);
+			break;
+		case xltypeStr:
+			String(&px->val.str[1], (unsigned short)px->val.str[0]);
+			break;
+		case xltypeBool:
+			Tag(CorpusBoolean);
+			m_buffer.push_back(px->val.xbool ? 1 : 0);
+			break;
+		case xltypeErr:
+			Tag(CorpusError);
+			Int32(px->val.err);
+			break;
+		case xltypeInt:
+			Integer(px->val.w);
+			break;
+		case xltypeMissing:
+			Tag(CorpusMissing);
+			break;
+		case xltypeNil:
+			Tag(CorpusNil);
+			break;
+		case xltypeMulti:
+			{
+				uint32_t rows = (uint32_t)px->val.array.rows;
+				uint32_t columns = (uint32_t)px->val.array.columns;
+				Tag(CorpusArray);
+				UInt32(rows);
+				UInt32(columns);
+				for (size_t i = 0; i < (size_t)rows * columns; i++)
+					Xloper(&px->val.array.lparray[i]);
+			}
+			break;
+		default:
+			// References and big data cannot be replayed.
+			Tag(CorpusUnsupported);
+			break;
+		}
+	}
+
+	void NumberArray(const FP12 *p)
+	{
+		if (p == nullptr)
+		{
+			Tag(CorpusUnsupported);
+			return;
+		}
+		Tag(CorpusNumberArray);
+		UInt32((uint32_t)p->rows);
+		UInt32((uint32_t)p->columns);
+		Bytes(p->array, (size_t)p->rows * p->columns * sizeof(double));
+	}
+
+	// Reads the next argument of the given type and appends its value.
+	void Argument(ArgumentType type, ThunkArguments &args)
+	{
+		switch (type)
+		{
+		case ArgumentDouble:
+			Number(args.NextDouble());
+			break;
+		case ArgumentInt32:
+			Integer((int32_t)args.NextInteger());
+			break;
+		case ArgumentInt16:
+			Integer((short)args.NextInteger());
+			break;
+		case ArgumentUInt16:
+			Integer((unsigned short)args.NextInteger());
+			break;
+		case ArgumentBoolean:
+			Tag(CorpusBoolean);
+			m_buffer.push_back((short)args.NextInteger() ? 1 : 0);
+			break;
+		case ArgumentString:
+			{
+				const wchar_t *s = (const wchar_t *)args.NextInteger();
+				if (s == nullptr)
+					Tag(CorpusMissing);
+				else
+					String(s, wcsnlen(s, 32767));
+			}
+			break;
+		case ArgumentCountedString:
+			{
+				const wchar_t *s = (const wchar_t *)args.NextInteger();
+				if (s == nullptr)
+					Tag(CorpusMissing);
+				else
+					String(&s[1], (unsigned short)s[0]);
+			}
+			break;
+		case ArgumentXloper:
+			Xloper((const XLOPER12 *)args.NextInteger());
+			break;
+		case ArgumentArray:
+			NumberArray((const FP12 *)args.NextInteger());
+			break;
+		default:
+			args.NextInteger();
+			Tag(CorpusUnsupported);
+			break;
+		}
+	}
+};
+
+static void WriteChunk(FILE *fp, CorpusChunkType type, const void *data, size_t size)
+{
+	TraceChunkHeader header = { (uint32_t)type, (uint32_t)size };
+	fwrite(&header, sizeof(header), 1, fp);
+	fwrite(data, 1, size, fp);
+}
+
+static std::string ToUtf8(const std::wstring &s)
+{
+	if (s.empty())
+		return std::string();
+	int n = WideCharToMultiByte(CP_UTF8, 0, s.c_str(), (int)s.size(), NULL, 0, NULL, NULL);
+	std::string result(n, '\0');
+	WideCharToMultiByte(CP_UTF8, 0, s.c_str(), (int)s.size(), &result[0], n, NULL, NULL);
+	return result;
+}
+
+// Writes the definitions of functions defined since the last call.
+// Must be called with s_captureMutex held.
+static void WriteFunctions(FILE *fp)
+{
+	for (; s_functionsWritten < s_functionChunks.size(); ++s_functionsWritten)
+	{
+		const std::string &chunk = s_functionChunks[s_functionsWritten];
+		WriteChunk(fp, CorpusChunkFunction, chunk.data(), chunk.size());
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Capture
+
+CaptureFunction* DefineCaptureFunction(const RegisteredFunctionInfo &info)
+{
+	CaptureFunction *pFunction = new CaptureFunction;
+	ParseTypeText(info.typeText.c_str(), pFunction->signature);
+	pFunction->isSupported = pFunction->signature.IsSupported();
+	pFunction->callCount.store(0);
+	pFunction->capturedCount.store(0);
+
+	std::lock_guard<std::mutex> lock(s_captureMutex);
+	pFunction->id = (uint32_t)s_functions.size();
+	s_functions.push_back(pFunction);
+
+	CorpusFunctionRecord record = { pFunction->id };
+	std::string chunk((const char *)&record, sizeof(record));
+	for (const std::wstring *s : { &info.functionName, &info.dllName, &info.entryPointName, &info.typeText })
+	{
+		chunk += ToUtf8(*s);
+		chunk += '\0';
+	}
+	s_functionChunks.push_back(chunk);
+	return pFunction;
+}
+
+bool IsCapturing()
+{
+	return s_isCapturing.load(std::memory_order_relaxed);
+}
+
+void CaptureCall(CaptureFunction *pFunction, ThunkArguments &args)
+{
+	if (!pFunction->isSupported)
+		return;
+
+	unsigned int n = pFunction->callCount.fetch_add(1, std::memory_order_relaxed);
+	if (n % s_sampleInterval != 0)
+		return;
+	if (pFunction->capturedCount.fetch_add(1, std::memory_order_relaxed) >= s_maxCallsPerFunction)
+		return;
+
+	std::vector<unsigned char> buffer;
+	CorpusWriter writer(buffer);
+	CorpusCallRecord record = { pFunction->id, GetCurrentThreadId(),
+		(uint32_t)pFunction->signature.arguments.size(), 0 };
+	writer.Bytes(&record, sizeof(record));
+	for (ArgumentType type : pFunction->signature.arguments)
+	{
+		writer.Argument(type, args);
+	}
+
+	std::lock_guard<std::mutex> lock(s_captureMutex);
+	if (s_corpusFile != nullptr)
+	{
+		WriteFunctions(s_corpusFile);
+		WriteChunk(s_corpusFile, CorpusChunkCall, buffer.data(), buffer.size());
+	}
+}
+
+BOOL StartCapture(LPCWSTR fileName, unsigned int sampleInterval, unsigned int maxCallsPerFunction)
+{
+	std::lock_guard<std::mutex> lock(s_captureMutex);
+	if (s_corpusFile != nullptr)
+		return FALSE;
+
+	FILE *fp = nullptr;
+	if (_wfopen_s(&fp, fileName, L"wb") != 0 || fp == nullptr)
+		return FALSE;
+
+	s_sampleInterval = (sampleInterval > 0) ? sampleInterval : 1;
+	s_maxCallsPerFunction = maxCallsPerFunction;
+	for (CaptureFunction *pFunction : s_functions)
+	{
+		pFunction->callCount.store(0);
+		pFunction->capturedCount.store(0);
+	}
+
+	CorpusFileHeader header = { XLL_CORPUS_FILE_MAGIC, XLL_CORPUS_FILE_VERSION, s_sampleInterval, 0 };
+	fwrite(&header, sizeof(header), 1, fp);
+	s_functionsWritten = 0;
+	s_corpusFile = fp;
+	s_isCapturing.store(true);
+	return TRUE;
+}
+
+void StopCapture()
+{
+	std::lock_guard<std::mutex> lock(s_captureMutex);
+	if (s_corpusFile == nullptr)
+		return;
+
+	s_isCapturing.store(false);
+	fclose(s_corpusFile);
+	s_corpusFile = nullptr;
+}
+
+static unsigned int GetEnvironmentUInt(LPCWSTR name, unsigned int defaultValue)
+{
+	WCHAR value[32];
+	DWORD n = GetEnvironmentVariableW(name, value, ARRAYSIZE(value));
+	if (n == 0 || n >= ARRAYSIZE(value))
+		return defaultValue;
+	return (unsigned int)wcstoul(value, nullptr, 10);
+}
+
+void StartCaptureFromEnvironment()
+{
+	WCHAR fileName[MAX_PATH];
+	DWORD n = GetEnvironmentVariableW(L"XLL_PROFILER_CAPTURE_FILE", fileName, ARRAYSIZE(fileName));
+	if (n > 0 && n < ARRAYSIZE(fileName))
+	{
+		StartCapture(fileName,
+			GetEnvironmentUInt(L"XLL_PROFILER_CAPTURE_INTERVAL", 100),
+			GetEnvironmentUInt(L"XLL_PROFILER_CAPTURE_LIMIT", 1000));
+	}
+}
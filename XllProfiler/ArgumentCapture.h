@@ -0,0 +1,54 @@
+////////////////////////////////////////////////////////////////////////////
+// ArgumentCapture.h -- capture the arguments of instrumented calls
+//
+// The arguments of a sample of calls to each instrumented function are
+// decoded according to the function's registered type text, deep-copied
+// and written to a corpus file (see CorpusFormat.h). The corpus can be
+// replayed against another build of the add-in with XllProfTool.
+//
+// Every sampleInterval-th call of a function is captured, up to
+// maxCallsPerFunction calls. Calls that are not sampled cost one
+// atomic increment. Functions with argument types that cannot be
+// replayed are not captured.
+//
+
+#pragma once
+
+#include <Windows.h>
+#include <atomic>
+#include <string>
+#include "CorpusFormat.h"
+#include "ExcelHelper.h"
+#include "ThunkManager.h"
+
+struct CaptureFunction
+{
+	uint32_t id;
+	FunctionSignature signature;
+	bool isSupported;
+	std::atomic<unsigned int> callCount;
+	std::atomic<unsigned int> capturedCount;
+};
+
+// Defines a function whose calls may be captured. The returned object
+// lives until the process exits.
+CaptureFunction* DefineCaptureFunction(const RegisteredFunctionInfo &info);
+
+// Returns true if a corpus file is being written.
+bool IsCapturing();
+
+// Captures the arguments of a call if it is sampled.
+void CaptureCall(CaptureFunction *pFunction, ThunkArguments &args);
+
+// Starts writing captured calls to the given file. Returns FALSE if
+// capture is already in progress or the file cannot be created.
+BOOL StartCapture(LPCWSTR fileName, unsigned int sampleInterval, unsigned int maxCallsPerFunction);
+
+// Closes the corpus file.
+void StopCapture();
+
+// Starts capturing to the file named by the environment variable
+// XLL_PROFILER_CAPTURE_FILE, if set. XLL_PROFILER_CAPTURE_INTERVAL
+// sets the sample interval (100 by default) and XLL_PROFILER_CAPTURE_LIMIT
+// the maximum number of calls captured per function (1000 by default).
+void StartCaptureFromEnvironment();
@@ -0,0 +1,103 @@
+////////////////////////////////////////////////////////////////////////////
+// CallbackInterposer.cpp -- time the calls of add-ins back into Excel
+
+#include "CallbackInterposer.h"
+#include "XLCALL.H"
+#include "TraceRecorder.h"
+#include <algorithm>
+#include <vector>
+
+typedef int (PASCAL *Excel12Proc)(int xlfn, int coper, LPXLOPER12 *rgpxloper12, LPXLOPER12 xloper12Res);
+
+// Excel's MdCallBack12, which the interposer forwards to.
+static Excel12Proc s_excel12;
+
+struct InterposedSlot
+{
+	HMODULE hModule;
+	void **slot;
+};
+
+static std::vector<HMODULE> s_interposedModules;
+static std::vector<InterposedSlot> s_interposedSlots;
+
+static int PASCAL InterposedExcel12(int xlfn, int coper, LPXLOPER12 *rgpxloper12, LPXLOPER12 xloper12Res)
+{
+	uint64_t enterTicks = ReadTraceClock();
+	int result = s_excel12(xlfn, coper, rgpxloper12, xloper12Res);
+	RecordExcelCallback(xlfn, result, enterTicks, ReadTraceClock());
+	return result;
+}
+
+int InterposeExcelCallbacks(HMODULE hModule)
+{
+	if (s_excel12 == NULL)
+		s_excel12 = (Excel12Proc)GetProcAddress(GetModuleHandleW(NULL), "MdCallBack12");
+	if (s_excel12 == NULL || hModule == NULL)
+		return 0;
+
+	if (std::find(s_interposedModules.begin(), s_interposedModules.end(), hModule) !=
+		s_interposedModules.end())
+		return 0;
+
+	const BYTE *base = (const BYTE *)hModule;
+	const IMAGE_DOS_HEADER *dosHeader = (const IMAGE_DOS_HEADER *)base;
+	if (dosHeader->e_magic != IMAGE_DOS_SIGNATURE)
+		return 0;
+	const IMAGE_NT_HEADERS *ntHeaders = (const IMAGE_NT_HEADERS *)(base + dosHeader->e_lfanew);
+	if (ntHeaders->Signature != IMAGE_NT_SIGNATURE)
+		return 0;
+	s_interposedModules.push_back(hModule);
+
+	// pexcel12 is in .data or .bss, which are writable and not
+	// executable; sections are aligned on pages.
+	int count = 0;
+	const IMAGE_SECTION_HEADER *section = IMAGE_FIRST_SECTION(ntHeaders);
+	for (WORD i = 0; i < ntHeaders->FileHeader.NumberOfSections; i++, section++)
+	{
+		if ((section->Characteristics & (IMAGE_SCN_MEM_WRITE | IMAGE_SCN_MEM_EXECUTE)) != IMAGE_SCN_MEM_WRITE)
+			continue;
+
+		void **slots = (void **)(base + section->VirtualAddress);
+		size_t n = section->Misc.VirtualSize / sizeof(void *);
+		for (size_t k = 0; k < n; k++)
+		{
+			if (slots[k] == (void *)s_excel12 &&
+				InterlockedCompareExchangePointer(&slots[k], (void *)InterposedExcel12,
+					(void *)s_excel12) == (void *)s_excel12)
+			{
+				InterposedSlot interposed = { hModule, &slots[k] };
+				s_interposedSlots.push_back(interposed);
+				count++;
+			}
+		}
+	}
+
+	WCHAR msg[MAX_PATH + 100];
+	WCHAR moduleName[MAX_PATH];
+	if (GetModuleFileNameW(hModule, moduleName, ARRAYSIZE(moduleName)) == 0)
+		moduleName[0] = L'\0';
+	swprintf_s(msg, L"XllProfiler: %s callbacks of %s\n",
+		(count > 0) ? L"interposed" : L"cannot interpose", moduleName);
+	OutputDebugStringW(msg);
+	return count;
+}
+
+void RemoveExcelCallbackInterposers()
+{
+	for (const InterposedSlot &interposed : s_interposedSlots)
+	{
+		// Skip modules that were unloaded, or unloaded and loaded again
+		// at a different address.
+		HMODULE hModule;
+		if (GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS |
+			GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT,
+			(LPCWSTR)interposed.slot, &hModule) && hModule == interposed.hModule)
+		{
+			InterlockedCompareExchangePointer(interposed.slot, (void *)s_excel12,
+				(void *)InterposedExcel12);
+		}
+	}
+	s_interposedSlots.clear();
+	s_interposedModules.clear();
+}
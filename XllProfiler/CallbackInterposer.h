@@ -0,0 +1,30 @@
+////////////////////////////////////////////////////////////////////////////
+// CallbackInterposer.h -- time the calls of add-ins back into Excel
+//
+// An XLL calls back into Excel through the function pointer pexcel12
+// defined in XLCALL.CPP, which points to MdCallBack12 exported by Excel
+// after the first callback. The interposer replaces that pointer in a
+// profiled XLL with a wrapper that records every callback, with its
+// function number, result code and duration, against the instrumented
+// call in progress on the thread (see RecordExcelCallback()).
+//
+// pexcel12 is not exported, so it is found by scanning the writable
+// data sections of the XLL for pointers to MdCallBack12; any copy of
+// the pointer that the XLL keeps elsewhere is redirected as well. The
+// SetExcel12EntryPt() function exported by XLCALL.CPP cannot be used
+// instead: it only takes effect if MdCallBack12 cannot be found in the
+// process, which is never the case in Excel.
+//
+
+#pragma once
+
+#include <Windows.h>
+
+// Redirects the Excel callbacks of a module to the interposer, if not
+// done already. Returns the number of pointers redirected, which is
+// zero if the module has not called Excel yet or does so through some
+// other means.
+int InterposeExcelCallbacks(HMODULE hModule);
+
+// Restores the callback pointers of all modules that are still loaded.
+void RemoveExcelCallbackInterposers();
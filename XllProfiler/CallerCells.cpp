@@ -0,0 +1,156 @@
+////////////////////////////////////////////////////////////////////////////
+// CallerCells.cpp -- attribute recorded calls to the calling cells
+
+#include "CallerCells.h"
+#include "XLCALL.H"
+#include "TraceRecorder.h"
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <new>
+#include <string>
+#include <tuple>
+
+// Number of calculations that have ended. Cached entries of an earlier
+// calculation are stale.
+static std::atomic<uint32_t> s_generation(1);
+
+// Number of entries in each thread's cache. Must be a power of two.
+static const size_t CallerCacheSize = 256;
+
+struct CallerCacheEntry
+{
+	IDSHEET idSheet;
+	RW row;
+	COL column;
+	uint32_t cellId;     // 0 if the entry is empty
+	uint32_t generation; // calculation in which the entry was made
+};
+
+struct CallerCache
+{
+	CallerCacheEntry entries[CallerCacheSize];
+};
+
+static __declspec(thread) CallerCache *t_callerCache;
+
+struct SheetName
+{
+	std::wstring name;
+	uint32_t generation;
+};
+
+static std::mutex s_cellsMutex;
+static std::map<IDSHEET, SheetName> s_sheetNames;
+static std::map<std::tuple<std::wstring, RW, COL>, uint32_t> s_cellIds;
+
+// Returns the name of the sheet of a reference, such as
+// "[Book1.xlsx]Sheet1". The name is looked up once per calculation.
+static std::wstring GetSheetName(const XLOPER12 &ref, IDSHEET idSheet, uint32_t generation)
+{
+	{
+		std::lock_guard<std::mutex> lock(s_cellsMutex);
+		auto it = s_sheetNames.find(idSheet);
+		if (it != s_sheetNames.end() && it->second.generation == generation)
+			return it->second.name;
+	}
+
+	// Call Excel without holding the lock.
+	std::wstring name;
+	XLOPER12 xName;
+	if (Excel12(xlSheetNm, &xName, 1, &ref) == xlretSuccess)
+	{
+		if (xName.xltype == xltypeStr && xName.val.str != NULL)
+			name.assign(xName.val.str + 1, xName.val.str[0]);
+		Excel12(xlFree, 0, 1, &xName);
+	}
+
+	SheetName entry = { name, generation };
+	std::lock_guard<std::mutex> lock(s_cellsMutex);
+	s_sheetNames[idSheet] = entry;
+	return name;
+}
+
+// Returns the id of a cell, defining it on first use. idSheet is 0 if
+// the sheet is not known.
+static uint32_t LookupCell(const XLOPER12 &ref, IDSHEET idSheet, RW row, COL column)
+{
+	uint32_t generation = s_generation.load(std::memory_order_relaxed);
+
+	CallerCache *cache = t_callerCache;
+	if (cache == nullptr)
+	{
+		cache = new (std::nothrow) CallerCache();
+		t_callerCache = cache;
+	}
+
+	uint32_t hash = (uint32_t)row * 2654435761u ^ (uint32_t)column * 2246822519u ^ (uint32_t)idSheet;
+	CallerCacheEntry *entry = (cache != nullptr) ?
+		&cache->entries[(hash ^ (hash >> 16)) & (CallerCacheSize - 1)] : nullptr;
+	if (entry != nullptr && entry->cellId != 0 && entry->idSheet == idSheet &&
+		entry->row == row && entry->column == column && entry->generation == generation)
+	{
+		return entry->cellId;
+	}
+
+	std::wstring sheetName = (idSheet != 0) ? GetSheetName(ref, idSheet, generation) : std::wstring();
+
+	uint32_t cellId;
+	{
+		std::lock_guard<std::mutex> lock(s_cellsMutex);
+		std::tuple<std::wstring, RW, COL> key(sheetName, row, column);
+		auto it = s_cellIds.find(key);
+		if (it != s_cellIds.end())
+		{
+			cellId = it->second;
+		}
+		else
+		{
+			cellId = DefineTraceCell(sheetName, (uint32_t)row, (uint32_t)column);
+			s_cellIds[key] = cellId;
+		}
+	}
+
+	if (entry != nullptr)
+	{
+		entry->idSheet = idSheet;
+		entry->row = row;
+		entry->column = column;
+		entry->cellId = cellId;
+		entry->generation = generation;
+	}
+	return cellId;
+}
+
+uint32_t ResolveCallerCell()
+{
+	XLOPER12 caller;
+	if (Excel12(xlfCaller, &caller, 0) != xlretSuccess)
+		return 0;
+
+	// A multi-cell array formula is attributed to its top-left cell.
+	uint32_t cellId = 0;
+	if (caller.xltype == xltypeRef && caller.val.mref.lpmref != NULL &&
+		caller.val.mref.lpmref->count > 0)
+	{
+		const XLREF12 &ref = caller.val.mref.lpmref->reftbl[0];
+		cellId = LookupCell(caller, caller.val.mref.idSheet, ref.rwFirst, ref.colFirst);
+	}
+	else if (caller.xltype == xltypeSRef)
+	{
+		cellId = LookupCell(caller, 0, caller.val.sref.ref.rwFirst, caller.val.sref.ref.colFirst);
+	}
+	Excel12(xlFree, 0, 1, &caller);
+	return cellId;
+}
+
+void InvalidateCallerCells()
+{
+	s_generation.fetch_add(1, std::memory_order_relaxed);
+}
+
+void ReleaseCallerCellCache()
+{
+	delete t_callerCache;
+	t_callerCache = nullptr;
+}
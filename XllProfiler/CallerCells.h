@@ -0,0 +1,36 @@
+////////////////////////////////////////////////////////////////////////////
+// CallerCells.h -- attribute recorded calls to the calling cells
+//
+// ResolveCallerCell() asks Excel for the cell that is calling the
+// current function (xlfCaller) and returns its trace cell id (see
+// DefineTraceCell()), so that XllProfTool can aggregate time by sheet
+// and cell range. It is installed with SetCallerResolver() and so only
+// runs for the recorded top-level calls.
+//
+// xlfCaller is called for every recorded top-level call, since nothing
+// else tells which cell is calculating. The rest of the lookup is
+// cached: each thread keeps a small table of the cells it has seen, so
+// that repeated calls from the same cell, such as those made when Excel
+// recalculates a cell whose precedents were not yet calculated, cost
+// no lock and no further callback. Sheet names are looked up with
+// xlSheetNm once per sheet and calculation. The caches are invalidated
+// when a calculation ends or is canceled, so that renamed sheets are
+// picked up by the next one.
+//
+
+#pragma once
+
+#include <Windows.h>
+#include <stdint.h>
+
+// Returns the trace cell id of the cell calling the current function,
+// or 0 if the function is not called from a cell.
+uint32_t ResolveCallerCell();
+
+// Discards the cached cells and sheet names. Call this when a
+// calculation ends or is canceled.
+void InvalidateCallerCells();
+
+// Frees the cache of the calling thread. Call this from DllMain() when
+// a thread detaches.
+void ReleaseCallerCellCache();
@@ -0,0 +1,170 @@
+////////////////////////////////////////////////////////////////////////////
+// CorpusFormat.h -- corpus of captured UDF arguments written by XllProfiler
+//
+// This header is shared by XllProfiler, which captures the arguments of
+// a sample of instrumented calls, and XllProfTool, which replays them.
+// It must not depend on Windows headers.
+//
+// A corpus file starts with a CorpusFileHeader, followed by chunks in
+// the same framing as trace files (see TraceChunkHeader). A function
+// chunk is written before the first call chunk that refers to it.
+//
+// Each argument is stored as a tagged value:
+//
+//   tag (1 byte) | payload
+//
+// where the payload depends on the tag:
+//
+//   CorpusNumber       double
+//   CorpusInteger      int32
+//   CorpusBoolean      uint8
+//   CorpusError        int32, an xlerr code
+//   CorpusString       uint32 length, followed by length UTF-16 units
+//   CorpusMissing      (none)
+//   CorpusNil          (none)
+//   CorpusArray        uint32 rows, uint32 columns, followed by rows *
+//                      columns tagged values in row-major order
+//   CorpusNumberArray  uint32 rows, uint32 columns, followed by rows *
+//                      columns doubles in row-major order
+//   CorpusUnsupported  (none); a value that cannot be replayed, such
+//                      as a reference
+//
+
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include "TraceFormat.h"
+
+#define XLL_CORPUS_FILE_MAGIC   0x43504C58 // "XLPC"
+#define XLL_CORPUS_FILE_VERSION 1
+
+#pragma pack(push, 8)
+
+struct CorpusFileHeader
+{
+	uint32_t magic;         // XLL_CORPUS_FILE_MAGIC
+	uint32_t version;       // XLL_CORPUS_FILE_VERSION
+	uint32_t sampleInterval;
+	uint32_t reserved;
+};
+static_assert(sizeof(CorpusFileHeader) == 16, "CorpusFileHeader layout");
+
+enum CorpusChunkType
+{
+	// A CorpusFunctionRecord, followed by the function name, the DLL
+	// path, the entry point name and the type text as null-terminated
+	// UTF-8 strings.
+	CorpusChunkFunction = 1,
+
+	// A CorpusCallRecord, followed by one tagged value per argument.
+	CorpusChunkCall = 2,
+};
+
+struct CorpusFunctionRecord
+{
+	uint32_t functionId;
+};
+
+struct CorpusCallRecord
+{
+	uint32_t functionId;
+	uint32_t threadId;
+	uint32_t argumentCount;
+	uint32_t reserved;
+};
+static_assert(sizeof(CorpusCallRecord) == 16, "CorpusCallRecord layout");
+
+#pragma pack(pop)
+
+enum CorpusValueTag
+{
+	CorpusNumber = 1,
+	CorpusInteger = 2,
+	CorpusBoolean = 3,
+	CorpusError = 4,
+	CorpusString = 5,
+	CorpusMissing = 6,
+	CorpusNil = 7,
+	CorpusArray = 8,
+	CorpusNumberArray = 9,
+	CorpusUnsupported = 10,
+};
+
+//
+// ArgumentType
+//
+// Data types of UDF arguments and return values that can be captured
+// and replayed, as specified by the type text passed to xlfRegister.
+//
+
+enum ArgumentType
+{
+	ArgumentUnsupported,
+	ArgumentDouble,        // B
+	ArgumentInt32,         // J
+	ArgumentInt16,         // I
+	ArgumentUInt16,        // H
+	ArgumentBoolean,       // A
+	ArgumentString,        // C%, null-terminated UTF-16
+	ArgumentCountedString, // D%, length-prefixed UTF-16
+	ArgumentXloper,        // Q
+	ArgumentArray,         // K%
+};
+
+struct FunctionSignature
+{
+	ArgumentType returnType;
+	std::vector<ArgumentType> arguments;
+
+	// Returns true if every argument can be captured and replayed.
+	bool IsSupported() const
+	{
+		for (ArgumentType type : arguments)
+		{
+			if (type == ArgumentUnsupported)
+				return false;
+		}
+		return true;
+	}
+};
+
+// Parses the type text of a function registered with Excel, such as
+// "QJC%K%$". The first type is the return type. Types not listed in
+// ArgumentType are parsed as ArgumentUnsupported. The trailing
+// attributes (!, $, #) are ignored.
+template <class Char>
+void ParseTypeText(const Char *typeText, FunctionSignature &signature)
+{
+	signature.arguments.clear();
+	bool isReturnType = true;
+	for (const Char *p = typeText; *p != 0; p++)
+	{
+		ArgumentType type;
+		switch (*p)
+		{
+		case '!': case '$': case '#':
+			continue;
+		case 'B': type = ArgumentDouble; break;
+		case 'J': type = ArgumentInt32; break;
+		case 'I': type = ArgumentInt16; break;
+		case 'H': type = ArgumentUInt16; break;
+		case 'A': type = ArgumentBoolean; break;
+		case 'Q': type = ArgumentXloper; break;
+		case 'C': type = (p[1] == '%') ? ArgumentString : ArgumentUnsupported; break;
+		case 'D': type = (p[1] == '%') ? ArgumentCountedString : ArgumentUnsupported; break;
+		case 'K': type = (p[1] == '%') ? ArgumentArray : ArgumentUnsupported; break;
+		default: type = ArgumentUnsupported; break;
+		}
+		if (p[1] == '%')
+			++p;
+
+		if (isReturnType)
+			signature.returnType = type;
+		else
+			signature.arguments.push_back(type);
+		isReturnType = false;
+	}
+	if (isReturnType)
+		signature.returnType = ArgumentUnsupported;
+}
@@ -102,14 +102,16 @@ FARPROC GetEntryPointAddress(LPCWSTR moduleName, const XLOPER12 &xProcedure)
 }
 
 // Returns a list of all registered XLL functions.
-void GetRegisteredFunctions(std::vector<RegisteredFunctionInfo> &info)
+bool GetRegisteredFunctions(std::vector<RegisteredFunctionInfo> &info)
 {
 	XLOPER12 result;
 	XLOPER12 arg;
 	arg.xltype = xltypeInt;
 	arg.val.w = 44;
+	bool ok = false;
 	if (Excel12(xlfGetWorkspace, &result, 1, &arg) == xlretSuccess)
 	{
+		ok = true;
 		if (result.xltype == xltypeMulti &&
 			result.val.array.lparray != nullptr &&
 			result.val.array.columns >= 3)
@@ -143,7 +145,11 @@ void GetRegisteredFunctions(std::vector<RegisteredFunctionInfo> &info)
 						}
 
 						XLOPER12 xId;
-						if (Excel12(xlfRegisterId, &xId, 3, &p[0], &xProcedure, &p[2]) == xlretSuccess)
+						if (Excel12(xlfRegisterId, &xId, 3, &p[0], &xProcedure, &p[2]) != xlretSuccess)
+						{
+							ok = false;
+						}
+						else
 						{
 							if (xId.xltype == xltypeNum)
 							{
@@ -171,4 +177,5 @@ void GetRegisteredFunctions(std::vector<RegisteredFunctionInfo> &info)
 		}
 		Excel12(xlFree, nullptr, 1, &result);
 	}
-}
\ No newline at end of file
+	return ok;
+}
@@ -1,7 +1,15 @@
 ////////////////////////////////////////////////////////////////////////////
 // ExcelHelper.h -- utility functions for XLL
 
+#pragma once
+
+#if defined(_WIN32)
 #include <Windows.h>
+#else
+// The Win32 type of the interface, so that FunctionFilter builds on
+// other platforms.
+typedef void (*FARPROC)();
+#endif
 #include <string>
 #include <vector>
 
@@ -15,4 +23,7 @@ struct RegisteredFunctionInfo
 	FARPROC procAddress; // as returned by GetProcAddress
 };
 
-void GetRegisteredFunctions(std::vector<RegisteredFunctionInfo> &info);
\ No newline at end of file
+// Reads the functions registered in Excel. Returns false if Excel
+// cannot list them, which happens unless it is called from a command
+// or a function registered as equivalent to a macro sheet function.
+bool GetRegisteredFunctions(std::vector<RegisteredFunctionInfo> &info);
\ No newline at end of file
@@ -0,0 +1,349 @@
+////////////////////////////////////////////////////////////////////////////
+// ExecutableMemory.cpp -- allocate memory for code generated at run-time
+
+#include "ExecutableMemory.h"
+#include <string.h>
+#include <stdint.h>
+
+#if defined(_WIN32)
+#include <Windows.h>
+#else
+#include <stdio.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// Size of the chunks reserved from the operating system.
+static const size_t ChunkSize = 64 * 1024;
+
+#if defined(_M_X64) || defined(__x86_64__)
+// Largest distance between a block and the code it must be near, a
+// little less than 2 GB.
+static const size_t MaxNearDistance = 0x7FF00000;
+
+static size_t Distance(size_t a, size_t b)
+{
+	return (a > b) ? a - b : b - a;
+}
+#endif
+
+// Returns true if every byte of [p, p + size) is within a 32-bit
+// displacement of address. Always true on x86.
+static bool IsNear(const void *p, size_t size, const void *address)
+{
+#if defined(_M_X64) || defined(__x86_64__)
+	return Distance((size_t)p, (size_t)address) <= MaxNearDistance &&
+		Distance((size_t)p + size, (size_t)address) <= MaxNearDistance;
+#else
+	(void)p;
+	(void)size;
+	(void)address;
+	return true;
+#endif
+}
+
+static void* AllocatePages(size_t size)
+{
+#if defined(_WIN32)
+	return VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+#else
+	void *p = mmap(NULL, size, PROT_READ | PROT_WRITE | PROT_EXEC,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	return (p == MAP_FAILED) ? nullptr : p;
+#endif
+}
+
+// Allocates pages within MaxNearDistance of address, searching
+// downwards from it first and then upwards.
+static void* AllocatePagesNear(const void *address, size_t size)
+{
+#if !(defined(_M_X64) || defined(__x86_64__))
+	(void)address;
+	return AllocatePages(size);
+#elif defined(_WIN32)
+	SYSTEM_INFO systemInfo;
+	GetSystemInfo(&systemInfo);
+	size_t granularity = systemInfo.dwAllocationGranularity;
+	size_t origin = (size_t)address;
+	size_t minAddress = (size_t)systemInfo.lpMinimumApplicationAddress;
+	size_t maxAddress = (size_t)systemInfo.lpMaximumApplicationAddress;
+	if (origin > minAddress + MaxNearDistance)
+		minAddress = origin - MaxNearDistance;
+	if (origin + MaxNearDistance < maxAddress)
+		maxAddress = origin + MaxNearDistance;
+
+	MEMORY_BASIC_INFORMATION mbi;
+	size_t p = origin & ~(granularity - 1);
+	while (p >= minAddress + granularity)
+	{
+		p -= granularity;
+		if (VirtualQuery((void*)p, &mbi, sizeof(mbi)) == 0)
+			break;
+		if (mbi.State == MEM_FREE)
+		{
+			void *block = VirtualAlloc((void*)p, size, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+			if (block != NULL)
+				return block;
+		}
+		else
+		{
+			// Skip the rest of the allocation.
+			p = (size_t)mbi.AllocationBase & ~(granularity - 1);
+		}
+	}
+
+	p = (origin + granularity - 1) & ~(granularity - 1);
+	while (p + size <= maxAddress)
+	{
+		if (VirtualQuery((void*)p, &mbi, sizeof(mbi)) == 0)
+			break;
+		if (mbi.State == MEM_FREE)
+		{
+			void *block = VirtualAlloc((void*)p, size, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+			if (block != NULL)
+				return block;
+			p += granularity;
+		}
+		else
+		{
+			p = ((size_t)mbi.BaseAddress + mbi.RegionSize + granularity - 1) & ~(granularity - 1);
+		}
+	}
+	return nullptr;
+#else
+	// mmap() takes the address as a hint, which it follows if the pages
+	// there are free.
+	const size_t Step = 1024 * 1024;
+	size_t origin = (size_t)address & ~(Step - 1);
+	for (size_t distance = Step; distance + size <= MaxNearDistance; distance += Step)
+	{
+		for (int direction = 0; direction < 2; direction++)
+		{
+			if (direction == 0 && origin < distance)
+				continue;
+			size_t hint = (direction == 0) ? origin - distance : origin + distance;
+			void *p = mmap((void*)hint, size, PROT_READ | PROT_WRITE | PROT_EXEC,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (p == MAP_FAILED)
+				continue;
+			if (IsNear(p, size, address))
+				return p;
+			munmap(p, size);
+		}
+	}
+	return nullptr;
+#endif
+}
+
+static void FreePages(void *address, size_t size)
+{
+#if defined(_WIN32)
+	(void)size;
+	VirtualFree(address, 0, MEM_RELEASE);
+#else
+	munmap(address, size);
+#endif
+}
+
+CodeHeap::CodeHeap()
+{
+}
+
+CodeHeap::~CodeHeap()
+{
+	for (const Chunk &chunk : m_chunks)
+	{
+		FreePages(chunk.base, chunk.size);
+	}
+}
+
+void* CodeHeap::Allocate(size_t size)
+{
+	return AllocateNear(nullptr, size);
+}
+
+void* CodeHeap::AllocateNear(const void *address, size_t size)
+{
+	size = (size + 15) & ~(size_t)15;
+
+	// Use the most recent chunk that has room and is close enough.
+	for (size_t i = m_chunks.size(); i-- > 0; )
+	{
+		Chunk &chunk = m_chunks[i];
+		if (size <= chunk.size - chunk.used &&
+			(address == nullptr || IsNear(chunk.base + chunk.used, size, address)))
+		{
+			void *p = chunk.base + chunk.used;
+			chunk.used += size;
+			return p;
+		}
+	}
+
+	size_t chunkSize = (size > ChunkSize) ? ((size + ChunkSize - 1) & ~(ChunkSize - 1)) : ChunkSize;
+	void *pages = (address == nullptr) ? AllocatePages(chunkSize) : AllocatePagesNear(address, chunkSize);
+	if (pages == nullptr)
+		return nullptr;
+
+	Chunk chunk = { static_cast<unsigned char*>(pages), chunkSize, size };
+	m_chunks.push_back(chunk);
+	return chunk.base;
+}
+
+void CodeHeap::Free(void *block, size_t size)
+{
+	size = (size + 15) & ~(size_t)15;
+	for (Chunk &chunk : m_chunks)
+	{
+		if (static_cast<unsigned char*>(block) + size == chunk.base + chunk.used)
+		{
+			chunk.used -= size;
+			return;
+		}
+	}
+}
+
+bool FlushCode(void *address, size_t size)
+{
+#if defined(_WIN32)
+	return FlushInstructionCache(GetCurrentProcess(), address, size) != FALSE;
+#else
+	__builtin___clear_cache(static_cast<char*>(address), static_cast<char*>(address) + size);
+	return true;
+#endif
+}
+
+#if !defined(_WIN32)
+// Returns the PROT_* flags of the mapping that contains address, as
+// listed in /proc/self/maps, or defaultProtection if it is not found.
+static int QueryProtection(const void *address, int defaultProtection)
+{
+	FILE *fp = fopen("/proc/self/maps", "r");
+	if (fp == nullptr)
+		return defaultProtection;
+
+	int protection = defaultProtection;
+	char line[4096 + 256];
+	while (fgets(line, sizeof(line), fp) != nullptr)
+	{
+		unsigned long begin, end;
+		char perms[5];
+		if (sscanf(line, "%lx-%lx %4s", &begin, &end, perms) == 3 &&
+			begin <= (size_t)address && (size_t)address < end)
+		{
+			protection = ((perms[0] == 'r') ? PROT_READ : 0) |
+				((perms[1] == 'w') ? PROT_WRITE : 0) |
+				((perms[2] == 'x') ? PROT_EXEC : 0);
+			break;
+		}
+	}
+	fclose(fp);
+	return protection;
+}
+#endif
+
+bool PatchPointer(void **slot, void *value)
+{
+#if defined(_WIN32)
+	DWORD oldProtect;
+	if (!VirtualProtect(slot, sizeof(void*), PAGE_EXECUTE_READWRITE, &oldProtect))
+		return false;
+	InterlockedExchangePointer(slot, value);
+	VirtualProtect(slot, sizeof(void*), oldProtect, &oldProtect);
+	FlushCode(slot, sizeof(void*));
+	return true;
+#else
+	size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+	unsigned char *page = (unsigned char*)((size_t)slot & ~(pageSize - 1));
+	size_t length = (unsigned char*)(slot + 1) - page;
+	int oldProtection = QueryProtection(slot, PROT_READ);
+	bool isWritable = (oldProtection & PROT_WRITE) != 0;
+	if (!isWritable && mprotect(page, length, oldProtection | PROT_WRITE) != 0)
+		return false;
+	__atomic_store_n(slot, value, __ATOMIC_SEQ_CST);
+	if (!isWritable)
+		mprotect(page, length, oldProtection);
+	FlushCode(slot, sizeof(void*));
+	return true;
+#endif
+}
+
+// Writes size bytes at address atomically. The bytes must lie within an
+// aligned 8-byte word, or be two bytes that cross it, which is written
+// with a locked (split) exchange.
+static void StoreCode(unsigned char *address, const unsigned char *bytes, size_t size)
+{
+	size_t offset = (size_t)address & 7;
+	if (offset + size > 8)
+	{
+		uint16_t value;
+		memcpy(&value, bytes, sizeof(value));
+#if defined(_WIN32)
+		InterlockedExchange16((SHORT volatile *)address, (SHORT)value);
+#else
+		__atomic_exchange_n((uint16_t*)address, value, __ATOMIC_SEQ_CST);
+#endif
+		return;
+	}
+
+	int64_t *word = (int64_t*)(address - offset);
+	int64_t oldWord = *(volatile int64_t *)word;
+	for (;;)
+	{
+		int64_t newWord = oldWord;
+		memcpy((unsigned char*)&newWord + offset, bytes, size);
+#if defined(_WIN32)
+		int64_t previous = InterlockedCompareExchange64((LONGLONG volatile *)word, newWord, oldWord);
+		if (previous == oldWord)
+			break;
+		oldWord = previous;
+#else
+		if (__atomic_compare_exchange_n(word, &oldWord, newWord, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+			break;
+#endif
+	}
+}
+
+bool PatchCode(void *address, const void *bytes, size_t size)
+{
+	unsigned char *code = static_cast<unsigned char*>(address);
+	const unsigned char *newCode = static_cast<const unsigned char*>(bytes);
+	if (size == 0)
+		return true;
+
+#if defined(_WIN32)
+	DWORD oldProtect;
+	if (!VirtualProtect(code, size, PAGE_EXECUTE_READWRITE, &oldProtect))
+		return false;
+#else
+	size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+	unsigned char *page = (unsigned char*)((size_t)code & ~(pageSize - 1));
+	size_t length = code + size - page;
+	int oldProtection = QueryProtection(code, PROT_READ | PROT_EXEC);
+	if (mprotect(page, length, PROT_READ | PROT_WRITE | PROT_EXEC) != 0)
+		return false;
+#endif
+
+	if (((size_t)code & 7) + size <= 8)
+	{
+		StoreCode(code, newCode, size);
+	}
+	else
+	{
+		// Hold threads that enter the code on a JMP to itself (EB FE)
+		// while the tail is written, then write the head.
+		static const unsigned char Spin[2] = { 0xEB, 0xFE };
+		StoreCode(code, Spin, 2);
+		FlushCode(code, 2);
+		memcpy(code + 2, newCode + 2, size - 2);
+		FlushCode(code + 2, size - 2);
+		StoreCode(code, newCode, 2);
+	}
+
+#if defined(_WIN32)
+	VirtualProtect(code, size, oldProtect, &oldProtect);
+#else
+	mprotect(page, length, oldProtection);
+#endif
+	FlushCode(code, size);
+	return true;
+}
@@ -0,0 +1,72 @@
+////////////////////////////////////////////////////////////////////////////
+// ExecutableMemory.h -- allocate memory for code generated at run-time
+//
+// CodeHeap hands out small blocks of memory that may be written to and
+// executed, for the stubs generated by ThunkManager. The pages come
+// from VirtualAlloc() on Windows and mmap() elsewhere. Blocks are not
+// freed individually, except that the last one allocated can be given
+// back when the code it was meant for cannot be generated; all pages
+// are released when the heap is destroyed, so the heap must outlive
+// all installed thunks.
+//
+// On x64, a block that is reached from, or refers to, existing code by
+// a 32-bit displacement must lie within 2 GB of it; AllocateNear()
+// looks for free pages close to the code for such blocks.
+//
+
+#pragma once
+
+#include <stddef.h>
+#include <vector>
+
+class CodeHeap
+{
+	struct Chunk
+	{
+		unsigned char *base;
+		size_t size;
+		size_t used;
+	};
+
+	std::vector<Chunk> m_chunks;
+
+	CodeHeap(const CodeHeap &) = delete;
+	CodeHeap& operator=(const CodeHeap &) = delete;
+
+public:
+	CodeHeap();
+	~CodeHeap();
+
+	// Returns a block of at least size bytes aligned to 16 bytes, or
+	// nullptr if out of memory. The block is readable, writable and
+	// executable.
+	void* Allocate(size_t size);
+
+	// Returns a block like Allocate(), whose every byte is within a
+	// 32-bit displacement of address, or nullptr if there are no free
+	// pages close enough.
+	void* AllocateNear(const void *address, size_t size);
+
+	// Gives back a block of the given size, which must be the last one
+	// allocated. Does nothing if another block has been allocated since.
+	void Free(void *block, size_t size);
+};
+
+// Makes code written to [address, address + size) visible to the
+// instruction stream.
+bool FlushCode(void *address, size_t size);
+
+// Atomically replaces the pointer stored at *slot with value, making
+// the page writable for the duration of the write if necessary. This
+// is used to redirect an import slot or jump target to a thunk.
+bool PatchPointer(void **slot, void *value);
+
+// Replaces the code at [address, address + size) with bytes, so that a
+// thread entering the code at address executes either the old or the
+// new instructions in full. A patch that lies within an aligned 8-byte
+// word is written at once; a longer one is written behind a JMP to
+// itself, which briefly holds threads that enter it. Threads must not
+// be executing inside the range other than at address, which the
+// caller ensures by patching the entry of a procedure that is not
+// running.
+bool PatchCode(void *address, const void *bytes, size_t size);
@@ -0,0 +1,194 @@
+////////////////////////////////////////////////////////////////////////////
+// FunctionFilter.cpp -- select the functions to instrument
+
+#include "FunctionFilter.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <wctype.h>
+
+bool MatchGlob(const wchar_t *pattern, const wchar_t *text)
+{
+	// Backtrack to the last '*' on a mismatch; this is linear in
+	// practice and never recurses.
+	const wchar_t *star = nullptr;
+	const wchar_t *resume = nullptr;
+	while (*text)
+	{
+		if (*pattern == L'*')
+		{
+			star = pattern++;
+			resume = text;
+		}
+		else if (*pattern == L'?' || (*pattern && towlower(*pattern) == towlower(*text)))
+		{
+			++pattern;
+			++text;
+		}
+		else if (star != nullptr)
+		{
+			pattern = star + 1;
+			text = ++resume;
+		}
+		else
+		{
+			return false;
+		}
+	}
+	while (*pattern == L'*')
+		++pattern;
+	return *pattern == L'\0';
+}
+
+// Attributes of a function given by characters in its type text.
+static const struct
+{
+	wchar_t code;
+	LPCWSTR name;
+} s_categories[] =
+{
+	{ L'$', L"threadsafe" },
+	{ L'!', L"volatile" },
+	{ L'#', L"macro" },
+	{ L'&', L"cluster" },
+	{ L'X', L"async" },
+};
+
+// Returns true if the type text has an attribute whose name matches
+// the pattern.
+static bool HasCategory(const std::wstring &typeText, const std::wstring &pattern)
+{
+	for (const auto &category : s_categories)
+	{
+		if (typeText.find(category.code) != std::wstring::npos &&
+			MatchGlob(pattern.c_str(), category.name))
+			return true;
+	}
+	return false;
+}
+
+bool FunctionFilter::Matches(const Rule &rule, const RegisteredFunctionInfo &info)
+{
+	switch (rule.field)
+	{
+	case FieldName:
+		return MatchGlob(rule.pattern.c_str(), info.functionName.c_str());
+	case FieldDll:
+		if (rule.pattern.find(L'\\') == std::wstring::npos)
+		{
+			size_t slash = info.dllName.find_last_of(L"\\/");
+			const wchar_t *fileName = info.dllName.c_str() +
+				((slash == std::wstring::npos) ? 0 : slash + 1);
+			return MatchGlob(rule.pattern.c_str(), fileName);
+		}
+		return MatchGlob(rule.pattern.c_str(), info.dllName.c_str());
+	case FieldCategory:
+		return HasCategory(info.typeText, rule.pattern);
+	default:
+		return false;
+	}
+}
+
+bool FunctionFilter::IsSelected(const RegisteredFunctionInfo &info) const
+{
+	bool hasInclude = false;
+	bool isIncluded = false;
+	for (const Rule &rule : m_rules)
+	{
+		if (rule.isInclude)
+		{
+			hasInclude = true;
+			if (!isIncluded && Matches(rule, info))
+				isIncluded = true;
+		}
+		else if (Matches(rule, info))
+		{
+			return false;
+		}
+	}
+	return isIncluded || !hasInclude;
+}
+
+static std::wstring Trim(const std::wstring &s)
+{
+	size_t begin = s.find_first_not_of(L" \t\r\n");
+	if (begin == std::wstring::npos)
+		return std::wstring();
+	size_t end = s.find_last_not_of(L" \t\r\n");
+	return s.substr(begin, end - begin + 1);
+}
+
+static FILE *OpenRuleFile(LPCWSTR fileName)
+{
+	FILE *fp = nullptr;
+#if defined(_WIN32)
+	if (_wfopen_s(&fp, fileName, L"rt, ccs=UTF-8") != 0)
+		return nullptr;
+#else
+	size_t size = wcstombs(nullptr, fileName, 0);
+	if (size == (size_t)-1)
+		return nullptr;
+	std::string path(size, '\0');
+	wcstombs(&path[0], fileName, size);
+	fp = fopen(path.c_str(), "r");
+#endif
+	return fp;
+}
+
+BOOL FunctionFilter::Load(LPCWSTR fileName)
+{
+	FILE *fp = OpenRuleFile(fileName);
+	if (fp == nullptr)
+		return FALSE;
+
+	m_rules.clear();
+	wchar_t line[1024];
+	for (int lineNumber = 1; fgetws(line, sizeof(line) / sizeof(line[0]), fp) != nullptr; lineNumber++)
+	{
+		std::wstring text = Trim(line);
+		if (text.empty() || text[0] == L'#')
+			continue;
+
+		Rule rule;
+		size_t space = text.find_first_of(L" \t");
+		size_t equals = text.find(L'=');
+		std::wstring verb = text.substr(0, space);
+		std::wstring field = (space != std::wstring::npos && equals != std::wstring::npos && equals > space) ?
+			Trim(text.substr(space, equals - space)) : std::wstring();
+		rule.pattern = (equals != std::wstring::npos) ? Trim(text.substr(equals + 1)) : std::wstring();
+
+		bool ok = !rule.pattern.empty();
+		if (verb == L"include")
+			rule.isInclude = true;
+		else if (verb == L"exclude")
+			rule.isInclude = false;
+		else
+			ok = false;
+
+		if (field == L"name")
+			rule.field = FieldName;
+		else if (field == L"dll")
+			rule.field = FieldDll;
+		else if (field == L"category")
+			rule.field = FieldCategory;
+		else
+			ok = false;
+
+		if (ok)
+		{
+			m_rules.push_back(rule);
+		}
+		else
+		{
+			std::wstring msg = std::wstring(L"XllProfiler: ") + fileName + L"(" +
+				std::to_wstring(lineNumber) + L"): invalid rule ignored\n";
+#if defined(_WIN32)
+			OutputDebugStringW(msg.c_str());
+#else
+			fprintf(stderr, "%ls", msg.c_str());
+#endif
+		}
+	}
+
+	fclose(fp);
+	return TRUE;
+}
@@ -0,0 +1,82 @@
+////////////////////////////////////////////////////////////////////////////
+// FunctionFilter.h -- select the functions to instrument
+//
+// A filter is a list of include and exclude rules, loaded from a text
+// file with one rule per line:
+//
+//   # comment
+//   include name=Black*
+//   exclude dll=Legacy*.xll
+//   exclude category=volatile
+//
+// A rule matches a field of a registered function against a pattern in
+// which '*' matches any sequence of characters and '?' matches any one
+// character, ignoring case. The fields are:
+//
+//   name      the name of the function as registered in Excel
+//   dll       the path of the XLL, or its file name if the pattern
+//             contains no backslash
+//   category  one of the attributes given by the type text of the
+//             function: threadsafe ($), volatile (!), macro (#),
+//             cluster (&) or async (X). Excel does not report the
+//             category a function was registered in to other add-ins.
+//
+// A function is selected if it matches no exclude rule, and either
+// matches an include rule or there are no include rules.
+//
+
+#pragma once
+
+#if defined(_WIN32)
+#include <Windows.h>
+#else
+// The Win32 types of the interface, so that the rules can be tested on
+// other platforms.
+typedef int BOOL;
+typedef const wchar_t *LPCWSTR;
+#ifndef TRUE
+#define TRUE 1
+#define FALSE 0
+#endif
+#endif
+#include <string>
+#include <vector>
+#include "ExcelHelper.h"
+
+// Returns true if text matches pattern, ignoring case.
+bool MatchGlob(const wchar_t *pattern, const wchar_t *text);
+
+class FunctionFilter
+{
+	enum Field
+	{
+		FieldName,
+		FieldDll,
+		FieldCategory,
+	};
+
+	struct Rule
+	{
+		bool isInclude;
+		Field field;
+		std::wstring pattern;
+	};
+
+	std::vector<Rule> m_rules;
+
+	static bool Matches(const Rule &rule, const RegisteredFunctionInfo &info);
+
+public:
+	// Reads the rules from a file, replacing the current rules. Returns
+	// FALSE if the file cannot be read. Malformed lines are reported
+	// with OutputDebugString(), or to stderr on other platforms, and
+	// ignored.
+	BOOL Load(LPCWSTR fileName);
+
+	// Returns true if the function is selected.
+	bool IsSelected(const RegisteredFunctionInfo &info) const;
+
+	// Returns true if there are no rules, in which case every function
+	// is selected.
+	bool empty() const { return m_rules.empty(); }
+};
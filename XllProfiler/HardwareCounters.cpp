@@ -0,0 +1,194 @@
+////////////////////////////////////////////////////////////////////////////
+// HardwareCounters.cpp -- read per-thread processor counters
+
+#include "HardwareCounters.h"
+#include <string.h>
+
+#if defined(_WIN32)
+
+#include <Windows.h>
+
+HardwareCounterSet::HardwareCounterSet() : m_available(0)
+{
+}
+
+HardwareCounterSet::~HardwareCounterSet()
+{
+	Close();
+}
+
+unsigned int HardwareCounterSet::Open()
+{
+	ULONG64 cycles;
+	m_available = QueryThreadCycleTime(GetCurrentThread(), &cycles) ?
+		(1u << HardwareCycles) : 0;
+	return m_available;
+}
+
+void HardwareCounterSet::Close()
+{
+	m_available = 0;
+}
+
+void HardwareCounterSet::Read(uint64_t values[HardwareCounterCount]) const
+{
+	memset(values, 0, HardwareCounterCount * sizeof(uint64_t));
+	if (m_available & (1u << HardwareCycles))
+	{
+		ULONG64 cycles;
+		if (QueryThreadCycleTime(GetCurrentThread(), &cycles))
+			values[HardwareCycles] = cycles;
+	}
+}
+
+#elif defined(__linux__)
+
+#include <linux/perf_event.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <x86intrin.h>
+
+static const struct
+{
+	uint32_t type;
+	uint64_t config;
+} s_events[HardwareCounterCount] =
+{
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	{ PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+		(PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+};
+
+HardwareCounterSet::HardwareCounterSet() : m_available(0)
+{
+	for (int i = 0; i < HardwareCounterCount; i++)
+	{
+		m_fd[i] = -1;
+		m_page[i] = nullptr;
+	}
+}
+
+HardwareCounterSet::~HardwareCounterSet()
+{
+	Close();
+}
+
+unsigned int HardwareCounterSet::Open()
+{
+	Close();
+	long pageSize = sysconf(_SC_PAGESIZE);
+	for (int i = 0; i < HardwareCounterCount; i++)
+	{
+		perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = s_events[i].type;
+		attr.config = s_events[i].config;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+
+		// Count the calling thread on any processor.
+		int fd = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+		if (fd < 0)
+			continue;
+
+		// The first page of the mapping tells whether and how the
+		// counter may be read with RDPMC.
+		void *page = mmap(nullptr, (size_t)pageSize, PROT_READ, MAP_SHARED, fd, 0);
+		m_fd[i] = fd;
+		m_page[i] = (page != MAP_FAILED) ? page : nullptr;
+		m_available |= 1u << i;
+	}
+	return m_available;
+}
+
+void HardwareCounterSet::Close()
+{
+	long pageSize = sysconf(_SC_PAGESIZE);
+	for (int i = 0; i < HardwareCounterCount; i++)
+	{
+		if (m_page[i] != nullptr)
+			munmap(m_page[i], (size_t)pageSize);
+		if (m_fd[i] >= 0)
+			close(m_fd[i]);
+		m_fd[i] = -1;
+		m_page[i] = nullptr;
+	}
+	m_available = 0;
+}
+
+// Reads a counter with RDPMC, as described in perf_event_open(2).
+// Returns false if the counter is not currently on a hardware counter
+// or user-mode reads are not allowed.
+static bool ReadCounterFast(const volatile perf_event_mmap_page *pc, uint64_t &value)
+{
+	uint32_t seq;
+	do
+	{
+		seq = pc->lock;
+		__sync_synchronize();
+		uint32_t index = pc->index;
+		if (!pc->cap_user_rdpmc || index == 0)
+			return false;
+		int64_t count = pc->offset;
+		uint16_t width = pc->pmc_width;
+		int64_t pmc = (int64_t)__rdpmc(index - 1);
+		pmc <<= 64 - width;
+		pmc >>= 64 - width; // sign-extend
+		value = (uint64_t)(count + pmc);
+		__sync_synchronize();
+	} while (pc->lock != seq);
+	return true;
+}
+
+void HardwareCounterSet::Read(uint64_t values[HardwareCounterCount]) const
+{
+	for (int i = 0; i < HardwareCounterCount; i++)
+	{
+		values[i] = 0;
+		if (m_fd[i] < 0)
+			continue;
+		if (m_page[i] != nullptr &&
+			ReadCounterFast((const volatile perf_event_mmap_page *)m_page[i], values[i]))
+			continue;
+		uint64_t count;
+		if (read(m_fd[i], &count, sizeof(count)) == (ssize_t)sizeof(count))
+			values[i] = count;
+	}
+}
+
+#else
+
+HardwareCounterSet::HardwareCounterSet() : m_available(0)
+{
+}
+
+HardwareCounterSet::~HardwareCounterSet()
+{
+}
+
+unsigned int HardwareCounterSet::Open()
+{
+	return 0;
+}
+
+void HardwareCounterSet::Close()
+{
+}
+
+void HardwareCounterSet::Read(uint64_t values[HardwareCounterCount]) const
+{
+	memset(values, 0, HardwareCounterCount * sizeof(uint64_t));
+}
+
+#endif
+
+unsigned int GetAvailableHardwareCounters()
+{
+	HardwareCounterSet set;
+	return set.Open();
+}
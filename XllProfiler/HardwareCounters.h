@@ -0,0 +1,72 @@
+////////////////////////////////////////////////////////////////////////////
+// HardwareCounters.h -- read per-thread processor counters
+//
+// HardwareCounterSet reads the processor's performance counters for the
+// calling thread, so that the profiler can tell whether a function is
+// bound by cache misses or by branch mispredictions rather than just
+// slow. Which counters are available depends on the platform:
+//
+//   Linux    All counters, through perf_event_open(). Counters that
+//            the kernel lets user mode read are read with RDPMC, which
+//            takes a few dozen cycles; others fall back to read().
+//
+//   Windows  Cycles only, through QueryThreadCycleTime(). Windows does
+//            not let user mode program the performance counters
+//            without a kernel driver.
+//
+// Counters that are not available read as zero. Hardware counting in
+// the profiler requires at least cycles and instructions, and cannot be
+// enabled without them, which includes every Windows system.
+//
+
+#pragma once
+
+#include <stdint.h>
+
+enum HardwareCounter
+{
+	HardwareCycles,
+	HardwareInstructions,
+	HardwareL1DataMisses,
+	HardwareLastLevelMisses,
+	HardwareBranchMisses,
+	HardwareCounterCount
+};
+
+class HardwareCounterSet
+{
+	unsigned int m_available; // bit i set if counter i is available
+#if defined(__linux__)
+	int m_fd[HardwareCounterCount];
+	void *m_page[HardwareCounterCount];
+#endif
+
+	HardwareCounterSet(const HardwareCounterSet &) = delete;
+	HardwareCounterSet& operator=(const HardwareCounterSet &) = delete;
+
+public:
+	HardwareCounterSet();
+	~HardwareCounterSet();
+
+	// Starts counting on the calling thread, and returns the bit mask
+	// of the available counters.
+	unsigned int Open();
+
+	// Stops counting.
+	void Close();
+
+	// Returns the bit mask of the available counters.
+	unsigned int GetAvailable() const { return m_available; }
+
+	// Reads the counters of the calling thread, which must be the
+	// thread that opened the set.
+	void Read(uint64_t values[HardwareCounterCount]) const;
+};
+
+// Returns the bit mask of the counters that can be opened on the
+// calling thread.
+unsigned int GetAvailableHardwareCounters();
+
+// Bit mask of the counters that hardware counting requires.
+const unsigned int RequiredHardwareCounters =
+	(1u << HardwareCycles) | (1u << HardwareInstructions);
@@ -0,0 +1,279 @@
+////////////////////////////////////////////////////////////////////////////
+// InstructionDecoder.cpp -- find the length of x86 and x64 instructions
+
+#include "InstructionDecoder.h"
+
+// Operands of an opcode that follow it.
+enum OpcodeFlags
+{
+	M = 0x001,     // ModRM byte, with SIB and displacement
+	I8 = 0x002,    // 8-bit immediate
+	I16 = 0x004,   // 16-bit immediate
+	IZ = 0x008,    // 16- or 32-bit immediate, by operand size
+	IV = 0x010,    // 16-, 32- or 64-bit immediate, by operand size
+	J8 = 0x020,    // 8-bit relative branch target
+	JZ = 0x040,    // 16- or 32-bit relative branch target
+	MO = 0x080,    // memory offset, by address size
+	FAR = 0x100,   // far pointer (x86 only)
+	X64 = 0x200,   // invalid in 64-bit mode
+	P = 0x400,     // prefix
+	ESC = 0x800,   // escape to the two-byte opcode map
+};
+
+// Operands of the one-byte opcodes.
+static const unsigned short OneByteOpcodes[256] =
+{
+	/* 00 */ M, M, M, M, I8, IZ, X64, X64, M, M, M, M, I8, IZ, X64, ESC,
+	/* 10 */ M, M, M, M, I8, IZ, X64, X64, M, M, M, M, I8, IZ, X64, X64,
+	/* 20 */ M, M, M, M, I8, IZ, P, X64, M, M, M, M, I8, IZ, P, X64,
+	/* 30 */ M, M, M, M, I8, IZ, P, X64, M, M, M, M, I8, IZ, P, X64,
+	/* 40 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	/* 50 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	/* 60 */ X64, X64, M, M, P, P, P, P, IZ, M | IZ, I8, M | I8, 0, 0, 0, 0,
+	/* 70 */ J8, J8, J8, J8, J8, J8, J8, J8, J8, J8, J8, J8, J8, J8, J8, J8,
+	/* 80 */ M | I8, M | IZ, M | I8 | X64, M | I8, M, M, M, M, M, M, M, M, M, M, M, M,
+	/* 90 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, FAR | X64, 0, 0, 0, 0, 0,
+	/* A0 */ MO, MO, MO, MO, 0, 0, 0, 0, I8, IZ, 0, 0, 0, 0, 0, 0,
+	/* B0 */ I8, I8, I8, I8, I8, I8, I8, I8, IV, IV, IV, IV, IV, IV, IV, IV,
+	/* C0 */ M | I8, M | I8, I16, 0, M, M, M | I8, M | IZ, I16 | I8, 0, I16, 0, 0, I8, X64, 0,
+	/* D0 */ M, M, M, M, I8 | X64, I8 | X64, X64, 0, M, M, M, M, M, M, M, M,
+	/* E0 */ J8, J8, J8, J8, I8, I8, I8, I8, JZ, JZ, FAR | X64, J8, 0, 0, 0, 0,
+	/* F0 */ P, 0, P, P, 0, 0, M, M, 0, 0, 0, 0, 0, 0, M, M,
+};
+
+// Returns the operands of an opcode in the two-byte (0F xx) map.
+static unsigned short GetTwoByteOpcodeFlags(unsigned char op)
+{
+	if (op >= 0x80 && op <= 0x8F)
+		return JZ;
+	if (op >= 0xC8 && op <= 0xCF)
+		return 0;
+	switch (op)
+	{
+	case 0x05: case 0x06: case 0x07: case 0x08: case 0x09: case 0x0B: case 0x0E:
+	case 0x30: case 0x31: case 0x32: case 0x33: case 0x34: case 0x35: case 0x37:
+	case 0x77: case 0xA0: case 0xA1: case 0xA2: case 0xA8: case 0xA9: case 0xAA:
+		return 0;
+	case 0x0F: case 0x70: case 0x71: case 0x72: case 0x73:
+	case 0xA4: case 0xAC: case 0xBA: case 0xC2: case 0xC4: case 0xC5: case 0xC6:
+		return M | I8;
+	default:
+		return M;
+	}
+}
+
+// Returns the operands of an opcode in a VEX or EVEX map, where every
+// instruction but VZEROUPPER/VZEROALL has a ModRM byte.
+static unsigned short GetVexOpcodeFlags(unsigned int map, unsigned char op)
+{
+	if (map == 1)
+		return (op == 0x77) ? 0 : (GetTwoByteOpcodeFlags(op) & (M | I8)) | M;
+	if (map == 3)
+		return M | I8;
+	return M;
+}
+
+bool DecodeInstruction(const unsigned char *code, bool is64Bit, DecodedInstruction &insn)
+{
+	const size_t MaxLength = 15;
+	size_t i = 0;
+	bool operandSize16 = false, addressSizeOverride = false, rexW = false;
+
+	// Legacy prefixes, then REX in 64-bit mode. A REX prefix that is
+	// followed by a legacy prefix is ignored by the processor.
+	for (;; i++)
+	{
+		if (i >= MaxLength)
+			return false;
+		unsigned char b = code[i];
+		if (is64Bit && (b & 0xF0) == 0x40)
+		{
+			rexW = (b & 0x08) != 0;
+			continue;
+		}
+		if (!(OneByteOpcodes[b] & P))
+			break;
+		rexW = false;
+		if (b == 0x66)
+			operandSize16 = true;
+		else if (b == 0x67)
+			addressSizeOverride = true;
+	}
+
+	insn.opcodeOffset = i;
+	insn.flow = FlowNext;
+	insn.relativeOffset = 0;
+	insn.relativeSize = 0;
+	insn.isRipRelative = false;
+
+	unsigned char op = code[i++];
+	unsigned short flags;
+	unsigned char secondOp = 0;
+	bool isOneByte = false, isTwoByte = false;
+
+	// VEX (C4, C5) and EVEX (62) prefixes. In 32-bit mode, the same
+	// bytes are LES, LDS and BOUND unless the next byte has mod == 3.
+	if ((op == 0xC4 || op == 0xC5 || op == 0x62) && (is64Bit || (code[i] & 0xC0) == 0xC0))
+	{
+		unsigned int map;
+		if (op == 0xC5)
+		{
+			map = 1;
+			i += 1;
+		}
+		else if (op == 0xC4)
+		{
+			map = code[i] & 0x1F;
+			i += 2;
+		}
+		else
+		{
+			map = code[i] & 0x07;
+			i += 3;
+		}
+		if (map == 0 || map > 7)
+			return false;
+		op = code[i++];
+		flags = GetVexOpcodeFlags(map, op);
+	}
+	else if (OneByteOpcodes[op] & ESC)
+	{
+		isTwoByte = true;
+		secondOp = code[i++];
+		if (secondOp == 0x38)
+		{
+			i++;
+			flags = M;
+		}
+		else if (secondOp == 0x3A)
+		{
+			i++;
+			flags = M | I8;
+		}
+		else
+		{
+			flags = GetTwoByteOpcodeFlags(secondOp);
+		}
+	}
+	else
+	{
+		isOneByte = true;
+		flags = OneByteOpcodes[op];
+		if (is64Bit && (flags & X64))
+			return false;
+	}
+
+	// ModRM, SIB and displacement.
+	if (flags & M)
+	{
+		unsigned char modrm = code[i++];
+		unsigned int mod = modrm >> 6, reg = (modrm >> 3) & 7, rm = modrm & 7;
+		if (mod != 3)
+		{
+			if (!is64Bit && addressSizeOverride)
+			{
+				// 16-bit addressing has no SIB byte.
+				if (mod == 0 && rm == 6)
+					i += 2;
+				else if (mod == 1)
+					i += 1;
+				else if (mod == 2)
+					i += 2;
+			}
+			else
+			{
+				if (rm == 4)
+				{
+					unsigned char sib = code[i++];
+					if (mod == 0 && (sib & 7) == 5)
+						i += 4;
+				}
+				else if (mod == 0 && rm == 5)
+				{
+					// disp32 alone is [rip+disp32] in 64-bit mode.
+					if (is64Bit)
+					{
+						insn.relativeOffset = i;
+						insn.relativeSize = 4;
+						insn.isRipRelative = true;
+					}
+					i += 4;
+				}
+				if (mod == 1)
+					i += 1;
+				else if (mod == 2)
+					i += 4;
+			}
+		}
+
+		if (isOneByte)
+		{
+			// TEST Eb/Ev has an immediate operand; the rest of the group
+			// does not.
+			if (op == 0xF6 && reg <= 1)
+				flags |= I8;
+			else if (op == 0xF7 && reg <= 1)
+				flags |= IZ;
+			else if (op == 0xFF && (reg == 4 || reg == 5))
+				insn.flow = FlowIndirectJump;
+		}
+	}
+
+	// Immediates.
+	if (flags & I8)
+		i += 1;
+	if (flags & I16)
+		i += 2;
+	if (flags & IZ)
+		i += operandSize16 ? 2 : 4;
+	if (flags & IV)
+		i += rexW ? 8 : (operandSize16 ? 2 : 4);
+	if (flags & MO)
+		i += is64Bit ? (addressSizeOverride ? 4 : 8) : (addressSizeOverride ? 2 : 4);
+	if (flags & FAR)
+	{
+		i += (operandSize16 ? 2 : 4) + 2;
+		insn.flow = FlowStop;
+	}
+
+	// Relative branch targets. The operand size prefix is ignored by
+	// near branches in 64-bit mode.
+	if (flags & (J8 | JZ))
+	{
+		insn.relativeOffset = i;
+		insn.relativeSize = (flags & J8) ? 1 : (is64Bit || !operandSize16) ? 4 : 2;
+		i += insn.relativeSize;
+		if (isTwoByte)
+			insn.flow = FlowConditionalJump;
+		else if (op >= 0x70 && op <= 0x7F)
+			insn.flow = FlowConditionalJump;
+		else if (op >= 0xE0 && op <= 0xE3)
+			insn.flow = FlowLoop;
+		else if (op == 0xE8)
+			insn.flow = FlowCall;
+		else
+			insn.flow = FlowJump;
+	}
+
+	if (isOneByte && (flags & (M | J8 | JZ)) == 0)
+	{
+		switch (op)
+		{
+		case 0xC2: case 0xC3: case 0xCA: case 0xCB: case 0xCF:
+			insn.flow = FlowReturn;
+			break;
+		case 0xCC: case 0xF4:
+			insn.flow = FlowStop;
+			break;
+		}
+	}
+	else if (isTwoByte && secondOp == 0x0B)
+	{
+		insn.flow = FlowStop; // UD2
+	}
+
+	if (i > MaxLength)
+		return false;
+	insn.length = i;
+	return true;
+}
@@ -0,0 +1,51 @@
+////////////////////////////////////////////////////////////////////////////
+// InstructionDecoder.h -- find the length of x86 and x64 instructions
+//
+// ThunkManager copies the first instructions of a procedure that it
+// hooks inline to a trampoline, so it must know where each instruction
+// ends and which operands are relative to the instruction pointer. The
+// decoder covers the general-purpose, x87, SSE, VEX and EVEX encodings
+// that compilers emit; it does not tell what an instruction does
+// beyond how it changes the flow of control.
+//
+
+#pragma once
+
+#include <stddef.h>
+
+// How an instruction changes the flow of control.
+enum InstructionFlow
+{
+	FlowNext,            // continues with the next instruction
+	FlowJump,            // JMP rel8/rel32
+	FlowConditionalJump, // Jcc rel8/rel32
+	FlowLoop,            // LOOP, LOOPcc or JCXZ rel8
+	FlowCall,            // CALL rel32
+	FlowIndirectJump,    // JMP through a register or memory
+	FlowReturn,          // RET, IRET
+	FlowStop,            // INT3, UD2, HLT and far transfers
+};
+
+struct DecodedInstruction
+{
+	// Length of the instruction in bytes.
+	size_t length;
+
+	// Offset of the opcode byte, after the prefixes.
+	size_t opcodeOffset;
+
+	InstructionFlow flow;
+
+	// Offset and size of the displacement that is relative to the end
+	// of the instruction: the target of a relative branch, or the
+	// memory operand of an x64 instruction that addresses [rip+disp32].
+	// relativeSize is 0 if there is none.
+	size_t relativeOffset;
+	size_t relativeSize;
+	bool isRipRelative;
+};
+
+// Decodes the instruction at code, in 64-bit mode if is64Bit is true and
+// in 32-bit mode otherwise. Reads at most 15 bytes. Returns false if
+// the bytes are not a valid instruction known to the decoder.
+bool DecodeInstruction(const unsigned char *code, bool is64Bit, DecodedInstruction &insn);
@@ -0,0 +1,251 @@
+////////////////////////////////////////////////////////////////////////////
+// LiveQueries.cpp -- worksheet functions that query the live statistics
+
+#include "LiveQueries.h"
+#include "TraceRecorder.h"
+#include <algorithm>
+#include <deque>
+#include <initializer_list>
+#include <string>
+#include <vector>
+
+static std::vector<LiveFunctionStatistics> s_snapshot;
+static bool s_hasSnapshot = false;
+
+// Time-stamp counter and performance counter at the start of the
+// clock, from which the rate of the time-stamp counter is estimated.
+static uint64_t s_clockStartTicks;
+static LARGE_INTEGER s_clockStartCounter;
+
+void InitializeLiveQueries()
+{
+	s_clockStartTicks = ReadTraceClock();
+	QueryPerformanceCounter(&s_clockStartCounter);
+	ResetLiveQueries();
+}
+
+void TakeLiveSnapshot()
+{
+	ReadLiveStatistics(s_snapshot);
+	s_hasSnapshot = true;
+}
+
+void ResetLiveQueries()
+{
+	ResetLiveStatistics();
+	TakeLiveSnapshot();
+}
+
+// Returns the number of trace clock ticks per microsecond.
+static double GetTicksPerMicrosecond()
+{
+	LARGE_INTEGER counter, frequency;
+	QueryPerformanceCounter(&counter);
+	QueryPerformanceFrequency(&frequency);
+	uint64_t ticks = ReadTraceClock();
+	double seconds = (double)(counter.QuadPart - s_clockStartCounter.QuadPart) / (double)frequency.QuadPart;
+	if (seconds <= 0.001)
+		return 1000.0;
+	return (double)(ticks - s_clockStartTicks) / seconds / 1e6;
+}
+
+//
+// ResultArray
+//
+// Builds an array to return to Excel in static storage, which remains
+// valid until the array is built again.
+//
+
+class ResultArray
+{
+	XLOPER12 m_result;
+	std::vector<XLOPER12> m_cells;
+	std::deque<std::wstring> m_strings; // length-prefixed
+	int m_columns;
+
+public:
+	ResultArray() : m_columns(0)
+	{
+		m_result.xltype = xltypeNil;
+	}
+
+	void Clear(int rows, int columns)
+	{
+		m_strings.clear();
+		m_cells.assign((size_t)rows * columns, XLOPER12());
+		for (XLOPER12 &cell : m_cells)
+			cell.xltype = xltypeNil;
+		m_columns = columns;
+		m_result.xltype = xltypeMulti;
+		m_result.val.array.lparray = m_cells.data();
+		m_result.val.array.rows = rows;
+		m_result.val.array.columns = columns;
+	}
+
+	void SetNumber(int row, int column, double value)
+	{
+		XLOPER12 &cell = m_cells[(size_t)row * m_columns + column];
+		cell.xltype = xltypeNum;
+		cell.val.num = value;
+	}
+
+	void SetString(int row, int column, const std::wstring &value)
+	{
+		size_t length = std::min(value.size(), (size_t)32767);
+		m_strings.push_back(std::wstring(1, (wchar_t)length) + value.substr(0, length));
+		XLOPER12 &cell = m_cells[(size_t)row * m_columns + column];
+		cell.xltype = xltypeStr;
+		cell.val.str = &m_strings.back()[0];
+	}
+
+	void SetHeader(std::initializer_list<LPCWSTR> names)
+	{
+		int column = 0;
+		for (LPCWSTR name : names)
+			SetString(0, column++, name);
+	}
+
+	LPXLOPER12 Result()
+	{
+		return &m_result;
+	}
+
+	LPXLOPER12 Error(int err)
+	{
+		m_strings.clear();
+		m_cells.clear();
+		m_result.xltype = xltypeErr;
+		m_result.val.err = err;
+		return &m_result;
+	}
+};
+
+static std::wstring FromUtf8(const std::string &s)
+{
+	if (s.empty())
+		return std::wstring();
+	int n = MultiByteToWideChar(CP_UTF8, 0, s.c_str(), (int)s.size(), NULL, 0);
+	std::wstring result(n, L'\0');
+	MultiByteToWideChar(CP_UTF8, 0, s.c_str(), (int)s.size(), &result[0], n);
+	return result;
+}
+
+LPXLOPER12 QueryTopFunctions(int count, LPCWSTR order)
+{
+	static ResultArray s_result;
+
+	enum { ByTotal, BySelf, ByCalls, ByMean, ByMax } key;
+	if (order == nullptr || order[0] == L'\0' || _wcsicmp(order, L"total") == 0)
+		key = ByTotal;
+	else if (_wcsicmp(order, L"self") == 0)
+		key = BySelf;
+	else if (_wcsicmp(order, L"calls") == 0)
+		key = ByCalls;
+	else if (_wcsicmp(order, L"mean") == 0)
+		key = ByMean;
+	else if (_wcsicmp(order, L"max") == 0)
+		key = ByMax;
+	else
+		return s_result.Error(xlerrValue);
+	if (count < 0)
+		return s_result.Error(xlerrValue);
+	if (count == 0)
+		count = 10;
+
+	if (!s_hasSnapshot)
+		TakeLiveSnapshot();
+
+	std::vector<const LiveFunctionStatistics*> functions;
+	for (const LiveFunctionStatistics &f : s_snapshot)
+	{
+		if (f.calls != 0)
+			functions.push_back(&f);
+	}
+	auto value = [key](const LiveFunctionStatistics *f) -> double {
+		switch (key)
+		{
+		case BySelf: return (double)f->selfTicks;
+		case ByCalls: return (double)f->calls;
+		case ByMean: return (double)f->inclusiveTicks / f->calls;
+		case ByMax: return (double)f->maxTicks;
+		default: return (double)f->inclusiveTicks;
+		}
+	};
+	std::stable_sort(functions.begin(), functions.end(),
+		[&value](const LiveFunctionStatistics *a, const LiveFunctionStatistics *b) {
+		return value(a) > value(b);
+	});
+	if (functions.size() > (size_t)count)
+		functions.resize(count);
+
+	double ticksPerMicrosecond = GetTicksPerMicrosecond();
+	s_result.Clear((int)functions.size() + 1, 7);
+	s_result.SetHeader({ L"Function", L"DLL", L"Calls", L"Total (ms)", L"Self (ms)",
+		L"Mean (us)", L"Max (ms)" });
+	for (size_t i = 0; i < functions.size(); i++)
+	{
+		const LiveFunctionStatistics &f = *functions[i];
+		int row = (int)i + 1;
+		s_result.SetString(row, 0, FromUtf8(f.name));
+		s_result.SetString(row, 1, FromUtf8(f.dllName));
+		s_result.SetNumber(row, 2, (double)f.calls);
+		s_result.SetNumber(row, 3, f.inclusiveTicks / ticksPerMicrosecond / 1000.0);
+		s_result.SetNumber(row, 4, f.selfTicks / ticksPerMicrosecond / 1000.0);
+		s_result.SetNumber(row, 5, f.inclusiveTicks / ticksPerMicrosecond / f.calls);
+		s_result.SetNumber(row, 6, f.maxTicks / ticksPerMicrosecond / 1000.0);
+	}
+	return s_result.Result();
+}
+
+LPXLOPER12 QueryLatencyHistogram(LPCWSTR functionName)
+{
+	static ResultArray s_result;
+
+	if (functionName == nullptr || functionName[0] == L'\0')
+		return s_result.Error(xlerrValue);
+
+	if (!s_hasSnapshot)
+		TakeLiveSnapshot();
+
+	// Add up the functions of that name in all DLLs.
+	bool found = false;
+	uint64_t calls = 0;
+	uint64_t latency[XLL_PROFILER_LATENCY_BUCKETS] = {};
+	for (const LiveFunctionStatistics &f : s_snapshot)
+	{
+		if (_wcsicmp(FromUtf8(f.name).c_str(), functionName) != 0)
+			continue;
+		found = true;
+		calls += f.calls;
+		for (int i = 0; i < XLL_PROFILER_LATENCY_BUCKETS; i++)
+			latency[i] += f.latency[i];
+	}
+	if (!found || calls == 0)
+		return s_result.Error(xlerrNA);
+
+	int first = 0, last = XLL_PROFILER_LATENCY_BUCKETS - 1;
+	while (latency[first] == 0)
+		first++;
+	while (latency[last] == 0)
+		last--;
+
+	// Bucket 0 starts at zero; bucket i > 0 covers
+	// [2^(FIRST_SHIFT + i - 1), 2^(FIRST_SHIFT + i)) ticks.
+	double ticksPerMicrosecond = GetTicksPerMicrosecond();
+	s_result.Clear(last - first + 2, 4);
+	s_result.SetHeader({ L"From (us)", L"To (us)", L"Calls", L"Share (%)" });
+	for (int i = first; i <= last; i++)
+	{
+		int row = i - first + 1;
+		double from = (i == 0) ? 0.0 : (double)(1ull << (LIVE_LATENCY_FIRST_SHIFT + i - 1));
+		double to = (double)(1ull << (LIVE_LATENCY_FIRST_SHIFT + i));
+		s_result.SetNumber(row, 0, from / ticksPerMicrosecond);
+		if (i < XLL_PROFILER_LATENCY_BUCKETS - 1)
+			s_result.SetNumber(row, 1, to / ticksPerMicrosecond);
+		else
+			s_result.SetString(row, 1, L"");
+		s_result.SetNumber(row, 2, (double)latency[i]);
+		s_result.SetNumber(row, 3, 100.0 * latency[i] / calls);
+	}
+	return s_result.Result();
+}
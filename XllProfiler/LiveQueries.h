@@ -0,0 +1,41 @@
+////////////////////////////////////////////////////////////////////////////
+// LiveQueries.h -- worksheet functions that query the live statistics
+//
+// The query functions read a snapshot of the live statistics of the
+// recorder (see ReadLiveStatistics()), taken when a recalculation ends
+// or when the XllProfiler.Snapshot command runs. All query cells of a
+// recalculation therefore show the same numbers, and do not include
+// the recalculation in which they run. Statistics are counted from the
+// time the profiler was opened, or from the last XllProfiler.Reset.
+//
+// The queries and commands run on the main thread; the snapshot is
+// taken without blocking the threads that make instrumented calls.
+// Results are returned in static storage, which Excel copies before
+// the next call.
+//
+
+#pragma once
+
+#include <Windows.h>
+#include "XLCALL.H"
+
+// Restarts the statistics from zero and the clock that converts their
+// times to seconds. Call this when the profiler is opened, after
+// calibration.
+void InitializeLiveQueries();
+
+// Takes a snapshot of the statistics for the queries to return.
+void TakeLiveSnapshot();
+
+// Restarts the statistics from zero.
+void ResetLiveQueries();
+
+// Returns an array of the count functions that rank first in the given
+// order, which is "total" (the default), "self", "calls",
+// "mean" or "max", with a header row.
+LPXLOPER12 QueryTopFunctions(int count, LPCWSTR order);
+
+// Returns the latency histogram of the functions with the given name,
+// with a row for each bucket between the shortest and the longest
+// call, and a header row.
+LPXLOPER12 QueryLatencyHistogram(LPCWSTR functionName);
@@ -2,11 +2,29 @@
 #include "XLCALL.H"
 #include "ExcelHelper.h"
 #include "ThunkManager.h"
+#include "TraceRecorder.h"
+#include "ArgumentCapture.h"
+#include "FunctionFilter.h"
+#include "CallbackInterposer.h"
+#include "CallerCells.h"
+#include "AllocationHooks.h"
+#include "LiveQueries.h"
+#include <algorithm>
+
+static HMODULE s_hModule;
 
 BOOL WINAPI DllMain(HANDLE hInstance, ULONG fdwReason, LPVOID lpReserved)
 {
 	switch (fdwReason)
 	{
+	case DLL_PROCESS_ATTACH:
+		s_hModule = (HMODULE)hInstance;
+		break;
+	case DLL_THREAD_DETACH:
+		ThunkManager::ReleaseThreadState();
+		ReleaseTraceThreadState();
+		ReleaseCallerCellCache();
+		break;
 	case DLL_PROCESS_DETACH:
 		// Uninstall thunks
 		break;
@@ -72,24 +90,92 @@ bool InstallThunk(RegisteredFunctionInfo *pInfo)
 }
 #endif
 
-void XllBeforeCall(ThunkInfo *pThunkInfo, void *returnAddress, va_list)
+// Registered function instrumented by the profiler. Passed to the
+// thunk handlers as the cookie.
+struct ProfiledFunction
+{
+	RegisteredFunctionInfo info;
+	uint32_t traceId;
+	CaptureFunction *capture;
+	ThunkInfo *thunk;
+	bool returnsXloper; // registered with return type Q or U
+};
+
+// Set if the heap allocations of profiled XLLs and the results they
+// return for Excel to free are recorded, by setting XLL_PROFILER_MEMORY
+// to 1.
+static bool s_isCountingMemory;
+
+// Returns the number of bytes taken by an XLOPER12 and by the strings,
+// array elements, references and binary data it points to. This counts
+// the same way as GetValueSize() in XllConnector, so that the sizes the
+// profiler reports agree with the connector's own accounting.
+static uint64_t GetXloperTreeSize(const XLOPER12 *p)
+{
+	uint64_t bytes = sizeof(XLOPER12);
+	switch (p->xltype & ~(xlbitDLLFree | xlbitXLFree))
+	{
+	case xltypeStr:
+		if (p->val.str != nullptr)
+			bytes += ((uint64_t)(unsigned short)p->val.str[0] + 1) * sizeof(XCHAR);
+		break;
+	case xltypeMulti:
+		if (p->val.array.lparray != nullptr)
+		{
+			uint64_t count = (uint64_t)p->val.array.rows * p->val.array.columns;
+			for (uint64_t i = 0; i < count; i++)
+				bytes += GetXloperTreeSize(&p->val.array.lparray[i]);
+		}
+		break;
+	case xltypeRef:
+		if (p->val.mref.lpmref != nullptr)
+			bytes += sizeof(XLMREF12) + (uint64_t)p->val.mref.lpmref->count * sizeof(XLREF12);
+		break;
+	case xltypeBigData:
+		if (p->val.bigdata.h.lpbData != nullptr)
+			bytes += p->val.bigdata.cbData;
+		break;
+	}
+	return bytes;
+}
+
+void XllBeforeCall(ThunkInfo *pThunkInfo, void *returnAddress, ThunkArguments &args)
 {
-	RegisteredFunctionInfo *pFunctionInfo = (RegisteredFunctionInfo*)pThunkInfo->cookie;
-	wchar_t msg[1000];
-	swprintf_s(msg, L"BeforeCall:%s:%s\n",
-		pFunctionInfo->functionName.c_str(), 
-		pFunctionInfo->typeText.c_str());
-	OutputDebugStringW(msg);
+	ProfiledFunction *pFunction = (ProfiledFunction*)pThunkInfo->cookie;
+	if (IsCapturing())
+	{
+		CaptureCall(pFunction->capture, args);
+	}
+	RecordCallEnter(pFunction->traceId);
 }
 
-void XllAfterCall(ThunkInfo *pThunkInfo, size_t intRetVal)
+void XllAfterCall(ThunkInfo *pThunkInfo, const ThunkReturnValue &returnValue)
+{
+	ProfiledFunction *pFunction = (ProfiledFunction*)pThunkInfo->cookie;
+	if (s_isCountingMemory && pFunction->returnsXloper)
+	{
+		const XLOPER12 *pResult = (const XLOPER12 *)returnValue.integer;
+		if (pResult != nullptr && (pResult->xltype & xlbitDLLFree) != 0)
+			RecordReturnedMemory(pResult, GetXloperTreeSize(pResult));
+	}
+	RecordCallLeave();
+}
+
+//
+// xlAutoFree12
+//
+// Excel passes each result returned with xlbitDLLFree to xlAutoFree12
+// of the XLL that returned it. A thunk on it tells the recorder how
+// long Excel held the result.
+//
+
+static void AutoFreeBeforeCall(ThunkInfo *pThunkInfo, void *returnAddress, ThunkArguments &args)
+{
+	RecordReleasedMemory((const void *)args.NextInteger());
+}
+
+static void AutoFreeAfterCall(ThunkInfo *pThunkInfo, const ThunkReturnValue &returnValue)
 {
-	RegisteredFunctionInfo *pFunctionInfo = (RegisteredFunctionInfo*)pThunkInfo->cookie;
-	wchar_t msg[1000];
-	swprintf_s(msg, L"AfterCall:%s:0x%p\n",
-		pFunctionInfo->functionName.c_str(),
-		intRetVal);
-	OutputDebugStringW(msg);
 }
 
 bool __stdcall IsProfilerPresent()
@@ -97,42 +183,464 @@ bool __stdcall IsProfilerPresent()
 	return true;
 }
 
-static void InstallThunk(const RegisteredFunctionInfo &functionInfo)
+//
+// Function selection
+//
+// The functions registered in Excel are read once when the profiler
+// opens, and again only if a control function names a function that
+// was registered later. A thunk is installed when a function is first
+// instrumented, and is then enabled and disabled by swapping its jump
+// target, so a disabled function runs at full speed.
+//
+// Installing a thunk may overwrite the first instructions of the
+// function, which is safe only while no thread runs them. Thunks are
+// therefore installed only from commands, which Excel does not run
+// during a calculation: when the profiler opens, by EnableAll, and
+// when a calculation ends for the functions that XllProfiler.Enable()
+// selected during it. Swapping the jump target is safe at any time.
+//
+
+static std::vector<RegisteredFunctionInfo> s_registeredFunctions;
+static std::vector<ProfiledFunction*> s_profiledFunctions;
+
+// Functions selected for instrumentation whose thunk is not installed
+// yet.
+static std::vector<RegisteredFunctionInfo> s_pendingFunctions;
+
+// Set if the callbacks of XLLs with instrumented functions into Excel
+// are recorded, by setting XLL_PROFILER_CALLBACKS to 1.
+static bool s_isInterposingCallbacks;
+
+// Reads the registered functions again. The table is kept if Excel
+// cannot list them, so that functions already instrumented can still
+// be found and disabled.
+static bool RefreshRegisteredFunctions()
+{
+	WCHAR modulePath[MAX_PATH];
+	DWORD n = GetModuleFileNameW(s_hModule, modulePath, ARRAYSIZE(modulePath));
+	std::wstring ownPath(modulePath, (n < ARRAYSIZE(modulePath)) ? n : 0);
+
+	std::vector<RegisteredFunctionInfo> info;
+	if (!GetRegisteredFunctions(info))
+		return false;
+
+	// Do not instrument the profiler itself.
+	std::vector<RegisteredFunctionInfo> functions;
+	for (const RegisteredFunctionInfo &f : info)
+	{
+		if (_wcsicmp(f.dllName.c_str(), ownPath.c_str()) != 0)
+			functions.push_back(f);
+	}
+	s_registeredFunctions.swap(functions);
+	return true;
+}
+
+static ProfiledFunction* FindProfiledFunction(FARPROC procAddress)
+{
+	for (ProfiledFunction *pFunction : s_profiledFunctions)
+	{
+		if (pFunction->info.procAddress == procAddress)
+			return pFunction;
+	}
+	return nullptr;
+}
+
+static std::vector<RegisteredFunctionInfo>::iterator FindPendingFunction(FARPROC procAddress)
+{
+	return std::find_if(s_pendingFunctions.begin(), s_pendingFunctions.end(),
+		[procAddress](const RegisteredFunctionInfo &f) { return f.procAddress == procAddress; });
+}
+
+// Routes calls of the function through a thunk. If the thunk is not
+// installed yet, it is installed if canInstall is true, which the
+// caller sets only from a command, and otherwise left to the next call
+// of InstallPendingThunks(). Returns false if the function cannot be
+// instrumented.
+static bool InstrumentFunction(const RegisteredFunctionInfo &functionInfo, bool canInstall)
 {
-	RegisteredFunctionInfo *pFunctionInfo =
-		new RegisteredFunctionInfo(functionInfo);
-	s_thunkManager.InstallThunk(NULL,
-		pFunctionInfo->procAddress, pFunctionInfo,
+	ProfiledFunction *pFunction = FindProfiledFunction(functionInfo.procAddress);
+	if (pFunction != nullptr)
+	{
+		return ThunkManager::IsThunkEnabled(pFunction->thunk) ||
+			ThunkManager::EnableThunk(pFunction->thunk, true);
+	}
+
+	if (!canInstall)
+	{
+		if (FindPendingFunction(functionInfo.procAddress) == s_pendingFunctions.end())
+			s_pendingFunctions.push_back(functionInfo);
+		return true;
+	}
+
+	pFunction = new ProfiledFunction;
+	pFunction->info = functionInfo;
+	pFunction->traceId = DefineTraceFunction(functionInfo.functionName, functionInfo.dllName,
+		functionInfo.typeText);
+	pFunction->capture = DefineCaptureFunction(functionInfo);
+	pFunction->returnsXloper = !functionInfo.typeText.empty() &&
+		(functionInfo.typeText[0] == L'Q' || functionInfo.typeText[0] == L'U');
+	pFunction->thunk = s_thunkManager.InstallThunk(NULL,
+		pFunction->info.procAddress, pFunction,
 		XllBeforeCall, XllAfterCall);
+	if (pFunction->thunk == NULL)
+	{
+		delete pFunction;
+		return false;
+	}
+	s_profiledFunctions.push_back(pFunction);
+
+	if (s_isInterposingCallbacks)
+		InterposeExcelCallbacks(GetModuleHandleW(functionInfo.dllName.c_str()));
+	if (s_isCountingMemory)
+	{
+		HMODULE hModule = GetModuleHandleW(functionInfo.dllName.c_str());
+		HookAllocator(hModule);
+		FARPROC autoFree = (hModule != NULL) ? GetProcAddress(hModule, "xlAutoFree12") : NULL;
+		if (autoFree != NULL && s_thunkManager.FindThunk(autoFree) == NULL)
+			s_thunkManager.InstallThunk(hModule, autoFree, nullptr, AutoFreeBeforeCall, AutoFreeAfterCall);
+	}
+	return true;
+}
+
+// Restores direct calls of the function. Returns false if it is not
+// instrumented.
+static bool UninstrumentFunction(const RegisteredFunctionInfo &functionInfo)
+{
+	auto pending = FindPendingFunction(functionInfo.procAddress);
+	if (pending != s_pendingFunctions.end())
+	{
+		s_pendingFunctions.erase(pending);
+		return true;
+	}
+
+	ProfiledFunction *pFunction = FindProfiledFunction(functionInfo.procAddress);
+	if (pFunction == nullptr || !ThunkManager::IsThunkEnabled(pFunction->thunk))
+		return false;
+	return ThunkManager::EnableThunk(pFunction->thunk, false) != FALSE;
+}
+
+// Installs the thunks of the functions selected by XllProfiler.Enable().
+// Must be called from a command.
+static void InstallPendingThunks()
+{
+	std::vector<RegisteredFunctionInfo> pending;
+	pending.swap(s_pendingFunctions);
+	for (const RegisteredFunctionInfo &f : pending)
+	{
+		InstrumentFunction(f, true);
+	}
+}
+
+// Enables or disables instrumentation of the functions whose name
+// matches the pattern, and returns the number of functions changed.
+// New thunks are installed only if canInstall is true.
+static int SetInstrumentation(LPCWSTR pattern, bool enable, bool canInstall)
+{
+	int count = 0;
+	bool isMatched = false;
+	for (int attempt = 0; attempt < 2 && !isMatched; attempt++)
+	{
+		if (attempt > 0 && !RefreshRegisteredFunctions())
+			break;
+
+		for (const RegisteredFunctionInfo &f : s_registeredFunctions)
+		{
+			if (MatchGlob(pattern, f.functionName.c_str()))
+			{
+				isMatched = true;
+				if (enable ? InstrumentFunction(f, canInstall) : UninstrumentFunction(f))
+					++count;
+			}
+		}
+	}
+	return count;
+}
+
+// Loads the selection rules from the file named by the environment
+// variable XLL_PROFILER_CONFIG, or from XllProfiler.cfg next to the
+// profiler. Without rules, no function is instrumented when the
+// profiler opens.
+static void LoadFunctionFilter(FunctionFilter &filter)
+{
+	WCHAR fileName[MAX_PATH];
+	DWORD n = GetEnvironmentVariableW(L"XLL_PROFILER_CONFIG", fileName, ARRAYSIZE(fileName));
+	if (n == 0 || n >= ARRAYSIZE(fileName))
+	{
+		n = GetModuleFileNameW(s_hModule, fileName, ARRAYSIZE(fileName));
+		if (n == 0 || n >= ARRAYSIZE(fileName))
+			return;
+		LPWSTR slash = wcsrchr(fileName, L'\\');
+		if (slash == nullptr || wcscpy_s(slash + 1, ARRAYSIZE(fileName) - (slash + 1 - fileName), L"XllProfiler.cfg") != 0)
+			return;
+	}
+
+	if (filter.Load(fileName))
+	{
+		std::wstring msg = std::wstring(L"XllProfiler: loaded rules from ") + fileName + L"\n";
+		OutputDebugStringW(msg.c_str());
+	}
+}
+
+//
+// Control functions
+//
+// XllProfiler.Enable(pattern) and XllProfiler.Disable(pattern) are
+// worksheet functions that return the number of functions changed.
+// They are registered as equivalent to macro sheet functions, which
+// may list the registered functions. Functions that Enable() selects
+// for the first time are instrumented when the calculation ends.
+// XllProfiler.EnableAll and XllProfiler.DisableAll are commands.
+//
+
+double __stdcall XllProfilerEnable(const wchar_t *pattern)
+{
+	return SetInstrumentation(pattern, true, false);
+}
+
+double __stdcall XllProfilerDisable(const wchar_t *pattern)
+{
+	return SetInstrumentation(pattern, false, false);
+}
+
+int __stdcall XllProfilerEnableAll()
+{
+	InstallPendingThunks();
+	SetInstrumentation(L"*", true, true);
+	return 1;
+}
+
+int __stdcall XllProfilerDisableAll()
+{
+	SetInstrumentation(L"*", false, false);
+	return 1;
+}
+
+//
+// Calculation events
+//
+// Excel runs these commands when a recalculation ends or is canceled.
+// Each one closes the current recalculation window of the trace,
+// discards the cached calling cells, and installs the thunks of the
+// functions enabled during it.
+//
+
+int __stdcall XllProfilerCalculationEnded()
+{
+	RecordRecalcEnd(TraceRecalcEnded);
+	TakeLiveSnapshot();
+	InvalidateCallerCells();
+	InstallPendingThunks();
+	return 1;
+}
+
+int __stdcall XllProfilerCalculationCanceled()
+{
+	RecordRecalcEnd(TraceRecalcCanceled);
+	TakeLiveSnapshot();
+	InvalidateCallerCells();
+	InstallPendingThunks();
+	return 1;
+}
+
+//
+// Live queries
+//
+// Worksheet functions that return the statistics of the instrumented
+// functions as arrays, and commands that take a new snapshot of them
+// or restart them (see LiveQueries.h).
+//
+
+LPXLOPER12 __stdcall XllProfilerTop(double count, const wchar_t *order)
+{
+	return QueryTopFunctions((int)count, order);
+}
+
+LPXLOPER12 __stdcall XllProfilerHistogram(const wchar_t *functionName)
+{
+	return QueryLatencyHistogram(functionName);
+}
+
+int __stdcall XllProfilerSnapshot()
+{
+	TakeLiveSnapshot();
+	return 1;
+}
+
+int __stdcall XllProfilerReset()
+{
+	ResetLiveQueries();
+	return 1;
+}
+
+// Asks Excel to run a registered command when an event occurs.
+static void RegisterEvent(LPCWSTR commandName, int event)
+{
+	std::wstring buffer = std::wstring(1, (wchar_t)wcslen(commandName)) + commandName;
+	XLOPER12 xName, xEvent;
+	xName.xltype = xltypeStr;
+	xName.val.str = &buffer[0];
+	xEvent.xltype = xltypeInt;
+	xEvent.val.w = event;
+	Excel12(xlEventRegister, 0, 2, &xName, &xEvent);
+}
+
+// Registers a procedure of this DLL. macroType is 1 for a worksheet
+// function and 2 for a command.
+static void RegisterProcedure(LPXLOPER12 pxDllName, LPCWSTR procedure,
+	LPCWSTR typeText, LPCWSTR functionText, LPCWSTR argumentText, int macroType)
+{
+	LPCWSTR strings[] = { procedure, typeText, functionText, argumentText };
+	std::wstring buffers[ARRAYSIZE(strings)];
+	XLOPER12 opers[ARRAYSIZE(strings) + 1];
+	for (size_t i = 0; i < ARRAYSIZE(strings); i++)
+	{
+		buffers[i] = std::wstring(1, (wchar_t)wcslen(strings[i])) + strings[i];
+		opers[i].xltype = xltypeStr;
+		opers[i].val.str = &buffers[i][0];
+	}
+	opers[ARRAYSIZE(strings)].xltype = xltypeInt;
+	opers[ARRAYSIZE(strings)].val.w = macroType;
+	Excel12(xlfRegister, nullptr, 6, pxDllName,
+		&opers[0], &opers[1], &opers[2], &opers[3], &opers[4]);
+}
+
+//
+// Calibration
+//
+// The overhead of the instrumentation is measured by calling an empty
+// function through a thunk installed the same way as for a UDF, that
+// is, on an exported JMP [...] stub.
+//
+
+typedef int (__stdcall *CalibrationProc)(int);
+
+static int __stdcall CalibrationTarget(int x)
+{
+	return x;
+}
+
+static CodeHeap s_calibrationCode;
+static CalibrationProc volatile s_calibrationStub;
+static CalibrationProc volatile s_calibrationTarget = CalibrationTarget;
+static volatile int s_calibrationSink;
+
+static void CallCalibrationStub()
+{
+	s_calibrationSink = s_calibrationStub(s_calibrationSink);
+}
+
+static void CallCalibrationTarget()
+{
+	s_calibrationSink = s_calibrationTarget(s_calibrationSink);
+}
+
+// Creates a JMP [...] stub that jumps to CalibrationTarget.
+static CalibrationProc CreateCalibrationStub()
+{
+	unsigned char *p = (unsigned char *)s_calibrationCode.Allocate(16);
+	if (p == nullptr)
+		return NULL;
+
+	void *target = (void *)CalibrationTarget;
+	p[0] = 0xFF; // jmp [...]
+	p[1] = 0x25;
+#if defined(_WIN64)
+	int displacement = 0; // the target follows the instruction
+#else
+	unsigned char *displacement = p + 6; // absolute address of the target
+#endif
+	memcpy(p + 2, &displacement, 4);
+	memcpy(p + 6, &target, sizeof(target));
+	FlushCode(p, 16);
+	return (CalibrationProc)p;
+}
+
+static void CalibrateProfiler()
+{
+	s_calibrationStub = CreateCalibrationStub();
+	if (s_calibrationStub == NULL)
+		return;
+
+	ProfiledFunction *pFunction = new ProfiledFunction;
+	pFunction->info.id = 0;
+	pFunction->info.procAddress = (FARPROC)s_calibrationStub;
+	pFunction->traceId = DefineTraceFunction(L"(calibration)", L"", L"");
+	pFunction->capture = nullptr;
+	pFunction->returnsXloper = false;
+	if (s_thunkManager.InstallThunk(NULL, pFunction->info.procAddress, pFunction, XllBeforeCall, XllAfterCall))
+	{
+		CalibrateOverhead(pFunction->traceId, CallCalibrationStub, CallCalibrationTarget);
+	}
 }
 
 int WINAPI xlAutoOpen()
 {
-	std::vector<RegisteredFunctionInfo> info;
-	GetRegisteredFunctions(info);
+	SetTraceModeFromEnvironment();
+
+	// Count heap allocations if XLL_PROFILER_MEMORY is 1. This is set
+	// before calibration, so that the overhead of reading the counts is
+	// subtracted like the rest of the instrumentation.
+	WCHAR value[8];
+	DWORD n = GetEnvironmentVariableW(L"XLL_PROFILER_MEMORY", value, ARRAYSIZE(value));
+	s_isCountingMemory = (n > 0 && n < ARRAYSIZE(value) && wcscmp(value, L"1") == 0);
+	SetMemoryCounting(s_isCountingMemory);
+
+	// Keep the live statistics for the query functions unless
+	// XLL_PROFILER_LIVE is 0.
+	n = GetEnvironmentVariableW(L"XLL_PROFILER_LIVE", value, ARRAYSIZE(value));
+	SetLiveStatistics(!(n > 0 && n < ARRAYSIZE(value) && wcscmp(value, L"0") == 0));
+
+	CalibrateProfiler();
+	InitializeLiveQueries();
+
+	// Attribute calls to their calling cells if XLL_PROFILER_CALLERS is
+	// 1. This is set after calibration, which is not called from a cell.
+	n = GetEnvironmentVariableW(L"XLL_PROFILER_CALLERS", value, ARRAYSIZE(value));
+	if (n > 0 && n < ARRAYSIZE(value) && wcscmp(value, L"1") == 0)
+		SetCallerResolver(ResolveCallerCell);
 
-	for (size_t i = 0; i < info.size(); i++)
+	StartRecordingFromEnvironment();
+	StartCaptureFromEnvironment();
+
+	FunctionFilter filter;
+	LoadFunctionFilter(filter);
+
+	n = GetEnvironmentVariableW(L"XLL_PROFILER_CALLBACKS", value, ARRAYSIZE(value));
+	s_isInterposingCallbacks = (n > 0 && n < ARRAYSIZE(value) && wcscmp(value, L"1") == 0);
+
+	// Instrument nothing unless asked to: without rules, the filter
+	// would select every function of every XLL.
+	RefreshRegisteredFunctions();
+	if (!filter.empty())
 	{
-		if (info[i].functionName == L"GetCircleArea")
+		for (const RegisteredFunctionInfo &f : s_registeredFunctions)
 		{
-			InstallThunk(info[i]);
+			if (filter.IsSelected(f))
+			{
+				InstrumentFunction(f, true);
+			}
 		}
 	}
 
-	// Register some function to prevent this DLL from
-	// being unloaded by Excel.
+	// Register the control functions. Registering a function also
+	// prevents this DLL from being unloaded by Excel.
 	XLOPER12 xDllName;
 	if (Excel12(xlGetName, &xDllName, 0) == xlretSuccess)
 	{
-		XLOPER12 xProcedure, xSignature, xFunction;
-		xProcedure.xltype = xltypeStr;
-		xProcedure.val.str = L"\021IsProfilerPresent";
-		xSignature.xltype = xltypeStr;
-		xSignature.val.str = L"\01A";
-		xFunction.xltype = xltypeStr;
-		xFunction.val.str = L"\021IsProfilerPresent";
-		Excel12(xlfRegister, nullptr, 4, &xDllName, &xProcedure, &xSignature, &xFunction);
-		Excel12(xlFree, 0, 1, xDllName);
+		RegisterProcedure(&xDllName, L"IsProfilerPresent", L"A", L"IsProfilerPresent", L"", 1);
+		RegisterProcedure(&xDllName, L"XllProfilerEnable", L"BC%#", L"XllProfiler.Enable", L"pattern", 1);
+		RegisterProcedure(&xDllName, L"XllProfilerDisable", L"BC%#", L"XllProfiler.Disable", L"pattern", 1);
+		RegisterProcedure(&xDllName, L"XllProfilerEnableAll", L"J", L"XllProfiler.EnableAll", L"", 2);
+		RegisterProcedure(&xDllName, L"XllProfilerDisableAll", L"J", L"XllProfiler.DisableAll", L"", 2);
+		RegisterProcedure(&xDllName, L"XllProfilerCalculationEnded", L"J", L"XllProfiler.CalculationEnded", L"", 2);
+		RegisterProcedure(&xDllName, L"XllProfilerCalculationCanceled", L"J", L"XllProfiler.CalculationCanceled", L"", 2);
+		RegisterProcedure(&xDllName, L"XllProfilerTop", L"QBC%!", L"XllProfiler.Top", L"count,order", 1);
+		RegisterProcedure(&xDllName, L"XllProfilerHistogram", L"QC%!", L"XllProfiler.Histogram", L"function", 1);
+		RegisterProcedure(&xDllName, L"XllProfilerSnapshot", L"J", L"XllProfiler.Snapshot", L"", 2);
+		RegisterProcedure(&xDllName, L"XllProfilerReset", L"J", L"XllProfiler.Reset", L"", 2);
+		RegisterEvent(L"XllProfiler.CalculationEnded", xleventCalculationEnded);
+		RegisterEvent(L"XllProfiler.CalculationCanceled", xleventCalculationCanceled);
+		Excel12(xlFree, 0, 1, &xDllName);
 	}
 
 	return 1;
@@ -140,5 +648,9 @@ int WINAPI xlAutoOpen()
 
 int WINAPI xlAutoClose()
 {
+	RemoveExcelCallbackInterposers();
+	RemoveAllocationHooks();
+	StopRecording();
+	StopCapture();
 	return 1;
 }
@@ -0,0 +1,305 @@
+////////////////////////////////////////////////////////////////////////////
+// CompressionTest.cpp -- compress and decode workbook states
+//
+// The codec and the blob format of XLL Connector read data from a saved
+// workbook, which may be damaged or written by another version. Every
+// input must round trip, and corrupt or truncated data must be rejected
+// without reading or writing outside the buffers. Build with
+// -fsanitize=address to check the latter.
+
+#include "Compression.h"
+#include "WorkbookStateFormat.h"
+#include "TestUtil.h"
+#include <climits>
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <vector>
+
+using namespace xll;
+
+typedef std::vector<unsigned char> Bytes;
+
+static Bytes RandomBytes(size_t size, unsigned int seed)
+{
+	Bytes data(size);
+	unsigned int x = seed;
+	for (size_t i = 0; i < size; i++)
+	{
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		data[i] = (unsigned char)x;
+	}
+	return data;
+}
+
+// Text with repeats at various distances, as in serialized strings.
+static Bytes MixedBytes(size_t size)
+{
+	static const char *const words[] = { "alpha", "beta", "gamma", "delta", "epsilon" };
+	Bytes random = RandomBytes(size, 7);
+	Bytes data;
+	for (size_t i = 0; data.size() < size; i++)
+	{
+		const char *word = words[random[i] % 5];
+		data.insert(data.end(), word, word + strlen(word));
+		data.push_back(random[i + 1]);
+	}
+	data.resize(size);
+	return data;
+}
+
+static Bytes Compress(const Bytes &data)
+{
+	Bytes compressed;
+	CompressBytes(data.data(), data.size(), compressed);
+	return compressed;
+}
+
+// Decompresses into a buffer of exactly size bytes, so that a write past
+// its end is caught by the address sanitizer.
+static bool Decompress(const Bytes &compressed, size_t size, Bytes &output)
+{
+	output.assign(size, 0);
+	return DecompressBytes(compressed.data(), compressed.size(), output.data(), size);
+}
+
+static void CheckRoundTrip(const Bytes &data)
+{
+	Bytes compressed = Compress(data);
+	Bytes output;
+	TEST_ASSERT(Decompress(compressed, data.size(), output));
+	TEST_ASSERT(output == data);
+
+	// The size must match exactly.
+	if (!data.empty())
+		TEST_ASSERT(!Decompress(compressed, data.size() - 1, output));
+	TEST_ASSERT(!Decompress(compressed, data.size() + 1, output));
+
+	Bytes blob, decoded;
+	EncodeWorkbookState(data.data(), data.size(), blob);
+	TEST_ASSERT(blob.size() <= sizeof(WorkbookStateHeader) + data.size());
+	TEST_ASSERT(DecodeWorkbookState(blob.data(), blob.size(), decoded));
+	TEST_ASSERT(decoded == data);
+}
+
+static void TestEmpty()
+{
+	Bytes empty;
+	CheckRoundTrip(empty);
+
+	// An empty input compresses to a single token.
+	TEST_ASSERT(Compress(empty).size() == 1);
+	Bytes output;
+	TEST_ASSERT(!Decompress(Bytes(), 0, output));
+}
+
+static void TestTiny()
+{
+	for (size_t size = 1; size <= 16; size++)
+	{
+		CheckRoundTrip(Bytes(size, 'x'));
+		CheckRoundTrip(RandomBytes(size, (unsigned int)size));
+	}
+}
+
+static void TestIncompressible()
+{
+	Bytes data = RandomBytes(100000, 12345);
+	CheckRoundTrip(data);
+
+	// Random data is stored raw rather than grown by compression.
+	Bytes blob;
+	EncodeWorkbookState(data.data(), data.size(), blob);
+	WorkbookStateHeader header;
+	memcpy(&header, blob.data(), sizeof(header));
+	TEST_ASSERT(header.codec == WorkbookStateRaw);
+	TEST_ASSERT(blob.size() == sizeof(header) + data.size());
+}
+
+static void TestLongRun()
+{
+	// A run longer than 255 * 255 exercises lengths of several extra
+	// bytes, and one longer than the 64 KB window matches a recent copy.
+	Bytes data(1000000, 0);
+	CheckRoundTrip(data);
+	TEST_ASSERT(Compress(data).size() < data.size() / 200);
+
+	Bytes blob;
+	EncodeWorkbookState(data.data(), data.size(), blob);
+	WorkbookStateHeader header;
+	memcpy(&header, blob.data(), sizeof(header));
+	TEST_ASSERT(header.codec == WorkbookStateCompressed);
+
+	// A long run of literals followed by a long match.
+	Bytes mixed = RandomBytes(5000, 99);
+	mixed.insert(mixed.end(), 5000, 'z');
+	CheckRoundTrip(mixed);
+}
+
+static void TestOverlappingMatch()
+{
+	// A match whose offset is shorter than its length copies the bytes it
+	// has just produced.
+	for (size_t period = 1; period <= 9; period++)
+	{
+		Bytes data;
+		for (size_t i = 0; i < 1000; i++)
+			data.push_back((unsigned char)('a' + i % period));
+		CheckRoundTrip(data);
+		TEST_ASSERT(Compress(data).size() < 50);
+	}
+
+	// Hand-written: the literals "ab", then a match of 8 bytes at offset
+	// 2, then the last literal "c".
+	static const unsigned char stream[] = { 0x24, 'a', 'b', 2, 0, 0x10, 'c' };
+	Bytes compressed(stream, stream + sizeof(stream));
+	Bytes output;
+	TEST_ASSERT(Decompress(compressed, 11, output));
+	TEST_ASSERT(std::string(output.begin(), output.end()) == "ababababab" "c");
+}
+
+static void TestMalformed()
+{
+	static const unsigned char offsetZero[] = { 0x10, 'a', 0, 0, 0x00 };
+	static const unsigned char offsetTooFar[] = { 0x10, 'a', 2, 0, 0x00 };
+	static const unsigned char missingOffset[] = { 0x10, 'a', 1 };
+	static const unsigned char endsAfterMatch[] = { 0x10, 'a', 1, 0 };
+	static const unsigned char literalsPastEnd[] = { 0x50, 'a', 'b' };
+	static const unsigned char lengthPastEnd[] = { 0xF0, 255, 255 };
+	struct { const unsigned char *data; size_t size; size_t outputSize; } cases[] =
+	{
+		{ offsetZero, sizeof(offsetZero), 5 },
+		{ offsetTooFar, sizeof(offsetTooFar), 5 },
+		{ missingOffset, sizeof(missingOffset), 5 },
+		{ endsAfterMatch, sizeof(endsAfterMatch), 5 },
+		{ literalsPastEnd, sizeof(literalsPastEnd), 5 },
+		{ lengthPastEnd, sizeof(lengthPastEnd), 1000 },
+	};
+	for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+	{
+		Bytes compressed(cases[i].data, cases[i].data + cases[i].size);
+		Bytes output;
+		TEST_ASSERT(!Decompress(compressed, cases[i].outputSize, output));
+	}
+}
+
+static void TestBitFlips()
+{
+	Bytes data = MixedBytes(2000);
+	Bytes compressed = Compress(data);
+	TEST_ASSERT(compressed.size() < data.size());
+
+	// A flipped bit in the stream may still decode to the right size, but
+	// must never take the decoder outside its buffers.
+	Bytes output;
+	for (size_t bit = 0; bit < compressed.size() * 8; bit++)
+	{
+		Bytes damaged = compressed;
+		damaged[bit / 8] ^= (unsigned char)(1 << (bit % 8));
+		Decompress(damaged, data.size(), output);
+	}
+
+	// In a blob, the header and the checksum catch every flipped bit that
+	// changes the data. A flip outside the reserved field is accepted only
+	// if it moves a match to an identical copy.
+	Bytes blob, decoded;
+	EncodeWorkbookState(data.data(), data.size(), blob);
+	int corrupted = 0;
+	for (size_t bit = 0; bit < blob.size() * 8; bit++)
+	{
+		size_t byte = bit / 8;
+		if (byte == offsetof(WorkbookStateHeader, reserved) ||
+			byte == offsetof(WorkbookStateHeader, reserved) + 1)
+			continue;
+		Bytes damaged = blob;
+		damaged[byte] ^= (unsigned char)(1 << (bit % 8));
+		if (DecodeWorkbookState(damaged.data(), damaged.size(), decoded) && decoded != data)
+			corrupted++;
+	}
+	TEST_ASSERT(corrupted == 0);
+}
+
+static void TestTruncated()
+{
+	Bytes data = MixedBytes(2000);
+	Bytes compressed = Compress(data);
+	Bytes output;
+	int accepted = 0;
+	for (size_t size = 0; size < compressed.size(); size++)
+	{
+		// Copy the prefix, so that a read past its end is caught.
+		Bytes prefix(compressed.begin(), compressed.begin() + size);
+		if (Decompress(prefix, data.size(), output))
+			accepted++;
+	}
+	TEST_ASSERT(accepted == 0);
+
+	Bytes blob, decoded;
+	EncodeWorkbookState(data.data(), data.size(), blob);
+	accepted = 0;
+	for (size_t size = 0; size < blob.size(); size++)
+	{
+		Bytes prefix(blob.begin(), blob.begin() + size);
+		if (DecodeWorkbookState(prefix.data(), prefix.size(), decoded))
+			accepted++;
+	}
+	TEST_ASSERT(accepted == 0);
+}
+
+static Bytes MakeBlob(unsigned char codec, unsigned int size, const Bytes &body)
+{
+	WorkbookStateHeader header;
+	memcpy(header.magic, "XLWS", 4);
+	header.version = WorkbookStateVersion;
+	header.codec = codec;
+	header.reserved = 0;
+	header.size = size;
+	header.checksum = 0;
+	Bytes blob((const unsigned char *)&header, (const unsigned char *)(&header + 1));
+	blob.insert(blob.end(), body.begin(), body.end());
+	return blob;
+}
+
+static void TestSizeChecks()
+{
+	Bytes decoded;
+
+	// A raw body must be exactly the size in the header.
+	Bytes body(100, 'r');
+	TEST_ASSERT(!DecodeWorkbookState(MakeBlob(WorkbookStateRaw, 99, body).data(), 16 + 100, decoded));
+	TEST_ASSERT(!DecodeWorkbookState(MakeBlob(WorkbookStateRaw, 101, body).data(), 16 + 100, decoded));
+
+	// A compressed body cannot claim more than 255 bytes for each of its
+	// bytes, nor any size near the 2 GB limit, so that a damaged header
+	// does not allocate more than the blob could hold.
+	Bytes small(4, 0);
+	Bytes blob = MakeBlob(WorkbookStateCompressed, 4 * 255 + 255, small);
+	TEST_ASSERT(!DecodeWorkbookState(blob.data(), blob.size(), decoded));
+	TEST_ASSERT(decoded.capacity() < 4 * 255 + 255);
+	blob = MakeBlob(WorkbookStateCompressed, 0xFFFFFFFF, Bytes(20000000, 0));
+	TEST_ASSERT(!DecodeWorkbookState(blob.data(), blob.size(), decoded));
+	TEST_ASSERT(decoded.capacity() < 0xFFFFFFFF);
+	blob = MakeBlob(WorkbookStateRaw, (unsigned int)INT_MAX, Bytes());
+	TEST_ASSERT(!DecodeWorkbookState(blob.data(), blob.size(), decoded));
+
+	// The header itself must be whole and of this version.
+	TEST_ASSERT(!DecodeWorkbookState(blob.data(), 15, decoded));
+	blob = MakeBlob(2, 0, Bytes());
+	TEST_ASSERT(!DecodeWorkbookState(blob.data(), blob.size(), decoded));
+}
+
+int main()
+{
+	TestEmpty();
+	TestTiny();
+	TestIncompressible();
+	TestLongRun();
+	TestOverlappingMatch();
+	TestMalformed();
+	TestBitFlips();
+	TestTruncated();
+	TestSizeChecks();
+	return TestSummary("CompressionTest");
+}
@@ -0,0 +1,258 @@
+////////////////////////////////////////////////////////////////////////////
+// DiffTest.cpp -- compare two profiles with XllProfTool diff
+//
+// The U statistic and p-value of the Mann-Whitney test must agree with
+// scipy.stats.mannwhitneyu(new, base, use_continuity=True,
+// method="asymptotic"), and the diff command must give each function
+// the right verdict and exit with status 3 if any regressed. The command
+// reads and writes files in the current directory.
+
+#include "Commands.h"
+#include "Diff.h"
+#include "TraceFormat.h"
+#include "TestUtil.h"
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <map>
+#include <string>
+#include <vector>
+
+static const char *const BaseFileName = "DiffTest.base";
+static const char *const NewFileName = "DiffTest.new";
+static const char *const OutputFileName = "DiffTest.csv";
+
+static bool IsNear(double x, double y)
+{
+	return fabs(x - y) <= 1e-9 * fabs(y);
+}
+
+static void CheckMannWhitney(const std::vector<double> &base, const std::vector<double> &next,
+	double expectedU, double expectedP)
+{
+	double shift = -1.0;
+	double p = MannWhitneyTest(base, next, shift);
+	TEST_ASSERT(IsNear(shift * base.size() * next.size(), expectedU));
+	TEST_ASSERT(IsNear(p, expectedP));
+}
+
+static void TestMannWhitney()
+{
+	// No ties.
+	CheckMannWhitney(
+		{ 1, 2, 3, 4, 5, 6, 7, 8, 9, 10 },
+		{ 3, 5, 7, 9, 11, 13, 15, 17, 19, 21 },
+		82.0, 0.017090034751250798);
+
+	// Many ties, as in timings quantized to timer ticks.
+	CheckMannWhitney(
+		{ 1, 1, 2, 2, 2, 3, 3, 4, 5, 5, 5, 5 },
+		{ 2, 3, 3, 4, 4, 4, 5, 5, 6, 6, 7 },
+		94.0, 0.08520789927643821);
+
+	// A faster new sample.
+	CheckMannWhitney(
+		{ 10, 12, 11, 13, 12, 14 },
+		{ 9, 8, 10, 7, 9, 11, 8 },
+		2.0, 0.007786320070664483);
+
+	// Identical samples show no shift.
+	double shift;
+	double p = MannWhitneyTest({ 5, 5, 5 }, { 5, 5, 5 }, shift);
+	TEST_ASSERT(p == 1.0);
+	TEST_ASSERT(shift == 0.5);
+}
+
+//
+// Profiles
+//
+
+struct SummaryRow
+{
+	const char *name;
+	double calls;
+	double totalMilliseconds;
+};
+
+static void WriteSummary(const char *fileName, const std::vector<SummaryRow> &rows)
+{
+	FILE *fp = fopen(fileName, "wb");
+	fputs("Function,Calls,Inclusive (ms)\n", fp);
+	for (const SummaryRow &row : rows)
+		fprintf(fp, "%s,%.0f,%.3f\n", row.name, row.calls, row.totalMilliseconds);
+	fclose(fp);
+}
+
+static void WriteChunk(FILE *fp, uint32_t type, const void *data, size_t size)
+{
+	TraceChunkHeader chunk = { type, (uint32_t)size };
+	fwrite(&chunk, sizeof(chunk), 1, fp);
+	fwrite(data, 1, size, fp);
+}
+
+// Writes a trace in event mode, with the time of each call of each
+// function in microseconds. The calls follow one another on one thread.
+static void WriteTrace(const char *fileName,
+	const std::map<std::string, std::vector<double>> &functions)
+{
+	FILE *fp = fopen(fileName, "wb");
+	TraceFileHeader header = { XLL_TRACE_FILE_MAGIC, XLL_TRACE_FILE_VERSION, 1e6, 0, 1, 1 };
+	fwrite(&header, sizeof(header), 1, fp);
+
+	uint32_t functionId = 0;
+	uint64_t ticks = 0;
+	std::vector<TraceCallEvent> calls;
+	for (const auto &kv : functions)
+	{
+		std::vector<char> record(sizeof(TraceFunctionRecord));
+		memcpy(&record[0], &functionId, sizeof(functionId));
+		record.insert(record.end(), kv.first.begin(), kv.first.end());
+		record.insert(record.end(), 3, '\0');
+		WriteChunk(fp, TraceChunkFunction, &record[0], record.size());
+
+		for (double us : kv.second)
+		{
+			TraceCallEvent e = { functionId, 1, ticks, ticks + (uint64_t)us, 1, 0 };
+			calls.push_back(e);
+			ticks += (uint64_t)us + 1;
+		}
+		functionId++;
+	}
+	WriteChunk(fp, TraceChunkCalls, &calls[0], calls.size() * sizeof(TraceCallEvent));
+	fclose(fp);
+}
+
+// Runs the diff command and reads the verdict of each function.
+static int RunDiff(std::vector<const char *> options, std::map<std::string, std::string> &verdicts)
+{
+	std::vector<const char *> args = { BaseFileName, NewFileName, "--output", OutputFileName };
+	args.insert(args.end(), options.begin(), options.end());
+	int status = DiffCommand((int)args.size(), const_cast<char **>(&args[0]));
+
+	verdicts.clear();
+	FILE *fp = fopen(OutputFileName, "rb");
+	if (fp == nullptr)
+		return status;
+	char line[1024];
+	for (bool header = true; fgets(line, sizeof(line), fp) != nullptr; header = false)
+	{
+		if (header)
+			continue;
+
+		// The name is quoted and the verdict is the last field.
+		char *nameEnd = strchr(line + 1, '"');
+		char *verdict = strrchr(line, ',');
+		if (nameEnd == nullptr || verdict == nullptr)
+			continue;
+		verdict[strcspn(verdict, "\r\n")] = '\0';
+		verdicts[std::string(line + 1, nameEnd)] = verdict + 1;
+	}
+	fclose(fp);
+	return status;
+}
+
+static void TestSummaryVerdicts()
+{
+	// Summaries have no call times, so the threshold alone decides.
+	WriteSummary(BaseFileName, {
+		{ "Slower", 100, 100.0 },
+		{ "Faster", 100, 100.0 },
+		{ "Slightly", 100, 100.0 },
+		{ "Rare", 5, 5.0 },
+		{ "Removed", 100, 100.0 },
+	});
+	WriteSummary(NewFileName, {
+		{ "Slower", 100, 150.0 },
+		{ "Faster", 100, 50.0 },
+		{ "Slightly", 100, 105.0 },
+		{ "Rare", 5, 50.0 },
+		{ "Added", 100, 100.0 },
+	});
+
+	std::map<std::string, std::string> verdicts;
+	TEST_ASSERT(RunDiff({}, verdicts) == 3);
+	TEST_ASSERT(verdicts["Slower"] == "regressed");
+	TEST_ASSERT(verdicts["Faster"] == "improved");
+	TEST_ASSERT(verdicts["Slightly"] == "unchanged");
+	TEST_ASSERT(verdicts["Rare"] == "unchanged");
+	TEST_ASSERT(verdicts["Removed"] == "removed");
+	TEST_ASSERT(verdicts["Added"] == "added");
+
+	// A lower threshold catches the smaller change.
+	TEST_ASSERT(RunDiff({ "--threshold", "2" }, verdicts) == 3);
+	TEST_ASSERT(verdicts["Slightly"] == "regressed");
+
+	// A higher one lets every change pass.
+	TEST_ASSERT(RunDiff({ "--threshold", "60" }, verdicts) == 0);
+	TEST_ASSERT(verdicts["Slower"] == "unchanged");
+	TEST_ASSERT(verdicts["Faster"] == "unchanged");
+
+	// Functions called less often than min-calls never regress.
+	TEST_ASSERT(RunDiff({ "--min-calls", "5" }, verdicts) == 3);
+	TEST_ASSERT(verdicts["Rare"] == "regressed");
+	TEST_ASSERT(RunDiff({ "--min-calls", "101", "--threshold", "1" }, verdicts) == 0);
+	TEST_ASSERT(verdicts["Slower"] == "unchanged");
+
+	// Unchanged profiles pass.
+	WriteSummary(NewFileName, { { "Slower", 100, 100.0 }, { "Faster", 100, 99.0 } });
+	TEST_ASSERT(RunDiff({}, verdicts) == 0);
+	TEST_ASSERT(verdicts["Slower"] == "unchanged");
+}
+
+static void TestTraceVerdicts()
+{
+	// The mean doubles with p = 0.0171, and falls by a quarter with
+	// p = 0.0078 (see TestMannWhitney).
+	std::map<std::string, std::vector<double>> base, next;
+	base["Slower"] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10 };
+	next["Slower"] = { 3, 5, 7, 9, 11, 13, 15, 17, 19, 21 };
+	base["Faster"] = { 10, 12, 11, 13, 12, 14 };
+	next["Faster"] = { 9, 8, 10, 7, 9, 11, 8 };
+
+	// The mean grows by 12% because of a single outlier, but most calls
+	// got faster, which is not a regression.
+	base["Outlier"] = { 10, 10, 10, 10, 10, 10, 10, 10, 10, 10 };
+	next["Outlier"] = { 9, 9, 9, 9, 9, 9, 9, 9, 9, 31 };
+	WriteTrace(BaseFileName, base);
+	WriteTrace(NewFileName, next);
+
+	std::map<std::string, std::string> verdicts;
+	TEST_ASSERT(RunDiff({ "--min-calls", "5" }, verdicts) == 0);
+	TEST_ASSERT(verdicts["Slower"] == "unchanged");
+	TEST_ASSERT(verdicts["Faster"] == "improved");
+	TEST_ASSERT(verdicts["Outlier"] == "unchanged");
+
+	// At a level above its p-value, the slowdown is significant.
+	TEST_ASSERT(RunDiff({ "--min-calls", "5", "--alpha", "0.05" }, verdicts) == 3);
+	TEST_ASSERT(verdicts["Slower"] == "regressed");
+	TEST_ASSERT(verdicts["Outlier"] == "unchanged");
+	TEST_ASSERT(RunDiff({ "--min-calls", "5", "--alpha", "0.005" }, verdicts) == 0);
+	TEST_ASSERT(verdicts["Faster"] == "unchanged");
+
+	// Faster has fewer than 10 calls in both profiles.
+	TEST_ASSERT(RunDiff({ "--alpha", "0.05" }, verdicts) == 3);
+	TEST_ASSERT(verdicts["Slower"] == "regressed");
+	TEST_ASSERT(verdicts["Faster"] == "unchanged");
+}
+
+static void TestUsage()
+{
+	std::map<std::string, std::string> verdicts;
+	TEST_ASSERT(RunDiff({ "--alpha", "1" }, verdicts) == 2);
+	TEST_ASSERT(RunDiff({ "--threshold", "-1" }, verdicts) == 2);
+	TEST_ASSERT(RunDiff({ "--metric", "max" }, verdicts) == 2);
+	remove(BaseFileName);
+	TEST_ASSERT(RunDiff({}, verdicts) == 1);
+}
+
+int main()
+{
+	TestMannWhitney();
+	TestSummaryVerdicts();
+	TestTraceVerdicts();
+	TestUsage();
+	remove(BaseFileName);
+	remove(NewFileName);
+	remove(OutputFileName);
+	return TestSummary("DiffTest");
+}
@@ -0,0 +1,106 @@
+////////////////////////////////////////////////////////////////////////////
+// ExecutableMemoryTest.cpp -- patch pointers and code in protected pages
+
+#include "ExecutableMemory.h"
+#include "TestUtil.h"
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Returns the permissions of the mapping that contains address, such as
+// "r--p", from /proc/self/maps.
+static std::string GetPermissions(const void *address)
+{
+	std::string perms;
+	FILE *fp = fopen("/proc/self/maps", "r");
+	if (fp == nullptr)
+		return perms;
+	char line[4096 + 256];
+	while (fgets(line, sizeof(line), fp) != nullptr)
+	{
+		unsigned long begin, end;
+		char buffer[5];
+		if (sscanf(line, "%lx-%lx %4s", &begin, &end, buffer) == 3 &&
+			begin <= (size_t)address && (size_t)address < end)
+		{
+			perms = buffer;
+			break;
+		}
+	}
+	fclose(fp);
+	return perms;
+}
+
+static void TestPatchPointerRestoresProtection()
+{
+	size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+	void **page = (void**)mmap(nullptr, pageSize, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	TEST_ASSERT(page != MAP_FAILED);
+	TEST_ASSERT(mprotect(page, pageSize, PROT_READ) == 0);
+	TEST_ASSERT(GetPermissions(page).compare(0, 3, "r--") == 0);
+
+	int target;
+	TEST_ASSERT(PatchPointer(&page[3], &target));
+	TEST_ASSERT(page[3] == &target);
+	TEST_ASSERT(GetPermissions(page).compare(0, 3, "r--") == 0);
+
+	// A writable page stays writable.
+	TEST_ASSERT(mprotect(page, pageSize, PROT_READ | PROT_WRITE) == 0);
+	TEST_ASSERT(PatchPointer(&page[3], nullptr));
+	TEST_ASSERT(page[3] == nullptr);
+	TEST_ASSERT(GetPermissions(page).compare(0, 3, "rw-") == 0);
+
+	munmap(page, pageSize);
+}
+
+static void TestPatchCodeRestoresProtection()
+{
+	CodeHeap heap;
+	unsigned char *code = static_cast<unsigned char*>(heap.Allocate(32));
+	TEST_ASSERT(code != nullptr);
+	memset(code, 0x90, 32); // NOP
+	code[31] = 0xC3;        // RET
+	size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+	void *page = (void*)((size_t)code & ~(pageSize - 1));
+	TEST_ASSERT(mprotect(page, pageSize, PROT_READ | PROT_EXEC) == 0);
+
+	// A patch within an 8-byte word, and one that spans words.
+	static const unsigned char Short[2] = { 0x66, 0x90 };
+	static const unsigned char Long[12] = { 0x0F, 0x1F, 0x40, 0x00, 0x0F, 0x1F,
+		0x40, 0x00, 0x0F, 0x1F, 0x40, 0x00 };
+	TEST_ASSERT(PatchCode(code, Short, sizeof(Short)));
+	TEST_ASSERT(PatchCode(code + 6, Long, sizeof(Long)));
+	TEST_ASSERT(memcmp(code, Short, sizeof(Short)) == 0);
+	TEST_ASSERT(memcmp(code + 6, Long, sizeof(Long)) == 0);
+	TEST_ASSERT(GetPermissions(code).compare(0, 3, "r-x") == 0);
+
+	((void (*)())code)();
+	TEST_ASSERT(mprotect(page, pageSize, PROT_READ | PROT_WRITE | PROT_EXEC) == 0);
+}
+
+static void TestFreeLastBlock()
+{
+	CodeHeap heap;
+	void *a = heap.Allocate(40);
+	TEST_ASSERT(a != nullptr);
+	heap.Free(a, 40);
+	void *b = heap.Allocate(24);
+	TEST_ASSERT(b == a);
+
+	// Only the last block is given back.
+	void *c = heap.Allocate(16);
+	heap.Free(b, 24);
+	void *d = heap.Allocate(16);
+	TEST_ASSERT(d != b && d != c);
+}
+
+int main()
+{
+	TestFreeLastBlock();
+	TestPatchPointerRestoresProtection();
+	TestPatchCodeRestoresProtection();
+	return TestSummary("ExecutableMemoryTest");
+}
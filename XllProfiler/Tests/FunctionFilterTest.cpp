@@ -0,0 +1,191 @@
+////////////////////////////////////////////////////////////////////////////
+// FunctionFilterTest.cpp -- select the functions to instrument
+//
+// Patterns match with '*' and '?' and ignore case. A function is
+// selected if it matches no exclude rule, and an include rule if there
+// is any. The test writes its rule files in the current directory.
+
+#include "FunctionFilter.h"
+#include "TestUtil.h"
+#include <stdio.h>
+
+static const char *const RuleFileName = "FunctionFilterTest.txt";
+
+static void TestGlob()
+{
+	TEST_ASSERT(MatchGlob(L"", L""));
+	TEST_ASSERT(!MatchGlob(L"", L"a"));
+	TEST_ASSERT(MatchGlob(L"Price", L"Price"));
+	TEST_ASSERT(!MatchGlob(L"Price", L"Prices"));
+	TEST_ASSERT(!MatchGlob(L"Prices", L"Price"));
+
+	// '*' matches any sequence of characters, including none.
+	TEST_ASSERT(MatchGlob(L"*", L""));
+	TEST_ASSERT(MatchGlob(L"*", L"anything"));
+	TEST_ASSERT(MatchGlob(L"Black*", L"Black"));
+	TEST_ASSERT(MatchGlob(L"Black*", L"BlackScholes"));
+	TEST_ASSERT(MatchGlob(L"*Vol", L"ImpliedVol"));
+	TEST_ASSERT(MatchGlob(L"B*k*s", L"BlackScholes"));
+	TEST_ASSERT(!MatchGlob(L"B*k*z", L"BlackScholes"));
+	TEST_ASSERT(MatchGlob(L"**a**", L"a"));
+
+	// A '*' must backtrack when a later part of the pattern fails.
+	TEST_ASSERT(MatchGlob(L"*ab", L"aaab"));
+	TEST_ASSERT(MatchGlob(L"*a*b", L"xaxxab"));
+	TEST_ASSERT(!MatchGlob(L"*ab", L"aaba"));
+
+	// '?' matches exactly one character.
+	TEST_ASSERT(MatchGlob(L"Vol?", L"Vol1"));
+	TEST_ASSERT(!MatchGlob(L"Vol?", L"Vol"));
+	TEST_ASSERT(!MatchGlob(L"Vol?", L"Vol12"));
+	TEST_ASSERT(MatchGlob(L"?*?", L"ab"));
+	TEST_ASSERT(!MatchGlob(L"?*?", L"a"));
+
+	// Case is ignored in both the pattern and the text.
+	TEST_ASSERT(MatchGlob(L"black*", L"BLACKSCHOLES"));
+	TEST_ASSERT(MatchGlob(L"LEGACY*.XLL", L"legacy32.xll"));
+}
+
+static void WriteRules(const char *rules)
+{
+	FILE *fp = fopen(RuleFileName, "wb");
+	fputs(rules, fp);
+	fclose(fp);
+}
+
+static bool LoadRules(FunctionFilter &filter, const char *rules)
+{
+	WriteRules(rules);
+	return filter.Load(L"FunctionFilterTest.txt") != FALSE;
+}
+
+static RegisteredFunctionInfo MakeFunction(const wchar_t *name, const wchar_t *dllName,
+	const wchar_t *typeText)
+{
+	RegisteredFunctionInfo info;
+	info.id = 0;
+	info.functionName = name;
+	info.dllName = dllName;
+	info.typeText = typeText;
+	info.procAddress = nullptr;
+	return info;
+}
+
+static void TestNoRules()
+{
+	FunctionFilter filter;
+	TEST_ASSERT(filter.empty());
+	TEST_ASSERT(filter.IsSelected(MakeFunction(L"Price", L"C:\\Addins\\Pricing.xll", L"BB")));
+
+	TEST_ASSERT(LoadRules(filter, "# only a comment\n\n   \n"));
+	TEST_ASSERT(filter.empty());
+	TEST_ASSERT(filter.IsSelected(MakeFunction(L"Price", L"C:\\Addins\\Pricing.xll", L"BB")));
+
+	TEST_ASSERT(!filter.Load(L"FunctionFilterTest.missing"));
+}
+
+static void TestPrecedence()
+{
+	FunctionFilter filter;
+	TEST_ASSERT(LoadRules(filter,
+		"include name=Black*\n"
+		"include name=Price?\n"
+		"exclude name=*Debug\n"));
+	TEST_ASSERT(!filter.empty());
+
+	// With include rules, only the functions they match are selected.
+	TEST_ASSERT(filter.IsSelected(MakeFunction(L"BlackScholes", L"A.xll", L"BB")));
+	TEST_ASSERT(filter.IsSelected(MakeFunction(L"PriceA", L"A.xll", L"BB")));
+	TEST_ASSERT(!filter.IsSelected(MakeFunction(L"Price", L"A.xll", L"BB")));
+	TEST_ASSERT(!filter.IsSelected(MakeFunction(L"Greeks", L"A.xll", L"BB")));
+
+	// An exclude rule wins over an include rule, whatever their order.
+	TEST_ASSERT(!filter.IsSelected(MakeFunction(L"BlackDebug", L"A.xll", L"BB")));
+	TEST_ASSERT(LoadRules(filter,
+		"exclude name=*Debug\n"
+		"include name=Black*\n"));
+	TEST_ASSERT(!filter.IsSelected(MakeFunction(L"BlackDebug", L"A.xll", L"BB")));
+	TEST_ASSERT(filter.IsSelected(MakeFunction(L"BlackScholes", L"A.xll", L"BB")));
+
+	// Without include rules, every function not excluded is selected.
+	TEST_ASSERT(LoadRules(filter, "exclude name=*Debug\n"));
+	TEST_ASSERT(filter.IsSelected(MakeFunction(L"Greeks", L"A.xll", L"BB")));
+	TEST_ASSERT(!filter.IsSelected(MakeFunction(L"GreeksDEBUG", L"A.xll", L"BB")));
+
+	// Loading replaces the previous rules.
+	TEST_ASSERT(LoadRules(filter, "include name=Greeks\n"));
+	TEST_ASSERT(!filter.IsSelected(MakeFunction(L"GreeksDebug", L"A.xll", L"BB")));
+	TEST_ASSERT(filter.IsSelected(MakeFunction(L"greeks", L"A.xll", L"BB")));
+}
+
+static void TestDll()
+{
+	FunctionFilter filter;
+
+	// Without a backslash, the pattern matches the file name of the XLL.
+	TEST_ASSERT(LoadRules(filter, "exclude dll=Legacy*.xll\n"));
+	TEST_ASSERT(!filter.IsSelected(MakeFunction(L"F", L"C:\\Addins\\Legacy32.xll", L"BB")));
+	TEST_ASSERT(!filter.IsSelected(MakeFunction(L"F", L"Legacy.xll", L"BB")));
+	TEST_ASSERT(filter.IsSelected(MakeFunction(L"F", L"C:\\Legacy\\Pricing.xll", L"BB")));
+
+	// With one, it matches the whole path.
+	TEST_ASSERT(LoadRules(filter, "include dll=C:\\Legacy\\*\n"));
+	TEST_ASSERT(filter.IsSelected(MakeFunction(L"F", L"c:\\legacy\\Pricing.xll", L"BB")));
+	TEST_ASSERT(!filter.IsSelected(MakeFunction(L"F", L"C:\\Addins\\Legacy.xll", L"BB")));
+}
+
+static void TestCategory()
+{
+	FunctionFilter filter;
+	TEST_ASSERT(LoadRules(filter,
+		"include category=threadsafe\n"
+		"exclude category=volatile\n"));
+	TEST_ASSERT(filter.IsSelected(MakeFunction(L"F", L"A.xll", L"BB$")));
+	TEST_ASSERT(!filter.IsSelected(MakeFunction(L"F", L"A.xll", L"BB")));
+	TEST_ASSERT(!filter.IsSelected(MakeFunction(L"F", L"A.xll", L"BB!$")));
+
+	// The pattern matches the name of the category, not the code.
+	TEST_ASSERT(LoadRules(filter, "include category=A*\n"));
+	TEST_ASSERT(filter.IsSelected(MakeFunction(L"F", L"A.xll", L">QX")));
+	TEST_ASSERT(!filter.IsSelected(MakeFunction(L"F", L"A.xll", L"QQ#")));
+	TEST_ASSERT(LoadRules(filter, "exclude category=MACRO\ninclude category=*\n"));
+	TEST_ASSERT(!filter.IsSelected(MakeFunction(L"F", L"A.xll", L"QQ#")));
+	TEST_ASSERT(filter.IsSelected(MakeFunction(L"F", L"A.xll", L"QQ&")));
+	TEST_ASSERT(!filter.IsSelected(MakeFunction(L"F", L"A.xll", L"QQ")));
+}
+
+static void TestInvalidLines()
+{
+	// Malformed lines are ignored, and the valid ones around them kept.
+	// Unlike patterns, the keywords are case-sensitive.
+	FunctionFilter filter;
+	TEST_ASSERT(LoadRules(filter,
+		"include name=\n"
+		"include\n"
+		"name=Price\n"
+		"select name=Price\n"
+		"include title=Price\n"
+		"include=Price\n"
+		"Include name=Price\n"
+		"  include   name = Black*  \r\n"
+		"exclude dll Legacy.xll\n"));
+	TEST_ASSERT(filter.IsSelected(MakeFunction(L"BlackScholes", L"Legacy.xll", L"BB")));
+	TEST_ASSERT(!filter.IsSelected(MakeFunction(L"Price", L"A.xll", L"BB")));
+
+	// A file of malformed lines selects every function.
+	TEST_ASSERT(LoadRules(filter, "include name\nexclude\n"));
+	TEST_ASSERT(filter.empty());
+	TEST_ASSERT(filter.IsSelected(MakeFunction(L"Price", L"A.xll", L"BB")));
+}
+
+int main()
+{
+	TestGlob();
+	TestNoRules();
+	TestPrecedence();
+	TestDll();
+	TestCategory();
+	TestInvalidLines();
+	remove(RuleFileName);
+	return TestSummary("FunctionFilterTest");
+}
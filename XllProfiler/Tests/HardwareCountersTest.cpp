@@ -0,0 +1,87 @@
+////////////////////////////////////////////////////////////////////////////
+// HardwareCountersTest.cpp -- read the processor counters of a thread
+//
+// The counters that the system provides must count up around a loop,
+// and the others must read as zero. A system without a PMU, such as
+// most virtual machines, has none, which the profiler must detect
+// before it enables hardware counting.
+
+#include "HardwareCounters.h"
+#include "TestUtil.h"
+#include <thread>
+
+static volatile double s_sink;
+
+static void Work()
+{
+	double x = 1.0;
+	for (int i = 0; i < 1000000; i++)
+	{
+		x = x * 1.0000001 + (i & 7);
+		if (x > 1e9)
+			x = 1.0;
+	}
+	s_sink = x;
+}
+
+static void TestCountersCountUp()
+{
+	HardwareCounterSet set;
+	unsigned int available = set.Open();
+	TEST_ASSERT(set.GetAvailable() == available);
+	TEST_ASSERT(GetAvailableHardwareCounters() == available);
+
+	uint64_t before[HardwareCounterCount], after[HardwareCounterCount];
+	set.Read(before);
+	Work();
+	set.Read(after);
+	for (int i = 0; i < HardwareCounterCount; i++)
+	{
+		if (available & (1u << i))
+		{
+			TEST_ASSERT(after[i] >= before[i]);
+		}
+		else
+		{
+			TEST_ASSERT(before[i] == 0 && after[i] == 0);
+		}
+	}
+	if ((available & RequiredHardwareCounters) == RequiredHardwareCounters)
+	{
+		TEST_ASSERT(after[HardwareInstructions] - before[HardwareInstructions] >= 1000000);
+		TEST_ASSERT(after[HardwareCycles] > before[HardwareCycles]);
+	}
+	else
+	{
+		printf("HardwareCountersTest: cycles and instructions are not available (mask %#x); "
+			"hardware counting cannot be enabled on this system\n", available);
+	}
+
+	set.Close();
+	TEST_ASSERT(set.GetAvailable() == 0);
+	set.Read(after);
+	for (int i = 0; i < HardwareCounterCount; i++)
+		TEST_ASSERT(after[i] == 0);
+}
+
+// Each thread opens its own set.
+static void TestPerThreadSets()
+{
+	unsigned int mainAvailable = GetAvailableHardwareCounters();
+	unsigned int threadAvailable = 0;
+	std::thread thread([&threadAvailable]()
+	{
+		HardwareCounterSet set;
+		threadAvailable = set.Open();
+		Work();
+	});
+	thread.join();
+	TEST_ASSERT(threadAvailable == mainAvailable);
+}
+
+int main()
+{
+	TestCountersCountUp();
+	TestPerThreadSets();
+	return TestSummary("HardwareCountersTest");
+}
@@ -0,0 +1,169 @@
+////////////////////////////////////////////////////////////////////////////
+// InstructionDecoderTest.cpp -- decode a corpus of x86 and x64 instructions
+//
+// Each entry gives the bytes of one instruction, as a compiler or an
+// assembler emits them, and what the decoder must find: its length,
+// how it changes the flow of control, and where its relative operand
+// is. The lengths agree with objdump.
+
+#include "InstructionDecoder.h"
+#include "TestUtil.h"
+#include <stdlib.h>
+#include <string.h>
+
+struct CorpusEntry
+{
+	bool is64Bit;
+	const char *bytes;      // hex, separated by spaces
+	size_t length;          // 0 if the bytes are not a valid instruction
+	InstructionFlow flow;
+	size_t relativeOffset;
+	size_t relativeSize;
+	bool isRipRelative;
+};
+
+static const CorpusEntry Corpus[] =
+{
+	// Prologues and epilogues.
+	{ true, "55", 1, FlowNext, 0, 0, false },                                      // push rbp
+	{ true, "48 89 E5", 3, FlowNext, 0, 0, false },                                // mov rbp, rsp
+	{ true, "F3 0F 1E FA", 4, FlowNext, 0, 0, false },                             // endbr64
+	{ true, "48 83 EC 20", 4, FlowNext, 0, 0, false },                             // sub rsp, 20h
+	{ true, "44 8B 44 24 28", 5, FlowNext, 0, 0, false },                          // mov r8d, [rsp+28h]
+	{ true, "4C 8B 8C 24 00 01 00 00", 8, FlowNext, 0, 0, false },                 // mov r9, [rsp+100h]
+	{ true, "C3", 1, FlowReturn, 0, 0, false },                                    // ret
+	{ true, "C2 08 00", 3, FlowReturn, 0, 0, false },                              // ret 8
+
+	// RIP-relative memory operands.
+	{ true, "48 8B 05 10 00 00 00", 7, FlowNext, 3, 4, true },                     // mov rax, [rip+10h]
+	{ true, "48 8D 0D 00 01 00 00", 7, FlowNext, 3, 4, true },                     // lea rcx, [rip+100h]
+	{ true, "66 0F 6F 05 20 00 00 00", 8, FlowNext, 4, 4, true },                  // movdqa xmm0, [rip+20h]
+	{ true, "F0 48 0F B1 0D 00 10 00 00", 9, FlowNext, 5, 4, true },               // lock cmpxchg [rip+1000h], rcx
+	{ true, "67 8B 05 08 00 00 00", 7, FlowNext, 3, 4, true },                     // mov eax, [eip+8]
+	{ true, "FF 25 00 00 00 00", 6, FlowIndirectJump, 2, 4, true },                // jmp [rip]
+
+	// Relative branches.
+	{ true, "E8 00 00 00 00", 5, FlowCall, 1, 4, false },                          // call rel32
+	{ true, "E9 10 00 00 00", 5, FlowJump, 1, 4, false },                          // jmp rel32
+	{ true, "EB 10", 2, FlowJump, 1, 1, false },                                   // jmp rel8
+	{ true, "74 05", 2, FlowConditionalJump, 1, 1, false },                        // je rel8
+	{ true, "0F 84 00 01 00 00", 6, FlowConditionalJump, 2, 4, false },            // je rel32
+	{ true, "E3 02", 2, FlowLoop, 1, 1, false },                                   // jrcxz rel8
+
+	// Indirect branches, traps.
+	{ true, "FF D0", 2, FlowNext, 0, 0, false },                                   // call rax
+	{ true, "41 FF D3", 3, FlowNext, 0, 0, false },                                // call r11
+	{ true, "FF E0", 2, FlowIndirectJump, 0, 0, false },                           // jmp rax
+	{ true, "CC", 1, FlowStop, 0, 0, false },                                      // int3
+	{ true, "0F 0B", 2, FlowStop, 0, 0, false },                                   // ud2
+	{ true, "0F 05", 2, FlowNext, 0, 0, false },                                   // syscall
+
+	// Immediates.
+	{ true, "48 B8 88 77 66 55 44 33 22 11", 10, FlowNext, 0, 0, false },          // mov rax, imm64
+	{ true, "48 A1 88 77 66 55 44 33 22 11", 10, FlowNext, 0, 0, false },          // mov rax, [moffs64]
+	{ true, "F7 C1 00 00 01 00", 6, FlowNext, 0, 0, false },                       // test ecx, imm32
+	{ true, "F6 C1 01", 3, FlowNext, 0, 0, false },                                // test cl, 1
+	{ true, "F7 D8", 2, FlowNext, 0, 0, false },                                   // neg eax
+	{ true, "66 C7 45 F0 34 12", 6, FlowNext, 0, 0, false },                       // mov word [rbp-10h], imm16
+	{ true, "48 69 C0 E8 03 00 00", 7, FlowNext, 0, 0, false },                    // imul rax, rax, imm32
+	{ true, "0F 1F 44 00 00", 5, FlowNext, 0, 0, false },                          // nop dword [rax+rax]
+	{ true, "66 0F 1F 84 00 00 00 00 00", 9, FlowNext, 0, 0, false },              // nop word [rax+rax+0]
+
+	// Three-byte maps, VEX and EVEX.
+	{ true, "66 0F 38 00 C1", 5, FlowNext, 0, 0, false },                          // pshufb xmm0, xmm1
+	{ true, "66 0F 3A 0F C1 08", 6, FlowNext, 0, 0, false },                       // palignr xmm0, xmm1, 8
+	{ true, "C5 F8 77", 3, FlowNext, 0, 0, false },                                // vzeroupper
+	{ true, "C5 FD 6F 05 40 00 00 00", 8, FlowNext, 4, 4, true },                  // vmovdqa ymm0, [rip+40h]
+	{ true, "C4 E3 7D 18 C1 01", 6, FlowNext, 0, 0, false },                       // vinsertf128 ymm0, ymm0, xmm1, 1
+	{ true, "C4 E2 79 18 05 04 00 00 00", 9, FlowNext, 5, 4, true },               // vbroadcastss xmm0, [rip+4]
+	{ true, "62 F1 7C 48 28 05 40 00 00 00", 10, FlowNext, 6, 4, true },           // vmovaps zmm0, [rip+40h]
+
+	// Invalid in 64-bit mode.
+	{ true, "06", 0, FlowNext, 0, 0, false },                                      // push es
+	{ true, "9A 00 00 00 00 08 00", 0, FlowNext, 0, 0, false },                    // call far
+
+	// 32-bit mode.
+	{ false, "55", 1, FlowNext, 0, 0, false },                                     // push ebp
+	{ false, "40", 1, FlowNext, 0, 0, false },                                     // inc eax
+	{ false, "06", 1, FlowNext, 0, 0, false },                                     // push es
+	{ false, "68 00 10 00 00", 5, FlowNext, 0, 0, false },                         // push imm32
+	{ false, "8B 44 24 04", 4, FlowNext, 0, 0, false },                            // mov eax, [esp+4]
+	{ false, "8B 05 00 10 00 00", 6, FlowNext, 0, 0, false },                      // mov eax, [1000h]
+	{ false, "67 8B 46 02", 4, FlowNext, 0, 0, false },                            // mov eax, [bp+2]
+	{ false, "FF 25 00 10 00 00", 6, FlowIndirectJump, 0, 0, false },              // jmp [1000h]
+	{ false, "E8 00 00 00 00", 5, FlowCall, 1, 4, false },                         // call rel32
+	{ false, "66 E9 34 12", 4, FlowJump, 2, 2, false },                            // jmp rel16
+	{ false, "E2 FE", 2, FlowLoop, 1, 1, false },                                  // loop rel8
+	{ false, "C4 06", 2, FlowNext, 0, 0, false },                                  // les eax, [esi]
+	{ false, "C5 F8 77", 3, FlowNext, 0, 0, false },                               // vzeroupper
+	{ false, "9A 00 00 00 00 08 00", 7, FlowStop, 0, 0, false },                   // call far
+};
+
+// Parses the hex bytes of an entry into code, padded with NOPs so
+// that the decoder may read ahead. Returns the number of bytes.
+static size_t ParseBytes(const char *text, unsigned char (&code)[32])
+{
+	memset(code, 0x90, sizeof(code));
+	size_t n = 0;
+	char *end;
+	for (const char *p = text; *p != '\0' && n < sizeof(code); p = end)
+	{
+		code[n++] = (unsigned char)strtoul(p, &end, 16);
+		if (end == p)
+			break;
+	}
+	return n;
+}
+
+static void TestCorpus()
+{
+	for (const CorpusEntry &entry : Corpus)
+	{
+		unsigned char code[32];
+		size_t size = ParseBytes(entry.bytes, code);
+
+		DecodedInstruction insn;
+		bool ok = DecodeInstruction(code, entry.is64Bit, insn);
+		if (entry.length == 0)
+		{
+			if (ok)
+				fprintf(stderr, "%s: decoded an invalid instruction\n", entry.bytes);
+			TEST_ASSERT(!ok);
+			continue;
+		}
+
+		if (!ok || insn.length != entry.length || insn.flow != entry.flow ||
+			insn.relativeOffset != entry.relativeOffset ||
+			insn.relativeSize != entry.relativeSize ||
+			insn.isRipRelative != entry.isRipRelative)
+		{
+			fprintf(stderr, "%s (%d-bit): length %d, flow %d, relative %d+%d%s\n",
+				entry.bytes, entry.is64Bit ? 64 : 32, ok ? (int)insn.length : -1,
+				(int)insn.flow, (int)insn.relativeOffset, (int)insn.relativeSize,
+				insn.isRipRelative ? " rip" : "");
+		}
+		TEST_ASSERT(ok);
+		TEST_ASSERT(insn.length == entry.length && insn.length == size);
+		TEST_ASSERT(insn.flow == entry.flow);
+		TEST_ASSERT(insn.relativeOffset == entry.relativeOffset);
+		TEST_ASSERT(insn.relativeSize == entry.relativeSize);
+		TEST_ASSERT(insn.isRipRelative == entry.isRipRelative);
+	}
+}
+
+// More than 15 bytes of prefixes are not an instruction.
+static void TestTooLong()
+{
+	unsigned char code[32];
+	memset(code, 0x66, sizeof(code));
+	DecodedInstruction insn;
+	TEST_ASSERT(!DecodeInstruction(code, true, insn));
+	TEST_ASSERT(!DecodeInstruction(code, false, insn));
+}
+
+int main()
+{
+	TestCorpus();
+	TestTooLong();
+	return TestSummary("InstructionDecoderTest");
+}
@@ -0,0 +1,177 @@
+////////////////////////////////////////////////////////////////////////////
+// ShadowStackTest.cpp -- stress the per-thread shadow call stacks
+//
+// Several threads make deeply nested calls through two instrumented
+// procedures that call each other. Each after-call handler checks that
+// it is paired with the before-call handler of the same call, by the
+// arguments and the return value, and calls deeper than the capacity
+// of the shadow stack must be passed through and counted. Meanwhile
+// the thunks are disabled and enabled again, which must not disturb
+// calls in progress.
+
+#include "ThunkManager.h"
+#include "TestUtil.h"
+#include <atomic>
+#include <random>
+#include <thread>
+#include <vector>
+
+#define TEST_PROCEDURE extern "C" __attribute__((noinline, optimize("O0")))
+
+TEST_PROCEDURE long Ping(long depth, long x);
+TEST_PROCEDURE long Pong(long depth, long x);
+
+static long (*volatile s_ping)(long, long) = &Ping;
+static long (*volatile s_pong)(long, long) = &Pong;
+
+TEST_PROCEDURE long Ping(long depth, long x)
+{
+	return (depth == 0) ? x : s_pong(depth - 1, x * 3 + 1) + 1;
+}
+
+TEST_PROCEDURE long Pong(long depth, long x)
+{
+	return (depth == 0) ? x : s_ping(depth - 1, x ^ 5) + 2;
+}
+
+// Same as Ping() and Pong(), not instrumented.
+static long Expected(bool isPing, long depth, long x)
+{
+	if (depth == 0)
+		return x;
+	return isPing ? Expected(false, depth - 1, x * 3 + 1) + 1 :
+		Expected(true, depth - 1, x ^ 5) + 2;
+}
+
+struct PendingCall
+{
+	bool isPing;
+	long depth;
+	long x;
+};
+
+static thread_local std::vector<PendingCall> t_pendingCalls;
+static std::atomic<long> s_mismatches(0);
+static std::atomic<long> s_instrumentedCalls(0);
+
+static int s_pingCookie, s_pongCookie;
+
+static void BeforeCall(ThunkInfo *pThunkInfo, void *, ThunkArguments &args)
+{
+	PendingCall call;
+	call.isPing = (pThunkInfo->cookie == &s_pingCookie);
+	call.depth = (long)args.NextInteger();
+	call.x = (long)args.NextInteger();
+	t_pendingCalls.push_back(call);
+}
+
+static void AfterCall(ThunkInfo *pThunkInfo, const ThunkReturnValue &returnValue)
+{
+	if (t_pendingCalls.empty())
+	{
+		++s_mismatches;
+		return;
+	}
+	PendingCall call = t_pendingCalls.back();
+	t_pendingCalls.pop_back();
+	if (call.isPing != (pThunkInfo->cookie == &s_pingCookie) ||
+		(long)returnValue.integer != Expected(call.isPing, call.depth, call.x))
+	{
+		++s_mismatches;
+	}
+	++s_instrumentedCalls;
+}
+
+static const int ThreadCount = 8;
+static const int CallsPerThread = 2000;
+static const long MaxDepth = THUNK_CALL_STACK_CAPACITY + 64;
+
+// Makes calls of random depth, and returns the number of calls that
+// are too deep for the shadow stack.
+static unsigned long long RunCalls(unsigned int seed, std::atomic<long> &wrongResults)
+{
+	std::mt19937 engine(seed);
+	std::uniform_int_distribution<long> depths(0, MaxDepth);
+	unsigned long long bypassed = 0;
+	for (int i = 0; i < CallsPerThread; i++)
+	{
+		long depth = depths(engine);
+		long x = (long)engine() & 0xFFFF;
+		if (s_ping(depth, x) != Expected(true, depth, x))
+			++wrongResults;
+		// Calls at depth 0..depth are made; those from the capacity on
+		// are passed through.
+		if (depth + 1 > THUNK_CALL_STACK_CAPACITY)
+			bypassed += depth + 1 - THUNK_CALL_STACK_CAPACITY;
+	}
+	if (!t_pendingCalls.empty())
+		++s_mismatches;
+	ThunkManager::ReleaseThreadState();
+	return bypassed;
+}
+
+static void TestConcurrentCalls(ThunkInfo *ping, ThunkInfo *pong, bool toggle)
+{
+	std::atomic<long> wrongResults(0);
+	std::atomic<unsigned long long> expectedBypassed(0);
+	std::atomic<bool> done(false);
+	unsigned long long bypassedBefore = ThunkManager::GetBypassedCallCount();
+	s_mismatches = 0;
+	s_instrumentedCalls = 0;
+
+	std::vector<std::thread> threads;
+	for (int t = 0; t < ThreadCount; t++)
+	{
+		threads.emplace_back([t, &wrongResults, &expectedBypassed]()
+		{
+			expectedBypassed += RunCalls(1234 + t, wrongResults);
+		});
+	}
+
+	std::thread toggler;
+	if (toggle)
+	{
+		toggler = std::thread([ping, pong, &done]()
+		{
+			for (bool enable = false; !done; enable = !enable)
+			{
+				ThunkManager::EnableThunk(ping, enable);
+				ThunkManager::EnableThunk(pong, !enable);
+				std::this_thread::yield();
+			}
+			ThunkManager::EnableThunk(ping, true);
+			ThunkManager::EnableThunk(pong, true);
+		});
+	}
+
+	for (std::thread &thread : threads)
+		thread.join();
+	done = true;
+	if (toggler.joinable())
+		toggler.join();
+
+	TEST_ASSERT(wrongResults == 0);
+	TEST_ASSERT(s_mismatches == 0);
+	TEST_ASSERT(s_instrumentedCalls > 0);
+	if (!toggle)
+	{
+		TEST_ASSERT(ThunkManager::GetBypassedCallCount() - bypassedBefore == expectedBypassed);
+	}
+}
+
+int main()
+{
+	ThunkManager manager;
+	ThunkInfo *ping = manager.InstallThunk(nullptr, (FARPROC)&Ping, &s_pingCookie, BeforeCall, AfterCall);
+	ThunkInfo *pong = manager.InstallThunk(nullptr, (FARPROC)&Pong, &s_pongCookie, BeforeCall, AfterCall);
+	TEST_ASSERT(ping != nullptr && pong != nullptr);
+	if (ping == nullptr || pong == nullptr)
+		return TestSummary("ShadowStackTest");
+
+	TestConcurrentCalls(ping, pong, false);
+	TestConcurrentCalls(ping, pong, true);
+
+	TEST_ASSERT(manager.UninstallThunk(ping));
+	TEST_ASSERT(manager.UninstallThunk(pong));
+	return TestSummary("ShadowStackTest");
+}
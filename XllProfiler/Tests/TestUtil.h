@@ -0,0 +1,30 @@
+////////////////////////////////////////////////////////////////////////////
+// TestUtil.h -- minimal assertions for the XllProfiler tests
+//
+// Each test is a program that returns zero if all its assertions hold.
+// A failed assertion is reported and the test goes on.
+
+#pragma once
+
+#include <stdio.h>
+
+static int s_testAssertions;
+static int s_testFailures;
+
+#define TEST_ASSERT(condition) \
+	do \
+	{ \
+		++s_testAssertions; \
+		if (!(condition)) \
+		{ \
+			++s_testFailures; \
+			fprintf(stderr, "%s(%d): assertion failed: %s\n", __FILE__, __LINE__, #condition); \
+		} \
+	} while (0)
+
+// Prints the result of the test and returns the exit code.
+inline int TestSummary(const char *name)
+{
+	printf("%s: %d assertions, %d failed\n", name, s_testAssertions, s_testFailures);
+	return (s_testFailures == 0) ? 0 : 1;
+}
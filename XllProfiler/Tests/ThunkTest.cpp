@@ -0,0 +1,167 @@
+////////////////////////////////////////////////////////////////////////////
+// ThunkTest.cpp -- call instrumented procedures through the System V thunk
+//
+// Hooks procedures of this program inline and checks that the handlers
+// see the integer and floating-point arguments, in registers and on
+// the stack, and the return value, and that the caller still gets the
+// result of the procedure.
+
+#include "ThunkManager.h"
+#include "TestUtil.h"
+#include <string.h>
+
+#define TEST_PROCEDURE extern "C" __attribute__((noinline, optimize("O0")))
+
+TEST_PROCEDURE long AddIntegers(long a, long b, long c, long d, long e,
+	long f, long g, long h)
+{
+	return a + 2 * b + 3 * c + 4 * d + 5 * e + 6 * f + 7 * g + 8 * h;
+}
+
+TEST_PROCEDURE double AddDoubles(double x1, double x2, double x3, double x4,
+	double x5, double x6, double x7, double x8, double x9, double x10)
+{
+	return x1 + 2 * x2 + 3 * x3 + 4 * x4 + 5 * x5 + 6 * x6 + 7 * x7 + 8 * x8
+		+ 9 * x9 + 10 * x10;
+}
+
+TEST_PROCEDURE double Mixed(int n, double x, const char *s, double y, long m)
+{
+	return n * x + (double)strlen(s) * y + (double)m;
+}
+
+// Argument kinds of a procedure, one character per argument: 'i' for
+// an integer or pointer and 'd' for a double.
+struct Recorder
+{
+	const char *signature;
+	size_t integers[16];
+	double doubles[16];
+	int calls;
+	ThunkReturnValue result;
+	int returns;
+};
+
+static void BeforeCall(ThunkInfo *pThunkInfo, void *, ThunkArguments &args)
+{
+	Recorder *r = static_cast<Recorder*>(pThunkInfo->cookie);
+	for (int i = 0; r->signature[i] != '\0'; i++)
+	{
+		if (r->signature[i] == 'd')
+			r->doubles[i] = args.NextDouble();
+		else
+			r->integers[i] = args.NextInteger();
+	}
+	r->calls++;
+}
+
+static void AfterCall(ThunkInfo *pThunkInfo, const ThunkReturnValue &returnValue)
+{
+	Recorder *r = static_cast<Recorder*>(pThunkInfo->cookie);
+	r->result = returnValue;
+	r->returns++;
+}
+
+template <typename Proc>
+static ThunkInfo* Install(ThunkManager &manager, Proc proc, Recorder &recorder)
+{
+	return manager.InstallThunk(nullptr, (FARPROC)proc, &recorder, BeforeCall, AfterCall);
+}
+
+static void TestIntegerArguments(ThunkManager &manager)
+{
+	Recorder r = { "iiiiiiii" };
+	ThunkInfo *thunk = Install(manager, &AddIntegers, r);
+	TEST_ASSERT(thunk != nullptr);
+
+	long (*volatile proc)(long, long, long, long, long, long, long, long) = &AddIntegers;
+	long result = proc(1, 2, 3, 4, 5, 6, 7, -8);
+	TEST_ASSERT(result == 1 + 4 + 9 + 16 + 25 + 36 + 49 - 64);
+	TEST_ASSERT(r.calls == 1 && r.returns == 1);
+	for (int i = 0; i < 7; i++)
+		TEST_ASSERT(r.integers[i] == (size_t)(i + 1));
+	TEST_ASSERT((long)r.integers[7] == -8);
+	TEST_ASSERT((long)r.result.integer == result);
+
+	TEST_ASSERT(manager.UninstallThunk(thunk));
+	TEST_ASSERT(proc(1, 1, 1, 1, 1, 1, 1, 1) == 36);
+	TEST_ASSERT(r.calls == 1);
+}
+
+static void TestDoubleArguments(ThunkManager &manager)
+{
+	Recorder r = { "dddddddddd" };
+	ThunkInfo *thunk = Install(manager, &AddDoubles, r);
+	TEST_ASSERT(thunk != nullptr);
+
+	double (*volatile proc)(double, double, double, double, double, double,
+		double, double, double, double) = &AddDoubles;
+	double result = proc(0.5, 1.5, 2.5, 3.5, 4.5, 5.5, 6.5, 7.5, 8.5, 9.5);
+	double expected = 0;
+	for (int i = 0; i < 10; i++)
+		expected += (i + 1) * (i + 0.5);
+	TEST_ASSERT(result == expected);
+	TEST_ASSERT(r.calls == 1 && r.returns == 1);
+	for (int i = 0; i < 10; i++)
+		TEST_ASSERT(r.doubles[i] == i + 0.5);
+	TEST_ASSERT(r.result.floating == result);
+
+	TEST_ASSERT(manager.UninstallThunk(thunk));
+}
+
+static void TestMixedArguments(ThunkManager &manager)
+{
+	Recorder r = { "idids" };
+	ThunkInfo *thunk = Install(manager, &Mixed, r);
+	TEST_ASSERT(thunk != nullptr);
+
+	double (*volatile proc)(int, double, const char *, double, long) = &Mixed;
+	const char *text = "thunk";
+	double result = proc(3, 0.25, text, 2.0, 100);
+	TEST_ASSERT(result == 3 * 0.25 + 5 * 2.0 + 100);
+	TEST_ASSERT(r.calls == 1 && r.returns == 1);
+	TEST_ASSERT((int)r.integers[0] == 3);
+	TEST_ASSERT(r.doubles[1] == 0.25);
+	TEST_ASSERT((const char *)r.integers[2] == text);
+	TEST_ASSERT(r.doubles[3] == 2.0);
+	TEST_ASSERT((long)r.integers[4] == 100);
+	TEST_ASSERT(r.result.floating == result);
+
+	// A disabled thunk passes calls through.
+	TEST_ASSERT(ThunkManager::EnableThunk(thunk, false));
+	TEST_ASSERT(!ThunkManager::IsThunkEnabled(thunk));
+	TEST_ASSERT(proc(1, 1.0, "", 0.0, 1) == 2.0);
+	TEST_ASSERT(r.calls == 1);
+	TEST_ASSERT(ThunkManager::EnableThunk(thunk, true));
+	TEST_ASSERT(proc(1, 1.0, "", 0.0, 1) == 2.0);
+	TEST_ASSERT(r.calls == 2);
+
+	TEST_ASSERT(manager.UninstallThunk(thunk));
+}
+
+// A procedure whose first instructions cannot be moved is not hooked,
+// and the code generated for it is given back.
+static void TestUnhookableProcedure(ThunkManager &manager)
+{
+	CodeHeap heap;
+	unsigned char *code = static_cast<unsigned char*>(heap.Allocate(16));
+	TEST_ASSERT(code != nullptr);
+	static const unsigned char Ret[16] = { 0xC3, 0xCC, 0xCC, 0xCC, 0xCC, 0xCC };
+	memcpy(code, Ret, sizeof(Ret));
+
+	Recorder r = { "" };
+	TEST_ASSERT(manager.InstallThunk(nullptr, (FARPROC)code, &r, BeforeCall, AfterCall) == nullptr);
+	TEST_ASSERT(code[0] == 0xC3);
+	((void (*)())code)();
+	TEST_ASSERT(r.calls == 0);
+}
+
+int main()
+{
+	ThunkManager manager;
+	TestUnhookableProcedure(manager);
+	TestIntegerArguments(manager);
+	TestDoubleArguments(manager);
+	TestMixedArguments(manager);
+	return TestSummary("ThunkTest");
+}
@@ -2,8 +2,20 @@
 // ThunkManager.cpp -- instrument DLL routines through thunking
 
 #include "ThunkManager.h"
+#include "InstructionDecoder.h"
 #include <string>
-#include <stack>
+#include <atomic>
+#include <algorithm>
+#include <new>
+#include <initializer_list>
+#include <stddef.h>
+#include <string.h>
+
+#if defined(_MSC_VER)
+#define THUNK_THREAD_LOCAL __declspec(thread)
+#else
+#define THUNK_THREAD_LOCAL __thread
+#endif
 
 struct CallStackEntry
 {
@@ -11,9 +23,47 @@ struct CallStackEntry
 	void *returnAddress;
 };
 
-static std::stack<CallStackEntry> thunkCallStack;
+//
+// ThunkCallStack
+//
+// Shadow stack of the instrumented calls in progress on a thread. The
+// thunk replaces the return address of each instrumented call, so the
+// real one is kept here until the procedure returns. Calls nest when a
+// procedure calls back into Excel, which in turn calls another
+// instrumented procedure on the same thread.
+//
+// Each thread allocates its stack on its first instrumented call and
+// never again; it is freed when the thread exits. If the stack is full
+// (or cannot be allocated), the call is passed through to the procedure
+// without instrumentation.
+//
 
-static void DefaultBeforeCallHandler(ThunkInfo *pThunkInfo, void *returnAddress, va_list)
+struct ThunkCallStack
+{
+	size_t depth;
+	CallStackEntry entries[THUNK_CALL_STACK_CAPACITY];
+};
+
+static THUNK_THREAD_LOCAL ThunkCallStack *t_callStack;
+
+static std::atomic<unsigned long long> s_bypassedCallCount(0);
+
+static ThunkCallStack* GetCallStack()
+{
+	ThunkCallStack *callStack = t_callStack;
+	if (callStack == nullptr)
+	{
+		callStack = new (std::nothrow) ThunkCallStack;
+		if (callStack == nullptr)
+			return nullptr;
+		callStack->depth = 0;
+		t_callStack = callStack;
+	}
+	return callStack;
+}
+
+#if defined(_WIN32)
+static void DefaultBeforeCallHandler(ThunkInfo *pThunkInfo, void *returnAddress, ThunkArguments &)
 {
 	std::wstring msg;
 	// msg = L"Precall(" + pInfo->functionName + L")\n";
@@ -21,45 +71,90 @@ static void DefaultBeforeCallHandler(ThunkInfo *pThunkInfo, void *returnAddress,
 	OutputDebugStringW(msg.c_str());
 }
 
-static void DefaultAfterCallHandler(ThunkInfo *pThunkInfo, size_t intReturnValue)
+static void DefaultAfterCallHandler(ThunkInfo *pThunkInfo, const ThunkReturnValue &)
 {
 	//std::wstring msg = L"Postcall(" + entry.pInfo->functionName + L")\n";
 	std::wstring msg = L"Postcall()\n";
 	OutputDebugStringW(msg.c_str());
 }
+#endif
 
-// Returns the actual entry point address of the dll procedure.
-static FARPROC __cdecl precall(ThunkInfo **ppThunkInfo, void *returnAddress, ...)
+// Saves the real return address and calls the before-call handler.
+// Returns the actual entry point address of the dll procedure, or NULL
+// if the call cannot be instrumented, in which case the thunk jumps to
+// the procedure directly and AfterCall() is not called.
+static FARPROC BeforeCall(ThunkInfo *pThunkInfo, void *returnAddress, ThunkArguments &args)
 {
-	ThunkInfo *pThunkInfo = *ppThunkInfo;
-
-	if (pThunkInfo->beforeCall)
+	ThunkCallStack *callStack = GetCallStack();
+	if (callStack == nullptr || callStack->depth >= THUNK_CALL_STACK_CAPACITY)
 	{
-		va_list ap;
-		va_start(ap, returnAddress);
-		pThunkInfo->beforeCall(pThunkInfo, returnAddress, ap);
-		va_end(ap);
+		s_bypassedCallCount.fetch_add(1, std::memory_order_relaxed);
+		return NULL;
 	}
 
-	CallStackEntry entry;
+	CallStackEntry &entry = callStack->entries[callStack->depth++];
 	entry.thunk = pThunkInfo;
 	entry.returnAddress = returnAddress;
-	thunkCallStack.push(entry);
+
+	if (pThunkInfo->beforeCall)
+	{
+		pThunkInfo->beforeCall(pThunkInfo, returnAddress, args);
+	}
 	return pThunkInfo->procEntryPoint;
 }
 
-// Returns the real return address.
-static void* __cdecl postcall(size_t returnValue)
+// Calls the after-call handler. Returns the real return address.
+static void* AfterCall(const ThunkReturnValue &returnValue)
 {
-	CallStackEntry entry = thunkCallStack.top();
-	thunkCallStack.pop();
+	ThunkCallStack *callStack = t_callStack;
+	CallStackEntry entry = callStack->entries[--callStack->depth];
 	if (entry.thunk->afterCall)
-	{ 
+	{
 		entry.thunk->afterCall(entry.thunk, returnValue);
 	}
 	return entry.returnAddress;
 }
 
+#if defined(_M_IX86)
+
+////////////////////////////////////////////////////////////////////////////
+// x86 backend
+
+size_t ThunkArguments::NextInteger()
+{
+	size_t value;
+	memcpy(&value, m_stack, sizeof(value));
+	m_stack += sizeof(value);
+	return value;
+}
+
+double ThunkArguments::NextDouble()
+{
+	double value;
+	memcpy(&value, m_stack, sizeof(value));
+	m_stack += sizeof(value);
+	return value;
+}
+
+// Returns the actual entry point address of the dll procedure, or NULL
+// to call the procedure without instrumentation.
+static FARPROC __cdecl precall(ThunkInfo **ppThunkInfo, void *returnAddress, ...)
+{
+	va_list ap;
+	va_start(ap, returnAddress);
+	ThunkArguments args(ap);
+	FARPROC entryPoint = BeforeCall(*ppThunkInfo, returnAddress, args);
+	va_end(ap);
+	return entryPoint;
+}
+
+// Returns the real return address.
+static void* __cdecl postcall(size_t returnValue)
+{
+	ThunkReturnValue value = { returnValue, 0.0 };
+	return AfterCall(value);
+}
+
 // GetProcAddress() returns the address of an import entry. The
 // import entry looks like the following:
 //
@@ -75,7 +170,7 @@ static void* __cdecl postcall(size_t returnValue)
 //   DD pThunkInfo
 //
 // This instruction pushes the EIP onto the stack, which happens
-// to point to the address containing pThunkInfo. This allows 
+// to point to the address containing pThunkInfo. This allows
 // thunk() to know which dll procedure is being called.
 //
 // When thunk() is called, the stack looks like this:
@@ -92,16 +187,19 @@ __declspec(naked) void thunk()
 	__asm
 	{
 		; // Top of stack contains the address that contains a
-		; // pointer to ThunkInfo. It is used to identify the 
+		; // pointer to ThunkInfo. It is used to identify the
 		; // dll procedure being called. On top of it is the
 		; // real return address.
 		call precall;
-		; // EAX now contains the real entry point address of 
-		; // the dll procedure.
+		; // EAX now contains the real entry point address of
+		; // the dll procedure, or NULL if the call cannot be
+		; // instrumented.
+		test eax, eax;
+		jz bypass;
 
 		; // Pop ppThunkInfo and returnAddress off the stack.
 		add esp, 8;
-		; // Now ESP points to the first actual argument to the 
+		; // Now ESP points to the first actual argument to the
 		; // dll procedure.
 
 		; // Call the DLL procedure now.
@@ -128,6 +226,16 @@ __declspec(naked) void thunk()
 
 		; // Return back to the real return address.
 		ret 8
+
+	bypass:
+		; // Jump to the procedure with the real return address
+		; // left on the stack, so that it returns to the caller
+		; // directly.
+		mov eax, [esp];
+		mov eax, [eax];
+		mov eax, [eax]ThunkInfo.procEntryPoint;
+		add esp, 4;
+		jmp eax;
 	}
 }
 
@@ -145,78 +253,719 @@ struct StubInstruction // CALL [s_thunkAddress]
 static_assert(sizeof(StubInstruction) == sizeof(size_t) * 3, "");
 static void* s_thunkAddress = thunk;
 
-ThunkManager::ThunkManager()
+static void* CreateThunkCode(CodeHeap &)
 {
-	// Create a heap to allocate memory to store stub code.
-	m_hCodeHeap = HeapCreate(HEAP_CREATE_ENABLE_EXECUTE, 0, 0);
+	return (void*)thunk;
 }
 
-ThunkManager::~ThunkManager()
+static FARPROC CreateStub(CodeHeap &codeHeap, void *, ThunkInfo *pThunkInfo)
 {
-	if (m_hCodeHeap != NULL)
+	StubInstruction *stub = static_cast<StubInstruction*>(
+		codeHeap.Allocate(sizeof(StubInstruction)));
+	if (stub == NULL)
+		return NULL;
+
+	memset(stub->padding, 0xCC, sizeof(stub->padding)); // INT 3
+	stub->opcode[0] = 0xFF;
+	stub->opcode[1] = 0x15;
+	stub->pThunkAddress = &s_thunkAddress;
+	stub->pThunkInfo = pThunkInfo;
+	if (!FlushCode(stub, sizeof(StubInstruction)))
 	{
-		HeapDestroy(m_hCodeHeap);
-		m_hCodeHeap = NULL;
+		codeHeap.Free(stub, sizeof(StubInstruction));
+		return NULL;
 	}
+
+	return (FARPROC)&stub->opcode;
+}
+
+// Gives back the stub created last, if the thunk cannot be installed.
+static void FreeStub(CodeHeap &codeHeap, FARPROC stubEntryPoint)
+{
+	codeHeap.Free((unsigned char*)stubEntryPoint - offsetof(StubInstruction, opcode),
+		sizeof(StubInstruction));
+}
+
+// Returns the address of the pointer that the jump instruction
+//
+//   FF 25 xx xx xx xx   jmp ds:[xx xx xx xx]
+//
+// jumps through. The operand is an absolute address.
+static FARPROC* GetJumpSlot(const unsigned char *instruction)
+{
+	FARPROC *slot;
+	memcpy(&slot, &instruction[2], sizeof(slot));
+	return slot;
+}
+
+#elif defined(_M_X64) || defined(__x86_64__)
+
+////////////////////////////////////////////////////////////////////////////
+// x64 backend
+//
+// The compiler does not support inline assembly on x64, so the thunk
+// is generated at run-time. Each instrumented procedure gets a stub
+//
+//   49 BB imm64         mov r11, pThunkInfo
+//   FF 25 00 00 00 00   jmp qword ptr [rip]
+//   DQ thunk
+//
+// that passes its ThunkInfo in r11, which is a scratch register in
+// both the Win64 and the System V calling conventions and is not used
+// to pass arguments. The shared thunk then
+//
+//   1) saves all registers that may carry arguments (rdi, rsi, rdx,
+//      rcx, r8, r9, rax and xmm0-xmm7) into a ThunkFrame;
+//   2) calls precall(), which returns the real entry point;
+//   3) restores the registers, pops the real return address and calls
+//      the procedure, which therefore sees its stack arguments at the
+//      original offsets and a correctly aligned stack; if precall()
+//      returns NULL, it jumps to the procedure instead, leaving the
+//      real return address on the stack, and stops here;
+//   4) saves rax, rdx, xmm0 and xmm1, which may carry the return value,
+//      calls postcall(), which returns the real return address;
+//   5) restores the return value registers and jumps back.
+//
+// The thunk has no unwind information, so exceptions must not
+// propagate out of an instrumented procedure. XLL entry points never
+// let them.
+//
+
+#if defined(_WIN32)
+#define THUNK_WIN64_ABI 1
+#else
+#define THUNK_WIN64_ABI 0
+#endif
+
+static_assert(offsetof(ThunkFrame, xmm) == 0, "ThunkFrame layout");
+static_assert(offsetof(ThunkFrame, rdi) == 128, "ThunkFrame layout");
+static_assert(offsetof(ThunkFrame, rax) == 176, "ThunkFrame layout");
+static_assert(offsetof(ThunkFrame, returnAddress) == 184, "ThunkFrame layout");
+static_assert(offsetof(ThunkFrame, stack) == 192, "ThunkFrame layout");
+static_assert(offsetof(ThunkInfo, procEntryPoint) < 128, "ThunkInfo layout");
+
+size_t ThunkArguments::NextInteger()
+{
+#if THUNK_WIN64_ABI
+	static const size_t ThunkFrame::*registers[4] =
+	{
+		&ThunkFrame::rcx, &ThunkFrame::rdx, &ThunkFrame::r8, &ThunkFrame::r9
+	};
+	int i = m_position++;
+	return (i < 4) ? m_frame->*registers[i] : m_frame->stack[i];
+#else
+	static const size_t ThunkFrame::*registers[6] =
+	{
+		&ThunkFrame::rdi, &ThunkFrame::rsi, &ThunkFrame::rdx,
+		&ThunkFrame::rcx, &ThunkFrame::r8, &ThunkFrame::r9
+	};
+	if (m_integerCount < 6)
+		return m_frame->*registers[m_integerCount++];
+	return m_frame->stack[m_stackCount++];
+#endif
 }
 
+double ThunkArguments::NextDouble()
+{
+	double value;
+#if THUNK_WIN64_ABI
+	int i = m_position++;
+	if (i < 4)
+		return m_frame->xmm[i].low;
+	memcpy(&value, &m_frame->stack[i], sizeof(value));
+#else
+	if (m_doubleCount < 8)
+		return m_frame->xmm[m_doubleCount++].low;
+	memcpy(&value, &m_frame->stack[m_stackCount++], sizeof(value));
+#endif
+	return value;
+}
+
+// Registers that may carry the return value, saved by the thunk.
+struct ThunkReturnFrame
+{
+	size_t rax;
+	size_t rdx;
+	ThunkXmmRegister xmm0;
+	ThunkXmmRegister xmm1;
+};
+
+static FARPROC precall(ThunkFrame *frame, ThunkInfo *pThunkInfo)
+{
+	ThunkArguments args(frame);
+	return BeforeCall(pThunkInfo, frame->returnAddress, args);
+}
+
+static void* postcall(ThunkReturnFrame *frame)
+{
+	ThunkReturnValue value = { frame->rax, frame->xmm0.low };
+	return AfterCall(value);
+}
+
+//
+// CodeWriter
+//
+// Appends machine code to a buffer.
+//
+
+class CodeWriter
+{
+	unsigned char *m_begin;
+	unsigned char *m_p;
+
+public:
+	explicit CodeWriter(void *buffer)
+		: m_begin(static_cast<unsigned char*>(buffer)), m_p(m_begin)
+	{
+	}
+
+	size_t size() const { return m_p - m_begin; }
+
+	unsigned char* Position() const { return m_p; }
+
+	// Sets the rel32 operand at the given position to jump to the
+	// current position.
+	void PatchJump(unsigned char *operand)
+	{
+		int displacement = (int)(m_p - (operand + 4));
+		memcpy(operand, &displacement, sizeof(displacement));
+	}
+
+	void Bytes(std::initializer_list<unsigned char> bytes)
+	{
+		for (unsigned char b : bytes)
+			*m_p++ = b;
+	}
+
+	void Int32(int value)
+	{
+		memcpy(m_p, &value, sizeof(value));
+		m_p += sizeof(value);
+	}
+
+	void Pointer(const void *value)
+	{
+		memcpy(m_p, &value, sizeof(value));
+		m_p += sizeof(value);
+	}
+
+	// movdqa [rsp+disp32], xmm(n)
+	void StoreXmm(int n, int disp)
+	{
+		Bytes({ 0x66, 0x0F, 0x7F, (unsigned char)(0x84 | (n << 3)), 0x24 });
+		Int32(disp);
+	}
+
+	// movdqa xmm(n), [rsp+disp32]
+	void LoadXmm(int n, int disp)
+	{
+		Bytes({ 0x66, 0x0F, 0x6F, (unsigned char)(0x84 | (n << 3)), 0x24 });
+		Int32(disp);
+	}
+};
+
+// Offsets of the frame allocated by the thunk before calling precall():
+// the shadow area, a slot that keeps the ThunkInfo (padded to 16 bytes)
+// and the ThunkFrame. The size is 8 modulo 16, so that rsp is 16-byte
+// aligned at the call.
+static const int PrecallShadowSize = 32;
+static const int PrecallInfoOffset = PrecallShadowSize;
+static const int PrecallFrameOffset = PrecallInfoOffset + 16;
+static const int PrecallFrameSize = PrecallFrameOffset + (int)offsetof(ThunkFrame, returnAddress);
+static_assert(PrecallFrameSize % 16 == 8, "stack must be aligned at the call to precall");
+
+// Frame allocated by the thunk before calling postcall(). The
+// procedure has popped its return address, so rsp is 16-byte aligned
+// and the frame size must be a multiple of 16.
+static const int PostcallFrameSize = 32 + (int)sizeof(ThunkReturnFrame);
+static_assert(PostcallFrameSize % 16 == 0, "stack must be aligned at the call to postcall");
+
+static void* CreateThunkCode(CodeHeap &codeHeap)
+{
+	const size_t MaxThunkSize = 512;
+	void *code = codeHeap.Allocate(MaxThunkSize);
+	if (code == nullptr)
+		return nullptr;
+
+	CodeWriter w(code);
+	const int frame = PrecallFrameOffset; // offset of ThunkFrame from rsp
+
+	// sub rsp, PrecallFrameSize
+	w.Bytes({ 0x48, 0x81, 0xEC }); w.Int32(PrecallFrameSize);
+
+	// Save the integer argument registers.
+	w.Bytes({ 0x48, 0x89, 0xBC, 0x24 }); w.Int32(frame + (int)offsetof(ThunkFrame, rdi)); // mov [rsp+x], rdi
+	w.Bytes({ 0x48, 0x89, 0xB4, 0x24 }); w.Int32(frame + (int)offsetof(ThunkFrame, rsi)); // mov [rsp+x], rsi
+	w.Bytes({ 0x48, 0x89, 0x94, 0x24 }); w.Int32(frame + (int)offsetof(ThunkFrame, rdx)); // mov [rsp+x], rdx
+	w.Bytes({ 0x48, 0x89, 0x8C, 0x24 }); w.Int32(frame + (int)offsetof(ThunkFrame, rcx)); // mov [rsp+x], rcx
+	w.Bytes({ 0x4C, 0x89, 0x84, 0x24 }); w.Int32(frame + (int)offsetof(ThunkFrame, r8));  // mov [rsp+x], r8
+	w.Bytes({ 0x4C, 0x89, 0x8C, 0x24 }); w.Int32(frame + (int)offsetof(ThunkFrame, r9));  // mov [rsp+x], r9
+	w.Bytes({ 0x48, 0x89, 0x84, 0x24 }); w.Int32(frame + (int)offsetof(ThunkFrame, rax)); // mov [rsp+x], rax
+
+	// Save the vector argument registers.
+	for (int i = 0; i < 8; i++)
+		w.StoreXmm(i, frame + (int)offsetof(ThunkFrame, xmm) + i * 16);
+
+	// mov [rsp+info], r11
+	w.Bytes({ 0x4C, 0x89, 0x5C, 0x24, (unsigned char)PrecallInfoOffset });
+
+	// precall(frame, r11)
+#if THUNK_WIN64_ABI
+	w.Bytes({ 0x48, 0x8D, 0x4C, 0x24, (unsigned char)frame }); // lea rcx, [rsp+frame]
+	w.Bytes({ 0x4C, 0x89, 0xDA });                             // mov rdx, r11
+#else
+	w.Bytes({ 0x48, 0x8D, 0x7C, 0x24, (unsigned char)frame }); // lea rdi, [rsp+frame]
+	w.Bytes({ 0x4C, 0x89, 0xDE });                             // mov rsi, r11
+#endif
+	w.Bytes({ 0x48, 0xB8 }); w.Pointer((const void*)precall);  // mov rax, precall
+	w.Bytes({ 0xFF, 0xD0 });                                   // call rax
+	w.Bytes({ 0x49, 0x89, 0xC3 });                             // mov r11, rax
+	w.Bytes({ 0x48, 0x85, 0xC0 });                             // test rax, rax
+
+	// Restore the argument registers. MOV does not change the flags.
+	for (int i = 0; i < 8; i++)
+		w.LoadXmm(i, frame + (int)offsetof(ThunkFrame, xmm) + i * 16);
+	w.Bytes({ 0x48, 0x8B, 0xBC, 0x24 }); w.Int32(frame + (int)offsetof(ThunkFrame, rdi)); // mov rdi, [rsp+x]
+	w.Bytes({ 0x48, 0x8B, 0xB4, 0x24 }); w.Int32(frame + (int)offsetof(ThunkFrame, rsi)); // mov rsi, [rsp+x]
+	w.Bytes({ 0x48, 0x8B, 0x94, 0x24 }); w.Int32(frame + (int)offsetof(ThunkFrame, rdx)); // mov rdx, [rsp+x]
+	w.Bytes({ 0x48, 0x8B, 0x8C, 0x24 }); w.Int32(frame + (int)offsetof(ThunkFrame, rcx)); // mov rcx, [rsp+x]
+	w.Bytes({ 0x4C, 0x8B, 0x84, 0x24 }); w.Int32(frame + (int)offsetof(ThunkFrame, r8));  // mov r8, [rsp+x]
+	w.Bytes({ 0x4C, 0x8B, 0x8C, 0x24 }); w.Int32(frame + (int)offsetof(ThunkFrame, r9));  // mov r9, [rsp+x]
+	w.Bytes({ 0x48, 0x8B, 0x84, 0x24 }); w.Int32(frame + (int)offsetof(ThunkFrame, rax)); // mov rax, [rsp+x]
+
+	// jz bypass
+	w.Bytes({ 0x0F, 0x84 });
+	unsigned char *bypassJump = w.Position();
+	w.Int32(0);
+
+	// Free the frame and pop the real return address, which precall()
+	// has saved, then call the procedure.
+	w.Bytes({ 0x48, 0x81, 0xC4 }); w.Int32(PrecallFrameSize + 8); // add rsp, size + 8
+	w.Bytes({ 0x41, 0xFF, 0xD3 });                                // call r11
+
+	// Save the return value registers.
+	const int ret = 32; // offset of ThunkReturnFrame from rsp
+	w.Bytes({ 0x48, 0x83, 0xEC, (unsigned char)PostcallFrameSize });                              // sub rsp, size
+	w.Bytes({ 0x48, 0x89, 0x44, 0x24, (unsigned char)(ret + offsetof(ThunkReturnFrame, rax)) }); // mov [rsp+x], rax
+	w.Bytes({ 0x48, 0x89, 0x54, 0x24, (unsigned char)(ret + offsetof(ThunkReturnFrame, rdx)) }); // mov [rsp+x], rdx
+	w.StoreXmm(0, ret + (int)offsetof(ThunkReturnFrame, xmm0));
+	w.StoreXmm(1, ret + (int)offsetof(ThunkReturnFrame, xmm1));
+
+	// postcall(frame)
+#if THUNK_WIN64_ABI
+	w.Bytes({ 0x48, 0x8D, 0x4C, 0x24, (unsigned char)ret });  // lea rcx, [rsp+ret]
+#else
+	w.Bytes({ 0x48, 0x8D, 0x7C, 0x24, (unsigned char)ret });  // lea rdi, [rsp+ret]
+#endif
+	w.Bytes({ 0x48, 0xB8 }); w.Pointer((const void*)postcall); // mov rax, postcall
+	w.Bytes({ 0xFF, 0xD0 });                                   // call rax
+	w.Bytes({ 0x49, 0x89, 0xC3 });                             // mov r11, rax
+
+	// Restore the return value and return to the real return address.
+	w.Bytes({ 0x48, 0x8B, 0x44, 0x24, (unsigned char)(ret + offsetof(ThunkReturnFrame, rax)) }); // mov rax, [rsp+x]
+	w.Bytes({ 0x48, 0x8B, 0x54, 0x24, (unsigned char)(ret + offsetof(ThunkReturnFrame, rdx)) }); // mov rdx, [rsp+x]
+	w.LoadXmm(0, ret + (int)offsetof(ThunkReturnFrame, xmm0));
+	w.LoadXmm(1, ret + (int)offsetof(ThunkReturnFrame, xmm1));
+	w.Bytes({ 0x48, 0x83, 0xC4, (unsigned char)PostcallFrameSize }); // add rsp, size
+	w.Bytes({ 0x41, 0xFF, 0xE3 });                                   // jmp r11
+
+	// bypass: free the frame and jump to the procedure, which returns
+	// to the real return address directly.
+	w.PatchJump(bypassJump);
+	w.Bytes({ 0x4C, 0x8B, 0x5C, 0x24, (unsigned char)PrecallInfoOffset }); // mov r11, [rsp+info]
+	w.Bytes({ 0x4D, 0x8B, 0x5B, (unsigned char)offsetof(ThunkInfo, procEntryPoint) }); // mov r11, [r11+x]
+	w.Bytes({ 0x48, 0x81, 0xC4 }); w.Int32(PrecallFrameSize);        // add rsp, size
+	w.Bytes({ 0x41, 0xFF, 0xE3 });                                   // jmp r11
+
+	if (w.size() > MaxThunkSize || !FlushCode(code, w.size()))
+		return nullptr;
+	return code;
+}
+
+#pragma pack(push, 1)
+struct StubInstruction
+{
+	unsigned char movR11[2]; // 49 BB: mov r11, imm64
+	ThunkInfo *pThunkInfo;
+	unsigned char jmp[2];    // FF 25: jmp qword ptr [rip+disp32]
+	int displacement;        // 0
+	void *thunkAddress;
+};
+#pragma pack(pop)
+static_assert(sizeof(StubInstruction) == 24, "");
+
+static FARPROC CreateStub(CodeHeap &codeHeap, void *thunkCode, ThunkInfo *pThunkInfo)
+{
+	StubInstruction *stub = static_cast<StubInstruction*>(
+		codeHeap.Allocate(sizeof(StubInstruction)));
+	if (stub == nullptr)
+		return NULL;
+
+	stub->movR11[0] = 0x49;
+	stub->movR11[1] = 0xBB;
+	stub->pThunkInfo = pThunkInfo;
+	stub->jmp[0] = 0xFF;
+	stub->jmp[1] = 0x25;
+	stub->displacement = 0;
+	stub->thunkAddress = thunkCode;
+	if (!FlushCode(stub, sizeof(StubInstruction)))
+	{
+		codeHeap.Free(stub, sizeof(StubInstruction));
+		return NULL;
+	}
+
+	return (FARPROC)stub;
+}
+
+// Gives back the stub created last, if the thunk cannot be installed.
+static void FreeStub(CodeHeap &codeHeap, FARPROC stubEntryPoint)
+{
+	codeHeap.Free((void*)stubEntryPoint, sizeof(StubInstruction));
+}
+
+// Returns the address of the pointer that the jump instruction
+//
+//   FF 25 xx xx xx xx   jmp qword ptr [rip+xxxxxxxx]
+//
+// jumps through. The operand is relative to the next instruction.
+static FARPROC* GetJumpSlot(const unsigned char *instruction)
+{
+	int displacement;
+	memcpy(&displacement, &instruction[2], sizeof(displacement));
+	return (FARPROC*)(instruction + 6 + displacement);
+}
+
+#else
+#error ThunkManager does not support this processor architecture.
+#endif
+
+////////////////////////////////////////////////////////////////////////////
+// Inline hooks
+//
+// A procedure that is not reached through a JMP [...] instruction is
+// hooked by overwriting its first instructions with
+//
+//   E9 xx xx xx xx      jmp relay
+//
+// The relay, allocated within reach of a rel32 displacement, is a
+// JMP [...] whose pointer serves as the jump slot of the thunk, so
+// that the thunk is enabled and disabled as for an import stub:
+//
+//   relay:       FF 25 xx xx xx xx   jmp [target]
+//   target:      DD/DQ stub or trampoline
+//   trampoline:  instructions copied from the procedure
+//                E9 xx xx xx xx      jmp procedure + copied size
+//
+// The copied instructions must span the five bytes of the JMP. Their
+// operands that are relative to the instruction pointer are adjusted
+// for the new location; short branches are widened to rel32.
+//
+
+#if defined(_M_X64) || defined(__x86_64__)
+static const bool Is64BitCode = true;
+#else
+static const bool Is64BitCode = false;
+#endif
+
+// Number of bytes overwritten at the entry of a procedure.
+static const size_t InlinePatchSize = 5;
+
+// Room for the copied instructions, which span at most
+// InlinePatchSize + 14 bytes and grow when short branches are widened,
+// and the jump back.
+static const size_t TrampolineCapacity = 80;
+
 #pragma pack(push, 1)
-struct JmpInstruction
+struct RelayInstruction
 {
 	unsigned char opcode[2]; // FF 25
-	FARPROC* pEntryPoint;
+	int operand;             // x86: &target; x64: 0 (rip-relative)
+	void *target;
 };
 #pragma pack(pop)
 
-BOOL ThunkManager::InstallThunk(
+static const size_t RelaySize = (sizeof(RelayInstruction) + 15) & ~(size_t)15;
+
+// Writes a rel32 operand at operand that refers to target from the end
+// of the instruction. Returns false if target is out of reach.
+static bool WriteRelative32(unsigned char *operand, const unsigned char *instructionEnd,
+	const unsigned char *target)
+{
+	size_t displacement = (size_t)target - (size_t)instructionEnd;
+	int value = (int)displacement;
+	if ((size_t)(ptrdiff_t)value != displacement)
+		return false;
+	memcpy(operand, &value, sizeof(value));
+	return true;
+}
+
+// Returns true if the rest of the procedure at code, after its first
+// size bytes, may branch back into them, such as a loop that starts at
+// the entry. The procedure is scanned up to the first return or jump
+// past all forward branches seen, which is taken as its end; a branch
+// to code itself behaves as a call and is allowed.
+static bool BranchesInto(const unsigned char *code, size_t size)
+{
+	const size_t MaxScanSize = 4096;
+	const unsigned char *end = code + size;
+	for (size_t offset = size; offset < MaxScanSize; )
+	{
+		const unsigned char *source = code + offset;
+		DecodedInstruction insn;
+		if (!DecodeInstruction(source, Is64BitCode, insn))
+			return true;
+		offset += insn.length;
+
+		if (insn.relativeSize != 0 && !insn.isRipRelative)
+		{
+			int displacement;
+			if (insn.relativeSize == 1)
+				displacement = (signed char)source[insn.relativeOffset];
+			else if (insn.relativeSize == 2)
+				displacement = (short)(source[insn.relativeOffset] | (source[insn.relativeOffset + 1] << 8));
+			else
+				memcpy(&displacement, &source[insn.relativeOffset], sizeof(displacement));
+			const unsigned char *target = source + insn.length + displacement;
+			if (target > code && target < code + size)
+				return true;
+			if (insn.flow != FlowCall && target > end && target < code + MaxScanSize)
+				end = target;
+		}
+
+		if ((insn.flow == FlowJump || insn.flow == FlowIndirectJump ||
+			insn.flow == FlowReturn || insn.flow == FlowStop) && code + offset > end)
+		{
+			return false;
+		}
+	}
+
+	// The end of the procedure was not found.
+	return true;
+}
+
+// Copies the instructions at code that span at least minSize bytes to
+// trampoline, followed by a jump back to the next instruction. Returns
+// the number of bytes copied from code, or 0 if the instructions cannot
+// be relocated.
+static size_t RelocateInstructions(const unsigned char *code, size_t minSize,
+	unsigned char *trampoline, size_t capacity)
+{
+	const size_t MaxInstructionSize = 15;
+	const unsigned char *branchTargets[16];
+	size_t branchCount = 0;
+	size_t copied = 0;
+	unsigned char *out = trampoline;
+
+	while (copied < minSize)
+	{
+		const unsigned char *source = code + copied;
+		DecodedInstruction insn;
+		if (!DecodeInstruction(source, Is64BitCode, insn))
+			return 0;
+		if (out + MaxInstructionSize + 6 > trampoline + capacity)
+			return 0;
+
+		const unsigned char *target = nullptr;
+		if (insn.relativeSize == 1)
+		{
+			target = source + insn.length + (signed char)source[insn.relativeOffset];
+		}
+		else if (insn.relativeSize == 4)
+		{
+			int displacement;
+			memcpy(&displacement, &source[insn.relativeOffset], sizeof(displacement));
+			target = source + insn.length + displacement;
+		}
+		else if (insn.relativeSize != 0)
+		{
+			return 0; // rel16
+		}
+
+		if (insn.flow == FlowLoop)
+		{
+			// LOOP and JCXZ have no rel32 form.
+			return 0;
+		}
+		else if (insn.relativeSize == 1)
+		{
+			// Widen JMP rel8 to E9 rel32 and Jcc rel8 to 0F 8x rel32,
+			// dropping any branch hint prefix.
+			if (insn.flow == FlowJump)
+			{
+				*out = 0xE9;
+				if (!WriteRelative32(out + 1, out + 5, target))
+					return 0;
+				out += 5;
+			}
+			else
+			{
+				out[0] = 0x0F;
+				out[1] = (unsigned char)(0x80 | (source[insn.opcodeOffset] & 0x0F));
+				if (!WriteRelative32(out + 2, out + 6, target))
+					return 0;
+				out += 6;
+			}
+		}
+		else
+		{
+			memcpy(out, source, insn.length);
+			if (target != nullptr && !WriteRelative32(out + insn.relativeOffset, out + insn.length, target))
+				return 0;
+			out += insn.length;
+		}
+
+		if (target != nullptr && !insn.isRipRelative)
+		{
+			if (branchCount == sizeof(branchTargets) / sizeof(branchTargets[0]))
+				return 0;
+			branchTargets[branchCount++] = target;
+		}
+
+		copied += insn.length;
+		if (copied < minSize && (insn.flow == FlowJump || insn.flow == FlowIndirectJump ||
+			insn.flow == FlowReturn || insn.flow == FlowStop))
+		{
+			// The procedure ends before the patch does.
+			return 0;
+		}
+	}
+
+	// A branch into the copied bytes would land in the middle of the
+	// JMP, or re-enter the hook from the trampoline.
+	for (size_t i = 0; i < branchCount; i++)
+	{
+		if (branchTargets[i] >= code && branchTargets[i] < code + copied)
+			return 0;
+	}
+	if (BranchesInto(code, copied))
+		return 0;
+
+	*out = 0xE9;
+	if (!WriteRelative32(out + 1, out + 5, code + copied))
+		return 0;
+	out += 5;
+
+	if (!FlushCode(trampoline, out - trampoline))
+		return 0;
+	return copied;
+}
+
+// Creates the relay and trampoline of an inline hook on the procedure
+// at code. Returns the relay, or NULL on failure.
+static RelayInstruction* CreateRelay(CodeHeap &codeHeap, const unsigned char *code,
+	FARPROC &trampoline)
+{
+	unsigned char *block = static_cast<unsigned char*>(
+		codeHeap.AllocateNear(code, RelaySize + TrampolineCapacity));
+	if (block == nullptr)
+		return nullptr;
+
+	if (RelocateInstructions(code, InlinePatchSize, block + RelaySize, TrampolineCapacity) == 0)
+	{
+		codeHeap.Free(block, RelaySize + TrampolineCapacity);
+		return nullptr;
+	}
+
+	RelayInstruction *relay = reinterpret_cast<RelayInstruction*>(block);
+	relay->opcode[0] = 0xFF;
+	relay->opcode[1] = 0x25;
+	relay->operand = Is64BitCode ? 0 : (int)(size_t)&relay->target;
+	relay->target = block + RelaySize;
+	trampoline = (FARPROC)(block + RelaySize);
+	return relay;
+}
+
+ThunkManager::ThunkManager()
+{
+	m_thunkCode = CreateThunkCode(m_codeHeap);
+}
+
+ThunkManager::~ThunkManager()
+{
+}
+
+void ThunkManager::ReleaseThreadState()
+{
+	ThunkCallStack *callStack = t_callStack;
+	if (callStack != nullptr && callStack->depth == 0)
+	{
+		t_callStack = nullptr;
+		delete callStack;
+	}
+}
+
+unsigned long long ThunkManager::GetBypassedCallCount()
+{
+	return s_bypassedCallCount.load(std::memory_order_relaxed);
+}
+
+ThunkInfo* ThunkManager::InstallThunk(
 	HMODULE hModule, FARPROC procAddress, void* cookie,
 	BeforeCallHandler beforeCall, AfterCallHandler afterCall)
 {
 	if (procAddress == NULL)
-		return FALSE;
+		return NULL;
 
-	if (m_hCodeHeap == NULL)
-		return FALSE;
+	if (m_thunkCode == NULL)
+		return NULL;
 
-	// The code at procAddress must be a JMP instruction of the form
+	if (FindThunk(procAddress) != NULL)
+		return NULL;
+
+	// If the code at procAddress is a JMP instruction of the form
 	//
-	//   FF 25 xx xx xx xx   jmp ds:[xx xx xx xx]
+	//   FF 25 xx xx xx xx   jmp [xx xx xx xx]
 	//
-	// where [xx xx xx xx] contains the actual entry point address
-	// of the procedure. If the instruction is not of this form, we
-	// do not support thunking it.
-	const JmpInstruction *instruction = (const JmpInstruction *)procAddress;
-	if (!(instruction->opcode[0] == 0xFF && instruction->opcode[1] == 0x25))
-		return FALSE;
-
-	// Allocate a code stub from the code heap.
-	StubInstruction *stub = static_cast<StubInstruction*>(
-		HeapAlloc(m_hCodeHeap, 0, sizeof(StubInstruction)));
-	if (stub == NULL)
-		return FALSE;
+	// then [xx xx xx xx] contains the actual entry point address of
+	// the procedure. The operand is absolute on x86 and relative to
+	// the next instruction on x64. Otherwise, hook the procedure
+	// inline through a relay that has such an instruction.
+	const unsigned char *instruction = (const unsigned char *)procAddress;
+	FARPROC *pEntryPoint;
+	FARPROC entryPoint;
+	RelayInstruction *relay = NULL;
+	size_t patchSize = 0;
+	unsigned char patch[InlinePatchSize];
+	if (instruction[0] == 0xFF && instruction[1] == 0x25)
+	{
+		pEntryPoint = GetJumpSlot(instruction);
+		entryPoint = *pEntryPoint;
+	}
+	else
+	{
+		relay = CreateRelay(m_codeHeap, instruction, entryPoint);
+		if (relay == NULL)
+			return NULL;
+		pEntryPoint = (FARPROC*)&relay->target;
+		patchSize = InlinePatchSize;
+		patch[0] = 0xE9;
+		if (!WriteRelative32(&patch[1], instruction + InlinePatchSize, (unsigned char*)relay))
+		{
+			m_codeHeap.Free(relay, RelaySize + TrampolineCapacity);
+			return NULL;
+		}
+	}
 
 	// Create book-keeping entry for the thunk.
 	ThunkInfo *pThunkInfo = new ThunkInfo;
 	pThunkInfo->hModule = hModule;
 	pThunkInfo->procAddress = procAddress;
 	pThunkInfo->cookie = cookie;
-	pThunkInfo->procEntryPoint = *instruction->pEntryPoint;
-	pThunkInfo->stubEntryPoint = (FARPROC)&stub->opcode;
+	pThunkInfo->procEntryPoint = entryPoint;
 	pThunkInfo->beforeCall = beforeCall;
 	pThunkInfo->afterCall = afterCall;
+	pThunkInfo->jumpSlot = pEntryPoint;
+	pThunkInfo->patchSize = patchSize;
+	memcpy(pThunkInfo->originalCode, instruction, patchSize);
 
-	// Fill the instructions in the stub.
-	memset(stub->padding, 0xCC, sizeof(stub->padding)); // INT 3
-	stub->opcode[0] = 0xFF;
-	stub->opcode[1] = 0x15;
-	stub->pThunkAddress = &s_thunkAddress;
-	stub->pThunkInfo = pThunkInfo;
-
-	// Flush instruction cache.
-	if (!FlushInstructionCache(GetCurrentProcess(), stub, sizeof(StubInstruction)))
+	// Generate a code stub for the procedure.
+	pThunkInfo->stubEntryPoint = CreateStub(m_codeHeap, m_thunkCode, pThunkInfo);
+	if (pThunkInfo->stubEntryPoint == NULL)
 	{
-		HeapFree(m_hCodeHeap, 0, stub);
-		return FALSE;
+		if (relay != NULL)
+			m_codeHeap.Free(relay, RelaySize + TrampolineCapacity);
+		delete pThunkInfo;
+		return NULL;
 	}
 
 	// TODO: make it exception free
@@ -225,8 +974,60 @@ BOOL ThunkManager::InstallThunk(
 	// TODO: lock the library in memory, or register a hook to
 	// uninstall the thunk when the DLL is unloaded.
 
-	// Redirect the entry point to our thunk.
-	*instruction->pEntryPoint = pThunkInfo->stubEntryPoint;
+	// Redirect the entry point to our thunk. For an inline hook, the
+	// relay is pointed to the stub before the JMP to it is written.
+	bool ok = PatchPointer((void**)pEntryPoint, (void*)pThunkInfo->stubEntryPoint);
+	if (ok && patchSize != 0)
+		ok = PatchCode((void*)procAddress, patch, patchSize);
+	if (!ok)
+	{
+		// The procedure still runs its original code, so the stub and
+		// relay are unused.
+		FreeStub(m_codeHeap, pThunkInfo->stubEntryPoint);
+		if (relay != NULL)
+			m_codeHeap.Free(relay, RelaySize + TrampolineCapacity);
+		m_thunks.pop_back();
+		delete pThunkInfo;
+		return NULL;
+	}
+	return pThunkInfo;
+}
+
+BOOL ThunkManager::UninstallThunk(ThunkInfo *pThunkInfo)
+{
+	std::vector<ThunkInfo*>::iterator it = std::find(m_thunks.begin(), m_thunks.end(), pThunkInfo);
+	if (it == m_thunks.end())
+		return FALSE;
+
+	bool ok;
+	if (pThunkInfo->patchSize != 0)
+		ok = PatchCode((void*)pThunkInfo->procAddress, pThunkInfo->originalCode, pThunkInfo->patchSize);
+	else
+		ok = PatchPointer((void**)pThunkInfo->jumpSlot, (void*)pThunkInfo->procEntryPoint);
+	if (!ok)
+		return FALSE;
 
+	m_thunks.erase(it);
 	return TRUE;
 }
+
+ThunkInfo* ThunkManager::FindThunk(FARPROC procAddress) const
+{
+	for (ThunkInfo *pThunkInfo : m_thunks)
+	{
+		if (pThunkInfo->procAddress == procAddress)
+			return pThunkInfo;
+	}
+	return NULL;
+}
+
+BOOL ThunkManager::EnableThunk(ThunkInfo *pThunkInfo, bool enable)
+{
+	FARPROC target = enable ? pThunkInfo->stubEntryPoint : pThunkInfo->procEntryPoint;
+	return PatchPointer((void**)pThunkInfo->jumpSlot, (void*)target) ? TRUE : FALSE;
+}
+
+bool ThunkManager::IsThunkEnabled(const ThunkInfo *pThunkInfo)
+{
+	return *(FARPROC volatile *)pThunkInfo->jumpSlot == pThunkInfo->stubEntryPoint;
+}
@@ -3,13 +3,109 @@
 
 #pragma once
 
-#include <Windows.h>
 #include <vector>
+#include "ExecutableMemory.h"
+
+#if defined(_WIN32)
+#include <Windows.h>
+#else
+// The Win32 types of the interface, so that the System V backend
+// builds on other platforms.
+typedef void *HMODULE;
+typedef void (*FARPROC)();
+typedef int BOOL;
+#ifndef TRUE
+#define TRUE 1
+#define FALSE 0
+#endif
+#endif
+
+// Maximum number of nested instrumented calls on a thread. Deeper calls
+// are passed through without instrumentation.
+#ifndef THUNK_CALL_STACK_CAPACITY
+#define THUNK_CALL_STACK_CAPACITY 256
+#endif
 
 struct ThunkInfo;
 
-typedef void (*BeforeCallHandler)(ThunkInfo *pThunkInfo, void *returnAddress, va_list);
-typedef void (*AfterCallHandler)(ThunkInfo* pThunkInfo, size_t);
+#if defined(_M_X64) || defined(__x86_64__)
+
+//
+// ThunkFrame
+//
+// Registers saved by the x64 thunk on entry to an instrumented
+// procedure, followed by the return address and the arguments passed
+// on the stack. The layout is shared with the generated code.
+//
+
+struct ThunkXmmRegister
+{
+	double low;
+	double high;
+};
+
+struct ThunkFrame
+{
+	ThunkXmmRegister xmm[8];
+	size_t rdi, rsi, rdx, rcx, r8, r9, rax;
+	void *returnAddress;
+	size_t stack[1]; // Win64: starts with the home area of rcx..r9
+};
+
+#endif
+
+//
+// ThunkArguments
+//
+// Reads the arguments of an instrumented call in declaration order.
+// The caller must know the signature of the procedure and call
+// NextInteger() for integer and pointer arguments and NextDouble() for
+// double arguments.
+//
+
+class ThunkArguments
+{
+#if defined(_M_X64) || defined(__x86_64__)
+	const ThunkFrame *m_frame;
+	int m_position;     // Win64: index of the next argument
+	int m_integerCount; // SysV: number of integer registers consumed
+	int m_doubleCount;  // SysV: number of xmm registers consumed
+	int m_stackCount;   // SysV: number of stack slots consumed
+
+public:
+	explicit ThunkArguments(const ThunkFrame *frame)
+		: m_frame(frame), m_position(0), m_integerCount(0),
+		m_doubleCount(0), m_stackCount(0)
+	{
+	}
+#else
+	const char *m_stack;
+
+public:
+	explicit ThunkArguments(const char *stack) : m_stack(stack)
+	{
+	}
+#endif
+
+	size_t NextInteger();
+	double NextDouble();
+};
+
+//
+// ThunkReturnValue
+//
+// Return value of an instrumented call. On x86, only the integer
+// (EAX) part is captured.
+//
+
+struct ThunkReturnValue
+{
+	size_t integer;
+	double floating;
+};
+
+typedef void (*BeforeCallHandler)(ThunkInfo *pThunkInfo, void *returnAddress, ThunkArguments &args);
+typedef void (*AfterCallHandler)(ThunkInfo* pThunkInfo, const ThunkReturnValue &returnValue);
 
 struct ThunkInfo
 {
@@ -17,10 +113,13 @@ struct ThunkInfo
 	HMODULE hModule;
 
 	// Address of the procedure as returned by GetProcAddress().
-	// This address contains a JMP ds:[...] instruction.
+	// This address contains a JMP ds:[...] instruction, or the first
+	// instructions of the procedure if it is hooked inline.
 	FARPROC procAddress;
 
-	// Entry point address of the dll procedure.
+	// Entry point address of the dll procedure. For an inline hook,
+	// this is the trampoline that runs the overwritten instructions and
+	// jumps back to the rest of the procedure.
 	FARPROC procEntryPoint;
 
 	// Entry point address of the stub generated by ThunkManager.
@@ -32,16 +131,68 @@ struct ThunkInfo
 	// Event handlers.
 	BeforeCallHandler beforeCall;
 	AfterCallHandler afterCall;
+
+	// Location of the pointer that the JMP [...] instruction at
+	// procAddress jumps through. For an inline hook, the JMP rel32
+	// written at procAddress leads to a JMP [...] next to the
+	// trampoline, whose pointer this is.
+	FARPROC *jumpSlot;
+
+	// Number of bytes overwritten at procAddress by an inline hook, and
+	// their original contents. Zero if the procedure is redirected
+	// through the pointer of its JMP [...] instruction.
+	size_t patchSize;
+	unsigned char originalCode[8];
 };
 
 class ThunkManager
 {
-	HANDLE m_hCodeHeap;
+	CodeHeap m_codeHeap;
+	void *m_thunkCode; // shared thunk generated at run-time (x64 only)
 	std::vector<ThunkInfo*> m_thunks;
 
 public:
 	ThunkManager();
 	~ThunkManager();
-	BOOL InstallThunk(HMODULE hModule, FARPROC procAddress, void* cookie,
+
+	// Redirects the procedure at procAddress to a thunk that calls the
+	// given handlers. If the procedure starts with a JMP [...]
+	// instruction, such as an import or export stub, the pointer it
+	// jumps through is redirected. Otherwise the first instructions of
+	// the procedure are moved to a trampoline and replaced with a jump
+	// to the thunk; this requires that no thread is running the
+	// procedure, and fails if the instructions cannot be moved, for
+	// example because the procedure is too short or branches back into
+	// them. Returns the thunk, or NULL on failure.
+	ThunkInfo* InstallThunk(HMODULE hModule, FARPROC procAddress, void* cookie,
 		BeforeCallHandler beforeCall, AfterCallHandler afterCall);
+
+	// Restores the original code or jump pointer of the procedure, so
+	// that it is called directly. The ThunkInfo, its stub and its
+	// trampoline are kept, since calls in progress may still use them,
+	// but must not be passed to EnableThunk() again. Like installing an
+	// inline hook, this requires that no thread is running the first
+	// instructions of the procedure.
+	BOOL UninstallThunk(ThunkInfo *pThunkInfo);
+
+	// Returns the thunk installed on the procedure at procAddress, or
+	// NULL if there is none.
+	ThunkInfo* FindThunk(FARPROC procAddress) const;
+
+	// Atomically points the jump slot of the procedure to the thunk, or
+	// back to the original entry point, so that a disabled thunk costs
+	// nothing. Calls in progress complete normally.
+	static BOOL EnableThunk(ThunkInfo *pThunkInfo, bool enable);
+
+	// Returns true if calls of the procedure go through the thunk.
+	static bool IsThunkEnabled(const ThunkInfo *pThunkInfo);
+
+	// Frees the shadow call stack of the calling thread. Call this
+	// from DllMain() when a thread detaches.
+	static void ReleaseThreadState();
+
+	// Returns the number of calls that were not instrumented because
+	// the shadow call stack of the thread was full or could not be
+	// allocated.
+	static unsigned long long GetBypassedCallCount();
 };
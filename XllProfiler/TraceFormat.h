@@ -0,0 +1,250 @@
+////////////////////////////////////////////////////////////////////////////
+// TraceFormat.h -- binary trace file written by XllProfiler
+//
+// This header is shared by XllProfiler, which writes the file, and
+// XllProfTool, which reads it. It must not depend on Windows headers.
+//
+// A trace file starts with a TraceFileHeader, followed by a sequence of
+// chunks. Each chunk starts with a TraceChunkHeader, whose size field
+// gives the number of bytes that follow it. Readers must skip chunks of
+// unknown type. All values are little-endian.
+//
+
+#pragma once
+
+#include <stdint.h>
+
+#define XLL_TRACE_FILE_MAGIC   0x54504C58 // "XLPT"
+#define XLL_TRACE_FILE_VERSION 1
+
+#pragma pack(push, 8)
+
+struct TraceFileHeader
+{
+	uint32_t magic;         // XLL_TRACE_FILE_MAGIC
+	uint32_t version;       // XLL_TRACE_FILE_VERSION
+	double ticksPerSecond;  // rate of the time-stamp counter
+	uint64_t startTicks;    // timestamp when recording started
+	uint32_t processId;
+	uint32_t sampleInterval; // 1 in N top-level calls recorded; 0 or 1: all
+};
+static_assert(sizeof(TraceFileHeader) == 32, "TraceFileHeader layout");
+
+enum TraceChunkType
+{
+	// A TraceFunctionRecord, followed by the function name, the DLL path
+	// and the registered type text as null-terminated UTF-8 strings. The
+	// type text is missing from traces written by older versions.
+	TraceChunkFunction = 1,
+
+	// An array of TraceCallEvent.
+	TraceChunkCalls = 2,
+
+	// A TraceDroppedRecord.
+	TraceChunkDropped = 3,
+
+	// An array of TraceCounterRecord.
+	TraceChunkCounters = 4,
+
+	// A TraceOverheadRecord.
+	TraceChunkOverhead = 5,
+
+	// An array of TraceHardwareRecord.
+	TraceChunkHardware = 6,
+
+	// An array of TraceCallbackEvent.
+	TraceChunkCallbacks = 7,
+
+	// A TraceCellRecord, followed by the sheet name as a null-terminated
+	// UTF-8 string.
+	TraceChunkCell = 8,
+
+	// A TraceRecalcRecord, followed by an array of TraceRecalcThreadRecord.
+	TraceChunkRecalc = 9,
+
+	// An array of TraceMemoryRecord.
+	TraceChunkMemory = 10,
+};
+
+struct TraceChunkHeader
+{
+	uint32_t type;
+	uint32_t size;
+};
+static_assert(sizeof(TraceChunkHeader) == 8, "TraceChunkHeader layout");
+
+// Defines the id used by TraceCallEvent to refer to a function.
+struct TraceFunctionRecord
+{
+	uint32_t functionId;
+};
+
+// One completed call of an instrumented function. A call is recorded
+// when it returns, so nested calls are recorded before their callers.
+struct TraceCallEvent
+{
+	uint32_t functionId;
+	uint32_t threadId;
+	uint64_t enterTicks;
+	uint64_t exitTicks;
+	uint32_t depth;         // number of instrumented calls in progress on the thread
+	uint32_t cellId;        // cell that made the outermost call, or 0 if unknown
+};
+static_assert(sizeof(TraceCallEvent) == 32, "TraceCallEvent layout");
+
+// Defines the id used by TraceCallEvent to refer to a worksheet cell.
+// Ids start at 1. row and column are zero-based.
+struct TraceCellRecord
+{
+	uint32_t cellId;
+	uint32_t row;
+	uint32_t column;
+};
+static_assert(sizeof(TraceCellRecord) == 12, "TraceCellRecord layout");
+
+// Number of events that a thread could not record because its buffer
+// was full.
+struct TraceDroppedRecord
+{
+	uint32_t threadId;
+	uint32_t reserved;
+	uint64_t count;
+};
+static_assert(sizeof(TraceDroppedRecord) == 16, "TraceDroppedRecord layout");
+
+// Calls of a function on a thread since the previous record for the
+// same function and thread, written in counting mode instead of call
+// events. The instrumentation overhead is already subtracted from the
+// times. Time spent in recursive calls is counted once in the inclusive
+// time of the outermost call.
+struct TraceCounterRecord
+{
+	uint32_t functionId;
+	uint32_t threadId;
+	uint64_t calls;
+	uint64_t inclusiveTicks;
+	uint64_t selfTicks;
+};
+static_assert(sizeof(TraceCounterRecord) == 32, "TraceCounterRecord layout");
+
+// Overhead of the instrumentation measured when the profiler started.
+// innerTicks is the time added to the measured duration of every call;
+// outerTicks is the time added to the duration of its caller. Readers
+// subtract them from the durations given by call events.
+struct TraceOverheadRecord
+{
+	double innerTicks;
+	double outerTicks;
+};
+static_assert(sizeof(TraceOverheadRecord) == 16, "TraceOverheadRecord layout");
+
+// Processor counters read around the calls of a function on a thread,
+// since the previous record for the same function and thread. Counts
+// include the calls nested in each call.
+enum TraceHardwareCounter
+{
+	TraceHardwareCycles,
+	TraceHardwareInstructions,
+	TraceHardwareL1DataMisses,
+	TraceHardwareLastLevelMisses,
+	TraceHardwareBranchMisses,
+	TraceHardwareCounterCount
+};
+
+struct TraceHardwareRecord
+{
+	uint32_t functionId;
+	uint32_t threadId;
+	uint32_t available;     // bit i set if counter i was read
+	uint32_t reserved;
+	uint64_t calls;
+	uint64_t counts[TraceHardwareCounterCount];
+};
+static_assert(sizeof(TraceHardwareRecord) == 64, "TraceHardwareRecord layout");
+
+// One call from an add-in back into Excel through MdCallBack12, such as
+// xlCoerce or xlfCaller, recorded when it returns. The callback is
+// attributed to the innermost instrumented call in progress on the
+// thread, if any, and its time is part of the time of that call.
+static const uint32_t TraceNoFunction = 0xFFFFFFFF;
+
+struct TraceCallbackEvent
+{
+	uint32_t functionId;    // caller, or TraceNoFunction
+	uint32_t threadId;
+	uint64_t enterTicks;
+	uint64_t exitTicks;
+	int32_t xlfn;           // function number passed to Excel12
+	int32_t result;         // xlret code returned by Excel
+};
+static_assert(sizeof(TraceCallbackEvent) == 32, "TraceCallbackEvent layout");
+
+// Summary of a recalculation, written when Excel reports that it ended
+// or was canceled. Excel does not report when a recalculation starts,
+// so it is taken to start with the first instrumented call after the
+// previous one ended. Times are those of the top-level instrumented
+// calls, which include the calls nested in them. A function that is
+// not thread-safe runs on the main thread only, so the time spent in
+// such functions cannot be shortened by more calculation threads.
+enum TraceRecalcStatus
+{
+	TraceRecalcEnded = 1,
+	TraceRecalcCanceled = 2,
+};
+
+struct TraceRecalcRecord
+{
+	uint32_t recalcId;      // 1 for the first recalculation recorded
+	uint32_t status;        // TraceRecalcStatus
+	uint64_t startTicks;    // entry of the first top-level call
+	uint64_t endTicks;      // when Excel reported the end
+	uint64_t calls;         // top-level calls on all threads
+	uint64_t busyTicks;     // time in top-level calls on all threads
+	uint64_t threadSafeTicks; // part of busyTicks in thread-safe functions
+	uint32_t threadCount;   // threads that made top-level calls
+	uint32_t reserved;
+};
+static_assert(sizeof(TraceRecalcRecord) == 56, "TraceRecalcRecord layout");
+
+// Activity of one thread during a recalculation. The thread is busy for
+// busyTicks in top-level calls, and idle for the rest of the
+// recalculation.
+struct TraceRecalcThreadRecord
+{
+	uint32_t recalcId;
+	uint32_t threadId;
+	uint64_t calls;
+	uint64_t busyTicks;
+	uint64_t threadSafeTicks;
+	uint64_t firstTicks;    // entry of the first top-level call
+	uint64_t lastTicks;     // exit of the last top-level call
+};
+static_assert(sizeof(TraceRecalcThreadRecord) == 48, "TraceRecalcThreadRecord layout");
+
+// Heap allocations made by the calls of a function on a thread, and the
+// XLOPER12 results it returned for Excel to free with xlAutoFree12,
+// since the previous record for the same function and thread. The
+// allocations include those of the calls nested in each call. A result
+// is released when Excel passes it to xlAutoFree12, which may happen on
+// another thread than the one that returned it; releases are recorded
+// on the thread that makes them. The size of a result is that of the
+// whole XLOPER12 tree, including strings and array elements.
+struct TraceMemoryRecord
+{
+	uint32_t functionId;
+	uint32_t threadId;
+	uint64_t calls;
+	uint64_t allocations;
+	uint64_t allocatedBytes;
+	uint64_t frees;
+	uint64_t freedBytes;
+	uint64_t returns;       // results with xlbitDLLFree set
+	uint64_t returnedBytes;
+	uint64_t releases;      // results passed to xlAutoFree12
+	uint64_t releasedBytes;
+	uint64_t holdTicks;     // from return to release, summed
+	uint64_t maxHoldTicks;
+};
+static_assert(sizeof(TraceMemoryRecord) == 96, "TraceMemoryRecord layout");
+
+#pragma pack(pop)
@@ -0,0 +1,1356 @@
+////////////////////////////////////////////////////////////////////////////
+// TraceRecorder.cpp -- record instrumented calls to a binary trace file
+
+#include "TraceRecorder.h"
+#include "ThunkManager.h"
+#include "HardwareCounters.h"
+#include "AllocationHooks.h"
+#include <intrin.h>
+#include <stdio.h>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <unordered_map>
+#include <vector>
+
+static_assert((XLL_PROFILER_TRACE_BUFFER_SIZE & (XLL_PROFILER_TRACE_BUFFER_SIZE - 1)) == 0,
+	"XLL_PROFILER_TRACE_BUFFER_SIZE must be a power of two.");
+static_assert((XLL_PROFILER_CALLBACK_BUFFER_SIZE & (XLL_PROFILER_CALLBACK_BUFFER_SIZE - 1)) == 0,
+	"XLL_PROFILER_CALLBACK_BUFFER_SIZE must be a power of two.");
+static_assert((int)HardwareCounterCount == (int)TraceHardwareCounterCount,
+	"HardwareCounter and TraceHardwareCounter must match.");
+
+static std::atomic<bool> s_isRecording(false);
+
+// The mode is only changed while not recording.
+static TraceMode s_mode = TraceModeEvents;
+static unsigned int s_sampleInterval = 1;
+static bool s_isHardwareEnabled = false;
+static bool s_isMemoryEnabled = false;
+static bool s_isLiveEnabled = false;
+static uint32_t (*s_callerResolver)() = nullptr;
+
+// Overhead of the instrumentation, subtracted from the times counted
+// in TraceModeCounts and in the live statistics.
+static uint64_t s_innerOverheadTicks = 0;
+static uint64_t s_outerOverheadTicks = 0;
+static TraceOverheadRecord s_overhead = { 0.0, 0.0 };
+
+// Bit i is set if function i is thread-safe. Functions beyond the
+// counted functions are taken not to be.
+static std::atomic<uint32_t> s_threadSafeFunctions[(XLL_PROFILER_MAX_COUNTED_FUNCTIONS + 31) / 32];
+
+// Incremented when a recalculation ends (see RecordRecalcEnd()).
+static std::atomic<unsigned int> s_recalcGeneration(0);
+
+// Incremented when the live statistics are reset.
+static std::atomic<unsigned int> s_liveGeneration(0);
+
+////////////////////////////////////////////////////////////////////////////
+// Per-thread ring buffers
+//
+// Each thread that records a call owns a TraceBuffer. The owner is the
+// only writer of head, of the events, of the counters and of the call
+// stack; the writer thread is the only writer of tail. Excel callbacks
+// have a ring buffer of their own, with the same rules. Buffers are
+// never freed, and are linked into a lock-free list for the writer
+// thread to walk.
+//
+
+// A call in progress on a thread.
+struct TraceFrame
+{
+	uint64_t enterTicks;
+	uint64_t childTicks;   // inclusive time of the callees (counting mode)
+	uint32_t descendants;  // number of nested calls (counting mode)
+	uint32_t functionId;
+	uint32_t cellId;
+	bool isSampled;
+	uint64_t hardware[HardwareCounterCount]; // when hardware counting
+	AllocationCounts memory;                 // when memory counting
+};
+
+struct TraceCounter
+{
+	std::atomic<uint64_t> calls;
+	std::atomic<uint64_t> inclusiveTicks;
+	std::atomic<uint64_t> selfTicks;
+	std::atomic<uint64_t> hardwareCalls;
+	std::atomic<uint64_t> hardware[HardwareCounterCount];
+	std::atomic<uint64_t> memoryCalls;
+	std::atomic<uint64_t> allocations;
+	std::atomic<uint64_t> allocatedBytes;
+	std::atomic<uint64_t> frees;
+	std::atomic<uint64_t> freedBytes;
+	std::atomic<uint64_t> returns;
+	std::atomic<uint64_t> returnedBytes;
+	std::atomic<uint64_t> releases;
+	std::atomic<uint64_t> releasedBytes;
+	std::atomic<uint64_t> holdTicks;
+	std::atomic<uint64_t> maxHoldTicks; // since recording started
+};
+
+// Values of a TraceCounter that have been written to the file.
+struct TraceCounterTotals
+{
+	uint64_t calls;
+	uint64_t inclusiveTicks;
+	uint64_t selfTicks;
+	uint64_t hardwareCalls;
+	uint64_t hardware[HardwareCounterCount];
+	uint64_t memoryCalls;
+	uint64_t allocations;
+	uint64_t allocatedBytes;
+	uint64_t frees;
+	uint64_t freedBytes;
+	uint64_t returns;
+	uint64_t returnedBytes;
+	uint64_t releases;
+	uint64_t releasedBytes;
+	uint64_t holdTicks;
+	uint64_t maxHoldTicks;
+};
+
+// Live statistics of a function on a thread.
+struct LiveCounter
+{
+	std::atomic<uint64_t> calls;
+	std::atomic<uint64_t> inclusiveTicks;
+	std::atomic<uint64_t> selfTicks;
+	std::atomic<uint64_t> maxTicks;
+	std::atomic<uint64_t> latency[XLL_PROFILER_LATENCY_BUCKETS];
+};
+
+// The live counters of a thread are allocated in blocks of functions
+// on the first call of a function in the block, since most XLLs define
+// far fewer functions than XLL_PROFILER_MAX_COUNTED_FUNCTIONS.
+static const uint32_t LiveBlockSize = 64;
+static const uint32_t LiveBlockCount =
+	(XLL_PROFILER_MAX_COUNTED_FUNCTIONS + LiveBlockSize - 1) / LiveBlockSize;
+
+struct TraceBuffer
+{
+	TraceBuffer *next;
+	DWORD threadId;
+	unsigned int depth;
+	unsigned int sampleCountdown; // top-level calls until the next sample
+	uint32_t randomState;
+	TraceFrame frames[THUNK_CALL_STACK_CAPACITY];
+	std::atomic<unsigned int> head;
+	std::atomic<unsigned int> tail;
+	std::atomic<unsigned long long> dropped;
+	std::atomic<TraceCounter*> counters; // allocated on the first count
+	HardwareCounterSet hardware;
+	bool isHardwareOpen;
+	std::atomic<unsigned int> hardwareAvailable; // read by the writer thread
+	unsigned long long droppedWritten;   // owned by the writer thread
+	TraceCounterTotals *countersWritten; // owned by the writer thread
+	TraceCallEvent events[XLL_PROFILER_TRACE_BUFFER_SIZE];
+	// Top-level calls in the recalculation given by recalcGeneration.
+	std::atomic<unsigned int> recalcGeneration;
+	std::atomic<uint64_t> recalcCalls;
+	std::atomic<uint64_t> recalcBusyTicks;
+	std::atomic<uint64_t> recalcThreadSafeTicks;
+	std::atomic<uint64_t> recalcFirstTicks;
+	std::atomic<uint64_t> recalcLastTicks;
+	std::atomic<unsigned int> callbackHead;
+	std::atomic<unsigned int> callbackTail;
+	TraceCallbackEvent callbacks[XLL_PROFILER_CALLBACK_BUFFER_SIZE];
+	// Live statistics, which are zero unless liveGeneration is the
+	// current generation.
+	std::atomic<unsigned int> liveGeneration;
+	std::atomic<LiveCounter*> live[LiveBlockCount];
+};
+
+static std::atomic<TraceBuffer*> s_traceBuffers(nullptr);
+
+static __declspec(thread) TraceBuffer *t_traceBuffer;
+
+static TraceBuffer* GetTraceBuffer()
+{
+	TraceBuffer *p = t_traceBuffer;
+	if (p == nullptr)
+	{
+		p = new (std::nothrow) TraceBuffer();
+		if (p == nullptr)
+			return nullptr;
+		p->threadId = GetCurrentThreadId();
+		p->sampleCountdown = 1;
+		p->randomState = (p->threadId * 2654435761u) | 1;
+
+		TraceBuffer *head = s_traceBuffers.load();
+		do
+		{
+			p->next = head;
+		} while (!s_traceBuffers.compare_exchange_weak(head, p));
+
+		t_traceBuffer = p;
+	}
+	return p;
+}
+
+// Returns the number of top-level calls until the next sample, which
+// is uniformly distributed in [1, 2 * s_sampleInterval - 1].
+static unsigned int NextSampleCountdown(TraceBuffer *buffer)
+{
+	uint32_t x = buffer->randomState; // xorshift32
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	buffer->randomState = x;
+	return 1 + x % (2 * s_sampleInterval - 1);
+}
+
+static TraceCounter* GetCounters(TraceBuffer *buffer)
+{
+	TraceCounter *counters = buffer->counters.load(std::memory_order_relaxed);
+	if (counters == nullptr)
+	{
+		counters = new (std::nothrow) TraceCounter[XLL_PROFILER_MAX_COUNTED_FUNCTIONS]();
+		buffer->counters.store(counters, std::memory_order_release);
+	}
+	return counters;
+}
+
+static inline void AddRelaxed(std::atomic<uint64_t> &value, uint64_t x)
+{
+	// Only the owner thread writes the value.
+	value.store(value.load(std::memory_order_relaxed) + x, std::memory_order_relaxed);
+}
+
+void RecordCallEnter(uint32_t functionId)
+{
+	TraceBuffer *buffer = GetTraceBuffer();
+	if (buffer == nullptr)
+		return;
+
+	unsigned int depth = buffer->depth++;
+	if (depth >= THUNK_CALL_STACK_CAPACITY)
+		return;
+
+	TraceFrame &frame = buffer->frames[depth];
+	frame.childTicks = 0;
+	frame.descendants = 0;
+	frame.functionId = functionId;
+	if (depth > 0)
+	{
+		frame.isSampled = buffer->frames[depth - 1].isSampled;
+		frame.cellId = buffer->frames[depth - 1].cellId;
+	}
+	else if (--buffer->sampleCountdown == 0)
+	{
+		buffer->sampleCountdown = (s_mode == TraceModeSampled) ? NextSampleCountdown(buffer) : 1;
+		frame.isSampled = true;
+		frame.cellId = (s_callerResolver != nullptr && s_mode != TraceModeCounts &&
+			s_isRecording.load(std::memory_order_relaxed)) ? s_callerResolver() : 0;
+	}
+	else
+	{
+		frame.isSampled = false;
+		frame.cellId = 0;
+	}
+
+	if (s_isHardwareEnabled)
+	{
+		if (!buffer->isHardwareOpen)
+		{
+			buffer->hardwareAvailable.store(buffer->hardware.Open(), std::memory_order_relaxed);
+			buffer->isHardwareOpen = true;
+		}
+		buffer->hardware.Read(frame.hardware);
+	}
+	if (s_isMemoryEnabled)
+		ReadAllocationCounts(frame.memory);
+
+	// Read the clock last, to leave out the above from the call time.
+	frame.enterTicks = __rdtsc();
+}
+
+// Adds the processor counters read around a call to the counters of its
+// function.
+static void CountHardware(TraceBuffer *buffer, unsigned int depth)
+{
+	uint64_t values[HardwareCounterCount];
+	buffer->hardware.Read(values);
+
+	const TraceFrame &frame = buffer->frames[depth];
+	if (!s_isRecording.load(std::memory_order_relaxed) ||
+		frame.functionId >= XLL_PROFILER_MAX_COUNTED_FUNCTIONS)
+		return;
+
+	TraceCounter *counters = GetCounters(buffer);
+	if (counters == nullptr)
+		return;
+
+	TraceCounter &c = counters[frame.functionId];
+	AddRelaxed(c.hardwareCalls, 1);
+	for (int i = 0; i < HardwareCounterCount; i++)
+		AddRelaxed(c.hardware[i], values[i] - frame.hardware[i]);
+}
+
+// Adds the heap allocations made during a call to the counters of its
+// function.
+static void CountMemory(TraceBuffer *buffer, unsigned int depth)
+{
+	AllocationCounts counts;
+	ReadAllocationCounts(counts);
+
+	const TraceFrame &frame = buffer->frames[depth];
+	if (!s_isRecording.load(std::memory_order_relaxed) ||
+		frame.functionId >= XLL_PROFILER_MAX_COUNTED_FUNCTIONS)
+		return;
+
+	TraceCounter *counters = GetCounters(buffer);
+	if (counters == nullptr)
+		return;
+
+	TraceCounter &c = counters[frame.functionId];
+	AddRelaxed(c.memoryCalls, 1);
+	AddRelaxed(c.allocations, counts.allocations - frame.memory.allocations);
+	AddRelaxed(c.allocatedBytes, counts.allocatedBytes - frame.memory.allocatedBytes);
+	AddRelaxed(c.frees, counts.frees - frame.memory.frees);
+	AddRelaxed(c.freedBytes, counts.freedBytes - frame.memory.freedBytes);
+}
+
+// Returns the inclusive and self time of the call at depth, with the
+// overhead of the instrumentation subtracted, and adds the call to the
+// time of its caller.
+static void MeasureCall(TraceBuffer *buffer, unsigned int depth, uint64_t ticks,
+	uint64_t &inclusive, uint64_t &self)
+{
+	TraceFrame &frame = buffer->frames[depth];
+	uint64_t overhead = s_innerOverheadTicks + frame.descendants * s_outerOverheadTicks;
+	uint64_t elapsed = ticks - frame.enterTicks;
+	inclusive = (elapsed > overhead) ? elapsed - overhead : 0;
+	self = (inclusive > frame.childTicks) ? inclusive - frame.childTicks : 0;
+	if (depth > 0)
+	{
+		TraceFrame &parent = buffer->frames[depth - 1];
+		parent.childTicks += inclusive;
+		parent.descendants += 1 + frame.descendants;
+	}
+}
+
+// Returns true if the function of the call at depth is also called
+// further up the stack, so that the time of the call is already in the
+// inclusive time of the outer call.
+static bool IsRecursiveCall(const TraceBuffer *buffer, unsigned int depth)
+{
+	uint32_t functionId = buffer->frames[depth].functionId;
+	for (unsigned int i = 0; i < depth; i++)
+	{
+		if (buffer->frames[i].functionId == functionId)
+			return true;
+	}
+	return false;
+}
+
+// Adds a call to the counters of its function.
+static void CountCall(TraceBuffer *buffer, unsigned int depth, uint64_t inclusive, uint64_t self)
+{
+	const TraceFrame &frame = buffer->frames[depth];
+	if (!s_isRecording.load(std::memory_order_relaxed) ||
+		frame.functionId >= XLL_PROFILER_MAX_COUNTED_FUNCTIONS)
+		return;
+
+	TraceCounter *counters = GetCounters(buffer);
+	if (counters == nullptr)
+		return;
+
+	TraceCounter &c = counters[frame.functionId];
+	AddRelaxed(c.calls, 1);
+	AddRelaxed(c.selfTicks, self);
+	if (!IsRecursiveCall(buffer, depth))
+		AddRelaxed(c.inclusiveTicks, inclusive);
+}
+
+static unsigned int GetLatencyBucket(uint64_t ticks)
+{
+	ticks >>= LIVE_LATENCY_FIRST_SHIFT;
+	if (ticks == 0)
+		return 0;
+	unsigned long index;
+	if (!_BitScanReverse(&index, (unsigned long)(ticks >> 32)))
+		_BitScanReverse(&index, (unsigned long)ticks);
+	else
+		index += 32;
+	return std::min((unsigned int)index + 1, (unsigned int)XLL_PROFILER_LATENCY_BUCKETS - 1);
+}
+
+// Adds a call to the live statistics of its function.
+static void CountLive(TraceBuffer *buffer, unsigned int depth, uint64_t inclusive, uint64_t self)
+{
+	uint32_t functionId = buffer->frames[depth].functionId;
+	if (functionId >= XLL_PROFILER_MAX_COUNTED_FUNCTIONS)
+		return;
+
+	unsigned int generation = s_liveGeneration.load(std::memory_order_relaxed);
+	if (buffer->liveGeneration.load(std::memory_order_relaxed) != generation)
+	{
+		for (uint32_t i = 0; i < LiveBlockCount; i++)
+		{
+			LiveCounter *counters = buffer->live[i].load(std::memory_order_relaxed);
+			for (uint32_t j = 0; counters != nullptr && j < LiveBlockSize; j++)
+			{
+				LiveCounter &c = counters[j];
+				c.calls.store(0, std::memory_order_relaxed);
+				c.inclusiveTicks.store(0, std::memory_order_relaxed);
+				c.selfTicks.store(0, std::memory_order_relaxed);
+				c.maxTicks.store(0, std::memory_order_relaxed);
+				for (int k = 0; k < XLL_PROFILER_LATENCY_BUCKETS; k++)
+					c.latency[k].store(0, std::memory_order_relaxed);
+			}
+		}
+		buffer->liveGeneration.store(generation, std::memory_order_release);
+	}
+
+	std::atomic<LiveCounter*> &block = buffer->live[functionId / LiveBlockSize];
+	LiveCounter *counters = block.load(std::memory_order_relaxed);
+	if (counters == nullptr)
+	{
+		counters = new (std::nothrow) LiveCounter[LiveBlockSize]();
+		if (counters == nullptr)
+			return;
+		block.store(counters, std::memory_order_release);
+	}
+
+	LiveCounter &c = counters[functionId % LiveBlockSize];
+	AddRelaxed(c.calls, 1);
+	AddRelaxed(c.selfTicks, self);
+	if (!IsRecursiveCall(buffer, depth))
+		AddRelaxed(c.inclusiveTicks, inclusive);
+	if (inclusive > c.maxTicks.load(std::memory_order_relaxed))
+		c.maxTicks.store(inclusive, std::memory_order_relaxed);
+	AddRelaxed(c.latency[GetLatencyBucket(inclusive)], 1);
+}
+
+// Adds a top-level call to the activity of its thread in the current
+// recalculation.
+static void AccountRecalc(TraceBuffer *buffer, const TraceFrame &frame, uint64_t ticks)
+{
+	unsigned int generation = s_recalcGeneration.load(std::memory_order_relaxed);
+	if (buffer->recalcGeneration.load(std::memory_order_relaxed) != generation)
+	{
+		buffer->recalcCalls.store(0, std::memory_order_relaxed);
+		buffer->recalcBusyTicks.store(0, std::memory_order_relaxed);
+		buffer->recalcThreadSafeTicks.store(0, std::memory_order_relaxed);
+		buffer->recalcFirstTicks.store(frame.enterTicks, std::memory_order_relaxed);
+		buffer->recalcGeneration.store(generation, std::memory_order_release);
+	}
+
+	uint64_t elapsed = ticks - frame.enterTicks;
+	uint64_t busy = (elapsed > s_innerOverheadTicks) ? elapsed - s_innerOverheadTicks : 0;
+	AddRelaxed(buffer->recalcCalls, 1);
+	AddRelaxed(buffer->recalcBusyTicks, busy);
+	if (frame.functionId < XLL_PROFILER_MAX_COUNTED_FUNCTIONS &&
+		(s_threadSafeFunctions[frame.functionId / 32].load(std::memory_order_relaxed) &
+			(1u << (frame.functionId % 32))) != 0)
+	{
+		AddRelaxed(buffer->recalcThreadSafeTicks, busy);
+	}
+	buffer->recalcLastTicks.store(ticks, std::memory_order_relaxed);
+}
+
+void RecordCallLeave()
+{
+	uint64_t ticks = __rdtsc();
+
+	// Do not allocate a buffer here: if RecordCallEnter() failed to
+	// allocate one, the call has no start time.
+	TraceBuffer *buffer = t_traceBuffer;
+	if (buffer == nullptr || buffer->depth == 0)
+		return;
+
+	unsigned int depth = --buffer->depth;
+	if (depth >= THUNK_CALL_STACK_CAPACITY)
+		return;
+
+	if (s_isHardwareEnabled && buffer->hardwareAvailable.load(std::memory_order_relaxed) != 0)
+		CountHardware(buffer, depth);
+	if (s_isMemoryEnabled)
+		CountMemory(buffer, depth);
+
+	if (depth == 0 && s_isRecording.load(std::memory_order_relaxed))
+		AccountRecalc(buffer, buffer->frames[0], ticks);
+
+	if (s_mode == TraceModeCounts || s_isLiveEnabled)
+	{
+		uint64_t inclusive, self;
+		MeasureCall(buffer, depth, ticks, inclusive, self);
+		if (s_isLiveEnabled)
+			CountLive(buffer, depth, inclusive, self);
+		if (s_mode == TraceModeCounts)
+		{
+			CountCall(buffer, depth, inclusive, self);
+			return;
+		}
+	}
+
+	const TraceFrame &frame = buffer->frames[depth];
+	if (!frame.isSampled || !s_isRecording.load(std::memory_order_relaxed))
+		return;
+
+	unsigned int head = buffer->head.load(std::memory_order_relaxed);
+	unsigned int tail = buffer->tail.load(std::memory_order_acquire);
+	if (head - tail >= XLL_PROFILER_TRACE_BUFFER_SIZE)
+	{
+		buffer->dropped.store(buffer->dropped.load(std::memory_order_relaxed) + 1,
+			std::memory_order_relaxed);
+		return;
+	}
+
+	TraceCallEvent &e = buffer->events[head & (XLL_PROFILER_TRACE_BUFFER_SIZE - 1)];
+	e.functionId = frame.functionId;
+	e.threadId = buffer->threadId;
+	e.enterTicks = frame.enterTicks;
+	e.exitTicks = ticks;
+	e.depth = depth;
+	e.cellId = frame.cellId;
+	buffer->head.store(head + 1, std::memory_order_release);
+}
+
+void RecordExcelCallback(int xlfn, int result, uint64_t enterTicks, uint64_t exitTicks)
+{
+	if (!s_isRecording.load(std::memory_order_relaxed))
+		return;
+
+	TraceBuffer *buffer = GetTraceBuffer();
+	if (buffer == nullptr)
+		return;
+
+	uint32_t functionId = TraceNoFunction;
+	unsigned int depth = std::min(buffer->depth, (unsigned int)THUNK_CALL_STACK_CAPACITY);
+	if (depth > 0)
+	{
+		const TraceFrame &frame = buffer->frames[depth - 1];
+		if (!frame.isSampled && s_mode == TraceModeSampled)
+			return;
+		functionId = frame.functionId;
+	}
+
+	unsigned int head = buffer->callbackHead.load(std::memory_order_relaxed);
+	unsigned int tail = buffer->callbackTail.load(std::memory_order_acquire);
+	if (head - tail >= XLL_PROFILER_CALLBACK_BUFFER_SIZE)
+	{
+		buffer->dropped.store(buffer->dropped.load(std::memory_order_relaxed) + 1,
+			std::memory_order_relaxed);
+		return;
+	}
+
+	TraceCallbackEvent &e = buffer->callbacks[head & (XLL_PROFILER_CALLBACK_BUFFER_SIZE - 1)];
+	e.functionId = functionId;
+	e.threadId = buffer->threadId;
+	e.enterTicks = enterTicks;
+	e.exitTicks = exitTicks;
+	e.xlfn = xlfn;
+	e.result = result;
+	buffer->callbackHead.store(head + 1, std::memory_order_release);
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Returned memory
+//
+// A result returned with xlbitDLLFree is remembered until Excel passes
+// it to xlAutoFree12, which is usually on the main thread after Excel
+// has copied the value into the cell.
+//
+
+struct PendingReturn
+{
+	uint32_t functionId;
+	uint64_t returnTicks;
+	uint64_t bytes;
+};
+
+static std::mutex s_pendingReturnsMutex;
+static std::unordered_map<const void*, PendingReturn> s_pendingReturns;
+
+void RecordReturnedMemory(const void *result, uint64_t bytes)
+{
+	if (!s_isMemoryEnabled || !s_isRecording.load(std::memory_order_relaxed))
+		return;
+
+	TraceBuffer *buffer = t_traceBuffer;
+	if (buffer == nullptr || buffer->depth == 0 || buffer->depth > THUNK_CALL_STACK_CAPACITY)
+		return;
+
+	uint32_t functionId = buffer->frames[buffer->depth - 1].functionId;
+	if (functionId >= XLL_PROFILER_MAX_COUNTED_FUNCTIONS)
+		return;
+
+	TraceCounter *counters = GetCounters(buffer);
+	if (counters == nullptr)
+		return;
+
+	TraceCounter &c = counters[functionId];
+	AddRelaxed(c.returns, 1);
+	AddRelaxed(c.returnedBytes, bytes);
+
+	PendingReturn pending = { functionId, ReadTraceClock(), bytes };
+	std::lock_guard<std::mutex> lock(s_pendingReturnsMutex);
+	if (s_pendingReturns.size() < XLL_PROFILER_MAX_PENDING_RETURNS)
+		s_pendingReturns[result] = pending;
+}
+
+void RecordReleasedMemory(const void *result)
+{
+	uint64_t ticks = ReadTraceClock();
+	if (!s_isMemoryEnabled || !s_isRecording.load(std::memory_order_relaxed))
+		return;
+
+	PendingReturn pending;
+	{
+		std::lock_guard<std::mutex> lock(s_pendingReturnsMutex);
+		auto it = s_pendingReturns.find(result);
+		if (it == s_pendingReturns.end())
+			return;
+		pending = it->second;
+		s_pendingReturns.erase(it);
+	}
+
+	TraceBuffer *buffer = GetTraceBuffer();
+	TraceCounter *counters = (buffer != nullptr) ? GetCounters(buffer) : nullptr;
+	if (counters == nullptr)
+		return;
+
+	TraceCounter &c = counters[pending.functionId];
+	uint64_t hold = ticks - pending.returnTicks;
+	AddRelaxed(c.releases, 1);
+	AddRelaxed(c.releasedBytes, pending.bytes);
+	AddRelaxed(c.holdTicks, hold);
+	if (hold > c.maxHoldTicks.load(std::memory_order_relaxed))
+		c.maxHoldTicks.store(hold, std::memory_order_relaxed);
+}
+
+unsigned long long GetDroppedCallEventCount()
+{
+	unsigned long long n = 0;
+	for (TraceBuffer *p = s_traceBuffers.load(); p != nullptr; p = p->next)
+	{
+		n += p->dropped.load(std::memory_order_relaxed);
+	}
+	return n;
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Function definitions
+
+struct TraceFunction
+{
+	std::string name;
+	std::string dllName;
+	std::string typeText;
+};
+
+static std::mutex s_functionsMutex;
+static std::vector<TraceFunction> s_functions;
+static size_t s_functionsWritten = 0; // owned by the writer
+
+struct TraceCell
+{
+	std::string sheetName;
+	uint32_t row;
+	uint32_t column;
+};
+
+static std::mutex s_cellsMutex;
+static std::vector<TraceCell> s_cells; // cell id - 1
+static size_t s_cellsWritten = 0;      // owned by the writer
+
+static std::string ToUtf8(const std::wstring &s)
+{
+	if (s.empty())
+		return std::string();
+	int n = WideCharToMultiByte(CP_UTF8, 0, s.c_str(), (int)s.size(), NULL, 0, NULL, NULL);
+	std::string result(n, '\0');
+	WideCharToMultiByte(CP_UTF8, 0, s.c_str(), (int)s.size(), &result[0], n, NULL, NULL);
+	return result;
+}
+
+uint32_t DefineTraceFunction(const std::wstring &name, const std::wstring &dllName,
+	const std::wstring &typeText)
+{
+	TraceFunction f;
+	f.name = ToUtf8(name);
+	f.dllName = ToUtf8(dllName);
+	f.typeText = ToUtf8(typeText);
+	bool isThreadSafe = (typeText.find(L'$') != std::wstring::npos);
+
+	std::lock_guard<std::mutex> lock(s_functionsMutex);
+	s_functions.push_back(f);
+	uint32_t functionId = (uint32_t)(s_functions.size() - 1);
+	if (isThreadSafe && functionId < XLL_PROFILER_MAX_COUNTED_FUNCTIONS)
+		s_threadSafeFunctions[functionId / 32].fetch_or(1u << (functionId % 32));
+	return functionId;
+}
+
+uint32_t DefineTraceCell(const std::wstring &sheetName, uint32_t row, uint32_t column)
+{
+	TraceCell c;
+	c.sheetName = ToUtf8(sheetName);
+	c.row = row;
+	c.column = column;
+
+	std::lock_guard<std::mutex> lock(s_cellsMutex);
+	s_cells.push_back(c);
+	return (uint32_t)s_cells.size();
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Recalculations
+
+static std::mutex s_recalcsMutex;
+static std::vector<char> s_pendingRecalcs; // chunks for the writer
+static uint32_t s_recalcCount = 0;
+
+void RecordRecalcEnd(TraceRecalcStatus status)
+{
+	uint64_t endTicks = ReadTraceClock();
+
+	// Calls that end from now on belong to the next recalculation. The
+	// calculation threads are idle when Excel reports the end, so the
+	// counts read below are final.
+	unsigned int generation = s_recalcGeneration.fetch_add(1);
+	if (!s_isRecording.load(std::memory_order_relaxed))
+		return;
+
+	TraceRecalcRecord recalc = {};
+	std::vector<TraceRecalcThreadRecord> threads;
+	recalc.status = status;
+	recalc.startTicks = endTicks;
+	recalc.endTicks = endTicks;
+	for (TraceBuffer *p = s_traceBuffers.load(); p != nullptr; p = p->next)
+	{
+		if (p->recalcGeneration.load(std::memory_order_acquire) != generation)
+			continue;
+
+		TraceRecalcThreadRecord t;
+		t.recalcId = 0;
+		t.threadId = p->threadId;
+		t.calls = p->recalcCalls.load(std::memory_order_relaxed);
+		t.busyTicks = p->recalcBusyTicks.load(std::memory_order_relaxed);
+		t.threadSafeTicks = p->recalcThreadSafeTicks.load(std::memory_order_relaxed);
+		t.firstTicks = p->recalcFirstTicks.load(std::memory_order_relaxed);
+		t.lastTicks = p->recalcLastTicks.load(std::memory_order_relaxed);
+		if (t.calls == 0)
+			continue;
+
+		recalc.startTicks = std::min(recalc.startTicks, t.firstTicks);
+		recalc.calls += t.calls;
+		recalc.busyTicks += t.busyTicks;
+		recalc.threadSafeTicks += t.threadSafeTicks;
+		threads.push_back(t);
+	}
+	if (threads.empty())
+		return;
+
+	std::lock_guard<std::mutex> lock(s_recalcsMutex);
+	recalc.recalcId = ++s_recalcCount;
+	recalc.threadCount = (uint32_t)threads.size();
+	for (TraceRecalcThreadRecord &t : threads)
+		t.recalcId = recalc.recalcId;
+
+	size_t size = sizeof(recalc) + threads.size() * sizeof(TraceRecalcThreadRecord);
+	TraceChunkHeader header = { TraceChunkRecalc, (uint32_t)size };
+	const char *parts[] = { (const char *)&header, (const char *)&recalc, (const char *)threads.data() };
+	size_t sizes[] = { sizeof(header), sizeof(recalc), threads.size() * sizeof(TraceRecalcThreadRecord) };
+	for (size_t i = 0; i < ARRAYSIZE(parts); i++)
+		s_pendingRecalcs.insert(s_pendingRecalcs.end(), parts[i], parts[i] + sizes[i]);
+}
+
+static void WriteRecalcs(FILE *fp)
+{
+	std::lock_guard<std::mutex> lock(s_recalcsMutex);
+	if (!s_pendingRecalcs.empty())
+	{
+		fwrite(s_pendingRecalcs.data(), 1, s_pendingRecalcs.size(), fp);
+		s_pendingRecalcs.clear();
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Writing
+
+static FILE *s_traceFile = nullptr;
+static TraceFileHeader s_header;
+static LARGE_INTEGER s_startCounter;
+static HANDLE s_hWriterThread = NULL;
+static HANDLE s_hWriterStopEvent = NULL;
+
+static void WriteChunk(FILE *fp, TraceChunkType type, const void *data, size_t size)
+{
+	TraceChunkHeader header = { (uint32_t)type, (uint32_t)size };
+	fwrite(&header, sizeof(header), 1, fp);
+	fwrite(data, 1, size, fp);
+}
+
+// Measures the rate of the time-stamp counter against the performance
+// counter since recording started, and rewrites the file header with
+// it. The longer the trace, the more accurate the result.
+static void UpdateFileHeader(FILE *fp)
+{
+	LARGE_INTEGER counter, frequency;
+	QueryPerformanceCounter(&counter);
+	uint64_t ticks = __rdtsc();
+	QueryPerformanceFrequency(&frequency);
+
+	LONGLONG elapsed = counter.QuadPart - s_startCounter.QuadPart;
+	if (elapsed <= 0)
+		return;
+	s_header.ticksPerSecond = (double)(ticks - s_header.startTicks) *
+		frequency.QuadPart / elapsed;
+
+	long long position = _ftelli64(fp);
+	_fseeki64(fp, 0, SEEK_SET);
+	fwrite(&s_header, sizeof(s_header), 1, fp);
+	_fseeki64(fp, position, SEEK_SET);
+}
+
+static void WriteFunctions(FILE *fp)
+{
+	std::lock_guard<std::mutex> lock(s_functionsMutex);
+	for (; s_functionsWritten < s_functions.size(); ++s_functionsWritten)
+	{
+		const TraceFunction &f = s_functions[s_functionsWritten];
+		TraceFunctionRecord record = { (uint32_t)s_functionsWritten };
+		size_t size = sizeof(record) + f.name.size() + 1 + f.dllName.size() + 1 +
+			f.typeText.size() + 1;
+
+		TraceChunkHeader header = { TraceChunkFunction, (uint32_t)size };
+		fwrite(&header, sizeof(header), 1, fp);
+		fwrite(&record, sizeof(record), 1, fp);
+		fwrite(f.name.c_str(), 1, f.name.size() + 1, fp);
+		fwrite(f.dllName.c_str(), 1, f.dllName.size() + 1, fp);
+		fwrite(f.typeText.c_str(), 1, f.typeText.size() + 1, fp);
+	}
+}
+
+static void WriteCells(FILE *fp)
+{
+	std::lock_guard<std::mutex> lock(s_cellsMutex);
+	for (; s_cellsWritten < s_cells.size(); ++s_cellsWritten)
+	{
+		const TraceCell &c = s_cells[s_cellsWritten];
+		TraceCellRecord record = { (uint32_t)s_cellsWritten + 1, c.row, c.column };
+		size_t size = sizeof(record) + c.sheetName.size() + 1;
+
+		TraceChunkHeader header = { TraceChunkCell, (uint32_t)size };
+		fwrite(&header, sizeof(header), 1, fp);
+		fwrite(&record, sizeof(record), 1, fp);
+		fwrite(c.sheetName.c_str(), 1, c.sheetName.size() + 1, fp);
+	}
+}
+
+static void LoadCounter(const TraceCounter &counter, TraceCounterTotals &totals)
+{
+	totals.calls = counter.calls.load(std::memory_order_relaxed);
+	totals.inclusiveTicks = counter.inclusiveTicks.load(std::memory_order_relaxed);
+	totals.selfTicks = counter.selfTicks.load(std::memory_order_relaxed);
+	totals.hardwareCalls = counter.hardwareCalls.load(std::memory_order_relaxed);
+	for (int i = 0; i < HardwareCounterCount; i++)
+		totals.hardware[i] = counter.hardware[i].load(std::memory_order_relaxed);
+	totals.memoryCalls = counter.memoryCalls.load(std::memory_order_relaxed);
+	totals.allocations = counter.allocations.load(std::memory_order_relaxed);
+	totals.allocatedBytes = counter.allocatedBytes.load(std::memory_order_relaxed);
+	totals.frees = counter.frees.load(std::memory_order_relaxed);
+	totals.freedBytes = counter.freedBytes.load(std::memory_order_relaxed);
+	totals.returns = counter.returns.load(std::memory_order_relaxed);
+	totals.returnedBytes = counter.returnedBytes.load(std::memory_order_relaxed);
+	totals.releases = counter.releases.load(std::memory_order_relaxed);
+	totals.releasedBytes = counter.releasedBytes.load(std::memory_order_relaxed);
+	totals.holdTicks = counter.holdTicks.load(std::memory_order_relaxed);
+	totals.maxHoldTicks = counter.maxHoldTicks.load(std::memory_order_relaxed);
+}
+
+// Writes the counters of a thread that changed since they were last
+// written.
+static void WriteCounters(FILE *fp, TraceBuffer *p)
+{
+	TraceCounter *counters = p->counters.load(std::memory_order_acquire);
+	if (counters == nullptr)
+		return;
+
+	if (p->countersWritten == nullptr)
+	{
+		p->countersWritten = new (std::nothrow) TraceCounterTotals[XLL_PROFILER_MAX_COUNTED_FUNCTIONS]();
+		if (p->countersWritten == nullptr)
+			return;
+	}
+
+	std::vector<TraceCounterRecord> records;
+	std::vector<TraceHardwareRecord> hardwareRecords;
+	std::vector<TraceMemoryRecord> memoryRecords;
+	for (uint32_t i = 0; i < XLL_PROFILER_MAX_COUNTED_FUNCTIONS; i++)
+	{
+		TraceCounterTotals &written = p->countersWritten[i];
+		TraceCounterTotals current;
+		LoadCounter(counters[i], current);
+
+		if (current.calls != written.calls)
+		{
+			TraceCounterRecord record = { i, p->threadId,
+				current.calls - written.calls,
+				current.inclusiveTicks - written.inclusiveTicks,
+				current.selfTicks - written.selfTicks };
+			records.push_back(record);
+		}
+		if (current.hardwareCalls != written.hardwareCalls)
+		{
+			TraceHardwareRecord record;
+			record.functionId = i;
+			record.threadId = p->threadId;
+			record.available = p->hardwareAvailable.load(std::memory_order_relaxed);
+			record.reserved = 0;
+			record.calls = current.hardwareCalls - written.hardwareCalls;
+			for (int j = 0; j < HardwareCounterCount; j++)
+				record.counts[j] = current.hardware[j] - written.hardware[j];
+			hardwareRecords.push_back(record);
+		}
+		if (current.memoryCalls != written.memoryCalls || current.returns != written.returns ||
+			current.releases != written.releases)
+		{
+			TraceMemoryRecord record;
+			record.functionId = i;
+			record.threadId = p->threadId;
+			record.calls = current.memoryCalls - written.memoryCalls;
+			record.allocations = current.allocations - written.allocations;
+			record.allocatedBytes = current.allocatedBytes - written.allocatedBytes;
+			record.frees = current.frees - written.frees;
+			record.freedBytes = current.freedBytes - written.freedBytes;
+			record.returns = current.returns - written.returns;
+			record.returnedBytes = current.returnedBytes - written.returnedBytes;
+			record.releases = current.releases - written.releases;
+			record.releasedBytes = current.releasedBytes - written.releasedBytes;
+			record.holdTicks = current.holdTicks - written.holdTicks;
+			record.maxHoldTicks = current.maxHoldTicks;
+			memoryRecords.push_back(record);
+		}
+		written = current;
+	}
+	if (!records.empty())
+	{
+		WriteChunk(fp, TraceChunkCounters, records.data(), records.size() * sizeof(TraceCounterRecord));
+	}
+	if (!hardwareRecords.empty())
+	{
+		WriteChunk(fp, TraceChunkHardware, hardwareRecords.data(),
+			hardwareRecords.size() * sizeof(TraceHardwareRecord));
+	}
+	if (!memoryRecords.empty())
+	{
+		WriteChunk(fp, TraceChunkMemory, memoryRecords.data(),
+			memoryRecords.size() * sizeof(TraceMemoryRecord));
+	}
+}
+
+// Writes the events published in a ring buffer to the trace file, in
+// chunks of the given type, and frees their slots.
+template <typename Event, unsigned int Size>
+static void FlushRing(FILE *fp, TraceChunkType type, Event (&events)[Size],
+	std::atomic<unsigned int> &headIndex, std::atomic<unsigned int> &tailIndex)
+{
+	unsigned int head = headIndex.load(std::memory_order_acquire);
+	unsigned int tail = tailIndex.load(std::memory_order_relaxed);
+	while (tail != head)
+	{
+		// Write the contiguous part of the ring in one chunk.
+		unsigned int index = tail & (Size - 1);
+		unsigned int count = head - tail;
+		if (count > Size - index)
+			count = Size - index;
+		WriteChunk(fp, type, &events[index], count * sizeof(Event));
+		tail += count;
+	}
+	tailIndex.store(tail, std::memory_order_release);
+}
+
+// Writes all published events to the trace file. Called only by the
+// writer thread, or by StopRecording() after the writer thread has
+// exited.
+static void FlushTraceBuffers()
+{
+	FILE *fp = s_traceFile;
+
+	// Functions and cells are written first, so that the reader knows
+	// them by the time it reads the events that refer to them.
+	WriteFunctions(fp);
+	WriteCells(fp);
+	WriteRecalcs(fp);
+
+	for (TraceBuffer *p = s_traceBuffers.load(); p != nullptr; p = p->next)
+	{
+		FlushRing(fp, TraceChunkCalls, p->events, p->head, p->tail);
+		FlushRing(fp, TraceChunkCallbacks, p->callbacks, p->callbackHead, p->callbackTail);
+
+		WriteCounters(fp, p);
+
+		unsigned long long dropped = p->dropped.load(std::memory_order_relaxed);
+		if (dropped != p->droppedWritten)
+		{
+			TraceDroppedRecord record = { p->threadId, 0, dropped - p->droppedWritten };
+			WriteChunk(fp, TraceChunkDropped, &record, sizeof(record));
+			p->droppedWritten = dropped;
+		}
+	}
+
+	UpdateFileHeader(fp);
+	fflush(fp);
+}
+
+static DWORD WINAPI TraceWriterThreadProc(LPVOID)
+{
+	while (WaitForSingleObject(s_hWriterStopEvent, 200) == WAIT_TIMEOUT)
+	{
+		FlushTraceBuffers();
+	}
+	return 0;
+}
+
+BOOL StartRecording(LPCWSTR fileName)
+{
+	if (s_traceFile != nullptr)
+		return FALSE;
+
+	FILE *fp = nullptr;
+	if (_wfopen_s(&fp, fileName, L"wb") != 0 || fp == nullptr)
+		return FALSE;
+
+	s_hWriterStopEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+	if (s_hWriterStopEvent == NULL)
+	{
+		fclose(fp);
+		return FALSE;
+	}
+
+	// Discard events and counts left over from a previous recording.
+	for (TraceBuffer *p = s_traceBuffers.load(); p != nullptr; p = p->next)
+	{
+		p->tail.store(p->head.load(std::memory_order_acquire));
+		p->callbackTail.store(p->callbackHead.load(std::memory_order_acquire));
+		p->droppedWritten = p->dropped.load(std::memory_order_relaxed);
+
+		TraceCounter *counters = p->counters.load(std::memory_order_acquire);
+		if (counters != nullptr)
+		{
+			if (p->countersWritten == nullptr)
+				p->countersWritten = new (std::nothrow) TraceCounterTotals[XLL_PROFILER_MAX_COUNTED_FUNCTIONS]();
+			for (size_t i = 0; i < XLL_PROFILER_MAX_COUNTED_FUNCTIONS; i++)
+				counters[i].maxHoldTicks.store(0, std::memory_order_relaxed);
+			for (size_t i = 0; p->countersWritten != nullptr && i < XLL_PROFILER_MAX_COUNTED_FUNCTIONS; i++)
+				LoadCounter(counters[i], p->countersWritten[i]);
+		}
+	}
+	{
+		std::lock_guard<std::mutex> lock(s_pendingReturnsMutex);
+		s_pendingReturns.clear();
+	}
+	s_functionsWritten = 0;
+	s_cellsWritten = 0;
+	{
+		std::lock_guard<std::mutex> lock(s_recalcsMutex);
+		s_pendingRecalcs.clear();
+		s_recalcCount = 0;
+	}
+	s_recalcGeneration.fetch_add(1);
+
+	QueryPerformanceCounter(&s_startCounter);
+	s_header.magic = XLL_TRACE_FILE_MAGIC;
+	s_header.version = XLL_TRACE_FILE_VERSION;
+	s_header.ticksPerSecond = 0.0;
+	s_header.startTicks = __rdtsc();
+	s_header.processId = GetCurrentProcessId();
+	s_header.sampleInterval = (s_mode == TraceModeSampled) ? s_sampleInterval : 1;
+	fwrite(&s_header, sizeof(s_header), 1, fp);
+	WriteChunk(fp, TraceChunkOverhead, &s_overhead, sizeof(s_overhead));
+	s_traceFile = fp;
+
+	s_hWriterThread = CreateThread(NULL, 0, TraceWriterThreadProc, NULL, 0, NULL);
+	if (s_hWriterThread == NULL)
+	{
+		CloseHandle(s_hWriterStopEvent);
+		s_hWriterStopEvent = NULL;
+		fclose(fp);
+		s_traceFile = nullptr;
+		return FALSE;
+	}
+
+	s_isRecording.store(true);
+	return TRUE;
+}
+
+void StopRecording()
+{
+	if (s_traceFile == nullptr)
+		return;
+
+	s_isRecording.store(false);
+
+	SetEvent(s_hWriterStopEvent);
+	WaitForSingleObject(s_hWriterThread, INFINITE);
+	CloseHandle(s_hWriterThread);
+	CloseHandle(s_hWriterStopEvent);
+	s_hWriterThread = NULL;
+	s_hWriterStopEvent = NULL;
+
+	FlushTraceBuffers();
+	fclose(s_traceFile);
+	s_traceFile = nullptr;
+}
+
+void StartRecordingFromEnvironment()
+{
+	WCHAR fileName[MAX_PATH];
+	DWORD n = GetEnvironmentVariableW(L"XLL_PROFILER_TRACE_FILE", fileName, ARRAYSIZE(fileName));
+	if (n == 0 || n >= ARRAYSIZE(fileName))
+	{
+		WCHAR tempPath[MAX_PATH];
+		DWORD m = GetTempPathW(ARRAYSIZE(tempPath), tempPath);
+		if (m == 0 || m >= ARRAYSIZE(tempPath))
+			return;
+		swprintf_s(fileName, L"%sXllProfiler-%lu.xlpt", tempPath, GetCurrentProcessId());
+	}
+
+	if (StartRecording(fileName))
+	{
+		WCHAR msg[MAX_PATH + 100];
+		swprintf_s(msg, L"XllProfiler: recording to %s\n", fileName);
+		OutputDebugStringW(msg);
+	}
+}
+
+BOOL SetTraceMode(TraceMode mode, unsigned int sampleInterval)
+{
+	if (s_traceFile != nullptr)
+		return FALSE;
+
+	s_mode = mode;
+	s_sampleInterval = (mode == TraceModeSampled && sampleInterval > 1) ? sampleInterval : 1;
+	return TRUE;
+}
+
+BOOL SetCallerResolver(uint32_t (*resolve)())
+{
+	if (s_traceFile != nullptr)
+		return FALSE;
+
+	s_callerResolver = resolve;
+	return TRUE;
+}
+
+BOOL SetHardwareCounting(bool enable)
+{
+	if (s_traceFile != nullptr)
+		return FALSE;
+
+	if (enable &&
+		(GetAvailableHardwareCounters() & RequiredHardwareCounters) != RequiredHardwareCounters)
+	{
+		OutputDebugStringW(L"XllProfiler: hardware counting is not available: "
+			L"the processor's cycle and instruction counters cannot be read on this system\n");
+		s_isHardwareEnabled = false;
+		return FALSE;
+	}
+
+	s_isHardwareEnabled = enable;
+	return TRUE;
+}
+
+BOOL SetMemoryCounting(bool enable)
+{
+	if (s_traceFile != nullptr)
+		return FALSE;
+
+	s_isMemoryEnabled = enable;
+	return TRUE;
+}
+
+BOOL SetLiveStatistics(bool enable)
+{
+	if (s_traceFile != nullptr)
+		return FALSE;
+
+	s_isLiveEnabled = enable;
+	return TRUE;
+}
+
+void ReadLiveStatistics(std::vector<LiveFunctionStatistics> &statistics)
+{
+	{
+		std::lock_guard<std::mutex> lock(s_functionsMutex);
+		statistics.resize(s_functions.size());
+		for (size_t i = 0; i < s_functions.size(); i++)
+		{
+			statistics[i].name = s_functions[i].name;
+			statistics[i].dllName = s_functions[i].dllName;
+		}
+	}
+
+	for (LiveFunctionStatistics &f : statistics)
+	{
+		f.calls = 0;
+		f.inclusiveTicks = 0;
+		f.selfTicks = 0;
+		f.maxTicks = 0;
+		std::fill(f.latency, f.latency + XLL_PROFILER_LATENCY_BUCKETS, 0);
+	}
+
+	unsigned int generation = s_liveGeneration.load();
+	for (TraceBuffer *p = s_traceBuffers.load(); p != nullptr; p = p->next)
+	{
+		// Skip a thread that has not made a call since the last reset.
+		if (p->liveGeneration.load(std::memory_order_acquire) != generation)
+			continue;
+		for (uint32_t block = 0; block < LiveBlockCount; block++)
+		{
+			const LiveCounter *counters = p->live[block].load(std::memory_order_acquire);
+			if (counters == nullptr)
+				continue;
+			for (uint32_t i = 0; i < LiveBlockSize; i++)
+			{
+				uint32_t functionId = block * LiveBlockSize + i;
+				if (functionId >= statistics.size())
+					break;
+				const LiveCounter &c = counters[i];
+				LiveFunctionStatistics &f = statistics[functionId];
+				f.calls += c.calls.load(std::memory_order_relaxed);
+				f.inclusiveTicks += c.inclusiveTicks.load(std::memory_order_relaxed);
+				f.selfTicks += c.selfTicks.load(std::memory_order_relaxed);
+				f.maxTicks = std::max(f.maxTicks, c.maxTicks.load(std::memory_order_relaxed));
+				for (int j = 0; j < XLL_PROFILER_LATENCY_BUCKETS; j++)
+					f.latency[j] += c.latency[j].load(std::memory_order_relaxed);
+			}
+		}
+	}
+}
+
+void ResetLiveStatistics()
+{
+	s_liveGeneration.fetch_add(1);
+}
+
+void ReleaseTraceThreadState()
+{
+	TraceBuffer *buffer = t_traceBuffer;
+	if (buffer != nullptr && buffer->isHardwareOpen)
+	{
+		buffer->hardwareAvailable.store(0, std::memory_order_relaxed);
+		buffer->hardware.Close();
+	}
+}
+
+void SetTraceModeFromEnvironment()
+{
+	TraceMode mode = TraceModeEvents;
+	WCHAR value[32];
+	DWORD n = GetEnvironmentVariableW(L"XLL_PROFILER_MODE", value, ARRAYSIZE(value));
+	if (n > 0 && n < ARRAYSIZE(value))
+	{
+		if (_wcsicmp(value, L"sample") == 0)
+			mode = TraceModeSampled;
+		else if (_wcsicmp(value, L"count") == 0)
+			mode = TraceModeCounts;
+	}
+
+	unsigned int sampleInterval = 100;
+	n = GetEnvironmentVariableW(L"XLL_PROFILER_SAMPLE_INTERVAL", value, ARRAYSIZE(value));
+	if (n > 0 && n < ARRAYSIZE(value))
+		sampleInterval = wcstoul(value, nullptr, 10);
+
+	SetTraceMode(mode, sampleInterval);
+
+	n = GetEnvironmentVariableW(L"XLL_PROFILER_HARDWARE_COUNTERS", value, ARRAYSIZE(value));
+	SetHardwareCounting(n > 0 && n < ARRAYSIZE(value) && wcscmp(value, L"1") == 0);
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Calibration
+
+static double Median(std::vector<double> &values)
+{
+	std::sort(values.begin(), values.end());
+	return values[values.size() / 2];
+}
+
+void CalibrateOverhead(uint32_t functionId, void (*callInstrumented)(), void (*callDirect)())
+{
+	const int BatchCount = 31;
+	const int CallsPerBatch = 256; // fits in an event buffer
+
+	if (s_traceFile != nullptr || functionId >= XLL_PROFILER_MAX_COUNTED_FUNCTIONS)
+		return;
+
+	TraceBuffer *buffer = GetTraceBuffer();
+	if (buffer == nullptr)
+		return;
+
+	// Measure the sampled path in sampled mode; the calls that are not
+	// sampled do not contribute to the recorded times.
+	unsigned int sampleInterval = s_sampleInterval;
+	s_sampleInterval = 1;
+	buffer->sampleCountdown = 1;
+	s_innerOverheadTicks = 0;
+	s_outerOverheadTicks = 0;
+	s_isRecording.store(true);
+
+	std::vector<double> inner, outer;
+	for (int batch = 0; batch < BatchCount; batch++)
+	{
+		unsigned int head = buffer->head.load(std::memory_order_relaxed);
+		TraceCounter *counters = buffer->counters.load(std::memory_order_relaxed);
+		uint64_t calls = 0, ticks = 0;
+		if (counters != nullptr)
+		{
+			calls = counters[functionId].calls.load(std::memory_order_relaxed);
+			ticks = counters[functionId].inclusiveTicks.load(std::memory_order_relaxed);
+		}
+
+		uint64_t t0 = __rdtsc();
+		for (int i = 0; i < CallsPerBatch; i++)
+			callDirect();
+		uint64_t t1 = __rdtsc();
+		for (int i = 0; i < CallsPerBatch; i++)
+			callInstrumented();
+		uint64_t t2 = __rdtsc();
+		outer.push_back(((double)(t2 - t1) - (double)(t1 - t0)) / CallsPerBatch);
+
+		if (s_mode == TraceModeCounts)
+		{
+			counters = buffer->counters.load(std::memory_order_relaxed);
+			if (counters == nullptr)
+				break;
+			calls = counters[functionId].calls.load(std::memory_order_relaxed) - calls;
+			ticks = counters[functionId].inclusiveTicks.load(std::memory_order_relaxed) - ticks;
+		}
+		else
+		{
+			unsigned int end = buffer->head.load(std::memory_order_relaxed);
+			calls = end - head;
+			for (; head != end; ++head)
+			{
+				const TraceCallEvent &e = buffer->events[head & (XLL_PROFILER_TRACE_BUFFER_SIZE - 1)];
+				ticks += e.exitTicks - e.enterTicks;
+			}
+			buffer->tail.store(end); // not recording: no writer thread
+		}
+		if (calls == 0)
+			break;
+		inner.push_back((double)ticks / calls);
+	}
+
+	s_isRecording.store(false);
+	s_sampleInterval = sampleInterval;
+
+	if (inner.empty() || inner.size() != outer.size())
+		return;
+
+	s_overhead.innerTicks = std::max(Median(inner), 0.0);
+	s_overhead.outerTicks = std::max(Median(outer), s_overhead.innerTicks);
+	s_innerOverheadTicks = (uint64_t)(s_overhead.innerTicks + 0.5);
+	s_outerOverheadTicks = (uint64_t)(s_overhead.outerTicks + 0.5);
+
+	WCHAR msg[100];
+	swprintf_s(msg, L"XllProfiler: overhead per call is %.0f ticks inside, %.0f ticks outside\n",
+		s_overhead.innerTicks, s_overhead.outerTicks);
+	OutputDebugStringW(msg);
+}
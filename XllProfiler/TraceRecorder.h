@@ -0,0 +1,209 @@
+////////////////////////////////////////////////////////////////////////////
+// TraceRecorder.h -- record instrumented calls to a binary trace file
+//
+// Each call of an instrumented function is recorded as a fixed-size
+// TraceCallEvent (see TraceFormat.h) in a per-thread ring buffer. No
+// lock is taken and nothing is formatted on the calling thread; a
+// background thread writes the buffers to the trace file every 200
+// milliseconds. If a thread records calls faster than they are written
+// out, the excess calls are dropped and counted.
+//
+// For functions that are called millions of times, recording every call
+// costs more than the calls themselves. TraceModeSampled records only
+// some top-level calls; TraceModeCounts records no events at all but
+// accumulates the call count and time of each function per thread.
+// In every mode, the overhead of the instrumentation, measured by
+// CalibrateOverhead(), is subtracted from the reported times, so that
+// the modes give comparable numbers.
+//
+// Use XllProfTool to convert the trace file to Chrome trace-event JSON,
+// folded stacks or a per-function summary.
+//
+
+#pragma once
+
+#include <Windows.h>
+#include <intrin.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "TraceFormat.h"
+
+// Number of events in each thread's buffer. Must be a power of two.
+#ifndef XLL_PROFILER_TRACE_BUFFER_SIZE
+#define XLL_PROFILER_TRACE_BUFFER_SIZE 8192
+#endif
+
+// Number of Excel callbacks in each thread's buffer. Must be a power
+// of two.
+#ifndef XLL_PROFILER_CALLBACK_BUFFER_SIZE
+#define XLL_PROFILER_CALLBACK_BUFFER_SIZE 1024
+#endif
+
+// Maximum number of functions counted in TraceModeCounts. Calls of
+// functions defined beyond this limit are not counted.
+#ifndef XLL_PROFILER_MAX_COUNTED_FUNCTIONS
+#define XLL_PROFILER_MAX_COUNTED_FUNCTIONS 4096
+#endif
+
+// Maximum number of results returned for Excel to free that are waiting
+// for xlAutoFree12. Results beyond this limit are counted but their
+// hold time is not measured.
+#ifndef XLL_PROFILER_MAX_PENDING_RETURNS
+#define XLL_PROFILER_MAX_PENDING_RETURNS 65536
+#endif
+
+// Number of buckets in the latency histogram of each function. Bucket
+// 0 counts the calls that took less than 2^LIVE_LATENCY_FIRST_SHIFT
+// ticks; each later bucket covers twice the time of the previous one,
+// and the last bucket counts all longer calls.
+#ifndef XLL_PROFILER_LATENCY_BUCKETS
+#define XLL_PROFILER_LATENCY_BUCKETS 32
+#endif
+#define LIVE_LATENCY_FIRST_SHIFT 10
+
+enum TraceMode
+{
+	// Record an event for every call.
+	TraceModeEvents,
+
+	// Record an event for one in sampleInterval top-level calls on
+	// average, and for every call nested in them. The interval between
+	// samples is randomized so that it does not lock onto a periodic
+	// calculation order.
+	TraceModeSampled,
+
+	// Record only the number of calls and the inclusive and self time
+	// of each function on each thread.
+	TraceModeCounts,
+};
+
+// Defines a function that calls may be recorded for, and returns its id.
+// typeText is the type text the function is registered with, whose '$'
+// tells that Excel may call the function on any of its calculation
+// threads. May be called whether or not recording is in progress.
+uint32_t DefineTraceFunction(const std::wstring &name, const std::wstring &dllName,
+	const std::wstring &typeText);
+
+// Defines a worksheet cell that calls may be attributed to, and returns
+// its id, which is never 0. row and column are zero-based.
+uint32_t DefineTraceCell(const std::wstring &sheetName, uint32_t row, uint32_t column);
+
+// Sets a function that returns the id of the cell that is calling the
+// current function, or 0 if it is unknown. If set, it is called on the
+// entry of each top-level call that is recorded as an event, before the
+// call is timed; nested calls are attributed to the same cell. Returns
+// FALSE if recording is in progress.
+BOOL SetCallerResolver(uint32_t (*resolve)());
+
+// Records the start of a call on the calling thread.
+void RecordCallEnter(uint32_t functionId);
+
+// Records the end of the call started by the matching RecordCallEnter().
+void RecordCallLeave();
+
+// Returns the current time on the clock of the trace.
+inline uint64_t ReadTraceClock()
+{
+	return __rdtsc();
+}
+
+// Records a call back into Excel that started at enterTicks and ended
+// at exitTicks, attributed to the innermost call in progress on the
+// calling thread. Callbacks are recorded as events in every mode; in
+// TraceModeSampled, only those made in sampled calls or outside any
+// instrumented call are recorded.
+void RecordExcelCallback(int xlfn, int result, uint64_t enterTicks, uint64_t exitTicks);
+
+// Records that the innermost call in progress on the calling thread is
+// returning an XLOPER12 for Excel to free with xlAutoFree12, whose tree
+// takes the given number of bytes. Only recorded with memory counting.
+void RecordReturnedMemory(const void *result, uint64_t bytes);
+
+// Records that Excel passed a result to xlAutoFree12, and adds the time
+// it held the result to the function that returned it.
+void RecordReleasedMemory(const void *result);
+
+// Ends the current recalculation window and writes its summary (see
+// TraceRecalcRecord), unless no instrumented function was called in it.
+// Call this on the main thread from the calculation events of Excel.
+void RecordRecalcEnd(TraceRecalcStatus status);
+
+// Sets what is recorded. Returns FALSE if recording is in progress.
+BOOL SetTraceMode(TraceMode mode, unsigned int sampleInterval);
+
+// Enables or disables reading the processor counters of the calling
+// thread around each call (see HardwareCounters.h), in addition to what
+// the mode records. Returns FALSE if recording is in progress, or if
+// the cycle and instruction counters are not available, as on Windows.
+BOOL SetHardwareCounting(bool enable);
+
+// Enables or disables reading the heap allocations of the calling
+// thread around each call (see AllocationHooks.h), and recording the
+// results returned for Excel to free. The allocator of the profiled
+// modules must be hooked separately. Returns FALSE if recording is in
+// progress.
+BOOL SetMemoryCounting(bool enable);
+
+// Enables or disables the live statistics that ReadLiveStatistics()
+// returns. They are kept in every mode, whether or not recording is in
+// progress. Returns FALSE if recording is in progress.
+BOOL SetLiveStatistics(bool enable);
+
+// Statistics of the calls of a function since live statistics were
+// enabled or last reset, summed over all threads. Times exclude the overhead of the
+// instrumentation; the inclusive time leaves out recursive calls, whose
+// time is already in the outer call.
+struct LiveFunctionStatistics
+{
+	std::string name;
+	std::string dllName;
+	uint64_t calls;
+	uint64_t inclusiveTicks;
+	uint64_t selfTicks;
+	uint64_t maxTicks;
+	uint64_t latency[XLL_PROFILER_LATENCY_BUCKETS]; // calls by inclusive time
+};
+
+// Reads the live statistics of every defined function, indexed by
+// function id. The counters of each thread are only written by that
+// thread and are read without a lock, so reading never delays a call;
+// calls that end during the read may be partly included.
+void ReadLiveStatistics(std::vector<LiveFunctionStatistics> &statistics);
+
+// Restarts the live statistics from zero. Each thread clears its own
+// counters on its next call, so this does not wait for the threads.
+void ResetLiveStatistics();
+
+// Sets the mode from the environment variable XLL_PROFILER_MODE, which
+// is "trace" (the default), "sample" or "count", and the sampling
+// interval from XLL_PROFILER_SAMPLE_INTERVAL (100 by default). Enables
+// hardware counting if XLL_PROFILER_HARDWARE_COUNTERS is 1.
+void SetTraceModeFromEnvironment();
+
+// Releases the processor counters of the calling thread. Call this
+// from DllMain() when a thread detaches.
+void ReleaseTraceThreadState();
+
+// Measures the overhead that the instrumentation adds to a call in the
+// current mode, by calling an empty function through a thunk, and
+// subtracts it from the times recorded from then on. callInstrumented
+// must call the thunk, which must call RecordCallEnter(functionId) and
+// RecordCallLeave() like the other thunks; callDirect must call the
+// function without the thunk. Must be called while not recording.
+void CalibrateOverhead(uint32_t functionId, void (*callInstrumented)(), void (*callDirect)());
+
+// Starts writing recorded calls to the given file. Returns FALSE if
+// recording is already in progress or the file cannot be created.
+BOOL StartRecording(LPCWSTR fileName);
+
+// Writes all pending events and closes the trace file.
+void StopRecording();
+
+// Starts recording to the file named by the environment variable
+// XLL_PROFILER_TRACE_FILE, or to XllProfiler-<pid>.xlpt in the
+// temporary directory if it is not set.
+void StartRecordingFromEnvironment();
+
+// Returns the number of events dropped because a buffer was full.
+unsigned long long GetDroppedCallEventCount();